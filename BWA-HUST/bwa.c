@@ -47,6 +47,7 @@ static inline void kseq2bseq1(const kseq_t *ks, bseq1_t *s)
 	s->seq = dupkstring(&ks->seq, 1);
 	s->qual = dupkstring(&ks->qual, 0);
 	s->l_seq = ks->seq.l;
+	s->bam = 0;
 }
 
 bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_, int *size_)
@@ -306,9 +307,10 @@ void bwa_idx_destroy(bwaidx_t *idx)
  * SAM header routines *
  ***********************/
 
-void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line)
+char *bwa_sam_hdr(const bntseq_t *bns, const char *hdr_line)
 {
 	int i, n_SQ = 0;
+	kstring_t str = {0, 0, 0};
 	extern char *bwa_pg;
 	if (hdr_line) {
 		const char *p = hdr_line;
@@ -319,14 +321,23 @@ void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line)
 	}
 	if (n_SQ == 0) {
 		for (i = 0; i < bns->n_seqs; ++i) {
-			err_printf("@SQ\tSN:%s\tLN:%d", bns->anns[i].name, bns->anns[i].len);
-			if (bns->anns[i].is_alt) err_printf("\tAH:*\n");
-			else err_fputc('\n', stdout);
+			ksprintf(&str, "@SQ\tSN:%s\tLN:%d", bns->anns[i].name, bns->anns[i].len);
+			if (bns->anns[i].is_alt) kputs("\tAH:*\n", &str);
+			else kputc('\n', &str);
 		}
 	} else if (n_SQ != bns->n_seqs && bwa_verbose >= 2)
 		fprintf(stderr, "[W::%s] %d @SQ lines provided with -H; %d sequences in the index. Continue anyway.\n", __func__, n_SQ, bns->n_seqs);
-	if (hdr_line) err_printf("%s\n", hdr_line);
-	if (bwa_pg) err_printf("%s\n", bwa_pg);
+	if (hdr_line) ksprintf(&str, "%s\n", hdr_line);
+	if (bwa_pg) ksprintf(&str, "%s\n", bwa_pg);
+	if (str.s == 0) kputs("", &str);
+	return str.s;
+}
+
+void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line)
+{
+	char *hdr = bwa_sam_hdr(bns, hdr_line);
+	err_fputs(hdr, stdout);
+	free(hdr);
 }
 
 static char *bwa_escape(char *s)
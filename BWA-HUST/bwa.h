@@ -31,6 +31,7 @@ typedef struct {
 typedef struct {
 	int l_seq, id;
 	char *name, *comment, *seq, *qual, *sam;
+	void *bam; // the records instead of sam with mem --sort-markdup, see bwamem_bam.h
 } bseq1_t;
 
 extern int bwa_verbose;
@@ -56,6 +57,7 @@ extern "C" {
 	bwaidx_t *bwa_idx_load(const char *hint, int which);
 	void bwa_idx_destroy(bwaidx_t *idx);
 
+	char *bwa_sam_hdr(const bntseq_t *bns, const char *hdr_line); // the text printed by bwa_print_sam_hdr, to be freed
 	void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line);
 	char *bwa_set_rg(const char *s);
 	char *bwa_insert_header(const char *s, char *hdr);
@@ -11,6 +11,7 @@
 
 #include "kstring.h"
 #include "bwamem.h"
+#include "bwamem_bam.h"
 #include "bntseq.h"
 #include "ksw.h"
 #include "kvec.h"
@@ -342,25 +343,10 @@ int get_rightmost_seed_index(SMEM* p, int i, int n){
     return right_index + 1;
 }
 
-// equivalence to mem_collect_intv
-void mem_collect_smem(FMI_search *fmi,
-                      LISA_search<index_t> *lisa,
-                      const mem_opt_t *opt,
-                      int len,
-                      const uint8_t *seq,
-                      smem_aux_t *a, std::vector<SMEM>& matchArray)
+// the kernel 1 queries of a read: its stretches without N, at least min_seed_len long
+static void mem_smem_k1_queries(LISA_search<index_t> *lisa, const mem_opt_t *opt, int len, const uint8_t *seq,
+                                std::vector<Info>& lisa_qdb)
 {
-    int64_t pos = 0;
-    int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
-    int64_t num_smem1 = 0, num_smem2 = 0, num_smem3 = 0;
-    int max_readlength = -1;
-    a->mem.n = 0;
-
-#ifdef ENABLE_LISA
-    std::vector<Info> lisa_qdb;
-    std::vector<Info> lisa_qdb_k2;
-    std::vector<Info> lisa_qdb_k3;
-#endif
     int j=0;
     while(j < len)
     {
@@ -372,6 +358,7 @@ void mem_collect_smem(FMI_search *fmi,
 
         Info temp_q;
         temp_q.p = (const char*)(seq + prev_j);
+        temp_q.id = 0;
         temp_q.offset = prev_j;
         temp_q.l = j - prev_j;
         temp_q.r = j - prev_j;
@@ -386,28 +373,19 @@ void mem_collect_smem(FMI_search *fmi,
         }
         j++;
     }
+}
 
-    // SMEM kernel 1
-    for(Info& q : lisa_qdb)
-    {
-        lisa->smem_rmi(q, opt->min_seed_len, matchArray);
-    }
-
-    // SMEM kernel 2
-    num_smem1 = matchArray.size();
-
-    // Input read dataset for kernel 2
-    SMEM *tal_smems = &matchArray[0];
-
-    sort(tal_smems, tal_smems + num_smem1, tal_smem_sort);
-
+// the kernel 2 queries to shrink from the first num_smem1 SMEMs of a read, sorted by tal_smem_sort
+static void mem_smem_k2_queries(LISA_search<index_t> *lisa, const mem_opt_t *opt, const uint8_t *seq,
+                                std::vector<SMEM>& matchArray, int64_t num_smem1, std::vector<Info>& lisa_qdb_k2)
+{
+    int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
     for (int64_t i=0; i<num_smem1; i++) {
         SMEM *p = &matchArray[i];
         int start = p->m, end = p->n +1;
         if (end - start < split_len || p->s > opt->split_width)
             continue;
 
-#ifdef ENABLE_LISA
         SMEM s = *p;
         Info q_temp;
         q_temp.p =  (const char*)seq;
@@ -419,32 +397,65 @@ void mem_collect_smem(FMI_search *fmi,
         // fmi_shrink_lisa: starting position for forward search
         q_temp.l = q_temp.mid;
         lisa_qdb_k2.push_back(q_temp);
+    }
+}
+
+// the kernel 2 query searched again from a shrunk one
+static Info mem_smem_k2_requery(LISA_search<index_t> *lisa, int len, const Info& k2_fmi_out)
+{
+    Info q_temp;
+    q_temp.p =  k2_fmi_out.p;
+    q_temp.id = k2_fmi_out.id;
+    q_temp.prev_l = q_temp.l = q_temp.r = k2_fmi_out.r;//s.n + 1;
+    assert(q_temp.l >= 0 && q_temp.r <= len);
+    q_temp.intv = {0, lisa->n};
+    q_temp.min_intv =  k2_fmi_out.min_intv - 1;
+    q_temp.mid = k2_fmi_out.mid;
+    q_temp.offset = 0;
+    return q_temp;
+}
+
+// equivalence to mem_collect_intv
+void mem_collect_smem(FMI_search *fmi,
+                      LISA_search<index_t> *lisa,
+                      const mem_opt_t *opt,
+                      int len,
+                      const uint8_t *seq,
+                      smem_aux_t *a, std::vector<SMEM>& matchArray)
+{
+    int64_t num_smem1 = 0, num_smem2 = 0, num_smem3 = 0;
+    a->mem.n = 0;
+
+#ifdef ENABLE_LISA
+    std::vector<Info> lisa_qdb;
+    std::vector<Info> lisa_qdb_k2;
 #endif
-        pos ++;
+    mem_smem_k1_queries(lisa, opt, len, seq, lisa_qdb);
+
+    // SMEM kernel 1
+    for(Info& q : lisa_qdb)
+    {
+        lisa->smem_rmi(q, opt->min_seed_len, matchArray);
     }
 
+    // SMEM kernel 2
+    num_smem1 = matchArray.size();
+
+    // Input read dataset for kernel 2
+    SMEM *tal_smems = &matchArray[0];
+
+    sort(tal_smems, tal_smems + num_smem1, tal_smem_sort);
+
 #ifdef ENABLE_LISA
+    mem_smem_k2_queries(lisa, opt, seq, matchArray, num_smem1, lisa_qdb_k2);
+
     Info k2_fmi_out[lisa_qdb_k2.size()];
     lisa->fmi_shrink(lisa_qdb_k2.size(), &lisa_qdb_k2[0], &k2_fmi_out[0], opt->min_seed_len);
 
-    int lisa_min_intv[pos];
-
     num_smem2 = lisa_qdb_k2.size();
 
-    lisa_qdb_k2.clear();
-    for (int64_t i=0; i<num_smem2; i++) {
-        Info q_temp;
-        q_temp.p =  k2_fmi_out[i].p;
-        q_temp.id = k2_fmi_out[i].id;
-        q_temp.prev_l = q_temp.l = q_temp.r = k2_fmi_out[i].r;//s.n + 1;
-        assert(q_temp.l >= 0 && q_temp.r <= len);
-        q_temp.intv = {0, lisa->n};
-        q_temp.min_intv =  k2_fmi_out[i].min_intv - 1;
-        q_temp.mid = k2_fmi_out[i].mid;
-        q_temp.offset = 0;
-        //q_temp.smem_id = i;
-        lisa_qdb_k2.push_back(q_temp);
-    }
+    for (int64_t i=0; i<num_smem2; i++)
+        lisa_qdb_k2[i] = mem_smem_k2_requery(lisa, len, k2_fmi_out[i]);
 
     for(int i=0; i<num_smem2; i++)
     {
@@ -462,27 +473,90 @@ void mem_collect_smem(FMI_search *fmi,
         ks_introsort(mem_intv1, tot_smem, &matchArray[0]);
 }
 
-// SMEM + SAL
-mem_chain_v
-mem_chain2(const mem_opt_t *opt, const bntseq_t *bns, FMI_search *fmi, LISA_search<index_t> * lisa, int len, const uint8_t *seq, void *buf) {
+// append the SMEMs of the batched kernels to the reads owning their queries, in the order of the queries
+static void mem_smem_scatter(std::vector<SMEM>& smems, const std::vector<int>& owner, std::vector<SMEM> *matchArrays)
+{
+    std::stable_sort(smems.begin(), smems.end(), [](const SMEM& a, const SMEM& b){return a.rid < b.rid;});
+    for(SMEM& s : smems) {
+        std::vector<SMEM>& matchArray = matchArrays[owner[s.rid]];
+        s.rid = 0;
+        matchArray.push_back(s);
+    }
+    smems.clear();
+}
+
+// mem_collect_smem over the n reads of a block. kernels 1 and 2 run the queries of all of them together, so
+// their IPBWT and FM-index lookups overlap, and matchArrays[i] ends up as mem_collect_smem leaves it for read i
+void mem_collect_smem_batched(FMI_search *fmi,
+                              LISA_search<index_t> *lisa,
+                              const mem_opt_t *opt,
+                              threadData &td,
+                              int n, const int *lens,
+                              uint8_t * const *seqs, std::vector<SMEM> *matchArrays)
+{
+    std::vector<Info> lisa_qdb;
+    std::vector<int> owner;
+    std::vector<SMEM> smems;
+
+    // SMEM kernel 1
+    for(int r = 0; r < n; r++) {
+        matchArrays[r].clear();
+        if(lens[r] < opt->min_seed_len) continue;
+        size_t first = lisa_qdb.size();
+        mem_smem_k1_queries(lisa, opt, lens[r], seqs[r], lisa_qdb);
+        for(size_t k = first; k < lisa_qdb.size(); k++) {
+            lisa_qdb[k].id = k;
+            owner.push_back(r);
+        }
+    }
+    lisa->smem_rmi_batched(lisa_qdb.data(), lisa_qdb.size(), BATCH_SIZE, td, smems, opt->min_seed_len);
+    mem_smem_scatter(smems, owner, matchArrays);
+
+#ifdef ENABLE_LISA
+    // SMEM kernel 2
+    lisa_qdb.clear();
+    owner.clear();
+    for(int r = 0; r < n; r++) {
+        std::vector<SMEM>& matchArray = matchArrays[r];
+        int64_t num_smem1 = matchArray.size();
+        sort(matchArray.begin(), matchArray.end(), tal_smem_sort);
+        size_t first = lisa_qdb.size();
+        mem_smem_k2_queries(lisa, opt, seqs[r], matchArray, num_smem1, lisa_qdb);
+        for(size_t k = first; k < lisa_qdb.size(); k++) {
+            lisa_qdb[k].id = k;
+            owner.push_back(r);
+        }
+    }
+    std::vector<Info> k2_fmi_out(lisa_qdb.size());
+    lisa->fmi_shrink_two_steps_batched(lisa_qdb.size(), lisa_qdb.data(), k2_fmi_out.data(), opt->min_seed_len);
+    for(Info& q : k2_fmi_out)
+        lisa_qdb[q.id] = mem_smem_k2_requery(lisa, lens[owner[q.id]], q);
+    lisa->smem_rmi_batched(lisa_qdb.data(), lisa_qdb.size(), BATCH_SIZE, td, smems, opt->min_seed_len);
+    mem_smem_scatter(smems, owner, matchArrays);
+#endif
+
+    // Kernel 3, read by read
+    for(int r = 0; r < n; r++) {
+        if(lens[r] < opt->min_seed_len) continue;
+        std::vector<SMEM>& matchArray = matchArrays[r];
+        fmi->bwtSeedStrategyAllPosOneThreadTwoSteps(seqs[r], lens[r], opt->max_mem_intv, opt->min_seed_len, matchArray);
+        if (matchArray.size() > 0)
+            ks_introsort(mem_intv1, matchArray.size(), &matchArray[0]);
+    }
+}
+
+// SAL: the chains of the seeds of a read's SMEMs
+static mem_chain_v
+mem_smem2chain(const mem_opt_t *opt, const bntseq_t *bns, LISA_search<index_t> * lisa, int len, std::vector<SMEM>& matchArray) {
     int i, b, e, l_rep;
     int64_t l_pac = bns->l_pac;
     mem_chain_v chain;
     kbtree_t(chn) * tree;
-    smem_aux_t *aux;
 
     kv_init(chain);
     if (len < opt->min_seed_len) return chain; // if the query is shorter than the seed length, no match
     tree = kb_init(chn, KB_DEFAULT_SIZE);
 
-    aux = buf ? (smem_aux_t *) buf : smem_aux_init();
-
-    std::vector<SMEM> matchArray;
-    matchArray.reserve(8);
-    //SMEM * matchArray = (SMEM* ) _mm_malloc(sizeof(SMEM) * 64);
-    int num_smem = 0;
-    mem_collect_smem(fmi, lisa, opt, len, seq, aux, matchArray);
-
     //fprintf(stderr,"matchArray.size: %d\n", matchArray.size());
     int size = matchArray.size();
     for (i = 0, b = e = l_rep = 0; i < size; ++i) { // compute frac_rep
@@ -529,8 +603,6 @@ mem_chain2(const mem_opt_t *opt, const bntseq_t *bns, FMI_search *fmi, LISA_sear
             }
         }
     }
-    if (buf == 0) smem_aux_destroy(aux);
-
     kv_resize(mem_chain_t, chain, kb_size(tree));
 
 #define traverse_func(p_) (chain.a[chain.n++] = *(p_))
@@ -544,6 +616,25 @@ mem_chain2(const mem_opt_t *opt, const bntseq_t *bns, FMI_search *fmi, LISA_sear
     return chain;
 }
 
+// SMEM + SAL
+mem_chain_v
+mem_chain2(const mem_opt_t *opt, const bntseq_t *bns, FMI_search *fmi, LISA_search<index_t> * lisa, int len, const uint8_t *seq, void *buf) {
+    mem_chain_v chain;
+    smem_aux_t *aux;
+
+    kv_init(chain);
+    if (len < opt->min_seed_len) return chain; // if the query is shorter than the seed length, no match
+
+    aux = buf ? (smem_aux_t *) buf : smem_aux_init();
+
+    std::vector<SMEM> matchArray;
+    matchArray.reserve(8);
+    mem_collect_smem(fmi, lisa, opt, len, seq, aux, matchArray);
+    if (buf == 0) smem_aux_destroy(aux);
+
+    return mem_smem2chain(opt, bns, lisa, len, matchArray);
+}
+
 
 
 /********************
@@ -878,14 +969,22 @@ static inline int cal_max_gap(const mem_opt_t *opt, int qlen) {
 
 #define MAX_BAND_TRY  2
 
-void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query,
-                   const mem_chain_t *c, mem_alnreg_v *av) {
-	int i, k, rid, max_off[2], aw[2]; // aw: actual bandwidth used in extension
-	int64_t l_pac = bns->l_pac, rmax[2], tmp, max = 0;
-	const mem_seed_t *s;
-	uint8_t *rseq = 0;
-	uint64_t * srt;
-
+// the state of mem_chain2aln() on a chain, kept from the extension of one of its seeds to the next
+typedef struct {
+	const mem_chain_t *c;
+	int64_t rmax[2];
+	uint8_t *rseq;
+	uint64_t *srt;
+	int k; // the seed tested next, from the highest score down
+} mem_c2a_t;
+
+static void mem_chain2aln_init(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query,
+                               const mem_chain_t *c, mem_c2a_t *st) {
+	int i, rid;
+	int64_t l_pac = bns->l_pac, *rmax = st->rmax, max = 0;
+
+	st->c = c;
+	st->rseq = 0, st->srt = 0, st->k = c->n - 1;
 	if (c->n == 0) return;
 	// get the max possible span
 	rmax[0] = l_pac << 1;
@@ -907,16 +1006,31 @@ void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac
 		else rmax[0] = l_pac;
 	}
 	// retrieve the reference sequence
-	rseq = bns_fetch_seq(bns, pac, &rmax[0], c->seeds[0].rbeg, &rmax[1], &rid);
+	st->rseq = bns_fetch_seq(bns, pac, &rmax[0], c->seeds[0].rbeg, &rmax[1], &rid);
 	assert(c->rid == rid);
 
-	srt = (uint64_t*)malloc(c->n * 8);
+	st->srt = (uint64_t*)malloc(c->n * 8);
 	for (i = 0; i < c->n; ++i)
-		srt[i] = (uint64_t)
+		st->srt[i] = (uint64_t)
 	c->seeds[i].score << 32 | i;
-	ks_introsort_64(c->n, srt);
+	ks_introsort_64(c->n, st->srt);
+}
+
+static void mem_chain2aln_destroy(mem_c2a_t *st) {
+	free(st->srt);
+	free(st->rseq);
+}
+
+// the next seed of the chain to extend, its region being pushed to av with the ends that need no extension; NULL
+// once every seed has been tested
+static const mem_seed_t *mem_chain2aln_next(const mem_opt_t *opt, const bntseq_t *bns, int l_query, mem_c2a_t *st,
+                                            mem_alnreg_v *av) {
+	int i, k;
+	const mem_chain_t *c = st->c;
+	uint64_t *srt = st->srt;
+	const mem_seed_t *s;
 
-	for (k = c->n - 1; k >= 0; --k) {
+	for (k = st->k; k >= 0; --k) {
 		mem_alnreg_t *a;
 		s = &c->seeds[(uint32_t) srt[k]];// to select highest score seeds among the seed that not be choosed
 
@@ -969,13 +1083,78 @@ void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac
 
 		a = kv_pushp(mem_alnreg_t, *av);
 		memset(a, 0, sizeof(mem_alnreg_t));
-		a->w = aw[0] = aw[1] = opt->w;
+		a->w = opt->w;
 		a->score = a->truesc = -1;
 		a->rid = c->rid;
+		if (!s->qbeg) a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
+		if (s->qbeg + s->len == l_query) a->qe = l_query, a->re = s->rbeg + s->len;
 
 		if (bwa_verbose >= 4)
 			err_printf("** ---> Extending from seed(%d) [%ld;%ld,%ld] @ %s <---\n", k, (long) s->len, (long) s->qbeg,
 			           (long) s->rbeg, bns->anns[c->rid].name);
+		st->k = k - 1;
+		return s;
+	}
+	st->k = -1;
+	return 0;
+}
+
+// the start of a from the left extension of seed s
+static inline void mem_chain2aln_left(const mem_opt_t *opt, const mem_seed_t *s, int qle, int tle, int gtle,
+                                      int gscore, mem_alnreg_t *a) {
+	// check whether we prefer to reach the end of the query
+	if (gscore <= 0 || gscore <= a->score - opt->pen_clip5) { // local extension
+		a->qb = s->qbeg - qle, a->rb = s->rbeg - tle;
+		a->truesc = a->score;
+	} else { // to-end extension
+		a->qb = 0, a->rb = s->rbeg - gtle;
+		a->truesc = gscore;
+	}
+}
+
+// the end of a from the right extension, started at query qe and reference re from the score sc0
+static inline void mem_chain2aln_right(const mem_opt_t *opt, int l_query, int qe, int64_t re, int sc0, int qle,
+                                       int tle, int gtle, int gscore, mem_alnreg_t *a) {
+	// similar to the above
+	if (gscore <= 0 || gscore <= a->score - opt->pen_clip3) { // local extension
+		a->qe = qe + qle, a->re = re + tle;
+		a->truesc += a->score - sc0;
+	} else { // to-end extension
+		a->qe = l_query, a->re = re + gtle;
+		a->truesc += gscore - sc0;
+	}
+}
+
+static void mem_chain2aln_finish(const mem_chain_t *c, const mem_seed_t *s, mem_alnreg_t *a) {
+	int i;
+	// compute seedcov
+	for (i = 0, a->seedcov = 0; i < c->n; ++i) {
+		const mem_seed_t *t = &c->seeds[i];
+		if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb &&
+		    t->rbeg + t->len <= a->re) // seed fully contained
+			a->seedcov += t->len; // this is not very accurate, but for approx. mapQ, this is good enough
+	}
+	a->seedlen0 = s->len;
+
+	a->frac_rep = c->frac_rep;
+}
+
+void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query,
+                   const mem_chain_t *c, mem_alnreg_v *av) {
+	int i, max_off[2], aw[2]; // aw: actual bandwidth used in extension
+	int64_t tmp;
+	const mem_seed_t *s;
+	mem_c2a_t st;
+
+	if (c->n == 0) return;
+	mem_chain2aln_init(opt, bns, pac, l_query, c, &st);
+	const int64_t *rmax = st.rmax;
+	const uint8_t *rseq = st.rseq;
+
+	while ((s = mem_chain2aln_next(opt, bns, l_query, &st, av)) != 0) {
+		mem_alnreg_t *a = &av->a[av->n - 1];
+		aw[0] = aw[1] = opt->w;
+
 		if (s->qbeg) { // left extension
 			uint8_t *rs, *qs;
 			int qle, tle, gtle, gscore;
@@ -1001,17 +1180,10 @@ void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac
 				       s->len * opt->a, a->score, qle, tle, gtle, gscore, aw[0], max_off[0]);
 				fflush(stdout);
 			}
-			// check whether we prefer to reach the end of the query
-			if (gscore <= 0 || gscore <= a->score - opt->pen_clip5) { // local extension
-				a->qb = s->qbeg - qle, a->rb = s->rbeg - tle;
-				a->truesc = a->score;
-			} else { // to-end extension
-				a->qb = 0, a->rb = s->rbeg - gtle;
-				a->truesc = gscore;
-			}
+			mem_chain2aln_left(opt, s, qle, tle, gtle, gscore, a);
 			free(qs);
 			free(rs);
-		} else a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
+		}
 
 		if (s->qbeg + s->len != l_query) { // right extension
 			int qle, tle, qe, re, gtle, gscore, sc0 = a->score;
@@ -1035,33 +1207,16 @@ void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac
 				       sc0, a->score, qle, tle, gtle, gscore, aw[1], max_off[1]);
 				fflush(stdout);
 			}
-			// similar to the above
-			if (gscore <= 0 || gscore <= a->score - opt->pen_clip3) { // local extension
-				a->qe = qe + qle, a->re = rmax[0] + re + tle;
-				a->truesc += a->score - sc0;
-			} else { // to-end extension
-				a->qe = l_query, a->re = rmax[0] + re + gtle;
-				a->truesc += gscore - sc0;
-			}
-		} else a->qe = l_query, a->re = s->rbeg + s->len;
+			mem_chain2aln_right(opt, l_query, qe, rmax[0] + re, sc0, qle, tle, gtle, gscore, a);
+		}
 		if (bwa_verbose >= 4)
 			printf("*** Added alignment region: [%d,%d) <=> [%ld,%ld); score=%d; {left,right}_bandwidth={%d,%d}\n",
 			       a->qb, a->qe, (long) a->rb, (long) a->re, a->score, aw[0], aw[1]);
 
-		// compute seedcov
-		for (i = 0, a->seedcov = 0; i < c->n; ++i) {
-			const mem_seed_t *t = &c->seeds[i];
-			if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb &&
-			    t->rbeg + t->len <= a->re) // seed fully contained
-				a->seedcov += t->len; // this is not very accurate, but for approx. mapQ, this is good enough
-		}
+		mem_chain2aln_finish(c, s, a);
 		a->w = aw[0] > aw[1] ? aw[0] : aw[1];
-		a->seedlen0 = s->len;
-
-		a->frac_rep = c->frac_rep;
 	}
-	free(srt);
-	free(rseq);
+	mem_chain2aln_destroy(&st);
 }
 
 /*****************************
@@ -1105,6 +1260,12 @@ void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq
 	int i, l_name;
 	mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0; // make a copy of the alignment to convert
 
+#ifdef USE_SORMADUP
+	if (opt->flag & MEM_F_BAM) { // the record goes to tbb-sormadup, no text
+		mem_aln2bam(opt, bns, s, n, list, which, m_);
+		return;
+	}
+#endif
 	if (m_) mtmp = *m_, m = &mtmp;
 	// set flag
 	p->flag |= m ? 0x1 : 0; // is paired in sequencing
@@ -1403,19 +1564,32 @@ mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const lbwt_t *lbwt, const bnt
 	return regs;
 }
 
-// this method is to process only one read
-mem_alnreg_v mem_align2_core(const mem_opt_t *opt, FMI_search *fmi, LISA_search<index_t> * lisa,
-                             int l_seq, char *seq, void *buf) {
+// the regions of a read once all its chains are extended
+static void mem_chain2regs_finish(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, char *seq,
+                                  mem_alnreg_v *regs) {
+    int i;
+    regs->n = mem_sort_dedup_patch(opt, bns, pac, (uint8_t *) seq, regs->n, regs->a);
+    if (bwa_verbose >= 4) {
+        err_printf("* %ld chains remain after removing duplicated chains\n", regs->n);
+        for (i = 0; i < regs->n; ++i) {
+            mem_alnreg_t *p = &regs->a[i];
+            printf("** %d, [%d,%d) <=> [%ld,%ld)\n", p->score, p->qb, p->qe, (long) p->rb, (long) p->re);
+        }
+    }
+    for (i = 0; i < regs->n; ++i) {//copy information
+        mem_alnreg_t *p = &regs->a[i];
+        if (p->rid >= 0 && bns->anns[p->rid].is_alt)
+            p->is_alt = 1;
+    }
+}
+
+// the alignment regions of a read from its chains
+static mem_alnreg_v mem_chain2regs(const mem_opt_t *opt, FMI_search *fmi, int l_seq, char *seq, mem_chain_v chn) {
     int i;
-    mem_chain_v chn;
     mem_alnreg_v regs;
     const bntseq_t *bns = fmi->idx->bns;
     uint8_t* pac = fmi->idx->pac;
 
-    for (i = 0; i < l_seq; ++i) // convert to 2-bit encoding if we have not done so
-        seq[i] = seq[i] < 4 ? seq[i] : nst_nt4_table[(int) seq[i]];
-
-    chn = mem_chain2(opt, bns, fmi, lisa, l_seq, (uint8_t *) seq, buf);
     chn.n = mem_chain_flt(opt, chn.n, chn.a);
     mem_flt_chained_seeds(opt, bns, pac, l_seq, (uint8_t *) seq, chn.n, chn.a);
     if (bwa_verbose >= 4) mem_print_chain(bns, &chn);
@@ -1428,20 +1602,103 @@ mem_alnreg_v mem_align2_core(const mem_opt_t *opt, FMI_search *fmi, LISA_search<
         free(chn.a[i].seeds);
     }
     free(chn.a);
-    regs.n = mem_sort_dedup_patch(opt, bns, pac, (uint8_t *) seq, regs.n, regs.a);
-    if (bwa_verbose >= 4) {
-        err_printf("* %ld chains remain after removing duplicated chains\n", regs.n);
-        for (i = 0; i < regs.n; ++i) {
-            mem_alnreg_t *p = &regs.a[i];
-            printf("** %d, [%d,%d) <=> [%ld,%ld)\n", p->score, p->qb, p->qe, (long) p->rb, (long) p->re);
-        }
+    mem_chain2regs_finish(opt, bns, pac, seq, &regs);
+    return regs;
+}
+
+// mem_chain2regs() on the n reads of a block, their seeds being extended by ksw_extend_batch(). it runs in rounds
+// taking the next seed to extend of every read, as whether a seed is extended depends on the regions of those
+// extended before it; the left extensions of a round go in one batch, then the right ones, which start from them
+static void mem_chain2regs_batched(const mem_opt_t *opt, FMI_search *fmi, int n, const int *lens, uint8_t **seqs,
+                                   mem_chain_v *chns, mem_alnreg_v *regs) {
+    int i, j, n_active = n;
+    const bntseq_t *bns = fmi->idx->bns;
+    uint8_t* pac = fmi->idx->pac;
+    std::vector<int> ci(n, 0); // the chain being extended
+    std::vector<mem_c2a_t> st(n);
+    std::vector<const mem_seed_t *> seeds(n);
+    std::vector<kswx_t> ext;
+    std::vector<int> ids;
+
+    for (j = 0; j < n; ++j) {
+        chns[j].n = mem_chain_flt(opt, chns[j].n, chns[j].a);
+        mem_flt_chained_seeds(opt, bns, pac, lens[j], seqs[j], chns[j].n, chns[j].a);
+        kv_init(regs[j]);
+        st[j].c = 0;
     }
-    for (i = 0; i < regs.n; ++i) {//copy information
-        mem_alnreg_t *p = &regs.a[i];
-        if (p->rid >= 0 && bns->anns[p->rid].is_alt)
-            p->is_alt = 1;
+    while (n_active > 0) {
+        ext.clear(), ids.clear();
+        for (j = 0; j < n; ++j) {
+            const mem_seed_t *s = 0;
+            if (ci[j] > (int) chns[j].n) continue;
+            for (; ci[j] < (int) chns[j].n; ++ci[j]) {
+                mem_chain_t *p = &chns[j].a[ci[j]];
+                if (st[j].c != p) mem_chain2aln_init(opt, bns, pac, lens[j], p, &st[j]);
+                if ((s = mem_chain2aln_next(opt, bns, lens[j], &st[j], &regs[j])) != 0) break;
+                mem_chain2aln_destroy(&st[j]);
+                free(p->seeds);
+            }
+            if ((seeds[j] = s) == 0) { // all chains done
+                free(chns[j].a);
+                mem_chain2regs_finish(opt, bns, pac, (char *) seqs[j], &regs[j]);
+                ++ci[j], --n_active;
+                continue;
+            }
+            if (s->qbeg) { // the reversed sequences ahead of the seed
+                kswx_t x;
+                x.qlen = s->qbeg, x.query = seqs[j] + s->qbeg;
+                x.tlen = s->rbeg - st[j].rmax[0], x.target = st[j].rseq + x.tlen;
+                x.rev = 1, x.h0 = s->len * opt->a;
+                ext.push_back(x), ids.push_back(j);
+            }
+        }
+        ksw_extend_batch(ext.size(), ext.data(), 5, opt->mat, opt->o_del, opt->e_ins, opt->w, opt->pen_clip5,
+                         opt->zdrop);
+        for (i = 0; i < (int) ext.size(); ++i) {
+            mem_alnreg_t *a = &regs[ids[i]].a[regs[ids[i]].n - 1];
+            a->score = ext[i].score;
+            mem_chain2aln_left(opt, seeds[ids[i]], ext[i].qle, ext[i].tle, ext[i].gtle, ext[i].gscore, a);
+        }
+
+        ext.clear(), ids.clear();
+        for (j = 0; j < n; ++j) {
+            const mem_seed_t *s = seeds[j];
+            if (s && s->qbeg + s->len != lens[j]) {
+                kswx_t x;
+                int64_t re = s->rbeg + s->len - st[j].rmax[0];
+                x.qlen = lens[j] - (s->qbeg + s->len), x.query = seqs[j] + s->qbeg + s->len;
+                x.tlen = st[j].rmax[1] - st[j].rmax[0] - re, x.target = st[j].rseq + re;
+                x.rev = 0, x.h0 = regs[j].a[regs[j].n - 1].score;
+                ext.push_back(x), ids.push_back(j);
+            }
+        }
+        ksw_extend_batch(ext.size(), ext.data(), 5, opt->mat, opt->o_del, opt->e_ins, opt->w, opt->pen_clip3,
+                         opt->zdrop);
+        for (i = 0; i < (int) ext.size(); ++i) {
+            const mem_seed_t *s = seeds[ids[i]];
+            mem_alnreg_t *a = &regs[ids[i]].a[regs[ids[i]].n - 1];
+            int qe = s->qbeg + s->len, sc0 = a->score;
+            a->score = ext[i].score;
+            mem_chain2aln_right(opt, lens[ids[i]], qe, s->rbeg + s->len, sc0, ext[i].qle, ext[i].tle, ext[i].gtle,
+                                ext[i].gscore, a);
+        }
+        for (j = 0; j < n; ++j)
+            if (seeds[j]) mem_chain2aln_finish(st[j].c, seeds[j], &regs[j].a[regs[j].n - 1]);
     }
-    return regs;
+}
+
+// this method is to process only one read
+mem_alnreg_v mem_align2_core(const mem_opt_t *opt, FMI_search *fmi, LISA_search<index_t> * lisa,
+                             int l_seq, char *seq, void *buf) {
+    int i;
+    mem_chain_v chn;
+    const bntseq_t *bns = fmi->idx->bns;
+
+    for (i = 0; i < l_seq; ++i) // convert to 2-bit encoding if we have not done so
+        seq[i] = seq[i] < 4 ? seq[i] : nst_nt4_table[(int) seq[i]];
+
+    chn = mem_chain2(opt, bns, fmi, lisa, l_seq, (uint8_t *) seq, buf);
+    return mem_chain2regs(opt, fmi, l_seq, seq, chn);
 }
 
 mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const char *query_,
@@ -1533,8 +1790,11 @@ typedef struct {
 	bseq1_t *seqs;
 	mem_alnreg_v *regs;
 	int64_t n_processed;
+	int n;                  // the number of reads in seqs
     FMI_search       *fmi;
     LISA_search<index_t> *lisa;
+    threadData **td;                // the LISA prefetch pools of every thread
+    std::vector<SMEM> **smems;      // the SMEMs of the reads of a block, for every thread
 } worker_t;
 
 //static void worker1(void *data, long i, int tid) {
@@ -1552,25 +1812,46 @@ typedef struct {
 //	}
 //}
 
+// block i holds the reads [i*BATCH_SIZE, (i+1)*BATCH_SIZE), both ends of a pair being in the same block as
+// BATCH_SIZE is even. their SMEMs are collected together, and their seeds extended together
 static void worker1(void *data, long i, int tid) {
     worker_t *w = (worker_t *) data;
-    if (!(w->opt->flag & MEM_F_PE)) {
-        if (bwa_verbose >= 4) printf("=====> Processing read '%s' <=====\n", w->seqs[i].name);
-        w->regs[i] = mem_align2_core(w->opt, w->fmi, w->lisa, w->seqs[i].l_seq, w->seqs[i].seq, w->aux[tid]);
-    } else {
-        if (bwa_verbose >= 4) printf("=====> Processing read '%s'/1 <=====\n", w->seqs[i << 1 | 0].name);
-        w->regs[i << 1 | 0] = mem_align2_core(w->opt, w->fmi, w->lisa, w->seqs[i << 1 | 0].l_seq,
-                                              w->seqs[i << 1 | 0].seq, w->aux[tid]);
-        if (bwa_verbose >= 4) printf("=====> Processing read '%s'/2 <=====\n", w->seqs[i << 1 | 1].name);
-        w->regs[i << 1 | 1] = mem_align2_core(w->opt, w->fmi, w->lisa, w->seqs[i << 1 | 1].l_seq,
-                                              w->seqs[i << 1 | 1].seq, w->aux[tid]);
+    int j, k, beg = i * BATCH_SIZE, n = w->n - beg < BATCH_SIZE ? w->n - beg : BATCH_SIZE;
+    int lens[BATCH_SIZE];
+    uint8_t *seqs[BATCH_SIZE];
+    std::vector<SMEM> *matchArrays = w->smems[tid];
+
+    for (j = 0; j < n; ++j) {
+        bseq1_t *s = &w->seqs[beg + j];
+        for (k = 0; k < s->l_seq; ++k) // convert to 2-bit encoding if we have not done so
+            s->seq[k] = s->seq[k] < 4 ? s->seq[k] : nst_nt4_table[(int) s->seq[k]];
+        lens[j] = s->l_seq;
+        seqs[j] = (uint8_t *) s->seq;
+    }
+    mem_collect_smem_batched(w->fmi, w->lisa, w->opt, *w->td[tid], n, lens, seqs, matchArrays);
+    if (bwa_verbose >= 4) { // read by read, with the traces of mem_chain2aln()
+        for (j = 0; j < n; ++j) {
+            bseq1_t *s = &w->seqs[beg + j];
+            if (!(w->opt->flag & MEM_F_PE)) printf("=====> Processing read '%s' <=====\n", s->name);
+            else printf("=====> Processing read '%s'/%d <=====\n", s->name, (beg + j) % 2 + 1);
+            mem_chain_v chn = mem_smem2chain(w->opt, w->bns, w->lisa, s->l_seq, matchArrays[j]);
+            w->regs[beg + j] = mem_chain2regs(w->opt, w->fmi, s->l_seq, s->seq, chn);
+        }
+        return;
     }
+    mem_chain_v chns[BATCH_SIZE];
+    for (j = 0; j < n; ++j)
+        chns[j] = mem_smem2chain(w->opt, w->bns, w->lisa, lens[j], matchArrays[j]);
+    mem_chain2regs_batched(w->opt, w->fmi, n, lens, seqs, chns, &w->regs[beg]);
 }
 
 static void worker2(void *data, long i, int tid) {
 	extern int
 	mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id,
 	           bseq1_t s[2], mem_alnreg_v a[2]);
+	extern int
+	mem_sam_pe_batch(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4],
+	                 uint64_t id, int n_pairs, bseq1_t *s, mem_alnreg_v *a);
 	extern void
 	mem_reg2ovlp(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bseq1_t *s, mem_alnreg_v *a);
 	worker_t *w = (worker_t *) data;
@@ -1580,11 +1861,16 @@ static void worker2(void *data, long i, int tid) {
 		if (w->opt->flag & MEM_F_PRIMARY5) mem_reorder_primary5(w->opt->T, &w->regs[i]);
 		mem_reg2sam(w->opt, w->bns, w->pac, &w->seqs[i], &w->regs[i], 0, 0);
 		free(w->regs[i].a);
-	} else {
-		if (bwa_verbose >= 4) printf("=====> Finalizing read pair '%s' <=====\n", w->seqs[i << 1 | 0].name);
-		mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed >> 1) + i, &w->seqs[i << 1], &w->regs[i << 1]);
-		free(w->regs[i << 1 | 0].a);
-		free(w->regs[i << 1 | 1].a);
+	} else { // block i holds the pairs [i*BATCH_SIZE/2, (i+1)*BATCH_SIZE/2), their mate rescues aligned together
+		int j, beg = i * (BATCH_SIZE >> 1), n = (w->n >> 1) - beg < BATCH_SIZE >> 1 ? (w->n >> 1) - beg : BATCH_SIZE >> 1;
+		if (bwa_verbose >= 4) {
+			for (j = beg; j < beg + n; ++j) {
+				printf("=====> Finalizing read pair '%s' <=====\n", w->seqs[j << 1 | 0].name);
+				mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed >> 1) + j, &w->seqs[j << 1], &w->regs[j << 1]);
+			}
+		} else mem_sam_pe_batch(w->opt, w->bns, w->pac, w->pes, (w->n_processed >> 1) + beg, n, &w->seqs[beg << 1], &w->regs[beg << 1]);
+		for (j = beg << 1; j < (beg + n) << 1; ++j)
+			free(w->regs[j].a);
 	}
 }
 
@@ -1651,16 +1937,29 @@ mem_process_seqs2(const mem_opt_t *opt, FMI_search* fmi, LISA_search<index_t>* l
         w.aux[i] = smem_aux_init();
     w.fmi = fmi;
     w.lisa = lisa;
-    kt_for(opt->n_threads, worker1, &w, (opt->flag & MEM_F_PE) ? n >> 1 : n, 0, t); // find mapping positions
-    for (i = 0; i < opt->n_threads; ++i)
+    w.n = n;
+    w.td = (threadData**)malloc(opt->n_threads * sizeof(threadData*));
+    w.smems = (std::vector<SMEM>**)malloc(opt->n_threads * sizeof(std::vector<SMEM>*));
+    for (i = 0; i < opt->n_threads; ++i) {
+        w.td[i] = new threadData(BATCH_SIZE);
+        w.smems[i] = new std::vector<SMEM>[BATCH_SIZE];
+    }
+    kt_for(opt->n_threads, worker1, &w, (n + BATCH_SIZE - 1) / BATCH_SIZE, 0, t); // find mapping positions
+    for (i = 0; i < opt->n_threads; ++i) {
         smem_aux_destroy(w.aux[i]);
+        w.td[i]->dealloc_td();
+        delete w.td[i];
+        delete[] w.smems[i];
+    }
     free(w.aux);
+    free(w.td);
+    free(w.smems);
     if (opt->flag & MEM_F_PE) { // infer insert sizes if not provided
         if (pes0)
             memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
         else mem_pestat(opt, bns->l_pac, n, w.regs, pes); // otherwise, infer the insert size distribution from data
     }
-    kt_for(opt->n_threads, worker2, &w, (opt->flag & MEM_F_PE) ? n >> 1 : n, 0, t); // generate alignment
+    kt_for(opt->n_threads, worker2, &w, (opt->flag & MEM_F_PE) ? ((n >> 1) + (BATCH_SIZE >> 1) - 1) / (BATCH_SIZE >> 1) : n, 0, t); // generate alignment
     free(w.regs);
     if (bwa_verbose >= 3)
         fprintf(stderr, "[M::%s] Processed %d reads in %.3f CPU sec, %.3f real sec\n", __func__, n, cputime() - ctime,
@@ -26,6 +26,7 @@ typedef struct __smem_i smem_i;
 #define MEM_F_PRIMARY5  0x800
 #define MEM_F_KEEP_SUPP_MAPQ 0x1000
 #define MEM_F_XB        0x2000
+#define MEM_F_BAM       0x4000 // bam1_t records for tbb-sormadup instead of SAM, see bwamem_bam.h
 
 typedef struct {
     bwtintv_v mem, mem1, *tmpv[2];
@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include "sam.h"
+#include "sormadup.h"
+#include "bwamem_bam.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+/*****************************
+ * Basic hit->BAM conversion *
+ *****************************/
+
+typedef std::vector<bam1_t*> mem_bam_v;
+
+// 4-bit BAM codes of ACGTN and of their complements
+static const uint8_t nt16_fwd[5] = { 1, 2, 4, 8, 15 };
+static const uint8_t nt16_rev[5] = { 8, 4, 2, 1, 15 };
+// the BAM operations of MIDSH
+static const int bam_op[5] = { BAM_CMATCH, BAM_CINS, BAM_CDEL, BAM_CSOFT_CLIP, BAM_CHARD_CLIP };
+
+static inline int get_rlen(int n_cigar, const uint32_t *cigar)
+{
+	int k, l;
+	for (k = l = 0; k < n_cigar; ++k) {
+		int op = cigar[k] & 0xf;
+		if (op == 0 || op == 2)
+			l += cigar[k] >> 4;
+	}
+	return l;
+}
+
+// the operation written by add_cigar(): hard clipping for supplementary alignments
+static inline int clip_op(const mem_opt_t *opt, const mem_aln_t *p, int c, int which)
+{
+	if (!(opt->flag & MEM_F_SOFTCLIP) && !p->is_alt && (c == 3 || c == 4))
+		c = which ? 4 : 3;
+	return c;
+}
+
+static void cigar_str(const mem_opt_t *opt, const mem_aln_t *p, int which, std::string &str)
+{
+	int i;
+	for (i = 0; i < p->n_cigar; ++i) {
+		str += std::to_string(p->cigar[i] >> 4);
+		str += "MIDSH"[clip_op(opt, p, p->cigar[i] & 0xf, which)];
+	}
+}
+
+// integers take the smallest type, as sam_parse1() gives them
+static void aux_int(bam1_t *b, const char tag[2], int64_t x)
+{
+	if (x < 0) {
+		if (x >= INT8_MIN) { int8_t v = x; bam_aux_append(b, tag, 'c', 1, (uint8_t*)&v); }
+		else if (x >= INT16_MIN) { int16_t v = x; bam_aux_append(b, tag, 's', 2, (uint8_t*)&v); }
+		else { int32_t v = x; bam_aux_append(b, tag, 'i', 4, (uint8_t*)&v); }
+	} else {
+		if (x <= UINT8_MAX) { uint8_t v = x; bam_aux_append(b, tag, 'C', 1, (uint8_t*)&v); }
+		else if (x <= UINT16_MAX) { uint16_t v = x; bam_aux_append(b, tag, 'S', 2, (uint8_t*)&v); }
+		else { uint32_t v = x; bam_aux_append(b, tag, 'I', 4, (uint8_t*)&v); }
+	}
+}
+
+static inline void aux_str(bam1_t *b, const char tag[2], const char *s)
+{
+	bam_aux_append(b, tag, 'Z', strlen(s) + 1, (uint8_t*)s);
+}
+
+// the TAB-separated SAM tags of the FASTA/FASTQ comment (-C)
+static void aux_comment(bam1_t *b, const char *comment)
+{
+	std::string field;
+	std::istringstream in(comment);
+	while (std::getline(in, field, '\t')) {
+		const char *v = field.c_str() + 5;
+		if (field.size() < 5 || field[2] != ':' || field[4] != ':') {
+			if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] comment '%s' is not a SAM tag; dropped\n", __func__, field.c_str());
+			continue;
+		}
+		switch (field[3]) {
+		case 'i': aux_int(b, field.c_str(), strtoll(v, 0, 10)); break;
+		case 'f': { float f = strtof(v, 0); bam_aux_append(b, field.c_str(), 'f', 4, (uint8_t*)&f); break; }
+		case 'A': bam_aux_append(b, field.c_str(), 'A', 1, (uint8_t*)v); break;
+		case 'Z':
+		case 'H': bam_aux_append(b, field.c_str(), field[3], strlen(v) + 1, (uint8_t*)v); break;
+		default:
+			if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] tag type '%c' of the comment is not supported; dropped\n", __func__, field[3]);
+		}
+	}
+}
+
+void mem_aln2bam(const mem_opt_t *opt, const bntseq_t *bns, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_)
+{
+	int i, l_name, l_qname, n_cigar, qb = 0, qe = s->l_seq, l_qseq;
+	mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0; // make a copy of the alignment to convert
+	bam1_t *b = bam_init1();
+	bam1_core_t *c = &b->core;
+	uint8_t *d;
+
+	if (m_) mtmp = *m_, m = &mtmp;
+	// set flag, as mem_aln2sam()
+	p->flag |= m ? 0x1 : 0; // is paired in sequencing
+	p->flag |= p->rid < 0 ? 0x4 : 0; // is mapped
+	p->flag |= m && m->rid < 0 ? 0x8 : 0; // is mate mapped
+	if (p->rid < 0 && m && m->rid >= 0) // copy mate to alignment
+		p->rid = m->rid, p->pos = m->pos, p->is_rev = m->is_rev, p->n_cigar = 0;
+	if (m && m->rid < 0 && p->rid >= 0) // copy alignment to mate
+		m->rid = p->rid, m->pos = p->pos, m->is_rev = p->is_rev, m->n_cigar = 0;
+	p->flag |= p->is_rev ? 0x10 : 0; // is on the reverse strand
+	p->flag |= m && m->is_rev ? 0x20 : 0; // is mate on the reverse strand
+
+	// the core: FLAG, RNAME, POS, MAPQ, the mate position and TLEN
+	c->flag = (p->flag & 0xffff) | (p->flag & 0x10000 ? 0x100 : 0);
+	c->tid = p->rid >= 0 ? p->rid : -1;
+	c->pos = p->rid >= 0 ? p->pos : -1;
+	c->qual = p->rid >= 0 ? p->mapq : 0;
+	n_cigar = p->rid >= 0 ? p->n_cigar : 0;
+	c->mtid = -1, c->mpos = -1, c->isize = 0;
+	if (m && m->rid >= 0) {
+		c->mtid = m->rid, c->mpos = m->pos;
+		if (p->rid == m->rid && m->n_cigar && p->n_cigar) {
+			int64_t p0 = p->pos + (p->is_rev ? get_rlen(p->n_cigar, p->cigar) - 1 : 0);
+			int64_t p1 = m->pos + (m->is_rev ? get_rlen(m->n_cigar, m->cigar) - 1 : 0);
+			c->isize = -(p0 - p1 + (p0 > p1 ? 1 : p0 < p1 ? -1 : 0));
+		}
+	}
+
+	// the bases of SEQ and QUAL
+	if (p->flag & 0x100) { // for secondary alignments, no SEQ and QUAL
+		qb = qe = 0;
+	} else if (p->n_cigar && which && !(opt->flag & MEM_F_SOFTCLIP) && !p->is_alt) { // hard clipped
+		int head = (p->cigar[0] & 0xf) == 4 || (p->cigar[0] & 0xf) == 3 ? p->cigar[0] >> 4 : 0;
+		int tail = (p->cigar[p->n_cigar - 1] & 0xf) == 4 || (p->cigar[p->n_cigar - 1] & 0xf) == 3 ? p->cigar[p->n_cigar - 1] >> 4 : 0;
+		if (!p->is_rev) qb += head, qe -= tail;
+		else qe -= head, qb += tail;
+	}
+	l_qseq = qe - qb;
+
+	// the variable length data: QNAME, CIGAR, SEQ and QUAL
+	l_name = strlen(s->name);
+	l_qname = l_name + 1;
+#ifdef HTS_VERSION
+	c->l_extranul = (4 - l_qname % 4) % 4; // keep the CIGAR aligned, as sam_parse1()
+	l_qname += c->l_extranul;
+#endif
+	c->l_qname = l_qname;
+	c->n_cigar = n_cigar;
+	c->l_qseq = l_qseq;
+	b->l_data = b->m_data = l_qname + 4 * n_cigar + ((l_qseq + 1) >> 1) + l_qseq;
+	b->data = d = (uint8_t*)calloc(b->m_data, 1);
+	memcpy(d, s->name, l_name);
+	d += l_qname;
+	for (i = 0; i < n_cigar; ++i, d += 4) {
+		uint32_t op = bam_cigar_gen(p->cigar[i] >> 4, bam_op[clip_op(opt, p, p->cigar[i] & 0xf, which)]);
+		memcpy(d, &op, 4);
+	}
+	for (i = 0; i < l_qseq; ++i) {
+		int k = p->is_rev ? qe - 1 - i : qb + i;
+		d[i >> 1] |= (p->is_rev ? nt16_rev : nt16_fwd)[(int)s->seq[k]] << ((~i & 1) << 2);
+	}
+	d += (l_qseq + 1) >> 1;
+	for (i = 0; i < l_qseq; ++i)
+		d[i] = s->qual ? s->qual[p->is_rev ? qe - 1 - i : qb + i] - 33 : 0xff;
+	c->bin = hts_reg2bin(c->pos, c->pos + (n_cigar ? bam_cigar2rlen(n_cigar, bam_get_cigar(b)) : 1), 14, 5);
+
+	// the optional tags, in the order of mem_aln2sam()
+	if (p->n_cigar) {
+		aux_int(b, "NM", p->NM);
+		aux_str(b, "MD", (char *) (p->cigar + p->n_cigar));
+	}
+	if (m && m->n_cigar) {
+		std::string mc;
+		cigar_str(opt, m, which, mc);
+		aux_str(b, "MC", mc.c_str());
+	}
+	if (p->score >= 0) aux_int(b, "AS", p->score);
+	if (p->sub >= 0) aux_int(b, "XS", p->sub);
+	if (bwa_rg_id[0]) aux_str(b, "RG", bwa_rg_id);
+	if (!(p->flag & 0x100)) { // not multi-hit
+		for (i = 0; i < n; ++i)
+			if (i != which && !(list[i].flag & 0x100)) break;
+		if (i < n) { // there are other primary hits
+			std::string sa;
+			for (i = 0; i < n; ++i) {
+				const mem_aln_t *r = &list[i];
+				int k;
+				if (i == which || (r->flag & 0x100)) continue;
+				sa += bns->anns[r->rid].name;
+				sa += ',' + std::to_string(r->pos + 1) + ',' + "+-"[r->is_rev] + ',';
+				for (k = 0; k < r->n_cigar; ++k)
+					sa += std::to_string(r->cigar[k] >> 4) + "MIDSH"[r->cigar[k] & 0xf];
+				sa += ',' + std::to_string(r->mapq) + ',' + std::to_string(r->NM) + ';';
+			}
+			aux_str(b, "SA", sa.c_str());
+		}
+		if (p->alt_sc > 0) { // the value of the text, rounded to 3 decimals
+			char buf[32];
+			float pa;
+			snprintf(buf, sizeof(buf), "%.3f", (double) p->score / p->alt_sc);
+			pa = strtof(buf, 0);
+			bam_aux_append(b, "pa", 'f', 4, (uint8_t*)&pa);
+		}
+	}
+	if (p->XA) aux_str(b, (opt->flag & MEM_F_XB) ? "XB" : "XA", p->XA);
+	if (s->comment) aux_comment(b, s->comment);
+	if ((opt->flag & MEM_F_REF_HDR) && p->rid >= 0 && bns->anns[p->rid].anno != 0 && bns->anns[p->rid].anno[0] != 0) {
+		std::string xr(bns->anns[p->rid].anno);
+		for (i = 0; i < (int)xr.size(); ++i) // replace TAB in the comment to SPACE
+			if (xr[i] == '\t') xr[i] = ' ';
+		aux_str(b, "XR", xr.c_str());
+	}
+
+	if (s->bam == 0) s->bam = new mem_bam_v;
+	((mem_bam_v*)s->bam)->push_back(b);
+}
+
+/************************
+ * tbb-sormadup handoff *
+ ************************/
+
+int mem_bam_start(const char *args, const bntseq_t *bns, const char *hdr_line)
+{
+	// the options are parsed by getopt, they have to outlive the run
+	static std::vector<std::string> words;
+	static std::vector<char*> argv;
+	std::istringstream in(args);
+	std::string word;
+	char *text;
+	sam_hdr_t *header;
+
+	words.push_back("tbb-sormadup");
+	while (in >> word) words.push_back(word);
+	for (auto &w : words) argv.push_back(&w[0]);
+	argv.push_back(0);
+
+	text = bwa_sam_hdr(bns, hdr_line);
+	header = sam_hdr_parse(strlen(text), text);
+	free(text);
+	if (header == 0) {
+		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] fail to parse the SAM header\n", __func__);
+		return -1;
+	}
+	return sormadup_start(argv.size() - 1, argv.data(), header) ? 0 : -1;
+}
+
+void mem_bam_push(int n, bseq1_t *seqs)
+{
+	int i;
+	std::vector<bam1_t*> batch;
+	for (i = 0; i < n; ++i) {
+		mem_bam_v *v = (mem_bam_v*)seqs[i].bam;
+		if (v == 0) continue;
+		batch.insert(batch.end(), v->begin(), v->end());
+		delete v;
+		seqs[i].bam = 0;
+	}
+	sormadup_push(batch.data(), batch.size());
+}
+
+int mem_bam_finish(void)
+{
+	return sormadup_finish();
+}
@@ -0,0 +1,43 @@
+#ifndef BWAMEM_BAM_H_
+#define BWAMEM_BAM_H_
+
+#include "bwamem.h"
+
+/**
+ * mem --sort-markdup: the alignments are built as bam1_t records and handed over to tbb-sormadup,
+ * linked into the same process (SortMarkDup/sormadup.h), instead of being written as SAM to a pipe.
+ * Available when built with `make SORMADUP=1`.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/**
+	 * Start tbb-sormadup with the options in $args, separated by blanks, on the header of
+	 * bwa_print_sam_hdr(). Return 0 on success.
+	 */
+	int mem_bam_start(const char *args, const bntseq_t *bns, const char *hdr_line);
+
+	/**
+	 * Build the record of $list[$which], with the fields and tags mem_aln2sam() would write, and
+	 * append it to $s->bam. mem_aln2sam() calls it when MEM_F_BAM is set.
+	 */
+	void mem_aln2bam(const mem_opt_t *opt, const bntseq_t *bns, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m);
+
+	/**
+	 * Hand the records of $seqs[0..$n) over to tbb-sormadup in this order and reset $seqs[i].bam. The
+	 * batches are pushed by one thread at a time, in the input order.
+	 */
+	void mem_bam_push(int n, bseq1_t *seqs);
+
+	/**
+	 * The end of the alignments: wait for tbb-sormadup to write its output, return its exit code.
+	 */
+	int mem_bam_finish(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
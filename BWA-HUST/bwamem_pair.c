@@ -135,11 +135,18 @@ void mem_pestat(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *
 		}
 }
 
-int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma)
+typedef struct {
+	int n, r[4], job[4]; // orientations tried, in order, and their alignment in the job list or -1
+	int64_t rb[4];
+	uint8_t *ref[4];
+} mem_matesw_t;
+
+// the references to align the mate to; jobs must have room for 4 more alignments
+static void mem_matesw_prep(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, uint8_t **rev, const mem_alnreg_v *ma, mem_matesw_t *m, int *n_jobs, kswa_t *jobs)
 {
-	extern int mem_sort_dedup_patch(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, uint8_t *query, int n, mem_alnreg_t *a);
 	int64_t l_pac = bns->l_pac;
-	int i, r, skip[4], n = 0, rid;
+	int i, r, skip[4], rid = -1;
+	m->n = 0;
 	for (r = 0; r < 4; ++r)
 		skip[r] = pes[r].failed? 1 : 0;
 	for (i = 0; i < ma->n; ++i) { // check which orinentation has been found
@@ -148,18 +155,20 @@ int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 		if (dist >= pes[r].low && dist <= pes[r].high)
 			skip[r] = 1;
 	}
-	if (skip[0] + skip[1] + skip[2] + skip[3] == 4) return 0; // consistent pair exist; no need to perform SW
+	if (skip[0] + skip[1] + skip[2] + skip[3] == 4) return; // consistent pair exist; no need to perform SW
 	for (r = 0; r < 4; ++r) {
 		int is_rev, is_larger;
-		uint8_t *seq, *rev = 0, *ref = 0;
+		uint8_t *seq, *ref = 0;
 		int64_t rb, re;
 		if (skip[r]) continue;
 		is_rev = (r>>1 != (r&1)); // whether to reverse complement the mate
 		is_larger = !(r>>1); // whether the mate has larger coordinate
 		if (is_rev) {
-			rev = (uint8_t*)malloc(l_ms); // this is the reverse complement of $ms
-			for (i = 0; i < l_ms; ++i) rev[l_ms - 1 - i] = ms[i] < 4? 3 - ms[i] : 4;
-			seq = rev;
+			if (*rev == 0) { // the reverse complement of $ms, shared by both orientations
+				*rev = (uint8_t*)malloc(l_ms);
+				for (i = 0; i < l_ms; ++i) (*rev)[l_ms - 1 - i] = ms[i] < 4? 3 - ms[i] : 4;
+			}
+			seq = *rev;
 		} else seq = (uint8_t*)ms;
 		if (!is_rev) {
 			rb = is_larger? a->rb + pes[r].low : a->rb - pes[r].high;
@@ -171,24 +180,42 @@ int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 		if (rb < 0) rb = 0;
 		if (re > l_pac<<1) re = l_pac<<1;
 		if (rb < re) ref = bns_fetch_seq(bns, pac, &rb, (rb+re)>>1, &re, &rid);
+		m->r[m->n] = r, m->rb[m->n] = rb, m->ref[m->n] = ref, m->job[m->n] = -1;
 		if (a->rid == rid && re - rb >= opt->min_seed_len) { // no funny things happening
-			kswr_t aln;
+			kswa_t *p = &jobs[m->job[m->n] = (*n_jobs)++];
+			p->qlen = l_ms, p->query = seq;
+			p->tlen = re - rb, p->target = ref;
+			p->xtra = KSW_XSUBO | KSW_XSTART | (l_ms * opt->a < 250? KSW_XBYTE : 0) | (opt->min_seed_len * opt->a);
+		}
+		++m->n;
+	}
+}
+
+// add the alignments of the mate to ma, in the order mem_matesw() has always done
+static int mem_matesw_apply(const mem_opt_t *opt, const bntseq_t *bns, const mem_alnreg_t *a, int l_ms, mem_matesw_t *m, const kswa_t *jobs, mem_alnreg_v *ma)
+{
+	extern int mem_sort_dedup_patch(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, uint8_t *query, int n, mem_alnreg_t *a);
+	int64_t l_pac = bns->l_pac;
+	int i, k, n = 0;
+	for (k = 0; k < m->n; ++k) {
+		int r = m->r[k], is_rev = (r>>1 != (r&1));
+		int64_t rb = m->rb[k];
+		if (m->job[k] >= 0) {
+			const kswr_t *aln = &jobs[m->job[k]].r;
 			mem_alnreg_t b;
-			int tmp, xtra = KSW_XSUBO | KSW_XSTART | (l_ms * opt->a < 250? KSW_XBYTE : 0) | (opt->min_seed_len * opt->a);
-			aln = ksw_align2(l_ms, seq, re - rb, ref, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, xtra, 0);
+			int tmp;
 			memset(&b, 0, sizeof(mem_alnreg_t));
-			if (aln.score >= opt->min_seed_len && aln.qb >= 0) { // something goes wrong if aln.qb < 0
+			if (aln->score >= opt->min_seed_len && aln->qb >= 0) { // something goes wrong if aln.qb < 0
 				b.rid = a->rid;
 				b.is_alt = a->is_alt;
-				b.qb = is_rev? l_ms - (aln.qe + 1) : aln.qb;                                                                                                                                                                              
-				b.qe = is_rev? l_ms - aln.qb : aln.qe + 1; 
-				b.rb = is_rev? (l_pac<<1) - (rb + aln.te + 1) : rb + aln.tb;
-				b.re = is_rev? (l_pac<<1) - (rb + aln.tb) : rb + aln.te + 1;
-				b.score = aln.score;
-				b.csub = aln.score2;
+				b.qb = is_rev? l_ms - (aln->qe + 1) : aln->qb;
+				b.qe = is_rev? l_ms - aln->qb : aln->qe + 1;
+				b.rb = is_rev? (l_pac<<1) - (rb + aln->te + 1) : rb + aln->tb;
+				b.re = is_rev? (l_pac<<1) - (rb + aln->tb) : rb + aln->te + 1;
+				b.score = aln->score;
+				b.csub = aln->score2;
 				b.secondary = -1;
 				b.seedcov = (b.re - b.rb < b.qe - b.qb? b.re - b.rb : b.qe - b.qb) >> 1;
-//				printf("*** %d, [%lld,%lld], %d:%d, (%lld,%lld), (%lld,%lld) == (%lld,%lld)\n", aln.score, rb, re, is_rev, is_larger, a->rb, a->re, ma->a[0].rb, ma->a[0].re, b.rb, b.re);
 				kv_push(mem_alnreg_t, *ma, b); // make room for a new element
 				// move b s.t. ma is sorted
 				for (i = 0; i < ma->n - 1; ++i) // find the insertion point
@@ -200,12 +227,25 @@ int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 			++n;
 		}
 		if (n) ma->n = mem_sort_dedup_patch(opt, 0, 0, 0, ma->n, ma->a);
-		if (rev) free(rev);
-		free(ref);
+		free(m->ref[k]);
 	}
 	return n;
 }
 
+int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma)
+{
+	mem_matesw_t m;
+	kswa_t jobs[4];
+	uint8_t *rev = 0;
+	int k, n_jobs = 0, n;
+	mem_matesw_prep(opt, bns, pac, pes, a, l_ms, ms, &rev, ma, &m, &n_jobs, jobs);
+	for (k = 0; k < n_jobs; ++k)
+		jobs[k].r = ksw_align2(jobs[k].qlen, (uint8_t*)jobs[k].query, jobs[k].tlen, (uint8_t*)jobs[k].target, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, jobs[k].xtra, 0);
+	n = mem_matesw_apply(opt, bns, a, l_ms, &m, jobs, ma);
+	free(rev);
+	return n;
+}
+
 int mem_pair(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], bseq1_t s[2], mem_alnreg_v a[2], int id, int *sub, int *n_sub, int z[2], int n_pri[2])
 {
 	pair64_v v, u;
@@ -274,14 +314,14 @@ void mem_reorder_primary5(int T, mem_alnreg_v *a);
 
 #define raw_mapq(diff, a) ((int)(6.02 * (diff) / (a) + .499))
 
-int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2])
+static void mem_pe2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2])
 {
 	extern int mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
 	extern int mem_approx_mapq_se(const mem_opt_t *opt, const mem_alnreg_t *a);
 	extern void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bseq1_t *s, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m);
 	extern char **mem_gen_alt(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_alnreg_v *a, int l_query, const char *query);
 
-	int n = 0, i, j, z[2], o, subo, n_sub, extra_flag = 1, n_pri[2], n_aa[2];
+	int i, j, z[2], o, subo, n_sub, extra_flag = 1, n_pri[2], n_aa[2];
 	kstring_t str;
 	mem_aln_t h[2], g[2], aa[2][2];
 
@@ -289,18 +329,6 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 	memset(h, 0, sizeof(mem_aln_t) * 2);
 	memset(g, 0, sizeof(mem_aln_t) * 2);
 	n_aa[0] = n_aa[1] = 0;
-	if (!(opt->flag & MEM_F_NO_RESCUE)) { // then perform SW for the best alignment
-		mem_alnreg_v b[2];
-		kv_init(b[0]); kv_init(b[1]);
-		for (i = 0; i < 2; ++i)
-			for (j = 0; j < a[i].n; ++j)
-				if (a[i].a[j].score >= a[i].a[0].score  - opt->pen_unpaired)
-					kv_push(mem_alnreg_t, b[i], a[i].a[j]);
-		for (i = 0; i < 2; ++i)
-			for (j = 0; j < b[i].n && j < opt->max_matesw; ++j)
-				n += mem_matesw(opt, bns, pac, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
-		free(b[0].a); free(b[1].a);
-	}
 	n_pri[0] = mem_mark_primary_se(opt, a[0].n, a[0].a, id<<1|0);
 	n_pri[1] = mem_mark_primary_se(opt, a[1].n, a[1].a, id<<1|1);
 	if (opt->flag & MEM_F_PRIMARY5) {
@@ -380,7 +408,7 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 		}
 		for (i = 0; i < n_aa[0]; ++i)
 			mem_aln2sam(opt, bns, &str, &s[0], n_aa[0], aa[0], i, &h[1]); // write read1 hits
-		s[0].sam = strdup(str.s); str.l = 0;
+		s[0].sam = str.s? strdup(str.s) : 0; str.l = 0; // no text with MEM_F_BAM
 		for (i = 0; i < n_aa[1]; ++i)
 			mem_aln2sam(opt, bns, &str, &s[1], n_aa[1], aa[1], i, &h[0]); // write read2 hits
 		s[1].sam = str.s;
@@ -393,7 +421,7 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
 			free(XA[i]);
 		}
 	} else goto no_pairing;
-	return n;
+	return;
 
 no_pairing:
 	for (i = 0; i < 2; ++i) {
@@ -416,5 +444,66 @@ no_pairing:
 	mem_reg2sam(opt, bns, pac, &s[1], &a[1], 0x81|extra_flag, &h[0]);
 	if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
 	free(h[0].cigar); free(h[1].cigar);
+}
+
+int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2])
+{
+	int n = 0, i, j;
+	if (!(opt->flag & MEM_F_NO_RESCUE)) { // then perform SW for the best alignment
+		mem_alnreg_v b[2];
+		kv_init(b[0]); kv_init(b[1]);
+		for (i = 0; i < 2; ++i)
+			for (j = 0; j < a[i].n; ++j)
+				if (a[i].a[j].score >= a[i].a[0].score  - opt->pen_unpaired)
+					kv_push(mem_alnreg_t, b[i], a[i].a[j]);
+		for (i = 0; i < 2; ++i)
+			for (j = 0; j < b[i].n && j < opt->max_matesw; ++j)
+				n += mem_matesw(opt, bns, pac, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
+		free(b[0].a); free(b[1].a);
+	}
+	mem_pe2sam(opt, bns, pac, pes, id, s, a);
+	return n;
+}
+
+/* mem_sam_pe() on n_pairs pairs, s[] and a[] holding both reads of a pair next to each other. The j-th rescue of
+ * every read depends on the rescues before it, so they go in rounds: in round j the SW of the j-th rescue of all
+ * reads is done at once by ksw_align2_batch(), before the results are added in the order of mem_sam_pe(). */
+int mem_sam_pe_batch(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, int n_pairs, bseq1_t *s, mem_alnreg_v *a)
+{
+	int n = 0, i, j, k;
+	if (!(opt->flag & MEM_F_NO_RESCUE)) {
+		int n_reads = n_pairs<<1, n_jobs;
+		mem_alnreg_v *b;
+		mem_matesw_t *m;
+		uint8_t **rev;
+		kswa_t *jobs;
+		b = (mem_alnreg_v*)calloc(n_reads, sizeof(mem_alnreg_v));
+		m = (mem_matesw_t*)malloc(n_reads * sizeof(mem_matesw_t));
+		rev = (uint8_t**)calloc(n_reads, sizeof(uint8_t*));
+		jobs = (kswa_t*)malloc(n_reads * 4 * sizeof(kswa_t));
+		for (i = 0; i < n_reads; ++i)
+			for (j = 0; j < a[i].n; ++j)
+				if (a[i].a[j].score >= a[i].a[0].score  - opt->pen_unpaired)
+					kv_push(mem_alnreg_t, b[i], a[i].a[j]);
+		for (j = 0; j < opt->max_matesw; ++j) {
+			int n_tried = 0;
+			for (i = n_jobs = 0; i < n_reads; ++i) { // the j-th hit of read i rescues its mate, i^1
+				if (j >= b[i].n) continue;
+				mem_matesw_prep(opt, bns, pac, pes, &b[i].a[j], s[i^1].l_seq, (uint8_t*)s[i^1].seq, &rev[i^1], &a[i^1], &m[i], &n_jobs, jobs);
+				++n_tried;
+			}
+			if (n_tried == 0) break;
+			ksw_align2_batch(n_jobs, jobs, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins);
+			for (i = 0; i < n_reads; ++i)
+				if (j < b[i].n)
+					n += mem_matesw_apply(opt, bns, &b[i].a[j], s[i^1].l_seq, &m[i], jobs, &a[i^1]);
+		}
+		for (i = 0; i < n_reads; ++i) {
+			free(b[i].a); free(rev[i]);
+		}
+		free(b); free(m); free(rev); free(jobs);
+	}
+	for (k = 0; k < n_pairs; ++k)
+		mem_pe2sam(opt, bns, pac, pes, id + k, &s[k<<1], &a[k<<1]);
 	return n;
 }
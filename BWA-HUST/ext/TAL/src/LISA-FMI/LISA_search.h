@@ -157,6 +157,15 @@ class LISA_search : public FMI_search {
 
     void fmi_shrink(int cnt, Info* q_batch,  Info* output, int min_seed_len);
 
+    // smem_rmi over the queries of many reads, interleaved with prefetching. the SMEMs of a query come in
+    // the order smem_rmi gives them, with its id in rid
+    void smem_rmi_batched(Info *qs, int64_t qs_size, int64_t batch_size, threadData &td, std::vector<SMEM>& matchArray, int min_seed_len);
+
+    void fmi_extend_two_steps_batched(int cnt, Info* q_batch, threadData &td, int min_seed_len, std::vector<SMEM>& matchArray);
+
+    // fmi_shrink interleaved over the queries, the output is in the order they finish
+    void fmi_shrink_two_steps_batched(int cnt, Info* q_batch, Info* output, int min_seed_len);
+
 
 	void exact_search_rmi_batched_k3(Info *qs, int64_t qs_size, int64_t batch_size, threadData &td, Output* output, int min_seed_len, int tid = 0);
 
@@ -1371,6 +1380,179 @@ void LISA_search<index_t>::fmi_shrink(int cnt, Info* q_batch, Info* output, int
     }
 }
 
+template<typename index_t>
+void LISA_search<index_t>::smem_rmi_batched(Info *qs, int64_t qs_size, int64_t batch_size, threadData &td, std::vector<SMEM>& matchArray, int min_seed_len)
+{
+    Info* fmi_pool = td.fmi_pool;
+    int &fmi_cnt = td.fmi_cnt;
+    int &tree_cnt = td.tree_cnt;
+
+    fmi_cnt = tree_cnt = 0;
+    int64_t next_q = 0;
+    while(next_q < qs_size || fmi_cnt > 0){
+        while(next_q < qs_size && fmi_cnt < batch_size)
+            fmi_pool[fmi_cnt++] = qs[next_q++];
+
+        // the queries still extending go to tree_pool, tree_shrink_batched brings back to fmi_pool the ones to extend again
+        auto cnt = fmi_cnt;
+        fmi_cnt = 0;
+        this->fmi_extend_two_steps_batched(cnt, fmi_pool, td, min_seed_len, matchArray);
+        cnt = tree_cnt;
+        tree_cnt = 0;
+        this->tree_shrink_batched(cnt, td);
+    }
+}
+
+#define OCC_PREFETCH(q) do{\
+        const Occline *s_line = &this->lbwt->occArray[(q).intv.first >> 7]; \
+        const Occline *e_line = &this->lbwt->occArray[(q).intv.second >> 7]; \
+        my_prefetch((const char*)s_line->base, _MM_HINT_T0); \
+        my_prefetch((const char*)s_line->offset, _MM_HINT_T0); \
+        my_prefetch((const char*)e_line->base, _MM_HINT_T0); \
+        my_prefetch((const char*)e_line->offset, _MM_HINT_T0); \
+}while(0)
+
+// one step of fmi_extend_two_steps per query and round, the steps of the other queries hide the occArray misses
+template<typename index_t>
+void LISA_search<index_t>::fmi_extend_two_steps_batched(int cnt, Info* q_batch, threadData &td, int min_seed_len, std::vector<SMEM>& matchArray)
+{
+    FMI_search* tal_fmi = this;
+    int &tree_cnt = td.tree_cnt;
+    uint8_t a[2];
+    std::pair<int64_t, int64_t> next_tal[2];
+
+    int fmi_batch_size = min(30, cnt);
+    auto cnt1 = fmi_batch_size;
+
+    for(int i = 0; i < fmi_batch_size; i++){
+        OCC_PREFETCH(q_batch[i]);
+        my_prefetch((const char*)(q_batch[i].p + q_batch[i].l - 2), _MM_HINT_T0);
+    }
+
+    while(fmi_batch_size > 0) {
+        for(int i = 0; i < fmi_batch_size; i++){
+            Info &q = q_batch[i];
+            int jj = q.l - 1;
+            int more = 1;   // the cnt of fmi_extend_two_steps
+            bool done = true;
+            if(jj > -1){
+                a[0] = jj == 0 ? 4 : q.p[jj-1];
+                a[1] = q.p[jj];
+                int retf = tal_fmi->backwardExtTwoSteps_light({q.intv.first, q.intv.second}, a, next_tal);
+
+                if(retf == 2){
+                    if (next_tal[1].second - next_tal[1].first > q.min_intv) {
+                        q.l = jj-1;
+                        q.intv={next_tal[1].first, next_tal[1].second}; // fmi-continue
+                        done = q.l == 0;
+                    } else if (next_tal[0].second - next_tal[0].first > q.min_intv) {
+                        q.l = jj;
+                        q.intv={next_tal[0].first, next_tal[0].second};
+                    }
+                } else if(retf == 1){
+                    if (next_tal[0].second - next_tal[0].first > q.min_intv) {
+                        q.l = jj;
+                        q.intv={next_tal[0].first, next_tal[0].second};
+                        more = 0;
+                    }
+                } else {
+                    more = 0;
+                }
+            }
+            if(!done){
+                OCC_PREFETCH(q);
+                my_prefetch((const char*)(q.p + q.l - 2), _MM_HINT_T0);
+                continue;
+            }
+
+            if(q.l == 0)
+                more = 0;
+            if(q.r - q.l >= min_seed_len && q.l != q.prev_l){
+#ifdef OUTPUT
+                if(q.mid == 0 || q.mid > 0 && q.l <= q.mid)
+                {
+                    matchArray.emplace_back(q.id, q.l + q.offset, q.r-1 + q.offset, q.intv.first, 0, q.intv.second - q.intv.first);
+                    q.prev_l = q.l;
+                }
+#endif
+            }
+            if(more){
+                this->s_pb(q, tree_cnt, td);
+                tree_cnt++;
+            }
+
+            if(cnt1 < cnt) //More queries to be processed?
+                q = q_batch[cnt1++];
+            else
+                q = q_batch[--fmi_batch_size];
+            OCC_PREFETCH(q);
+            my_prefetch((const char*)(q.p + q.l - 2), _MM_HINT_T0);
+        }
+    }
+}
+
+// one step of fmi_shrink per query and round
+template<typename index_t>
+void LISA_search<index_t>::fmi_shrink_two_steps_batched(int cnt, Info* q_batch, Info* output, int min_seed_len)
+{
+    FMI_search* tal_fmi = this;
+    int output_cnt = 0;
+    uint8_t a[2];
+    std::pair<int64_t, int64_t> next_tal[2];
+
+    int fmi_batch_size = min(30, cnt);
+    auto cnt1 = fmi_batch_size;
+
+    for(int i = 0; i < fmi_batch_size; i++){
+        OCC_PREFETCH(q_batch[i]);
+        my_prefetch((const char*)(q_batch[i].p + q_batch[i].l), _MM_HINT_T0);
+    }
+
+    while(fmi_batch_size > 0) {
+        for(int i = 0; i < fmi_batch_size; i++){
+            Info &q = q_batch[i];
+            int it = q.l;
+            bool done = true;
+            if(it < q.r){
+                a[1] = 3 - q.p[it]; // the first step
+                a[0] = it+1 < q.r ? 3 - q.p[it+1] : 4;
+                int retf = tal_fmi->backwardExtTwoSteps_light({q.intv.first, q.intv.second}, a, next_tal);
+
+                if(retf == 2){
+                    if (next_tal[1].second - next_tal[1].first >= q.min_intv) {  // fmi-continue
+                        q.l = it + 2, q.intv={next_tal[1].first, next_tal[1].second};
+                        done = q.l >= q.r;
+                    } else if(next_tal[0].second - next_tal[0].first >= q.min_intv) {
+                        q.l = it + 1, q.intv={next_tal[0].first, next_tal[0].second};
+                    }
+                } else if(retf == 1){
+                    if (next_tal[0].second - next_tal[0].first >= q.min_intv) {
+                        q.l = it + 1;
+                        q.intv={next_tal[0].first, next_tal[0].second};
+                        done = q.l >= q.r;
+                    }
+                }
+            }
+            if(!done){
+                OCC_PREFETCH(q);
+                my_prefetch((const char*)(q.p + q.l), _MM_HINT_T0);
+                continue;
+            }
+
+            q.r = q.l;
+            output[output_cnt++] = q;
+            if(cnt1 < cnt) //More queries to be processed?
+                q = q_batch[cnt1++];
+            else
+                q = q_batch[--fmi_batch_size];
+            OCC_PREFETCH(q);
+            my_prefetch((const char*)(q.p + q.l), _MM_HINT_T0);
+        }
+    }
+}
+
+#undef OCC_PREFETCH
+
 template<typename index_t>
 void LISA_search<index_t>::exact_search_rmi_batched_k3(Info *qs, int64_t qs_size, int64_t batch_size, threadData &td, Output* output, int min_seed_len, int tid){
 	
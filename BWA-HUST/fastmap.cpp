@@ -7,8 +7,10 @@
 #include <ctype.h>
 #include <math.h>
 #include <pthread.h>
+#include <getopt.h>
 #include "bwa.h"
 #include "bwamem.h"
+#include "bwamem_bam.h"
 #include "kvec.h"
 #include "utils.h"
 #include "bntseq.h"
@@ -37,6 +39,7 @@ typedef struct {
     FMI_search *fmi;
     LISA_search<index_t> *lisa;
     kt_for_t *kt_for;
+    int sort_markdup; // the records go to tbb-sormadup instead of stdout
 } ktp_aux_t;
 
 typedef struct {
@@ -82,14 +85,14 @@ static void *process(void *shared, int step, void *_data)
 				//mem_process_seqs(&tmp_opt, idx->lbwt, idx->bns, idx->pac, aux->n_processed, n_sep[0], sep[0], 0, aux->kt_for);
                 mem_process_seqs2(&tmp_opt, fmi, lisa, aux->n_processed, n_sep[0], sep[0], 0, aux->kt_for);
                 for (i = 0; i < n_sep[0]; ++i)
-					data->seqs[sep[0][i].id].sam = sep[0][i].sam;
+					data->seqs[sep[0][i].id].sam = sep[0][i].sam, data->seqs[sep[0][i].id].bam = sep[0][i].bam;
 			}
 			if (n_sep[1]) {
 				tmp_opt.flag |= MEM_F_PE;
 				//mem_process_seqs(&tmp_opt, idx->lbwt, idx->bns, idx->pac, aux->n_processed + n_sep[0], n_sep[1], sep[1], aux->pes0, aux->kt_for);
                 mem_process_seqs2(&tmp_opt, fmi, lisa, aux->n_processed + n_sep[0], n_sep[1], sep[1], aux->pes0, aux->kt_for);
                 for (i = 0; i < n_sep[1]; ++i)
-					data->seqs[sep[1][i].id].sam = sep[1][i].sam;
+					data->seqs[sep[1][i].id].sam = sep[1][i].sam, data->seqs[sep[1][i].id].bam = sep[1][i].bam;
 			}
 			free(sep[0]); free(sep[1]);
 		} // else mem_process_seqs(opt, idx->lbwt, idx->bns, idx->pac, aux->n_processed, data->n_seqs, data->seqs, aux->pes0, aux->kt_for);
@@ -99,6 +102,9 @@ static void *process(void *shared, int step, void *_data)
 		int n_seqs = data->n_seqs;
 		bseq1_t *seqs = data->seqs;
 		aux->n_processed += n_seqs;
+#ifdef USE_SORMADUP
+		if (aux->sort_markdup) mem_bam_push(n_seqs, seqs);
+#endif
 		for (i = 0; i < n_seqs; ++i) {
 			if (seqs[i].sam) err_fputs(seqs[i].sam, stdout);
 			free(seqs[i].name); free(seqs[i].comment);
@@ -131,9 +137,13 @@ int main_mem(int argc, char *argv[])
 {
 	mem_opt_t *opt, opt0;
 	int fd, fd2, i, c, ignore_alt = 0, no_mt_io = 0;
-	int fixed_chunk_size = -1;
+	int fixed_chunk_size = -1, ret = 0;
 	gzFile fp, fp2 = 0;
-	char *p, *rg_line = 0, *hdr_line = 0;
+	char *p, *rg_line = 0, *hdr_line = 0, *sormadup_args = 0;
+	static struct option long_options[] = {
+		{ "sort-markdup", required_argument, 0, 0 },
+		{ 0, 0, 0, 0 }
+	};
 	const char *mode = 0;
 	void *ko = 0, *ko2 = 0;
 	mem_pestat_t pes[4];
@@ -149,8 +159,9 @@ int main_mem(int argc, char *argv[])
 
 	aux.opt = opt = mem_opt_init();
 	memset(&opt0, 0, sizeof(mem_opt_t));
-	while ((c = getopt(argc, argv, "51qpaMCSPVYjuk:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:o:f:W:x:G:h:y:K:X:H:")) >= 0) {
-		if (c == 'k') opt->min_seed_len = atoi(optarg), opt0.min_seed_len = 1;
+	while ((c = getopt_long(argc, argv, "51qpaMCSPVYjuk:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:o:f:W:x:G:h:y:K:X:H:", long_options, 0)) >= 0) {
+		if (c == 0) sormadup_args = optarg;
+		else if (c == 'k') opt->min_seed_len = atoi(optarg), opt0.min_seed_len = 1;
 		else if (c == '1') no_mt_io = 1;
 		else if (c == 'x') mode = optarg;
 		else if (c == 'w') opt->w = atoi(optarg), opt0.w = 1;
@@ -255,6 +266,13 @@ int main_mem(int argc, char *argv[])
 	}
 
 	if (opt->n_threads < 1) opt->n_threads = 1;
+#ifndef USE_SORMADUP
+	if (sormadup_args) {
+		fprintf(stderr, "[E::%s] --sort-markdup needs BWA-HUST built with SortMarkDup (make SORMADUP=1)\n", __func__);
+		free(opt);
+		return 1;
+	}
+#endif
 	if (optind + 1 >= argc || optind + 3 < argc) {
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage: bwa mem [options] <idxbase> <in1.fq> [in2.fq]\n\n");
@@ -288,6 +306,9 @@ int main_mem(int argc, char *argv[])
 		fprintf(stderr, "       -R STR        read group header line such as '@RG\\tID:foo\\tSM:bar' [null]\n");
 		fprintf(stderr, "       -H STR/FILE   insert STR to header if it starts with @; or insert lines in FILE [null]\n");
 		fprintf(stderr, "       -o FILE       sam file to output results to [stdout]\n");
+		fprintf(stderr, "       --sort-markdup STR\n");
+		fprintf(stderr, "                     sort and mark duplicates in process with the tbb-sormadup options STR\n");
+		fprintf(stderr, "                     (e.g. \"-O out.bam -t 16\") instead of writing SAM\n");
 		fprintf(stderr, "       -j            treat ALT contigs as part of the primary assembly (i.e. ignore <idxbase>.alt file)\n");
 		fprintf(stderr, "       -5            for split alignment, take the alignment with the smallest coordinate as primary\n");
 		fprintf(stderr, "       -q            don't modify mapQ of supplementary alignments\n");
@@ -435,12 +456,22 @@ int main_mem(int argc, char *argv[])
 			opt->flag |= MEM_F_PE;
 		}
 	}
+#ifdef USE_SORMADUP
+	if (sormadup_args) {
+		if (mem_bam_start(sormadup_args, aux.fmi->idx->bns, hdr_line) != 0) return 1;
+		opt->flag |= MEM_F_BAM;
+		aux.sort_markdup = 1;
+	} else
+#endif
 	bwa_print_sam_hdr(aux.fmi->idx->bns, hdr_line);
 	aux.actual_chunk_size = fixed_chunk_size > 0? fixed_chunk_size : opt->chunk_size * opt->n_threads;
 	kt_for_t kt;
 	kt.func = 0;
 	aux.kt_for = &kt;
 	kt_pipeline(no_mt_io? 1 : 2, process, &aux, 3);
+#ifdef USE_SORMADUP
+	if (aux.sort_markdup) ret = mem_bam_finish();
+#endif
 	//kt_for(opt->n_threads, NULL, NULL, 0, 1, aux.kt_for);   //destroy thread pool
 	free(hdr_line);
 	free(opt);
@@ -458,5 +489,5 @@ int main_mem(int argc, char *argv[])
 #endif
 
 	// malloc_stats_print(NULL, NULL, "a"); // print memory stats
-	return 0;
+	return ret;
 }
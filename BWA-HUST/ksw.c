@@ -953,6 +953,546 @@ int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	                    gtle, gscore, max_off);
 }
 
+/****************************
+ * Batched extension (AVX2) *
+ ****************************/
+
+#define KSW_LANES 16        // 16-bit lanes of an AVX2 register, one pair each
+#define KSW_LANES8 32       // 8-bit lanes of an AVX2 register
+#define KSW_BATCH_MAXLEN 16384
+
+// the scores of mat as (match, mismatch, ambiguous) if it is laid out as by bwa_fill_scmat()
+static int ksw_batch_scores(int m, const int8_t *mat, int *sc) {
+	int i, j;
+	if (m != 5) return 0;
+	sc[0] = mat[0], sc[1] = mat[1], sc[2] = mat[4];
+	for (i = 0; i < 5; ++i)
+		for (j = 0; j < 5; ++j)
+			if (mat[i * 5 + j] != (i == 4 || j == 4 ? sc[2] : i == j ? sc[0] : sc[1])) return 0;
+	return 1;
+}
+
+static inline int ksw_batch_base(const uint8_t *s, int rev, int i) {
+	return rev ? s[-1 - i] : s[i];
+}
+
+static int ksw_batch_cmp(const void *a, const void *b) {
+	const kswx_t *p = *(const kswx_t **) a, *q = *(const kswx_t **) b;
+	int lp = (p->qlen + 7) >> 3, lq = (q->qlen + 7) >> 3;
+	if (lp != lq) return lp < lq ? -1 : 1;
+	return p->tlen < q->tlen ? -1 : p->tlen > q->tlen;
+}
+
+/* ksw_extend2() on up to KSW_LANES pairs at once, one pair in every 16-bit lane and the DP matrices walked row by
+ * row in all lanes together. The query of a lane is padded to a multiple of 8 with columns scoring 0, as the
+ * striped profile of ksw_extend2() is, because these columns take part in its row maxima. */
+static void ksw_extend_lanes(int n, kswx_t **p, const int sc[3], int o_del, int e_del, int o_ins, int e_ins,
+                             int zdrop, __m256i *buf) {
+	int i, j, l, tmax = 0, pmax = 0, n_active = 0;
+	int best[KSW_LANES], max_i[KSW_LANES], max_j[KSW_LANES], max_ie[KSW_LANES], gscore[KSW_LANES];
+	int max_off[KSW_LANES], end[KSW_LANES];
+	int16_t row_max[KSW_LANES] __attribute__((aligned(32))), row_j[KSW_LANES] __attribute__((aligned(32)));
+	int16_t row_q[KSW_LANES] __attribute__((aligned(32))), h_beg[KSW_LANES] __attribute__((aligned(32)));
+	int16_t *t;
+	__m256i *T, *Q, *H, *E, zero = _mm256_setzero_si256();
+	__m256i vmat = _mm256_set1_epi16(sc[0]), vmis = _mm256_set1_epi16(sc[1]), vamb = _mm256_set1_epi16(sc[2]);
+	__m256i v3 = _mm256_set1_epi16(3), v4 = _mm256_set1_epi16(4);
+	__m256i voe_del = _mm256_set1_epi16(o_del + e_del), voe_ins = _mm256_set1_epi16(o_ins + e_ins);
+	__m256i ve_del = _mm256_set1_epi16(e_del), ve_ins = _mm256_set1_epi16(e_ins);
+	__m256i vplen, vqend;
+
+	for (l = 0; l < n; ++l) {
+		tmax = tmax > p[l]->tlen ? tmax : p[l]->tlen;
+		pmax = pmax > (p[l]->qlen + 7) / 8 * 8 ? pmax : (p[l]->qlen + 7) / 8 * 8;
+	}
+	T = buf, Q = T + tmax, H = Q + pmax, E = H + pmax;
+	// the lanes: targets, queries with code 5 for the padding, and the first row
+	for (i = 0, t = (int16_t *) T; i < tmax; ++i)
+		for (l = 0; l < KSW_LANES; ++l)
+			*t++ = l < n && i < p[l]->tlen ? ksw_batch_base(p[l]->target, p[l]->rev, i) : 0;
+	for (j = 0, t = (int16_t *) Q; j < pmax; ++j)
+		for (l = 0; l < KSW_LANES; ++l)
+			*t++ = l < n && j < p[l]->qlen ? ksw_batch_base(p[l]->query, p[l]->rev, j) : 5;
+	for (j = 0, t = (int16_t *) H; j < pmax; ++j)
+		for (l = 0; l < KSW_LANES; ++l)
+			*t++ = l < n && j < p[l]->qlen ? max(0, p[l]->h0 - e_ins * (j + 1) - o_ins) : 0;
+	for (j = 0; j < pmax; ++j) E[j] = zero;
+	for (l = 0; l < KSW_LANES; ++l) {
+		row_j[l] = l < n ? (p[l]->qlen + 7) / 8 * 8 : 0;
+		row_q[l] = l < n ? p[l]->qlen - 1 : -1;
+	}
+	vplen = _mm256_load_si256((__m256i *) row_j);
+	vqend = _mm256_load_si256((__m256i *) row_q);
+	for (l = 0; l < n; ++l) {
+		best[l] = p[l]->h0, max_i[l] = max_j[l] = -1, max_ie[l] = -1, gscore[l] = -1, max_off[l] = 0;
+		end[l] = p[l]->tlen == 0;
+		n_active += !end[l];
+	}
+
+	for (i = 0; i < tmax && n_active > 0; ++i) {
+		__m256i vt = T[i], vH, vF = zero, vMax = _mm256_set1_epi16(-1), vMaxj = zero, vHq = zero;
+		for (l = 0; l < KSW_LANES; ++l) // H(i-1,-1)
+			h_beg[l] = l >= n ? 0 : i == 0 ? p[l]->h0 : max(0, p[l]->h0 - e_del * i - o_del);
+		vH = _mm256_load_si256((__m256i *) h_beg);
+		for (j = 0; j < pmax; ++j) {
+			__m256i vq = Q[j], vj = _mm256_set1_epi16(j), vs, vM, vh, vu;
+			vs = _mm256_blendv_epi8(vmis, vmat, _mm256_cmpeq_epi16(vt, vq));
+			vs = _mm256_blendv_epi8(vs, vamb, _mm256_cmpgt_epi16(_mm256_max_epi16(vt, vq), v3));
+			vs = _mm256_andnot_si256(_mm256_cmpgt_epi16(vq, v4), vs);
+			// the same steps as in ksw_extend2(), the inter-lane F pass being unneeded here
+			vM = _mm256_add_epi16(vH, vs);
+			vM = _mm256_max_epi16(vM, zero);
+			vM = _mm256_and_si256(vM, _mm256_cmpgt_epi16(vH, zero));
+			vh = _mm256_max_epi16(_mm256_max_epi16(vM, E[j]), vF);
+			vH = H[j];
+			H[j] = vh;
+			E[j] = _mm256_max_epi16(_mm256_subs_epu16(vM, voe_del), _mm256_subs_epu16(E[j], ve_del));
+			vF = _mm256_max_epi16(_mm256_subs_epu16(vF, ve_ins), _mm256_subs_epu16(vM, voe_ins));
+			// the row maximum in the (padded) query, at its last column
+			vu = _mm256_andnot_si256(_mm256_cmpgt_epi16(vMax, vh), _mm256_cmpgt_epi16(vplen, vj));
+			vMax = _mm256_blendv_epi8(vMax, vh, vu);
+			vMaxj = _mm256_blendv_epi8(vMaxj, vj, vu);
+			vHq = _mm256_blendv_epi8(vHq, vh, _mm256_cmpeq_epi16(vqend, vj));
+		}
+		_mm256_store_si256((__m256i *) row_max, vMax);
+		_mm256_store_si256((__m256i *) row_j, vMaxj);
+		_mm256_store_si256((__m256i *) row_q, vHq);
+		for (l = 0; l < n; ++l) {
+			int m = row_max[l], mj = row_j[l];
+			if (end[l]) continue;
+			if (m == 0) {
+				end[l] = 1, --n_active;
+				continue;
+			}
+			if (row_q[l] >= gscore[l]) gscore[l] = row_q[l], max_ie[l] = i;
+			if (m > best[l]) {
+				best[l] = m, max_i[l] = i, max_j[l] = mj;
+				max_off[l] = max(max_off[l], abs(i - mj));
+			} else if (zdrop > 0) {
+				if (i - max_i[l] > mj - max_j[l]) {
+					if (best[l] - m - ((i - max_i[l]) - (mj - max_j[l])) * e_del > zdrop) end[l] = 1;
+				} else {
+					if (best[l] - m - ((mj - max_j[l]) - (i - max_i[l])) * e_ins > zdrop) end[l] = 1;
+				}
+			}
+			if (!end[l] && i + 1 == p[l]->tlen) end[l] = 1;
+			n_active -= end[l];
+		}
+	}
+	for (l = 0; l < n; ++l) {
+		p[l]->score = best[l];
+		p[l]->qle = max_j[l] + 1, p[l]->tle = max_i[l] + 1, p[l]->gtle = max_ie[l] + 1;
+		p[l]->gscore = gscore[l], p[l]->max_off = max_off[l];
+	}
+}
+
+void ksw_extend_batch(int n, kswx_t *a, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus,
+                      int zdrop) {
+	int i, k, sc[3], n_lane = 0, tmax = 0, pmax = 0, has_sc;
+	kswx_t **p;
+	__m256i *buf;
+
+	if (n <= 0) return;
+	has_sc = ksw_batch_scores(m, mat, sc);
+	p = (kswx_t **) malloc(n * sizeof(kswx_t *));
+	for (i = 0; i < n; ++i) {
+		kswx_t *x = &a[i];
+		if (has_sc && x->qlen > 4 && x->qlen < KSW_BATCH_MAXLEN && x->tlen < KSW_BATCH_MAXLEN) {
+			p[n_lane++] = x;
+			tmax = tmax > x->tlen ? tmax : x->tlen;
+			pmax = pmax > x->qlen ? pmax : x->qlen;
+		} else { // what the lanes do not cover, ksw_extend21() included
+			uint8_t *qs = 0, *ts = 0;
+			const uint8_t *q = x->query, *t = x->target;
+			if (x->rev) {
+				qs = (uint8_t *) malloc(x->qlen + 1);
+				ts = (uint8_t *) malloc(x->tlen + 1);
+				for (k = 0; k < x->qlen; ++k) qs[k] = x->query[-1 - k];
+				for (k = 0; k < x->tlen; ++k) ts[k] = x->target[-1 - k];
+				q = qs, t = ts;
+			}
+			x->score = ksw_extend(x->qlen, q, x->tlen, t, m, mat, gapo, gape, w, end_bonus, zdrop, x->h0, &x->qle,
+			                      &x->tle, &x->gtle, &x->gscore, &x->max_off);
+			free(qs);
+			free(ts);
+		}
+	}
+	if (n_lane > 0) {
+		// similar lengths in the lanes of a group, so that few cells are computed for nothing
+		qsort(p, n_lane, sizeof(kswx_t *), ksw_batch_cmp);
+		pmax = (pmax + 7) / 8 * 8;
+		buf = (__m256i *) _mm_malloc((tmax + 3 * pmax) * sizeof(__m256i), 32);
+		for (i = 0; i < n_lane; i += KSW_LANES)
+			ksw_extend_lanes(n_lane - i < KSW_LANES ? n_lane - i : KSW_LANES, p + i, sc, gapo, gape, gapo, gape,
+			                 zdrop, buf);
+		_mm_free(buf);
+	}
+	free(p);
+}
+
+/* ksw_u8() and ksw_i16() on many pairs at once, one pair in every lane: 32 8-bit lanes for the pairs scored in
+ * bytes, 16 16-bit lanes for the others. The striped layout of a query of qlen is replayed column by column: the
+ * query is padded to slen*p columns scoring 0 (p=16 for bytes, 8 otherwise) and E is computed from H before the
+ * lazy-F pass, that is with an F restarted at every multiple of slen. Hmax is kept as those functions do, the row
+ * of a lane where its best score rises being copied while the next row is computed. The score of a cell is looked
+ * up by pshufb from t<<2|q, with the bwa_fill_scmat() layout checked by ksw_batch_scores(). */
+
+typedef struct {
+	int plen, tlen, shift, minsc, endsc;
+	int gmax, te, end, upd, n_b, m_b;
+	uint64_t *b;
+} ksw_lane_t;
+
+static void ksw_lane_init(ksw_lane_t *s, const kswa_t *p, int size, int shift) {
+	int q = 8 * (3 - size);
+	s->tlen = p->tlen;
+	s->plen = (p->qlen + q - 1) / q * q;
+	s->shift = size == 1 ? shift : 0;
+	s->minsc = (p->xtra & KSW_XSUBO) ? p->xtra & 0xffff : 0x10000;
+	s->endsc = (p->xtra & KSW_XSTOP) ? p->xtra & 0xffff : 0x10000;
+	s->gmax = 0, s->te = -1, s->end = p->tlen == 0, s->upd = 0;
+	s->n_b = s->m_b = 0, s->b = 0;
+}
+
+// the end of row i in a lane, as in ksw_u8(); return 1 if the lane is done
+static inline int ksw_lane_row(ksw_lane_t *s, int i, int imax) {
+	if (imax >= s->minsc) { // write the b array
+		if (s->n_b == 0 || (int32_t) s->b[s->n_b - 1] + 1 != i) {
+			if (s->n_b == s->m_b) {
+				s->m_b = s->m_b ? s->m_b << 1 : 8;
+				s->b = (uint64_t *) realloc(s->b, 8 * s->m_b);
+			}
+			s->b[s->n_b++] = (uint64_t) imax << 32 | i;
+		} else if ((int) (s->b[s->n_b - 1] >> 32) < imax) s->b[s->n_b - 1] = (uint64_t) imax << 32 | i;
+	}
+	s->upd = imax > s->gmax;
+	if (s->upd) {
+		s->gmax = imax, s->te = i;
+		if ((s->shift && s->gmax + s->shift >= 255) || s->gmax >= s->endsc) return s->end = 1;
+	}
+	return s->end = i + 1 == s->tlen;
+}
+
+// the result of a lane, from its Hmax read every step-th element
+static void ksw_lane_result(ksw_lane_t *s, int qmax, const uint8_t *hmax, int step, int is16, kswr_t *r) {
+	*r = g_defr;
+	r->score = s->shift && s->gmax + s->shift >= 255 ? 255 : s->gmax;
+	r->te = s->te;
+	if (!s->shift || r->score != 255) {
+		int j, max = -1;
+		for (j = 0; j < s->plen; ++j, hmax += step) {
+			int h = is16 ? *(const int16_t *) hmax : *hmax;
+			if (h > max) max = h, r->qe = j;
+		}
+		if (s->b) {
+			int k, d = (r->score + qmax - 1) / qmax, low = s->te - d, high = s->te + d;
+			for (k = 0; k < s->n_b; ++k) {
+				int e = (int32_t) s->b[k];
+				if ((e < low || e > high) && (int) (s->b[k] >> 32) > r->score2)
+					r->score2 = s->b[k] >> 32, r->te2 = e;
+			}
+		}
+	}
+	free(s->b);
+}
+
+// the bounds under which the row max of no lane needs recording, as in ksw_lane_row(); return the next row a lane ends at
+static int ksw_lanes_next8(int n, const ksw_lane_t *s, int tmax, __m256i *vg, __m256i *vm, __m256i *vupd, int *upd) {
+	uint8_t g[KSW_LANES8] __attribute__((aligned(32))), m[KSW_LANES8] __attribute__((aligned(32)));
+	uint8_t u[KSW_LANES8] __attribute__((aligned(32)));
+	int l, tnext = tmax;
+	for (l = 0, *upd = 0; l < KSW_LANES8; ++l) {
+		int on = l < n && !s[l].end;
+		*upd |= u[l] = l < n && s[l].upd ? 0xff : 0;
+		g[l] = on ? s[l].gmax : 0xff; // below 255 while the lane runs
+		m[l] = on && s[l].minsc < 0xff ? s[l].minsc : 0xff;
+		if (on && s[l].tlen < tnext) tnext = s[l].tlen;
+	}
+	*vg = _mm256_load_si256((__m256i *) g), *vm = _mm256_load_si256((__m256i *) m);
+	*vupd = _mm256_load_si256((__m256i *) u);
+	return tnext;
+}
+
+static int ksw_lanes_next16(int n, const ksw_lane_t *s, int tmax, __m256i *vg, __m256i *vm, __m256i *vupd, int *upd) {
+	int16_t g[KSW_LANES] __attribute__((aligned(32))), m[KSW_LANES] __attribute__((aligned(32)));
+	int16_t u[KSW_LANES] __attribute__((aligned(32)));
+	int l, tnext = tmax;
+	for (l = 0, *upd = 0; l < KSW_LANES; ++l) {
+		int on = l < n && !s[l].end;
+		*upd |= u[l] = l < n && s[l].upd ? -1 : 0;
+		g[l] = on ? s[l].gmax : 0x7fff;
+		m[l] = on && s[l].minsc <= 0x7fff ? s[l].minsc - 1 : 0x7fff;
+		if (on && s[l].tlen < tnext) tnext = s[l].tlen;
+	}
+	*vg = _mm256_load_si256((__m256i *) g), *vm = _mm256_load_si256((__m256i *) m);
+	*vupd = _mm256_load_si256((__m256i *) u);
+	return tnext;
+}
+
+static void ksw_align_lanes8(int n, kswa_t **p, const int sc[4], int qmax, int o_del, int e_del, int o_ins, int e_ins,
+                             __m256i *buf) {
+	int i, j, l, tmax = 0, pmax = 0, pmin = 0x7fffffff, tnext, n_active = 0, upd;
+	ksw_lane_t s[KSW_LANES8];
+	uint8_t row[KSW_LANES8] __attribute__((aligned(32))), *t;
+	__m256i *T, *Q, *H, *E, *R, *V, *Hmax, zero = _mm256_setzero_si256(), vupd, vg, vm, vsc, vsn;
+	__m256i vamb = _mm256_set1_epi8(sc[2] + sc[3]), vshift = _mm256_set1_epi8(sc[3]), vN = _mm256_set1_epi8(0x80);
+	__m256i v15 = _mm256_set1_epi8(15);
+	__m256i voe_del = _mm256_set1_epi8(o_del + e_del), voe_ins = _mm256_set1_epi8(o_ins + e_ins);
+	__m256i ve_del = _mm256_set1_epi8(e_del), ve_ins = _mm256_set1_epi8(e_ins);
+
+	for (l = 0; l < n; ++l) {
+		ksw_lane_init(&s[l], p[l], 1, sc[3]);
+		tmax = tmax > p[l]->tlen ? tmax : p[l]->tlen;
+		pmax = pmax > s[l].plen ? pmax : s[l].plen;
+		pmin = pmin < s[l].plen ? pmin : s[l].plen;
+		n_active += !s[l].end;
+	}
+	for (i = 0, t = row; i < 32; ++i) // match and mismatch scores indexed by t<<2|q, shifted
+		*t++ = (i >> 2 & 3) == (i & 3) ? sc[0] + sc[3] : sc[1] + sc[3];
+	vsc = _mm256_load_si256((__m256i *) row);
+	for (i = 0, t = row; i < 32; ++i) // the scores of an ambiguous base, 0x84, and of padding, 0x85, in the query
+		*t++ = (i & 15) == 4 ? sc[2] + sc[3] : (i & 15) == 5 ? sc[3] : 0;
+	vsn = _mm256_load_si256((__m256i *) row);
+	T = buf, Q = T + tmax, H = Q + pmax, E = H + pmax, R = E + pmax, V = R + pmax, Hmax = V + pmax;
+	for (i = 0, t = (uint8_t *) T; i < tmax; ++i) // an ambiguous base is 0x80, scoring 0 in the lookup
+		for (l = 0; l < KSW_LANES8; ++l)
+			*t++ = l < n && i < p[l]->tlen ? (p[l]->target[i] < 4 ? p[l]->target[i] << 2 : 0x80) : 0;
+	for (j = 0, t = (uint8_t *) Q; j < pmax; ++j)
+		for (l = 0; l < KSW_LANES8; ++l)
+			*t++ = l < n && j < p[l]->qlen ? (p[l]->query[j] < 4 ? p[l]->query[j] : 0x84) : 0x85;
+	for (j = 0, t = (uint8_t *) R; j < pmax; ++j) // where the F of the striped layout restarts
+		for (l = 0; l < KSW_LANES8; ++l)
+			*t++ = l < n && (j + 1) % (s[l].plen / 16) == 0 ? 0xff : 0;
+	for (j = 0, t = (uint8_t *) V; j < pmax; ++j) // the columns of a lane, padding included
+		for (l = 0; l < KSW_LANES8; ++l)
+			*t++ = l < n && j < s[l].plen ? 0xff : 0;
+	for (j = 0; j < pmax; ++j) H[j] = E[j] = Hmax[j] = zero;
+	tnext = ksw_lanes_next8(n, s, tmax, &vg, &vm, &vupd, &upd);
+
+	for (i = 0; i < tmax && n_active > 0; ++i) {
+		__m256i vt = T[i], vh = zero, vFp = zero, vF = zero, vMax = zero, vamb_t;
+		int has_n;
+		vamb_t = _mm256_and_si256(_mm256_cmpeq_epi8(vt, vN), vamb);
+		has_n = !_mm256_testz_si256(vamb_t, vamb_t);
+		for (j = 0; j < pmax; ++j) {
+			__m256i vq = Q[j], vs, h, h1, f;
+			vs = _mm256_shuffle_epi8(vsc, _mm256_or_si256(vt, vq));
+			vs = _mm256_max_epu8(vs, _mm256_shuffle_epi8(vsn, _mm256_and_si256(vq, v15)));
+			if (has_n) vs = _mm256_max_epu8(vs, vamb_t);
+			h = _mm256_subs_epu8(_mm256_adds_epu8(vh, vs), vshift);
+			h1 = _mm256_max_epu8(_mm256_max_epu8(h, E[j]), vFp); // H before the lazy-F pass
+			h = _mm256_max_epu8(h1, vF);
+			vh = H[j];
+			H[j] = h;
+			if (upd) Hmax[j] = _mm256_blendv_epi8(Hmax[j], vh, vupd);
+			E[j] = _mm256_max_epu8(_mm256_subs_epu8(E[j], ve_del), _mm256_subs_epu8(h1, voe_del));
+			f = _mm256_subs_epu8(h1, voe_ins); // no lower than F-oe_ins, so F can be opened from h1 as well
+			vFp = _mm256_andnot_si256(R[j], _mm256_max_epu8(_mm256_subs_epu8(vFp, ve_ins), f));
+			vF = _mm256_max_epu8(_mm256_subs_epu8(vF, ve_ins), f);
+			vMax = _mm256_max_epu8(vMax, j < pmin ? h : _mm256_and_si256(h, V[j]));
+		}
+		if (i + 1 < tnext && _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(vMax, vg), vg)) == -1
+		    && _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(vm, vMax), zero)) == 0) {
+			upd = 0, vupd = zero; // no lane to record the row of
+			continue;
+		}
+		_mm256_store_si256((__m256i *) row, vMax);
+		for (l = 0; l < n; ++l) {
+			if (s[l].end) {
+				s[l].upd = 0;
+				continue;
+			}
+			n_active -= ksw_lane_row(&s[l], i, row[l]);
+		}
+		tnext = ksw_lanes_next8(n, s, tmax, &vg, &vm, &vupd, &upd);
+	}
+	for (j = 0; j < pmax; ++j) Hmax[j] = _mm256_blendv_epi8(Hmax[j], H[j], vupd);
+	for (l = 0; l < n; ++l)
+		ksw_lane_result(&s[l], qmax, (uint8_t *) Hmax + l, KSW_LANES8, 0, &p[l]->r);
+}
+
+static void ksw_align_lanes16(int n, kswa_t **p, const int sc[4], int qmax, int o_del, int e_del, int o_ins,
+                              int e_ins, __m256i *buf) {
+	int i, j, l, tmax = 0, pmax = 0, pmin = 0x7fffffff, tnext, n_active = 0, upd;
+	ksw_lane_t s[KSW_LANES];
+	int16_t row[KSW_LANES] __attribute__((aligned(32))), *t;
+	uint8_t tab[32] __attribute__((aligned(32)));
+	__m256i *T, *Q, *H, *E, *R, *V, *Hmax, zero = _mm256_setzero_si256(), vupd, vg, vm, vsc, vsn;
+	__m256i vamb = _mm256_set1_epi16(sc[2] + sc[3]), vshift = _mm256_set1_epi16(sc[3]), vN = _mm256_set1_epi16(0x8080);
+	__m256i v15 = _mm256_set1_epi16(0x800f);
+	__m256i voe_del = _mm256_set1_epi16(o_del + e_del), voe_ins = _mm256_set1_epi16(o_ins + e_ins);
+	__m256i ve_del = _mm256_set1_epi16(e_del), ve_ins = _mm256_set1_epi16(e_ins);
+
+	for (l = 0; l < n; ++l) {
+		ksw_lane_init(&s[l], p[l], 2, 0);
+		tmax = tmax > p[l]->tlen ? tmax : p[l]->tlen;
+		pmax = pmax > s[l].plen ? pmax : s[l].plen;
+		pmin = pmin < s[l].plen ? pmin : s[l].plen;
+		n_active += !s[l].end;
+	}
+	for (i = 0; i < 32; ++i) // as in ksw_align_lanes8(), the lookups leaving the high byte of a lane at 0
+		tab[i] = (i >> 2 & 3) == (i & 3) ? sc[0] + sc[3] : sc[1] + sc[3];
+	vsc = _mm256_load_si256((__m256i *) tab);
+	for (i = 0; i < 32; ++i)
+		tab[i] = (i & 15) == 4 ? sc[2] + sc[3] : (i & 15) == 5 ? sc[3] : 0;
+	vsn = _mm256_load_si256((__m256i *) tab);
+	T = buf, Q = T + tmax, H = Q + pmax, E = H + pmax, R = E + pmax, V = R + pmax, Hmax = V + pmax;
+	for (i = 0, t = (int16_t *) T; i < tmax; ++i)
+		for (l = 0; l < KSW_LANES; ++l)
+			*t++ = 0x8000 | (l < n && i < p[l]->tlen ? (p[l]->target[i] < 4 ? p[l]->target[i] << 2 : 0x80) : 0);
+	for (j = 0, t = (int16_t *) Q; j < pmax; ++j)
+		for (l = 0; l < KSW_LANES; ++l)
+			*t++ = 0x8000 | (l < n && j < p[l]->qlen ? (p[l]->query[j] < 4 ? p[l]->query[j] : 0x84) : 0x85);
+	for (j = 0, t = (int16_t *) R; j < pmax; ++j)
+		for (l = 0; l < KSW_LANES; ++l)
+			*t++ = l < n && (j + 1) % (s[l].plen / 8) == 0 ? -1 : 0;
+	for (j = 0, t = (int16_t *) V; j < pmax; ++j)
+		for (l = 0; l < KSW_LANES; ++l)
+			*t++ = l < n && j < s[l].plen ? -1 : 0;
+	for (j = 0; j < pmax; ++j) H[j] = E[j] = Hmax[j] = zero;
+	tnext = ksw_lanes_next16(n, s, tmax, &vg, &vm, &vupd, &upd);
+
+	for (i = 0; i < tmax && n_active > 0; ++i) {
+		__m256i vt = T[i], vh = zero, vFp = zero, vF = zero, vMax = zero, vamb_t;
+		int has_n;
+		vamb_t = _mm256_and_si256(_mm256_cmpeq_epi16(vt, vN), vamb);
+		has_n = !_mm256_testz_si256(vamb_t, vamb_t);
+		for (j = 0; j < pmax; ++j) {
+			__m256i vq = Q[j], vs, h, h1, f;
+			vs = _mm256_shuffle_epi8(vsc, _mm256_or_si256(vt, vq));
+			vs = _mm256_max_epi16(vs, _mm256_shuffle_epi8(vsn, _mm256_and_si256(vq, v15)));
+			if (has_n) vs = _mm256_max_epi16(vs, vamb_t);
+			h = _mm256_adds_epi16(vh, _mm256_sub_epi16(vs, vshift));
+			h1 = _mm256_max_epi16(_mm256_max_epi16(h, E[j]), vFp);
+			h = _mm256_max_epi16(h1, vF);
+			vh = H[j];
+			H[j] = h;
+			if (upd) Hmax[j] = _mm256_blendv_epi8(Hmax[j], vh, vupd);
+			E[j] = _mm256_max_epi16(_mm256_subs_epu16(E[j], ve_del), _mm256_subs_epu16(h1, voe_del));
+			f = _mm256_subs_epu16(h1, voe_ins);
+			vFp = _mm256_andnot_si256(R[j], _mm256_max_epi16(_mm256_subs_epu16(vFp, ve_ins), f));
+			vF = _mm256_max_epi16(_mm256_subs_epu16(vF, ve_ins), f);
+			vMax = _mm256_max_epi16(vMax, j < pmin ? h : _mm256_and_si256(h, V[j]));
+		}
+		if (i + 1 < tnext && _mm256_testz_si256(_mm256_or_si256(_mm256_cmpgt_epi16(vMax, vg),
+		                                                        _mm256_cmpgt_epi16(vMax, vm)), _mm256_set1_epi8(-1))) {
+			upd = 0, vupd = zero;
+			continue;
+		}
+		_mm256_store_si256((__m256i *) row, vMax);
+		for (l = 0; l < n; ++l) {
+			if (s[l].end) {
+				s[l].upd = 0;
+				continue;
+			}
+			n_active -= ksw_lane_row(&s[l], i, row[l]);
+		}
+		tnext = ksw_lanes_next16(n, s, tmax, &vg, &vm, &vupd, &upd);
+	}
+	for (j = 0; j < pmax; ++j) Hmax[j] = _mm256_blendv_epi8(Hmax[j], H[j], vupd);
+	for (l = 0; l < n; ++l)
+		ksw_lane_result(&s[l], qmax, (uint8_t *) ((int16_t *) Hmax + l), 2 * KSW_LANES, 1, &p[l]->r);
+}
+
+static int ksw_align_cmp(const void *a, const void *b) {
+	const kswa_t *p = *(const kswa_t **) a, *q = *(const kswa_t **) b;
+	int bp = !(p->xtra & KSW_XBYTE), bq = !(q->xtra & KSW_XBYTE), lp = (p->qlen + 7) >> 3, lq = (q->qlen + 7) >> 3;
+	if (bp != bq) return bp - bq;
+	if (lp != lq) return lp < lq ? -1 : 1;
+	return p->tlen < q->tlen ? -1 : p->tlen > q->tlen;
+}
+
+// without KSW_XSTART, ksw_align2() leaves the sequences as they are
+#define ksw_align_one(x, m, mat, o_del, e_del, o_ins, e_ins) \
+	((x)->r = ksw_align2((x)->qlen, (uint8_t *) (x)->query, (x)->tlen, (uint8_t *) (x)->target, m, mat, o_del, e_del, \
+	                     o_ins, e_ins, (x)->xtra & ~KSW_XSTART, 0))
+
+/* Run the lanes on the pairs, sorted by score size and length. A group of lanes takes the pairs whose padded query
+ * is at most 5/4 of that of its first pair; ksw_align2() does those the lanes do not cover and groups less than half
+ * full, where the lanes would mostly be idle. */
+static void ksw_align_run(int n, kswa_t *a, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins) {
+	int i, j, k, sc[4], n_lane = 0, tmax = 0, pmax = 0, has_sc, qmax;
+	kswa_t **p;
+	__m256i *buf;
+
+	has_sc = ksw_batch_scores(m, mat, sc);
+	for (i = 0, qmax = 0, sc[3] = 0; i < m * m; ++i) { // the max score and the shift, as in ksw_qinit()
+		qmax = qmax > mat[i] ? qmax : mat[i];
+		sc[3] = sc[3] > -mat[i] ? sc[3] : -mat[i];
+	}
+	p = (kswa_t **) malloc(n * sizeof(kswa_t *));
+	for (i = 0; i < n; ++i) {
+		kswa_t *x = &a[i];
+		if (has_sc && x->qlen > 0 && x->qlen < KSW_BATCH_MAXLEN && x->tlen < KSW_BATCH_MAXLEN) {
+			p[n_lane++] = x;
+			tmax = tmax > x->tlen ? tmax : x->tlen;
+			pmax = pmax > x->qlen ? pmax : x->qlen;
+		} else ksw_align_one(x, m, mat, o_del, e_del, o_ins, e_ins);
+	}
+	if (n_lane > 0) {
+		qsort(p, n_lane, sizeof(kswa_t *), ksw_align_cmp);
+		pmax = (pmax + 15) / 16 * 16;
+		buf = (__m256i *) _mm_malloc((tmax + 6 * pmax) * sizeof(__m256i), 32);
+		for (i = 0; i < n_lane; i = k) {
+			int is8 = (p[i]->xtra & KSW_XBYTE) != 0, w = is8 ? KSW_LANES8 : KSW_LANES, q = is8 ? 16 : 8;
+			int plen = (p[i]->qlen + q - 1) / q * q;
+			for (k = i + 1; k < n_lane && k - i < w && ((p[k]->xtra & KSW_XBYTE) != 0) == is8; ++k)
+				if ((p[k]->qlen + q - 1) / q * q * 4 > plen * 5) break;
+			if (k - i < w / 2)
+				for (j = i; j < k; ++j) ksw_align_one(p[j], m, mat, o_del, e_del, o_ins, e_ins);
+			else if (is8) ksw_align_lanes8(k - i, p + i, sc, qmax, o_del, e_del, o_ins, e_ins, buf);
+			else ksw_align_lanes16(k - i, p + i, sc, qmax, o_del, e_del, o_ins, e_ins, buf);
+		}
+		_mm_free(buf);
+	}
+	free(p);
+}
+
+void ksw_align2_batch(int n, kswa_t *a, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins) {
+	int i, k, n_st = 0;
+	int64_t l_st = 0;
+	kswa_t *st;
+	uint8_t *s;
+
+	if (n <= 0) return;
+	ksw_align_run(n, a, m, mat, o_del, e_del, o_ins, e_ins);
+	// the start positions, from the reversed sequences ending at the best hit as in ksw_align2()
+	for (i = 0; i < n; ++i) {
+		kswr_t *r = &a[i].r;
+		if ((a[i].xtra & KSW_XSTART) == 0 || ((a[i].xtra & KSW_XSUBO) && r->score < (a[i].xtra & 0xffff))) continue;
+		if (r->qe < 0) continue;
+		++n_st, l_st += r->qe + 1 + a[i].tlen;
+	}
+	if (n_st == 0) return;
+	st = (kswa_t *) malloc(n_st * sizeof(kswa_t));
+	s = (uint8_t *) malloc(l_st);
+	for (i = n_st = 0; i < n; ++i) {
+		kswa_t *x = &a[i], *y;
+		kswr_t *r = &x->r;
+		uint8_t *qs, *ts;
+		if ((x->xtra & KSW_XSTART) == 0 || ((x->xtra & KSW_XSUBO) && r->score < (x->xtra & 0xffff))) continue;
+		if (r->qe < 0) continue;
+		y = &st[n_st++];
+		qs = s, ts = s + r->qe + 1, s += r->qe + 1 + x->tlen;
+		for (k = 0; k <= r->qe; ++k) qs[k] = x->query[r->qe - k];
+		for (k = 0; k < x->tlen; ++k) ts[k] = k <= r->te ? x->target[r->te - k] : x->target[k];
+		y->qlen = r->qe + 1, y->query = qs;
+		y->tlen = x->tlen, y->target = ts;
+		y->xtra = KSW_XSTOP | r->score | (x->xtra & KSW_XBYTE);
+	}
+	ksw_align_run(n_st, st, m, mat, o_del, e_del, o_ins, e_ins);
+	for (i = n_st = 0; i < n; ++i) {
+		kswr_t *r = &a[i].r;
+		if ((a[i].xtra & KSW_XSTART) == 0 || ((a[i].xtra & KSW_XSUBO) && r->score < (a[i].xtra & 0xffff))) continue;
+		if (r->qe < 0) continue;
+		if (r->score == st[n_st].r.score)
+			r->tb = r->te - st[n_st].r.te, r->qb = r->qe - st[n_st].r.qe;
+		++n_st;
+	}
+	free(s - l_st);
+	free(st);
+}
+
 /********************
  * Global alignment *
  ********************/
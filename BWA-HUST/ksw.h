@@ -18,6 +18,20 @@ typedef struct {
 	int tb, qb; // target start and query start
 } kswr_t;
 
+typedef struct {
+	int qlen, tlen;
+	const uint8_t *query, *target;
+	int xtra;
+	kswr_t r; // (out) as returned by ksw_align2()
+} kswa_t;
+
+typedef struct {
+	int qlen, tlen;
+	const uint8_t *query, *target; // read backwards, from query[-1] and target[-1], if rev is set
+	int rev, h0;
+	int score, qle, tle, gtle, gscore, max_off; // (out) as returned by ksw_extend()
+} kswx_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -63,6 +77,13 @@ extern "C" {
 	kswr_t ksw_align(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int xtra, kswq_t **qry);
 	kswr_t ksw_align2(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswq_t **qry);
 
+	/**
+	 * ksw_align2() on n pairs at once, one pair in every lane of an AVX2
+	 * register (32 lanes with KSW_XBYTE, 16 otherwise), with the results of
+	 * ksw_align2() in kswa_t::r. The queries and targets are left untouched.
+	 */
+	void ksw_align2_batch(int n, kswa_t *a, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins);
+
 	/**
 	 * Banded global alignment
 	 *
@@ -107,6 +128,16 @@ extern "C" {
 	int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 	int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 
+	/**
+	 * ksw_extend() on n pairs at once
+	 *
+	 * The pairs are sorted by length and extended 16 at a time, one in every
+	 * lane of an AVX2 register. The results are those of ksw_extend() on
+	 * every pair; the pairs the lanes do not cover (short queries, very long
+	 * sequences or a matrix not laid out by bwa_fill_scmat()) go to it.
+	 */
+	void ksw_extend_batch(int n, kswx_t *a, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,334 @@
+/**
+ * sormadup-gen: a reproducible synthetic input of tbb-sormadup.
+ *
+ * Writes name-grouped paired-end SAM, as BWA does, to stdout or -o. The molecules are drawn over a
+ * genome of equal contigs, a fraction --skew of them inside a hot region of 1% of the genome; each
+ * pair is a copy of an earlier molecule with probability --dup-rate. Copies keep the unclipped 5'
+ * ends of their molecule but may be soft clipped, so they are found by the unclipped position only.
+ * --unmapped pairs lose one end (and a tenth of them both), --supplementary pairs get a
+ * supplementary record after their primaries. The same seed gives the same file.
+ * BAM is made with `samtools view -b`.
+ */
+
+#include <getopt.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+struct GenOptions
+{
+    uint64_t genome = 100000000;    // bases
+    int contigs = 4;
+    uint64_t pairs = 1000000;
+    int read_length = 150;
+    int insert = 400;               // mean insert size, sd is a tenth of it
+    double dup_rate = 0.1;
+    double unmapped = 0.02;
+    double supplementary = 0.01;
+    double skew = 0;
+    bool illumina_names = true;
+    uint64_t seed = 1;
+    const char * output = nullptr;
+};
+
+// one molecule, the unclipped 5' ends of its two reads
+struct Molecule
+{
+    int tid;
+    int64_t left;       // 5' of the forward read
+    int64_t right;      // 5' of the reverse read
+    bool read1_forward;
+};
+
+static const char * kBases = "ACGT";
+
+class Generator
+{
+public:
+    Generator(const GenOptions &options, FILE * out) :
+        options(options), out(out), rng(options.seed),
+        contig_length(options.genome / options.contigs)
+    {
+        seq.resize(options.read_length + 1);
+        qual.resize(options.read_length + 1);
+    }
+
+    void run()
+    {
+        fprintf(out, "@HD\tVN:1.6\tGO:query\n");
+        for(int i = 0; i < options.contigs; i++)
+        {
+            fprintf(out, "@SQ\tSN:chr%d\tLN:%llu\n", i + 1, (unsigned long long)contig_length);
+        }
+        fprintf(out, "@PG\tID:sormadup-gen\tPN:sormadup-gen\tCL:seed=%llu\n", (unsigned long long)options.seed);
+
+        std::uniform_real_distribution<double> uniform(0, 1);
+        molecules.reserve(options.pairs);
+        for(uint64_t i = 0; i < options.pairs; i++)
+        {
+            Molecule m;
+            if(!molecules.empty() && uniform(rng) < options.dup_rate)
+            {
+                m = molecules[std::uniform_int_distribution<uint64_t>(0, molecules.size() - 1)(rng)];
+            }else{
+                m = new_molecule();
+                molecules.push_back(m);
+            }
+            write_pair(i, m);
+        }
+    }
+
+private:
+    const GenOptions &options;
+    FILE * out;
+    std::mt19937_64 rng;
+    uint64_t contig_length;
+    std::vector<Molecule> molecules;
+    std::string name, seq, qual;
+
+    Molecule new_molecule()
+    {
+        std::uniform_real_distribution<double> uniform(0, 1);
+        Molecule m;
+        uint64_t hot = std::max<uint64_t>(options.genome / 100, options.insert * 4);
+        uint64_t span = uniform(rng) < options.skew ? hot : options.genome;
+        uint64_t coordinate = std::uniform_int_distribution<uint64_t>(0, span - 1)(rng);
+        m.tid = std::min<uint64_t>(coordinate / contig_length, options.contigs - 1);
+        // the sum of 12 uniforms minus 6 is close to a standard normal
+        double normal = -6;
+        for(int k = 0; k < 12; k++)
+            normal += uniform(rng);
+        int64_t insert = std::max<int64_t>(options.read_length, options.insert + normal * options.insert / 10);
+        int64_t max_left = std::max<int64_t>(contig_length - insert, 1);
+        m.left = coordinate % contig_length % max_left;
+        m.right = m.left + insert - 1;
+        m.read1_forward = uniform(rng) < 0.5;
+        return m;
+    }
+
+    // unique per pair, illumina names carry tile:x:y < 65536
+    void make_name(uint64_t i)
+    {
+        char buffer[64];
+        if(options.illumina_names)
+        {
+            snprintf(buffer, sizeof(buffer), "SIM:1:FC0001:1:%llu:%llu:%llu",
+                     (unsigned long long)(1 + i / 2500000000ULL),
+                     (unsigned long long)(i / 50000 % 50000), (unsigned long long)(i % 50000));
+        }else{
+            snprintf(buffer, sizeof(buffer), "read.%llu", (unsigned long long)i);
+        }
+        name = buffer;
+    }
+
+    void random_read()
+    {
+        std::uniform_int_distribution<int> base(0, 3), quality(2, 40);
+        for(int k = 0; k < options.read_length; k++)
+        {
+            seq[k] = kBases[base(rng)];
+            qual[k] = '!' + quality(rng);
+        }
+        seq[options.read_length] = qual[options.read_length] = 0;
+    }
+
+    // POS and CIGAR of a read whose unclipped 5' end is prime5, with clip bases soft clipped at 5'
+    void place(int64_t prime5, bool forward, int clip, int64_t &pos, char * cigar)
+    {
+        int aligned = options.read_length - clip;
+        if(forward)
+        {
+            pos = prime5 + clip;
+            if(clip > 0)
+                sprintf(cigar, "%dS%dM", clip, aligned);
+            else
+                sprintf(cigar, "%dM", aligned);
+        }else{
+            pos = prime5 - clip - aligned + 1;
+            if(clip > 0)
+                sprintf(cigar, "%dM%dS", aligned, clip);
+            else
+                sprintf(cigar, "%dM", aligned);
+        }
+    }
+
+    void write_pair(uint64_t i, const Molecule &m)
+    {
+        std::uniform_real_distribution<double> uniform(0, 1);
+        make_name(i);
+        char chr[32];
+        snprintf(chr, sizeof(chr), "chr%d", m.tid + 1);
+
+        // which ends are mapped
+        bool mapped[2] = {true, true};
+        if(uniform(rng) < options.unmapped)
+        {
+            mapped[uniform(rng) < 0.5 ? 0 : 1] = false;
+            if(uniform(rng) < 0.1)
+                mapped[0] = mapped[1] = false;
+        }
+
+        int64_t pos[2];
+        char cigar[2][32];
+        bool forward[2];
+        for(int r = 0; r < 2; r++)
+        {
+            forward[r] = (r == 0) == m.read1_forward;
+            int clip = uniform(rng) < 0.1 ? std::uniform_int_distribution<int>(1, 5)(rng) : 0;
+            int64_t prime5 = forward[r] ? m.left : m.right;
+            place(prime5, forward[r], clip, pos[r], cigar[r]);
+            // keep the clipped ends inside the contig
+            if(pos[r] < 0 || pos[r] + options.read_length > (int64_t)contig_length)
+                place(prime5, forward[r], 0, pos[r], cigar[r]);
+        }
+        // an unmapped end sits at its mate, as BWA places it
+        for(int r = 0; r < 2; r++)
+        {
+            if(!mapped[r] && mapped[1 - r])
+                pos[r] = pos[1 - r];
+        }
+
+        int64_t tlen = m.right - m.left + 1;
+        for(int r = 0; r < 2; r++)
+        {
+            int flag = 0x1 | (r == 0 ? 0x40 : 0x80);
+            int mate = 1 - r;
+            if(mapped[0] && mapped[1])
+                flag |= 0x2;
+            if(!mapped[r])
+                flag |= 0x4;
+            if(!mapped[mate])
+                flag |= 0x8;
+            if(mapped[r] && !forward[r])
+                flag |= 0x10;
+            if(mapped[mate] && !forward[mate])
+                flag |= 0x20;
+            random_read();
+            bool any = mapped[r] || mapped[mate];
+            fprintf(out, "%s\t%d\t%s\t%lld\t%d\t%s\t%s\t%lld\t%lld\t%s\t%s\n",
+                    name.c_str(), flag,
+                    any ? chr : "*",
+                    any ? (long long)(pos[r] + 1) : 0LL,
+                    mapped[r] ? 60 : 0,
+                    mapped[r] ? cigar[r] : "*",
+                    any ? "=" : "*",
+                    any ? (long long)(pos[mate] + 1) : 0LL,
+                    mapped[0] && mapped[1] ? (long long)(forward[r] ? tlen : -tlen) : 0LL,
+                    seq.c_str(), qual.c_str());
+        }
+
+        if(mapped[0] && uniform(rng) < options.supplementary)
+        {
+            // a chimeric part of read 1 elsewhere on its contig
+            int64_t other = std::uniform_int_distribution<int64_t>(0, contig_length - options.read_length)(rng);
+            int part = options.read_length / 2;
+            random_read();
+            seq[part] = qual[part] = 0;
+            fprintf(out, "%s\t%d\t%s\t%lld\t60\t%dM\t=\t%lld\t0\t%s\t%s\n",
+                    name.c_str(), 0x1 | 0x40 | 0x800 | (mapped[1] ? 0 : 0x8), chr, (long long)(other + 1),
+                    part, (long long)(pos[1] + 1), seq.c_str(), qual.c_str());
+        }
+    }
+};
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: sormadup-gen [options] > input.sam\n"
+            "      --genome NUM         genome size in bases [100000000]\n"
+            "      --contigs NUM        contigs of equal length [4]\n"
+            "  -n, --pairs NUM          read pairs [1000000]\n"
+            "      --read-length NUM    [150]\n"
+            "      --insert NUM         mean insert size [400]\n"
+            "      --dup-rate FLOAT     fraction of the pairs copying an earlier molecule [0.1]\n"
+            "      --unmapped FLOAT     fraction of the pairs with an unmapped end [0.02]\n"
+            "      --supplementary FLOAT fraction of the pairs with a supplementary record [0.01]\n"
+            "      --skew FLOAT         fraction of the molecules in a hot region of 1%% of the genome [0]\n"
+            "      --names STR          read names, illumina or plain [illumina]\n"
+            "  -s, --seed NUM           [1]\n"
+            "  -o, --output FILE        [stdout]\n");
+}
+
+enum
+{
+    OPT_GENOME = 1000,
+    OPT_CONTIGS,
+    OPT_READ_LENGTH,
+    OPT_INSERT,
+    OPT_DUP_RATE,
+    OPT_UNMAPPED,
+    OPT_SUPPLEMENTARY,
+    OPT_SKEW,
+    OPT_NAMES
+};
+
+int main(int argc, char * argv[])
+{
+    GenOptions options;
+    static struct option long_options[] = {
+        {"genome", required_argument, nullptr, OPT_GENOME},
+        {"contigs", required_argument, nullptr, OPT_CONTIGS},
+        {"pairs", required_argument, nullptr, 'n'},
+        {"read-length", required_argument, nullptr, OPT_READ_LENGTH},
+        {"insert", required_argument, nullptr, OPT_INSERT},
+        {"dup-rate", required_argument, nullptr, OPT_DUP_RATE},
+        {"unmapped", required_argument, nullptr, OPT_UNMAPPED},
+        {"supplementary", required_argument, nullptr, OPT_SUPPLEMENTARY},
+        {"skew", required_argument, nullptr, OPT_SKEW},
+        {"names", required_argument, nullptr, OPT_NAMES},
+        {"seed", required_argument, nullptr, 's'},
+        {"output", required_argument, nullptr, 'o'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "n:s:o:h", long_options, nullptr)) >= 0)
+    {
+        switch(c)
+        {
+            case OPT_GENOME: options.genome = strtoull(optarg, nullptr, 10); break;
+            case OPT_CONTIGS: options.contigs = atoi(optarg); break;
+            case 'n': options.pairs = strtoull(optarg, nullptr, 10); break;
+            case OPT_READ_LENGTH: options.read_length = atoi(optarg); break;
+            case OPT_INSERT: options.insert = atoi(optarg); break;
+            case OPT_DUP_RATE: options.dup_rate = atof(optarg); break;
+            case OPT_UNMAPPED: options.unmapped = atof(optarg); break;
+            case OPT_SUPPLEMENTARY: options.supplementary = atof(optarg); break;
+            case OPT_SKEW: options.skew = atof(optarg); break;
+            case OPT_NAMES:
+                if(strcmp(optarg, "illumina") != 0 && strcmp(optarg, "plain") != 0)
+                {
+                    fprintf(stderr, "unknown read names: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                options.illumina_names = strcmp(optarg, "illumina") == 0;
+                break;
+            case 's': options.seed = strtoull(optarg, nullptr, 10); break;
+            case 'o': options.output = optarg; break;
+            case 'h': usage(); return EXIT_SUCCESS;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if(options.contigs < 1 || options.read_length < 10 || options.insert < options.read_length
+       || options.genome / options.contigs < (uint64_t)options.insert * 4)
+    {
+        fprintf(stderr, "contigs must hold a few inserts and inserts a read\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE * out = options.output ? fopen(options.output, "w") : stdout;
+    if(out == nullptr)
+    {
+        fprintf(stderr, "can't open %s\n", options.output);
+        return EXIT_FAILURE;
+    }
+    Generator(options, out).run();
+    if(options.output)
+        fclose(out);
+    return EXIT_SUCCESS;
+}
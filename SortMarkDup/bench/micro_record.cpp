@@ -0,0 +1,274 @@
+/**
+ * sormadup-micro: microbenchmark of the per-record functions of tbb-sormadup.
+ *
+ * Parses a set of synthetic records (short reads of --read-length bases and long reads of
+ * --long-length bases, clipped, on both strands) and times BAMRecord::score, BAMRecord::prime5_pos
+ * on fresh records and again once cached, and the construction of SinglePair and DoublePair, as the
+ * best nanoseconds per record of --repeats runs. score is checked against a scalar sum.
+ *
+ * With --baseline FILE, the first run is saved there; later runs fail when a function is slower
+ * than the baseline by more than BENCH_TOLERANCE percent (default 20).
+ */
+
+#include <getopt.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "sam.h"
+#include "bam_record.h"
+#include "pair.h"
+
+struct MicroOptions
+{
+    size_t records = 200000;
+    int read_length = 150;
+    int long_length = 10000;
+    int repeats = 5;
+    const char * baseline = nullptr;
+};
+
+enum
+{
+    OPT_READ_LENGTH = 1000,
+    OPT_LONG_LENGTH
+};
+
+static const uint64_t kContigLength = 100000000;
+
+typedef std::vector<std::unique_ptr<BAMRecord>> tRecords;
+
+// name-grouped pairs of reads of length bases, every fourth one clipped
+static tRecords make_records(sam_hdr_t * header, size_t n, int length, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::string seq(length, 'A'), qual(length, 'I');
+    tRecords records;
+    for(size_t i = 0; i < n; i++)
+    {
+        for(int k = 0; k < length; k++)
+        {
+            seq[k] = "ACGT"[rng() & 3];
+            qual[k] = '!' + 2 + rng() % 40;
+        }
+        bool read2 = i & 1;
+        bool reverse = ((i >> 1) & 1) != read2;
+        int clip = (i % 4 == 0) ? 1 + rng() % (length / 10) : 0;
+        std::string cigar = clip ? std::to_string(clip) + "S" + std::to_string(length - 2 * clip) + "M"
+            + std::to_string(clip) + "S" : std::to_string(length) + "M";
+        uint64_t pos = 1 + rng() % (kContigLength - 2 * length);
+        int flag = BAM_FPAIRED | BAM_FPROPER_PAIR | (read2 ? BAM_FREAD2 : BAM_FREAD1)
+            | (reverse ? BAM_FREVERSE : BAM_FMREVERSE);
+        char name[64];
+        snprintf(name, sizeof(name), "M0:1:FC:1:%d:%d:%d", (int)(1101 + i / 2 % 20), (int)(rng() % 30000),
+                 (int)(rng() % 30000));
+        std::string text = std::string(name) + "\t" + std::to_string(flag) + "\tchr1\t" + std::to_string(pos) + "\t60\t"
+            + cigar + "\t=\t" + std::to_string(pos) + "\t0\t" + seq + "\t" + qual;
+        kstring_t line = {text.size(), text.size() + 1, &text[0]};
+        records.emplace_back(new BAMRecord);
+        bam1_t * b = records.back()->get_record();
+        if(sam_parse1(&line, header, b) < 0)
+        {
+            fprintf(stderr, "can't parse %s\n", line.s);
+            exit(EXIT_FAILURE);
+        }
+        bam_set_mempolicy(b, BAM_USER_OWNS_STRUCT);
+        records.back()->set_pairID(i / 2 + 1);
+    }
+    return records;
+}
+
+static uint32_t scalar_score(const bam1_t * b)
+{
+    const uint8_t * qual = bam_get_qual(b);
+    uint32_t sum = 0;
+    for(int i = 0; i < b->core.l_qseq; i++)
+    {
+        if(qual[i] >= 15)
+            sum += qual[i];
+    }
+    return sum;
+}
+
+// the best nanoseconds per record of run over repeats runs, prepare runs untimed before each
+static double best_ns(int repeats, size_t n, const std::function<void()> &prepare, const std::function<uint64_t()> &run)
+{
+    double best = 1e300;
+    volatile uint64_t sink = 0;
+    for(int r = 0; r < repeats; r++)
+    {
+        prepare();
+        auto start = std::chrono::steady_clock::now();
+        sink = sink + run();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count() / n);
+    }
+    return best;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: sormadup-micro [options]\n"
+        "  -n, --records NUM       records of each length [200000]\n"
+        "      --read-length NUM   bases of the short reads [150]\n"
+        "      --long-length NUM   bases of the long reads [10000]\n"
+        "  -r, --repeats NUM       runs of each function, the best one is kept [5]\n"
+        "  -b, --baseline FILE     compare with FILE, or save the run there if it does not exist\n");
+}
+
+int main(int argc, char * argv[])
+{
+    MicroOptions options;
+    static struct option long_options[] = {
+        {"records", required_argument, nullptr, 'n'},
+        {"read-length", required_argument, nullptr, OPT_READ_LENGTH},
+        {"long-length", required_argument, nullptr, OPT_LONG_LENGTH},
+        {"repeats", required_argument, nullptr, 'r'},
+        {"baseline", required_argument, nullptr, 'b'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "n:r:b:h", long_options, nullptr)) >= 0)
+    {
+        switch(c)
+        {
+            case 'n': options.records = strtoull(optarg, nullptr, 10) & ~(size_t)1; break;
+            case OPT_READ_LENGTH: options.read_length = atoi(optarg); break;
+            case OPT_LONG_LENGTH: options.long_length = atoi(optarg); break;
+            case 'r': options.repeats = atoi(optarg); break;
+            case 'b': options.baseline = optarg; break;
+            case 'h': usage(); return EXIT_SUCCESS;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if(options.records < 2 || options.read_length < 20 || options.long_length < 20 || options.repeats < 1)
+    {
+        fprintf(stderr, "needs 2 records of 20 bases and a run at least\n");
+        return EXIT_FAILURE;
+    }
+
+    std::string text = "@HD\tVN:1.6\tSO:unsorted\n@SQ\tSN:chr1\tLN:" + std::to_string(kContigLength) + "\n";
+    sam_hdr_t * header = sam_hdr_parse(text.size(), text.c_str());
+    BAMRecord::kTable = {0, kContigLength};
+
+    // name, nanoseconds per record
+    std::vector<std::pair<std::string, double>> results;
+    const size_t n = options.records;
+    auto nothing = [](){};
+    for(auto length_name : {std::make_pair(options.read_length, std::string("short")),
+                            std::make_pair(options.long_length, std::string("long"))})
+    {
+        const std::string &name = length_name.second;
+        // the long reads are fewer, to keep the same number of bases at most
+        size_t count = std::max<size_t>(2, std::min<size_t>(n, n * options.read_length / length_name.first) & ~(size_t)1);
+        tRecords records = make_records(header, count, length_name.first, 42);
+
+        for(auto &record : records)
+        {
+            if(record->score() != scalar_score(record->get_record()))
+            {
+                fprintf(stderr, "score of %s is %u, the scalar sum %u\n", record->qname(), record->score(),
+                        scalar_score(record->get_record()));
+                return EXIT_FAILURE;
+            }
+        }
+        results.emplace_back("score/" + name, best_ns(options.repeats, count, nothing, [&records](){
+            uint64_t sum = 0;
+            for(auto &record : records)
+                sum += record->score();
+            return sum;
+        }));
+        results.emplace_back("scalar_score/" + name, best_ns(options.repeats, count, nothing, [&records](){
+            uint64_t sum = 0;
+            for(auto &record : records)
+                sum += scalar_score(record->get_record());
+            return sum;
+        }));
+
+        // the first call walks the CIGAR, fresh records are parsed for each run
+        tRecords fresh;
+        uint64_t seed = 43;
+        results.emplace_back("prime5_pos_first/" + name, best_ns(options.repeats, count,
+            [&fresh, &header, count, &length_name, &seed](){
+                fresh.clear();
+                fresh = make_records(header, count, length_name.first, seed++);
+            },
+            [&fresh](){
+                uint64_t sum = 0;
+                for(auto &record : fresh)
+                    sum += record->prime5_pos();
+                return sum;
+            }));
+        results.emplace_back("prime5_pos_cached/" + name, best_ns(options.repeats, count, nothing, [&fresh](){
+            uint64_t sum = 0;
+            for(auto &record : fresh)
+                sum += record->prime5_pos();
+            return sum;
+        }));
+
+        results.emplace_back("single_pair/" + name, best_ns(options.repeats, count, nothing, [&records](){
+            uint64_t sum = 0;
+            for(auto &record : records)
+                sum += SinglePair(record.get()).get_prime5_pos();
+            return sum;
+        }));
+        results.emplace_back("double_pair/" + name, best_ns(options.repeats, count / 2, nothing, [&records](){
+            uint64_t sum = 0;
+            for(size_t i = 0; i + 1 < records.size(); i += 2)
+                sum += DoublePair(records[i].get(), records[i + 1].get()).get_record2_prime5_pos();
+            return sum;
+        }));
+    }
+    sam_hdr_destroy(header);
+
+    std::map<std::string, double> baseline;
+    bool compare = false;
+    if(options.baseline != nullptr)
+    {
+        std::ifstream in(options.baseline);
+        std::string name;
+        double ns;
+        while(in >> name >> ns)
+            baseline[name] = ns;
+        compare = !baseline.empty();
+    }
+    const char * tolerance_env = getenv("BENCH_TOLERANCE");
+    const double tolerance = tolerance_env ? atof(tolerance_env) : 20;
+    bool failed = false;
+    printf("%-28s %10s %10s\n", "function", "ns/record", compare ? "baseline" : "");
+    for(auto &result : results)
+    {
+        printf("%-28s %10.2f", result.first.c_str(), result.second);
+        auto base = baseline.find(result.first);
+        if(compare && base != baseline.end() && base->second > 0)
+        {
+            double slower = (result.second / base->second - 1) * 100;
+            printf(" %10.2f %+7.1f%%", base->second, slower);
+            failed |= slower > tolerance;
+        }
+        printf("\n");
+    }
+    if(options.baseline != nullptr && !compare)
+    {
+        std::ofstream out(options.baseline);
+        for(auto &result : results)
+            out << result.first << "\t" << result.second << "\n";
+        printf("baseline saved to %s\n", options.baseline);
+    }
+    if(failed)
+    {
+        printf("slower than the baseline\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,327 @@
+/**
+ * sormadup-refdup: a simple single-threaded duplicate marker, the reference of the benchmark.
+ *
+ * It keeps every pair in memory and applies the rules of tbb-sormadup without its machinery:
+ * pairs with both ends mapped are duplicates when the unclipped 5' positions and orientation of
+ * their ends match a pair of higher score (the sum of the base qualities over Q15, then the lower
+ * tile:x:y); a pair with one end mapped is a duplicate of such a pair on its end, or of a higher
+ * scoring one-end pair. The input must be grouped by QNAME.
+ *
+ * With --check, the duplicate flags of the primary records of a tbb-sormadup output are compared
+ * with the reference, by QNAME; the pairs tied for the best of their set may go either way.
+ */
+
+#include <getopt.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "sam.h"
+
+enum Orientation {FF = 0, FR = 1, RF = 2, RR = 3};
+
+struct RefPair
+{
+    uint64_t key1;      // first 5' position << 2 | orientation
+    uint64_t key2;      // second 5' position, UINT64_MAX for a one-end pair
+    uint32_t score;
+    uint16_t tile, x, y;
+    uint32_t name;      // index in names
+};
+
+class RefMarkDup
+{
+public:
+    bool read(const char * path)
+    {
+        htsFile * fp = sam_open(path, "r");
+        if(fp == nullptr)
+        {
+            fprintf(stderr, "can't open %s\n", path);
+            return false;
+        }
+        sam_hdr_t * header = sam_hdr_read(fp);
+        uint64_t accumulate = 0;
+        for(int i = 0; i < header->n_targets; i++)
+        {
+            offsets.push_back(accumulate);
+            accumulate += header->target_len[i];
+        }
+        reference_length = accumulate;
+
+        bam1_t * record = bam_init1();
+        std::vector<bam1_t *> group;
+        std::string qname;
+        while(sam_read1(fp, header, record) >= 0)
+        {
+            if(!group.empty() && qname != bam_get_qname(record))
+            {
+                add_group(group);
+                group.clear();
+            }
+            qname = bam_get_qname(record);
+            if((record->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) == 0)
+            {
+                group.push_back(bam_dup1(record));
+            }
+        }
+        add_group(group);
+        bam_destroy1(record);
+        sam_hdr_destroy(header);
+        sam_close(fp);
+        return true;
+    }
+
+    // sort and flag, fills duplicates and tied
+    void mark()
+    {
+        auto order = [](const RefPair &a, const RefPair &b){
+            if(a.key1 != b.key1)
+                return a.key1 < b.key1;
+            if(a.key2 != b.key2)
+                return a.key2 < b.key2;
+            if(a.score != b.score)
+                return a.score > b.score;
+            if(a.tile != b.tile)
+                return a.tile < b.tile;
+            if(a.x != b.x)
+                return a.x < b.x;
+            return a.y < b.y;
+        };
+        std::sort(pairs.begin(), pairs.end(), order);
+        duplicate.assign(names.size(), false);
+        tied.assign(names.size(), false);
+        for(size_t i = 0; i < pairs.size(); )
+        {
+            size_t j = i + 1;
+            while(j < pairs.size() && pairs[j].key1 == pairs[i].key1 && pairs[j].key2 == pairs[i].key2)
+                j++;
+            bool single = pairs[i].key2 == UINT64_MAX;
+            uint64_t target = (pairs[i].key1 >> 2) + ((pairs[i].key1 & 3) == RR ? reference_length : 0);
+            bool all = single && double_ends.count(target) > 0;
+            for(size_t k = i; k < j; k++)
+            {
+                duplicate[pairs[k].name] = all || k > i;
+            }
+            // the best is not unique, any of the tied pairs may be kept
+            for(size_t k = i + 1; !all && k < j && same_rank(pairs[i], pairs[k]); k++)
+            {
+                tied[pairs[i].name] = tied[pairs[k].name] = true;
+            }
+            i = j;
+        }
+    }
+
+    uint64_t num_pairs() const {return pairs.size();}
+    uint64_t num_duplicate() const {return std::count(duplicate.begin(), duplicate.end(), true);}
+
+    // compare with the duplicate flags of the primaries of path, return the mismatches
+    uint64_t check(const char * path)
+    {
+        htsFile * fp = sam_open(path, "r");
+        if(fp == nullptr)
+        {
+            fprintf(stderr, "can't open %s\n", path);
+            return UINT64_MAX;
+        }
+        sam_hdr_t * header = sam_hdr_read(fp);
+        bam1_t * record = bam_init1();
+        std::unordered_set<std::string> flagged;
+        while(sam_read1(fp, header, record) >= 0)
+        {
+            if((record->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) == 0
+               && (record->core.flag & BAM_FDUP) != 0)
+            {
+                flagged.insert(bam_get_qname(record));
+            }
+        }
+        bam_destroy1(record);
+        sam_hdr_destroy(header);
+        sam_close(fp);
+
+        uint64_t missing = 0, extra = 0, ties = 0;
+        for(size_t i = 0; i < names.size(); i++)
+        {
+            bool marked = flagged.count(names[i]) > 0;
+            if(marked == duplicate[i])
+                continue;
+            if(tied[i])
+                ties++;
+            else if(marked)
+                extra++;
+            else
+                missing++;
+        }
+        printf("check: %llu not marked, %llu wrongly marked, %llu tied pairs swapped\n",
+               (unsigned long long)missing, (unsigned long long)extra, (unsigned long long)ties);
+        return missing + extra;
+    }
+
+private:
+    std::vector<uint64_t> offsets;
+    uint64_t reference_length = 0;
+    std::vector<RefPair> pairs;
+    std::vector<std::string> names;
+    std::vector<bool> duplicate, tied;
+    std::unordered_set<uint64_t> double_ends;  // 5' positions of the ends of pairs, + reference_length if reverse
+
+    static bool same_rank(const RefPair &a, const RefPair &b)
+    {
+        return a.score == b.score && a.tile == b.tile && a.x == b.x && a.y == b.y;
+    }
+
+    uint64_t prime5(const bam1_t * b) const
+    {
+        const uint32_t * cigar = bam_get_cigar(b);
+        int n = b->core.n_cigar;
+        uint64_t pos = offsets[b->core.tid] + b->core.pos;
+        auto clip = [](uint32_t c){
+            return bam_cigar_op(c) == BAM_CSOFT_CLIP || bam_cigar_op(c) == BAM_CHARD_CLIP;
+        };
+        if(!bam_is_rev(b))
+        {
+            for(int i = 0; i < n && clip(cigar[i]); i++)
+                pos -= bam_cigar_oplen(cigar[i]);
+            return pos;
+        }
+        // the clips after the alignment, then the reference it covers
+        int i = n - 1;
+        for(; i >= 0 && clip(cigar[i]); i--)
+            pos += bam_cigar_oplen(cigar[i]);
+        for(; i >= 0; i--)
+        {
+            if((bam_cigar_type(bam_cigar_op(cigar[i])) & 2) != 0)
+                pos += bam_cigar_oplen(cigar[i]);
+        }
+        return pos - 1;
+    }
+
+    static uint32_t score(const bam1_t * b)
+    {
+        const uint8_t * qual = bam_get_qual(b);
+        uint32_t sum = 0;
+        for(int i = 0; i < b->core.l_qseq; i++)
+        {
+            if(qual[i] >= 15)
+                sum += qual[i];
+        }
+        return sum;
+    }
+
+    // illumina instrument:run:flowcell:lane:tile:x:y, or without the instrument
+    static void tile_x_y(const char * qname, RefPair &pair)
+    {
+        std::vector<std::string> fields;
+        std::string field;
+        for(const char * p = qname; ; p++)
+        {
+            if(*p == ':' || *p == 0)
+            {
+                if(!field.empty())
+                    fields.push_back(field);
+                field.clear();
+                if(*p == 0)
+                    break;
+            }else{
+                field += *p;
+            }
+        }
+        pair.tile = pair.x = pair.y = 0;
+        if(fields.size() == 7 || fields.size() == 6)
+        {
+            size_t first = fields.size() - 3;
+            pair.tile = strtol(fields[first].c_str(), nullptr, 10);
+            pair.x = strtol(fields[first + 1].c_str(), nullptr, 10);
+            pair.y = strtol(fields[first + 2].c_str(), nullptr, 10);
+        }
+    }
+
+    // the mapped primaries of one QNAME
+    void add_group(std::vector<bam1_t *> &group)
+    {
+        if(!group.empty())
+        {
+            RefPair pair;
+            pair.name = names.size();
+            names.push_back(bam_get_qname(group[0]));
+            tile_x_y(names.back().c_str(), pair);
+            uint64_t pos1 = prime5(group[0]);
+            bool forward1 = !bam_is_rev(group[0]);
+            pair.score = score(group[0]);
+            if(group.size() == 1)
+            {
+                pair.key1 = pos1 << 2 | (forward1 ? FF : RR);
+                pair.key2 = UINT64_MAX;
+            }else{
+                uint64_t pos2 = prime5(group[1]);
+                bool forward2 = !bam_is_rev(group[1]);
+                pair.score += score(group[1]);
+                double_ends.insert(pos1 + (forward1 ? 0 : reference_length));
+                double_ends.insert(pos2 + (forward2 ? 0 : reference_length));
+                if(pos1 > pos2)
+                {
+                    std::swap(pos1, pos2);
+                    std::swap(forward1, forward2);
+                }
+                Orientation orientation = forward1 ? (forward2 ? FF : FR) : (forward2 ? RF : RR);
+                if(pos1 == pos2 && orientation == RF)
+                    orientation = FR;
+                pair.key1 = pos1 << 2 | orientation;
+                pair.key2 = pos2;
+            }
+            pairs.push_back(pair);
+        }
+        for(auto b : group)
+            bam_destroy1(b);
+    }
+};
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: sormadup-refdup -I input.sam [--check output.bam]\n"
+            "  -I, --input FILE     name-grouped SAM/BAM\n"
+            "      --check FILE     compare the duplicate flags of FILE with the reference\n");
+}
+
+int main(int argc, char * argv[])
+{
+    const char * input = nullptr;
+    const char * output = nullptr;
+    static struct option long_options[] = {
+        {"input", required_argument, nullptr, 'I'},
+        {"check", required_argument, nullptr, 1000},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "I:h", long_options, nullptr)) >= 0)
+    {
+        switch(c)
+        {
+            case 'I': input = optarg; break;
+            case 1000: output = optarg; break;
+            case 'h': usage(); return EXIT_SUCCESS;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if(input == nullptr)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    RefMarkDup markdup;
+    if(!markdup.read(input))
+        return EXIT_FAILURE;
+    markdup.mark();
+    printf("reference: %llu pairs, %llu duplicates\n",
+           (unsigned long long)markdup.num_pairs(), (unsigned long long)markdup.num_duplicate());
+    if(output != nullptr && markdup.check(output) != 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Benchmark of tbb-sormadup on a synthetic input, run by the bench targets of CMakeLists.txt.
+#
+# usage: run_bench.sh TBB_SORMADUP SORMADUP_GEN SORMADUP_REFDUP WORKDIR PAIRS THREADS BASELINE
+#
+# The input of PAIRS read pairs is generated once in WORKDIR (fixed seed, 10% duplicates, 2%
+# unmapped ends, hot region skew). tbb-sormadup writes its --metrics there, the stage times are
+# printed and its duplicate flags are checked against sormadup-refdup. The first run is kept as
+# BASELINE; later runs fail when a stage is slower than the baseline by more than
+# BENCH_TOLERANCE percent (default 20).
+
+set -e
+if [ $# -ne 7 ]; then
+    sed -n '4p' "$0" >&2
+    exit 1
+fi
+sormadup=$1
+gen=$2
+refdup=$3
+workdir=$4
+pairs=$5
+threads=$6
+baseline=$7
+tolerance=${BENCH_TOLERANCE:-20}
+
+mkdir -p "$workdir"
+cd "$workdir"
+input=input_$pairs.sam
+if [ ! -f "$input" ]; then
+    "$gen" --pairs "$pairs" --genome 300000000 --contigs 8 --dup-rate 0.1 --unmapped 0.02 --skew 0.05 \
+        --seed 42 -o "$input"
+fi
+
+"$sormadup" -I "$input" -O output.bam -t "$threads" --metrics metrics.json > sormadup.log
+# one stage per line in the metrics
+stages() {
+    sed -n 's/.*{"name": "\([^"]*\)", "seconds": \([0-9.e+-]*\),.*/\2\t\1/p' "$1"
+}
+echo "stage seconds ($pairs pairs, $threads threads):"
+stages metrics.json
+grep -o '"totals": {[^}]*}' metrics.json
+grep -o '"peak_rss_kb": [0-9]*' metrics.json
+
+"$refdup" -I "$input" --check output.bam
+
+if [ ! -f "$baseline" ]; then
+    cp metrics.json "$baseline"
+    echo "baseline saved to $baseline"
+    exit 0
+fi
+stages "$baseline" > baseline.tsv
+stages metrics.json | awk -F '\t' -v tolerance="$tolerance" '
+    NR == FNR {base[$2] = $1; next}
+    ($2 in base) {
+        slower = base[$2] > 0 ? ($1 / base[$2] - 1) * 100 : 0
+        printf "%-40s %8.2fs %8.2fs %+7.1f%%\n", $2, base[$2], $1, slower
+        # stages under a second are noise
+        if (slower > tolerance && $1 > 1) failed = 1
+    }
+    END {if (failed) {print "slower than the baseline"; exit 1}}' baseline.tsv -
@@ -0,0 +1,57 @@
+#!/bin/sh
+# TLB misses of tbb-sormadup under each --huge-pages policy, run by the bench-tlb target of CMakeLists.txt.
+#
+# usage: run_tlb.sh TBB_SORMADUP SORMADUP_GEN WORKDIR PAIRS THREADS
+#
+# The input of PAIRS read pairs is the one of run_bench.sh, generated once in WORKDIR. tbb-sormadup
+# runs with --huge-pages off, thp and hugetlb under `perf stat`, and the seconds, dTLB load and store
+# misses and the huge pages it got are printed per policy. Without perf only the seconds are. hugetlb
+# needs reserved pages (vm.nr_hugepages), it falls back to thp otherwise.
+
+set -e
+if [ $# -ne 5 ]; then
+    sed -n '4p' "$0" >&2
+    exit 1
+fi
+sormadup=$1
+gen=$2
+workdir=$3
+pairs=$4
+threads=$5
+
+mkdir -p "$workdir"
+cd "$workdir"
+input=input_$pairs.sam
+if [ ! -f "$input" ]; then
+    "$gen" --pairs "$pairs" --genome 300000000 --contigs 8 --dup-rate 0.1 --unmapped 0.02 --skew 0.05 \
+        --seed 42 -o "$input"
+fi
+
+perf=""
+if command -v perf > /dev/null 2>&1 && perf stat -e dTLB-load-misses true > /dev/null 2>&1; then
+    perf="perf stat -x , -e dTLB-load-misses,dTLB-store-misses -o"
+else
+    echo "perf or its dTLB events are unavailable, only the times are compared"
+fi
+
+printf "%-8s %10s %16s %16s  %s\n" policy seconds dTLB-load-miss dTLB-store-miss "huge pages"
+for policy in off thp hugetlb; do
+    start=$(date +%s.%N)
+    if [ -n "$perf" ]; then
+        $perf "perf_$policy.csv" "$sormadup" -I "$input" -O "output_$policy.bam" -t "$threads" \
+            --huge-pages "$policy" > "tlb_$policy.log"
+    else
+        "$sormadup" -I "$input" -O "output_$policy.bam" -t "$threads" --huge-pages "$policy" > "tlb_$policy.log"
+    fi
+    end=$(date +%s.%N)
+    seconds=$(echo "$start $end" | awk '{printf "%.2f", $2 - $1}')
+    loads=-
+    stores=-
+    if [ -n "$perf" ]; then
+        loads=$(awk -F , '$3 ~ /^dTLB-load-misses/ {print $1}' "perf_$policy.csv")
+        stores=$(awk -F , '$3 ~ /^dTLB-store-misses/ {print $1}' "perf_$policy.csv")
+    fi
+    printf "%-8s %10s %16s %16s  %s\n" "$policy" "$seconds" "$loads" "$stores" \
+        "$(grep '^huge pages:' "tlb_$policy.log" | sed 's/^huge pages: [a-z]*, //')"
+    rm -f "output_$policy.bam" "output_$policy.bam.bai"
+done
@@ -3,6 +3,7 @@
 #include <tbb/tbb.h>
 #include <tbb/parallel_for_each.h>
 #include <tbb/parallel_for.h>
+#include <tbb/flow_graph.h>
 #include <cassert>
 #include <filesystem>
 #include "tbb/bam_record.h"
@@ -17,6 +18,7 @@
 #include <iostream>
 #include <algorithm>
 #include <chrono>
+#include <functional>
 #include <string>
 #include "bgzf.h"
 #include "hfile.h"
@@ -25,6 +27,28 @@
 #include "tbb/bam_parser.h"
 #include "getopt.h"
 #include "tbb/SAMRead.h"
+#include "tbb/options.h"
+#include "tbb/OrderedRecordStore.h"
+#include "tbb/StreamingMarkDup.h"
+#include "tbb/umi.h"
+#include "tbb/RegionIndex.h"
+#include "tbb/SplitOutput.h"
+#include "tbb/SpillRecord.h"
+#include "tbb/SpillCodec.h"
+#include "tbb/MateMatcher.h"
+#include "tbb/ThreadBudget.h"
+#include "tbb/NumaPlacement.h"
+#include "tbb/Metrics.h"
+#include "tbb/Checkpoint.h"
+#include "tbb/Shard.h"
+#include "tbb/QcStats.h"
+#include "tbb/BaseRecalibrator.h"
+#include "tbb/HugePages.h"
+#include "sormadup.h"
+#include "thread_pool.h"
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define BULK_SIZE 10000
 #define INT_SIZE sizeof(int)
@@ -35,53 +59,449 @@ namespace fs = std::filesystem;
 static std::atomic_uint64_t pairIDSource = 1;
 static const  uint32_t pairIDASC = 100;
 
+// a bulk of SAM lines, id records the order in the input
+struct LineBatch
+{
+    uint64_t id;
+    std::vector<kstring_t> * lines;
+    uint64_t first_line;    // the index of its first line in the input
+    std::vector<bam1_t *> * records;    // instead of the lines, built by the aligner linked in (sormadup.h)
+};
+
+// long options without a short name
+enum
+{
+    OPT_WINDOW = 1000,
+    OPT_MAX_BUFFERED,
+    OPT_UMI,
+    OPT_UMI_TAG,
+    OPT_UMI_EDITS,
+    OPT_REGIONS,
+    OPT_DROP_OFF_TARGET,
+    OPT_SPLIT,
+    OPT_SPILL_CODEC,
+    OPT_SPILL_MEMORY,
+    OPT_UNGROUPED,
+    OPT_MATE_MEMORY,
+    OPT_PIN_THREADS,
+    OPT_METRICS,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_SHARDS,
+    OPT_SHARD,
+    OPT_SHARD_DIR,
+    OPT_MERGE_SHARDS,
+    OPT_SHARD_TIMEOUT,
+    OPT_QC,
+    OPT_QC_TARGETS,
+    OPT_BQSR_TABLE,
+    OPT_REFERENCE,
+    OPT_KNOWN_SITES,
+    OPT_HUGE_PAGES
+};
+
 void time_stamp(std::string hint);
+void usage();
+void construct_kTable(const sam_hdr_t * header);
+int stream_markdup(const SormadupOptions &options);
+int sort_markdup(const SormadupOptions &options);
+int parse_options(int argc, char * argv[], SormadupOptions &options);
+int run_sormadup(SormadupOptions &options, int argc, char * argv[]);
+int run_shards(const SormadupOptions &options, int argc, char * argv[]);
 char *auto_index(htsFile *fp, const char *fn, bam_hdr_t *header);
 void read_alignment(htsFile *fp, sam_hdr_t * header);
 void output_alignment(char* output_file, const sam_hdr_t *header, std::vector<BAMPartitioner::tRDD>& rdds, int num_partitions, BAMPartitioner& bam_partitioner
     , bitmap& duplicate_index);
-
-moodycamel::ConcurrentQueue<std::vector<kstring_t> *> LineQueue(1000);
+void output_alignment_ordered(const SormadupOptions &options, const sam_hdr_t *header, OrderedRecordStore &record_store
+    , bitmap * duplicate_index, int num_thread, QcStats * qc, BaseRecalibrator * bqsr);
+void output_alignment_split(const SormadupOptions &options, sam_hdr_t *header, std::vector<BAMPartitioner::tRDD>& rdds,
+    BAMPartitioner& bam_partitioner, const std::vector<OutputGroup>& groups, bitmap * duplicate_index, int num_thread,
+    QcStats * qc, BaseRecalibrator * bqsr);
+std::unique_ptr<QcStats> make_qc(const SormadupOptions &options, sam_hdr_t * header, const RegionIndex * regions,
+    std::unique_ptr<RegionIndex> &qc_targets);
+std::unique_ptr<BaseRecalibrator> make_bqsr(const SormadupOptions &options, sam_hdr_t * header);
+template<typename tRDD>
+void report_rdd_size(const std::string &name, const std::vector<tRDD>& rdds);
+void search_double_duplicate(RangePartitioner<DoublePair>::tRDD& rdd, bitmap& duplicate_index, int umi_edits);
+void search_single_duplicate(RangePartitioner<SinglePair>::tRDD& rdd, bitmap& double_pair_indicator,
+    bitmap& duplicate_index, uint64_t reference_length, int umi_edits);
+
+moodycamel::ConcurrentQueue<LineBatch> LineQueue(1000);
 std::atomic_bool read_finished;
 
-// usage: ./sormadup [-I input.sam] [-t num] -O output.bam
+// linked into an aligner, the header comes from sormadup_start and the records from sormadup_push
+static sam_hdr_t * library_header = nullptr;
+static SormadupOptions library_options;
+static std::thread library_thread;
+static int library_ret = EXIT_FAILURE;
+static uint64_t library_batches = 0, library_records = 0;
+
+#ifndef SORMADUP_LIBRARY
+// usage: ./sormadup [-I input.sam] [-t num] [-m mode] -O output.bam
 int main(int argc, char* argv[]){
-    // by default, use one thread to read and the left to process
-    int num_thread_shuffle = std::thread::hardware_concurrency() - 1;
+    SormadupOptions options;
+    int ret = parse_options(argc, argv, options);
+    if(ret >= 0){
+        return ret;
+    }
+    return run_sormadup(options, argc, argv);
+}
+#endif
+
+bool sormadup_start(int argc, char * argv[], sam_hdr_t * header)
+{
+    library_header = header;
+    // the aligner parsed its own options with getopt before
+    optind = 0;
+    if(parse_options(argc, argv, library_options) >= 0){
+        return false;
+    }
+    read_finished = false;
+    library_thread = std::thread([](){library_ret = run_sormadup(library_options, 0, nullptr);});
+    return true;
+}
+
+void sormadup_push(bam1_t ** records, size_t n)
+{
+    if(n == 0){
+        return;
+    }
+    auto batch = new std::vector<bam1_t *>(records, records + n);
+    LineQueue.enqueue(LineBatch{library_batches++, nullptr, library_records, batch});
+    library_records += n;
+    Metrics::sample_queue("line_queue", LineQueue.size_approx());
+}
+
+int sormadup_finish()
+{
+    read_finished = true;
+    library_thread.join();
+    return library_ret;
+}
+
+// parse and check the options, return -1 to run them or the exit code
+int parse_options(int argc, char * argv[], SormadupOptions &options)
+{
     int c;
-    char * input_file = nullptr;
-    char * output_file = nullptr;
-    while((c = getopt(argc, argv, "I:O:t:")) >= 0)
+    static struct option long_options[] = {
+        {"input", required_argument, nullptr, 'I'},
+        {"output", required_argument, nullptr, 'O'},
+        {"threads", required_argument, nullptr, 't'},
+        {"mode", required_argument, nullptr, 'm'},
+        {"window", required_argument, nullptr, OPT_WINDOW},
+        {"max-buffered", required_argument, nullptr, OPT_MAX_BUFFERED},
+        {"umi", no_argument, nullptr, OPT_UMI},
+        {"umi-tag", required_argument, nullptr, OPT_UMI_TAG},
+        {"umi-edits", required_argument, nullptr, OPT_UMI_EDITS},
+        {"regions", required_argument, nullptr, OPT_REGIONS},
+        {"drop-off-target", no_argument, nullptr, OPT_DROP_OFF_TARGET},
+        {"split", required_argument, nullptr, OPT_SPLIT},
+        {"spill-codec", required_argument, nullptr, OPT_SPILL_CODEC},
+        {"spill-memory", required_argument, nullptr, OPT_SPILL_MEMORY},
+        {"ungrouped", no_argument, nullptr, OPT_UNGROUPED},
+        {"mate-memory", required_argument, nullptr, OPT_MATE_MEMORY},
+        {"pin-threads", no_argument, nullptr, OPT_PIN_THREADS},
+        {"metrics", required_argument, nullptr, OPT_METRICS},
+        {"checkpoint", required_argument, nullptr, OPT_CHECKPOINT},
+        {"resume", no_argument, nullptr, OPT_RESUME},
+        {"shards", required_argument, nullptr, OPT_SHARDS},
+        {"shard", required_argument, nullptr, OPT_SHARD},
+        {"shard-dir", required_argument, nullptr, OPT_SHARD_DIR},
+        {"merge-shards", required_argument, nullptr, OPT_MERGE_SHARDS},
+        {"shard-timeout", required_argument, nullptr, OPT_SHARD_TIMEOUT},
+        {"qc", required_argument, nullptr, OPT_QC},
+        {"qc-targets", required_argument, nullptr, OPT_QC_TARGETS},
+        {"bqsr-table", required_argument, nullptr, OPT_BQSR_TABLE},
+        {"reference", required_argument, nullptr, OPT_REFERENCE},
+        {"known-sites", required_argument, nullptr, OPT_KNOWN_SITES},
+        {"huge-pages", required_argument, nullptr, OPT_HUGE_PAGES},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    while((c = getopt_long(argc, argv, "I:O:t:m:h", long_options, nullptr)) >= 0)
     {
         switch (c)
         {
             case 'I':
-                input_file = strdup(optarg);
+                options.input_file = strdup(optarg);
                 break;
             
             case 'O':
-                output_file = strdup(optarg);
+                options.output_file = strdup(optarg);
+                break;
+
+            case 't':
+                options.num_threads = atoi(optarg);
+                break;
 
-                // 检查输入参数妥当
-                if(fs::exists(output_file)){
-                    fs::remove(output_file);
+            case 'm':
+                if(!parse_run_mode(optarg, options.mode)){
+                    std::cerr << "unknown mode: " << optarg << std::endl;
+                    usage();
+                    return EXIT_FAILURE;
                 }
                 break;
 
-            case 't':
-                num_thread_shuffle = atoi(optarg);
+            case OPT_WINDOW:
+                options.stream_window = strtoull(optarg, nullptr, 10);
+                break;
+
+            case OPT_MAX_BUFFERED:
+                options.stream_max_buffered = strtoull(optarg, nullptr, 10);
+                break;
+
+            case OPT_UMI:
+                options.umi = true;
+                break;
+
+            case OPT_UMI_TAG:
+                options.umi = true;
+                options.umi_tag = optarg;
+                break;
+
+            case OPT_UMI_EDITS:
+                options.umi_edits = atoi(optarg);
+                break;
+
+            case OPT_REGIONS:
+                options.regions_file = strdup(optarg);
+                break;
+
+            case OPT_DROP_OFF_TARGET:
+                options.drop_off_target = true;
                 break;
+
+            case OPT_SPLIT:
+                options.split_output = true;
+                options.split_size = strcmp(optarg, "contig") == 0 ? 0 : strtoull(optarg, nullptr, 10);
+                break;
+
+            case OPT_SPILL_CODEC:
+                options.spill_codec = optarg;
+                break;
+
+            case OPT_SPILL_MEMORY:
+                options.spill_memory = strtoull(optarg, nullptr, 10);
+                break;
+
+            case OPT_UNGROUPED:
+                options.ungrouped_input = true;
+                break;
+
+            case OPT_MATE_MEMORY:
+                options.mate_memory = strtoull(optarg, nullptr, 10);
+                break;
+
+            case OPT_PIN_THREADS:
+                options.pin_threads = true;
+                break;
+
+            case OPT_METRICS:
+                options.metrics_file = strdup(optarg);
+                break;
+
+            case OPT_CHECKPOINT:
+                options.checkpoint_dir = strdup(optarg);
+                break;
+
+            case OPT_RESUME:
+                options.resume = true;
+                break;
+
+            case OPT_SHARDS:
+                options.num_shards = atoi(optarg);
+                break;
+
+            case OPT_SHARD:
+                if(!Shard::parse(optarg, options.shard_index, options.num_shards)){
+                    std::cerr << "--shard takes i/N with 0 <= i < N: " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case OPT_SHARD_DIR:
+                options.shard_dir = strdup(optarg);
+                break;
+
+            case OPT_MERGE_SHARDS:
+                options.merge_shards = true;
+                options.num_shards = atoi(optarg);
+                break;
+
+            case OPT_SHARD_TIMEOUT:
+                options.shard_timeout = atoi(optarg);
+                break;
+
+            case OPT_QC:
+                options.qc_prefix = strdup(optarg);
+                break;
+
+            case OPT_QC_TARGETS:
+                options.qc_targets_file = strdup(optarg);
+                break;
+
+            case OPT_BQSR_TABLE:
+                options.bqsr_table = strdup(optarg);
+                break;
+
+            case OPT_REFERENCE:
+                options.reference_file = strdup(optarg);
+                break;
+
+            case OPT_KNOWN_SITES:
+                options.known_sites_file = strdup(optarg);
+                break;
+
+            case OPT_HUGE_PAGES:
+                options.huge_pages = optarg;
+                break;
+
+            case 'h':
+                usage();
+                return 0;
                 
             default:
                 break;
         }
     }
-    assert(output_file != nullptr);
+    // 检查输入参数妥当
+    if(library_header != nullptr && (options.input_file != nullptr || options.mode == RunMode::Stream
+        || options.num_shards > 0 || options.merge_shards || options.resume)){
+        std::cerr << "the records come from the aligner, -I, the stream mode, the shards and --resume are not available"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    if(options.num_shards > 0){
+        if(options.shard_dir == nullptr){
+            std::cerr << "--shards needs the --shard-dir shared by the workers" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if(!options.merge_shards && (options.input_file == nullptr || !options.need_sort() || options.split_output
+            || options.ungrouped_input || options.regions_file != nullptr || options.checkpoint_dir != nullptr)){
+            std::cerr << "the shards read the -I file, sort, and can't be combined with "
+                      << "--split, --ungrouped, --regions or --checkpoint" << std::endl;
+            return EXIT_FAILURE;
+        }
+        fs::create_directories(options.shard_dir);
+        if(options.shard_worker()){
+            // a worker writes its part of the output into the shard directory
+            free(options.output_file);
+            options.output_file = strdup(Shard::bam_file(options.shard_dir, options.shard_index).c_str());
+            Shard::clear(options.shard_dir, options.shard_index);
+            if(options.metrics_file != nullptr){
+                std::string name = std::string(options.metrics_file) + "." + std::to_string(options.shard_index);
+                free(options.metrics_file);
+                options.metrics_file = strdup(name.c_str());
+            }
+            if(options.qc_prefix != nullptr){
+                std::string name = std::string(options.qc_prefix) + "." + std::to_string(options.shard_index);
+                free(options.qc_prefix);
+                options.qc_prefix = strdup(name.c_str());
+            }
+            if(options.bqsr_table != nullptr){
+                std::string name = std::string(options.bqsr_table) + "." + std::to_string(options.shard_index);
+                free(options.bqsr_table);
+                options.bqsr_table = strdup(name.c_str());
+            }
+        }
+    }
+    assert(options.output_file != nullptr);
+    if(options.bqsr_table != nullptr && options.reference_file == nullptr){
+        std::cerr << "--bqsr-table needs the --reference FASTA" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if(options.checkpoint_dir != nullptr && !options.need_sort()){
+        std::cerr << "--checkpoint needs a mode sorting the records" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if(options.resume && options.checkpoint_dir == nullptr){
+        std::cerr << "--resume needs the --checkpoint directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if(options.split_output){
+        if(!options.need_sort()){
+            std::cerr << "--split needs the sorted output" << std::endl;
+            return EXIT_FAILURE;
+        }
+        fs::create_directories(options.output_file);
+    }else if(fs::exists(options.output_file)){
+        fs::remove(options.output_file);
+    }
+    if(!SpillCodec::set_policy(options.spill_codec)){
+        std::cerr << "unknown or unavailable spill codec: " << options.spill_codec << std::endl;
+        return EXIT_FAILURE;
+    }
+    if(!HugePages::set_policy(options.huge_pages)){
+        std::cerr << "unknown huge page policy: " << options.huge_pages << std::endl;
+        return EXIT_FAILURE;
+    }
+    if(options.umi){
+        BAMRecord::umi_tag = options.umi_tag;
+    }
+    return -1;
+}
+
+int run_sormadup(SormadupOptions &options, int argc, char * argv[])
+{
+    // every stage runs in the arena of the budget, one thread reads the input and the left parse it
+    ThreadBudget budget(options.num_threads, options.pin_threads);
+    options.num_threads = budget.size();
+    options.num_thread_shuffle = std::max(budget.size() - 1, 1);
+    std::cout << "threads: " << budget.size() << (options.pin_threads ? " pinned" : "") << std::endl;
+    Metrics::set("mode", run_mode_name(options.mode));
+    Metrics::set("input", options.input_file ? options.input_file : library_header ? "aligner" : "-");
+    Metrics::set("threads", budget.size());
+
+    int ret;
+    if(options.merge_shards)
+    {
+        ret = Shard::merge(options.shard_dir, options.num_shards, options.output_file) ? 0 : EXIT_FAILURE;
+        time_stamp("shards merged");
+    }else if(options.num_shards > 0 && !options.shard_worker())
+    {
+        ret = run_shards(options, argc, argv);
+    }else if(options.mode == RunMode::Stream)
+    {
+        ret = budget.execute([&options](){return stream_markdup(options);});
+    }else{
+        ret = budget.execute([&options](){return sort_markdup(options);});
+    }
+    if(options.metrics_file != nullptr && !Metrics::write_json(options.metrics_file)){
+        std::cerr << "can't write the metrics to " << options.metrics_file << std::endl;
+    }
+    return ret;
+}
+
+// sort and/or mark duplicates of name-grouped SAM, every mode but stream
+int sort_markdup(const SormadupOptions &options)
+{
+    char * input_file = options.input_file;
+    char * output_file = options.output_file;
+    int num_thread_shuffle = options.num_thread_shuffle;
+    // the UMIs of the pairs are kept beside them, the pairs don't grow without --umi
+    if(options.umi){
+        PairUmis::enable();
+    }
        
-    // read the header
+    // read the header. a resumed run takes it and the partitions from the checkpoint, the input is not read
     sam_hdr_t * header = nullptr;
     htsFile * fp = nullptr;
-    if(input_file != nullptr)
+    std::unique_ptr<Checkpoint> checkpoint;
+    if(options.resume)
+    {
+        checkpoint.reset(new Checkpoint);
+        if(!checkpoint->load(options.checkpoint_dir, options))
+        {
+            return EXIT_FAILURE;
+        }
+        header = checkpoint->header;
+        pairIDSource = checkpoint->num_pairIDs;
+    }
+    else if(library_header != nullptr)
+    {
+        header = library_header;
+    }
+    else if(input_file != nullptr)
     {
         fp = sam_open(input_file, "r");
         assert(strcmp("sam", hts_format_file_extension(hts_get_format(fp))) == 0);// 强制检查文件格式为 sam
@@ -92,292 +512,487 @@ int main(int argc, char* argv[]){
    
     BamParser::header = header;
 
-    {
-        // construct kTable
-        uint64_t accumulate = 0;
-        for(int i = 0; i < header->n_targets; i++){
-            BAMRecord::kTable.push_back(accumulate);
-            accumulate += header->target_len[i];
-        }
-        BAMRecord::kTable.push_back(accumulate);
-    }
+    construct_kTable(header);
 
     // global variable
     const int num_partitions = 100;
     uint64_t max_elems_per_partition = 1024*1024*1024;
     uint64_t reference_length = BAMRecord::kTable.back();
+    // a worker of a sharded run keeps the records and the pairs of its range
+    std::unique_ptr<Shard> shard;
+    if(options.shard_worker()){
+        uint64_t run = Shard::fingerprint(options.input_file, sam_hdr_str(header), Checkpoint::shape(options),
+                                          options.num_shards);
+        shard.reset(new Shard(options.shard_dir, options.shard_index, options.num_shards, reference_length, run));
+        std::cout << "shard " << shard->index() << " of " << shard->count() << std::endl;
+    }
 
-    
-    // partitioners
-    BAMPartitioner bam_partitioner(reference_length, num_partitions, max_elems_per_partition);
-    RangePartitioner<SinglePair> single_partitioner(reference_length, num_partitions, max_elems_per_partition);
-    RangePartitioner<DoublePair> double_partitioner(reference_length, num_partitions, max_elems_per_partition);
-    bitmap double_pair_indicator(2*reference_length); // 辅助根据 double pair 的信息去重 single pair
-    time_stamp("program start");
-
-    read_finished = false;
-    std::thread read_thread(read_alignment, fp, header);
+    // the partitions after the shuffle are spread over the NUMA nodes
+    NumaPlacement numa(options.num_threads);
+    if(numa.num_nodes() > 1){
+        std::cout << numa.num_nodes() << " NUMA nodes" << std::endl;
+    }
 
-    size_t total_num = 0;
-    std::mutex num_lock;
+    std::unique_ptr<RegionIndex> regions;
+    if(options.regions_file != nullptr){
+        regions.reset(new RegionIndex);
+        if(!regions->load(options.regions_file, header)){
+            std::cerr << "can't load the regions: " << options.regions_file << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << regions->size() << " target regions, " << regions->targeted_length() << " bases" << std::endl;
+    }
+    std::unique_ptr<RegionIndex> qc_targets;
+    std::unique_ptr<QcStats> qc = make_qc(options, header, regions.get(), qc_targets);
+    if(options.qc_prefix != nullptr && !qc){
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<BaseRecalibrator> bqsr = make_bqsr(options, header);
+    if(options.bqsr_table != nullptr && !bqsr){
+        return EXIT_FAILURE;
+    }
     
+    // the groups of the split output, the sort partitions are aligned to their bounds
+    std::vector<OutputGroup> output_groups;
+    if(options.split_output){
+        output_groups = make_output_groups(header, options.split_size,
+            options.split_size > 0 ? options.split_size : reference_length / num_partitions);
+        std::cout << output_groups.size() << " output groups" << std::endl;
+    }
+
+    // partitioners, only the ones needed by the mode are constructed.
+    // with target regions the duplicate partitions are split by the targeted bases instead of the whole reference
+    std::unique_ptr<BAMPartitioner> bam_partitioner;
+    std::unique_ptr<OrderedRecordStore> record_store;
+    // the pages of all the sort partitions share one pool, one more frame than the threads adding records
+    std::unique_ptr<SpillPagePool> page_pool;
+    const std::string spill_dir = options.checkpoint_dir ? Checkpoint::spill_dir(options.checkpoint_dir) : shard ? shard->spill_dir() : "temp";
+    if(options.need_sort() && !checkpoint){
+        size_t num_frames = std::max(options.spill_memory * 1024 * 1024 / BAM_BUFFER_SIZE, (size_t)num_thread_shuffle + 2);
+        page_pool.reset(new SpillPagePool(num_frames, BAM_BUFFER_SIZE));
+        BAMRecordBuffer::page_pool = page_pool.get();
+    }
+    if(checkpoint){
+        bam_partitioner = std::move(checkpoint->bam_partitioner);
+    }else if(shard){
+        bam_partitioner.reset(new BAMPartitioner(shard->partition_bounds(num_partitions), max_elems_per_partition, spill_dir));
+    }else if(options.need_sort() && !(regions && options.drop_off_target) && !options.split_output){
+        bam_partitioner.reset(new BAMPartitioner(reference_length, num_partitions, max_elems_per_partition, spill_dir));
+    }else if(options.need_sort()){
+        std::vector<uint64_t> bounds;
+        if(regions && options.drop_off_target){
+            bounds = regions->partition_bounds(num_partitions);
+        }else{
+            uint64_t range_size = (reference_length + num_partitions - 1) / num_partitions;
+            for(int i = 0; i < num_partitions; i++){
+                bounds.push_back(i * range_size);
+            }
+            bounds.push_back(reference_length + 1);
+        }
+        std::vector<uint64_t> group_bounds;
+        for(auto &group : output_groups){
+            group_bounds.push_back(group.start);
+        }
+        bam_partitioner.reset(new BAMPartitioner(merge_bounds(bounds, group_bounds), max_elems_per_partition, spill_dir));
+    }else{
+        record_store.reset(new OrderedRecordStore);
+    }
+    std::unique_ptr<RangePartitioner<SinglePair>> single_partitioner;
+    std::unique_ptr<RangePartitioner<DoublePair>> double_partitioner;
+    std::unique_ptr<bitmap> double_pair_indicator; // 辅助根据 double pair 的信息去重 single pair
+    if(options.need_markdup()){
+        if(regions || shard){
+            auto bounds = shard ? shard->partition_bounds(num_partitions) : regions->partition_bounds(num_partitions);
+            single_partitioner.reset(new RangePartitioner<SinglePair>(bounds, max_elems_per_partition));
+            double_partitioner.reset(new RangePartitioner<DoublePair>(bounds, max_elems_per_partition));
+        }else{
+            single_partitioner.reset(new RangePartitioner<SinglePair>(reference_length, num_partitions, max_elems_per_partition));
+            double_partitioner.reset(new RangePartitioner<DoublePair>(reference_length, num_partitions, max_elems_per_partition));
+        }
+        // a slice per strand, each node owns the positions of its duplicate partitions
+        double_pair_indicator.reset(new bitmap(2*reference_length, false));
+        numa.place(*double_pair_indicator, 2, false);
+    }
+    // the mates of ungrouped input are not adjacent, they meet in the matcher
+    std::unique_ptr<MateMatcher> mate_matcher;
+    if(options.need_markdup() && options.ungrouped_input && !checkpoint){
+        // beside the sort partitions, so the runs spilling elsewhere don't share the files
+        mate_matcher.reset(new MateMatcher(options.mate_memory * 1024 * 1024, spill_dir + "/mates"));
+    }
+    const int num_bam_partitions = bam_partitioner ? bam_partitioner->getNumPartitions() : 0;
+    std::atomic_uint64_t off_target_num(0);
+    time_stamp("program start");
 
     // cache for SinglePair and DoublePair 
     SinglePairCache * singlePairCache = new SinglePairCache[num_thread_shuffle];
     DoublePairCache * doublePairCache = new DoublePairCache[num_thread_shuffle];
 
-    tbb::parallel_for(0, num_thread_shuffle,
-                          [&bam_partitioner, &single_partitioner, &double_partitioner, reference_length, &header,
-                          &double_pair_indicator, &singlePairCache, &doublePairCache, &total_num, &num_lock]
-                          (int i){
-                            auto bbuffer = bam_partitioner.initBuffer();
-                            auto sbuffer = single_partitioner.initBuffer();
-                            auto dbuffer = double_partitioner.initBuffer();
-
-                            uint64_t pairID_base = pairIDSource.fetch_add(pairIDASC);
-                            uint32_t cnt_pairID = 0;
-
-                            std::vector<kstring_t> * items = nullptr;
-                            BamParser bam_parser;
-                            size_t read_num = 0;
-                            while(true)
-                            {  
-                                // if all the reads are processed, then break the loop
-                                if(read_finished && LineQueue.size_approx() == 0)
-                                {
-                                    break;
+    // mark the 5' positions of the ends of a double pair in double_pair_indicator
+    auto mark_double_ends = [&double_pair_indicator, reference_length](const DoublePair * pair){
+                            // set double_pair_indicator
+                            if(pair->get_orientation() == Orientation::FF
+                            || pair->get_orientation() == Orientation::RF){
+                                double_pair_indicator->set(pair->get_record2_prime5_pos());
+                            }else{
+                                double_pair_indicator->set(pair->get_record2_prime5_pos() + reference_length);
+                            }
+                            if(pair->get_orientation() == Orientation::FF
+                            || pair->get_orientation() == Orientation::FR){
+                                double_pair_indicator->set(pair->get_record1_prime5_pos());
+                            }else{
+                                double_pair_indicator->set(pair->get_record1_prime5_pos() + reference_length);
+                            }
+                          };
+    // add a double pair and mark the 5' positions of its ends
+    auto add_double_pair = [&double_partitioner, &mark_double_ends]
+                          (std::vector<RangePartitioner<DoublePair>::tBuffer> * dbuffer, DoublePair * pair){
+                            double_partitioner->addElem(dbuffer, pair);
+                            mark_double_ends(pair);
+                          };
+
+    // a new run discards the checkpoint of an earlier one before spilling over it
+    if(options.checkpoint_dir != nullptr && !checkpoint){
+        Checkpoint::discard(options.checkpoint_dir);
+    }
+    // the pairs decided by this shard with records in other shards, their duplicates are shared
+    std::vector<uint64_t> shared_pairs;
+    if(!checkpoint){
+        // the aligner linked in pushes the records itself
+        std::thread read_thread;
+        if(library_header == nullptr){
+            read_finished = false;
+            read_thread = std::thread(read_alignment, fp, header);
+        }
+
+        size_t total_num = 0;
+        std::mutex num_lock;
+    
+
+        tbb::parallel_for(0, num_thread_shuffle,
+                              [&bam_partitioner, &record_store, &single_partitioner, &double_partitioner, &header,
+                              &singlePairCache, &doublePairCache, &total_num, &num_lock,
+                              &regions, &options, &off_target_num, &mate_matcher, &add_double_pair,
+                              &shard, &shared_pairs, &mark_double_ends]
+                              (int i){
+                                std::vector<BAMPartitioner::tBuffer> * bbuffer = nullptr;
+                                std::vector<RangePartitioner<SinglePair>::tBuffer> * sbuffer = nullptr;
+                                std::vector<RangePartitioner<DoublePair>::tBuffer> * dbuffer = nullptr;
+                                if(bam_partitioner){
+                                    bbuffer = bam_partitioner->initBuffer();
+                                }
+                                if(double_partitioner){
+                                    sbuffer = single_partitioner->initBuffer();
+                                    dbuffer = double_partitioner->initBuffer();
                                 }
+                                // records of the current batch, kept in the input order when not sorting
+                                std::vector<BAMRecord *> ordered;
+                                auto emit = [&bam_partitioner, &bbuffer, &ordered, &shard](BAMRecord * record){
+                                    if(shard && !shard->owns(record->partition_key())){
+                                        // written by another shard
+                                        delete record;
+                                    }else if(bam_partitioner){
+                                        bam_partitioner->addElem(record, bbuffer);
+                                    }else{
+                                        ordered.push_back(record);
+                                    }
+                                };
+
+                                uint64_t pairID_base = pairIDSource.fetch_add(pairIDASC);
+                                uint32_t cnt_pairID = 0;
+
+                                // a sharded pair is decided by the shard of its key. the records of the pairs
+                                // decided here falling in other shards, secondary and supplementary ones following
+                                // their primary, are shared
+                                std::vector<uint64_t> shared;
+                                int decider = -1;
+                                auto decide = [&shard, &shared, &decider](uint64_t key, BAMRecord * record1, BAMRecord * record2){
+                                    decider = shard->owner(key);
+                                    if(decider == shard->index() && (!shard->owns(record1->partition_key())
+                                        || (record2 != nullptr && !shard->owns(record2->partition_key())))){
+                                        shared.push_back(record1->get_pairID());
+                                    }
+                                };
+                                auto follow = [&shard, &shared, &decider](BAMRecord * record){
+                                    if(record->get_pairID() != 0 && decider == shard->index() && !shard->owns(record->partition_key())){
+                                        shared.push_back(record->get_pairID());
+                                    }
+                                };
 
-                                LineQueue.try_dequeue(items);
-                                if(items)
+                                LineBatch items = {0, nullptr, 0, nullptr};
+                                BamParser bam_parser;
+                                size_t read_num = 0;
+                                while(true)
                                 {
-                                    read_num += items->size();
-                                    bam_parser.add_line(items);
-                                    while(bam_parser.has_record())
+                                    // if all the reads are processed, then break the loop
+                                    if(read_finished && LineQueue.size_approx() == 0)
                                     {
-                                        uint64_t pairID;
-                                        if(cnt_pairID == pairIDASC){
-                                            cnt_pairID = 0;
-                                            pairID_base = pairIDSource.fetch_add(pairIDASC);
-                                        }
-                                        pairID = pairID_base + cnt_pairID;
-                                        cnt_pairID++;
-
-                                        BAMRecord * record1 = bam_parser.pop_record(pairID).release();
-                                        BAMRecord * record2 = bam_parser.pop_record(pairID, record1).release();
-                                        if(record2 == nullptr){
-                                            //ignorable 的 single pair 没有被进行找重的必要
-                                            if(record1->ignorable() == false){
-                                                auto pair = new (singlePairCache[i].getSpace()) SinglePair(record1);
-                                                single_partitioner.addElem(sbuffer, pair);
+                                        break;
+                                    }
+
+                                    LineQueue.try_dequeue(items);
+                                    if(items.lines || items.records)
+                                    {
+                                        uint64_t num_records = 0, num_bytes = 0;
+                                        if(items.lines){
+                                            num_records = items.lines->size();
+                                            for(auto &line : *items.lines){
+                                                num_bytes += line.l;
                                             }
-                                            bam_partitioner.addElem(record1, bbuffer);
-                                        }else{   
-                                            auto pair = new (doublePairCache[i].getSpace()) DoublePair(record1, record2);
-                                            double_partitioner.addElem(dbuffer, pair);  
-                                            bam_partitioner.addElem( record1, bbuffer);
-                                            bam_partitioner.addElem(record2, bbuffer);
-                                            // set double_pair_indicator
-                                            if(pair->get_orientation() == Orientation::FF
-                                            || pair->get_orientation() == Orientation::RF){
-                                                double_pair_indicator.set(pair->get_record2_prime5_pos());
-                                            }else{
-                                                double_pair_indicator.set(pair->get_record2_prime5_pos() + reference_length);
+                                            bam_parser.add_line(items.lines);
+                                        }else{
+                                            num_records = items.records->size();
+                                            for(auto b : *items.records){
+                                                num_bytes += b->l_data;
                                             }
-                                            if(pair->get_orientation() == Orientation::FF
-                                            || pair->get_orientation() == Orientation::FR){
-                                                double_pair_indicator.set(pair->get_record1_prime5_pos());
+                                            bam_parser.add_records(items.records);
+                                        }
+                                        read_num += num_records;
+                                        Metrics::add(Counter::ParsedRecords, num_records);
+                                        Metrics::add(Counter::ParsedBytes, num_bytes);
+                                        uint64_t batch_pairs = 0;
+                                        while(bam_parser.has_record())
+                                        {
+                                            uint64_t pairID;
+                                            if(shard){
+                                                // the same in every worker: a pair pops at least one line of its batch
+                                                pairID = items.first_line + 1 + batch_pairs++;
                                             }else{
-                                                double_pair_indicator.set(pair->get_record1_prime5_pos() + reference_length);
+                                                if(cnt_pairID == pairIDASC){
+                                                    cnt_pairID = 0;
+                                                    pairID_base = pairIDSource.fetch_add(pairIDASC);
+                                                }
+                                                pairID = pairID_base + cnt_pairID;
+                                                cnt_pairID++;
+                                            }
+
+                                            BAMRecord * record1 = bam_parser.pop_record(pairID).release();
+                                            BAMRecord * record2 = mate_matcher ? nullptr : bam_parser.pop_record(pairID, record1).release();
+                                            bool on_target = !regions || regions->overlap(record1)
+                                                || (record2 != nullptr && regions->overlap(record2));
+                                            if(!on_target){
+                                                off_target_num += record2 == nullptr ? 1 : 2;
+                                            }
+                                            if(!on_target && options.drop_off_target){
+                                                delete record1;
+                                                delete record2;
+                                            }else if(!double_partitioner || !on_target){
+                                                // sort only or off target, the pairs are not needed
+                                                emit(record1);
+                                                if(record2 != nullptr){
+                                                    emit(record2);
+                                                }
+                                            }else if(mate_matcher && MateMatcher::need_mate(record1)){
+                                                // the mate may have come before, otherwise record1 waits for it
+                                                auto mate = mate_matcher->match(record1);
+                                                if(mate){
+                                                    add_double_pair(dbuffer, new (doublePairCache[i].getSpace()) DoublePair(*mate, SinglePair(record1)));
+                                                }
+                                                emit(record1);
+                                            }else if(record2 == nullptr){
+                                                //ignorable 的 single pair 没有被进行找重的必要
+                                                if(record1->ignorable() == false){
+                                                    if(!shard || shard->owns(record1->prime5_pos())){
+                                                        auto pair = new (singlePairCache[i].getSpace()) SinglePair(record1);
+                                                        single_partitioner->addElem(sbuffer, pair);
+                                                    }
+                                                    if(shard){
+                                                        decide(record1->prime5_pos(), record1, nullptr);
+                                                    }
+                                                }else if(shard){
+                                                    follow(record1);
+                                                }
+                                                emit(record1);
+                                            }else if(shard){
+                                                // every shard marks the ends, the single pairs of its range may be on them
+                                                DoublePair pair(record1, record2);
+                                                mark_double_ends(&pair);
+                                                if(shard->owns(pair.partition_key())){
+                                                    double_partitioner->addElem(dbuffer, new (doublePairCache[i].getSpace()) DoublePair(pair));
+                                                }
+                                                decide(pair.partition_key(), record1, record2);
+                                                emit(record1);
+                                                emit(record2);
+                                            }else{   
+                                                add_double_pair(dbuffer, new (doublePairCache[i].getSpace()) DoublePair(record1, record2));
+                                                emit(record1);
+                                                emit(record2);
                                             }
                                         }
-                                    }
+                                        if(record_store){
+                                            record_store->put(items.id, ordered);
+                                        }
                                     
-                                } else {
-                                    // give up CPU if there are no task left
-                                    //std::this_thread::yield();
-                                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
-                                }
+                                    } else {
+                                        // give up CPU if there are no task left
+                                        //std::this_thread::yield();
+                                        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                                    }
                                 
-                                items = nullptr;
+                                    items.lines = nullptr;
+                                    items.records = nullptr;
                             
-                            }
-                    
-                            single_partitioner.destroyBuffer(sbuffer);
-                            double_partitioner.destroyBuffer(dbuffer);
-                            bam_partitioner.destroyBuffer(bbuffer);
-                            num_lock.lock();
-                            total_num += read_num;
-                            num_lock.unlock();
-                          });
-    //std::cout << total_num << " reads parsed" << std::endl;
-    read_thread.join();
-    // close the file
-    if(input_file)
-    {
-        sam_close(fp);
-        free(input_file);
-    }
-        
-
-    // flush all the data in the buffer to the file
-    tbb::parallel_for(0, num_partitions, [&bam_partitioner](int i){
-        BAMRecordBuffer * bam_buffer = bam_partitioner.getBAMRecordBuffer(i);
-        bam_buffer->flushData();
-    });
-
-    time_stamp("shuffle done");
+                                }
 
-    std::cout << "bam record count: " << BAMRecord::count_bam_record
-        << "\t" << "memory size: " << double(BAMRecord::count_bam_record) * sizeof(BAMRecord) * 2 / 1024 / 1024
-        << "MB" << std::endl;
-    
-    bitmap duplicate_index(pairIDSource); // 存储找重的结果
-    // sort double pair
-    {
-        auto rdds = double_partitioner.getResult();
+                                if(double_partitioner){
+                                    single_partitioner->destroyBuffer(sbuffer);
+                                    double_partitioner->destroyBuffer(dbuffer);
+                                }
+                                if(bam_partitioner){
+                                    bam_partitioner->destroyBuffer(bbuffer);
+                                }
+                                num_lock.lock();
+                                total_num += read_num;
+                                shared_pairs.insert(shared_pairs.end(), shared.begin(), shared.end());
+                                num_lock.unlock();
+                              });
+        //std::cout << total_num << " reads parsed" << std::endl;
+        if(read_thread.joinable()){
+            read_thread.join();
+        }
+        if(shard){
+            // the pairIDs are the input lines
+            pairIDSource = total_num + 1;
+            std::sort(shared_pairs.begin(), shared_pairs.end());
+            shared_pairs.erase(std::unique(shared_pairs.begin(), shared_pairs.end()), shared_pairs.end());
+        }
+        // close the file
+        if(input_file)
         {
-            uint64_t size = 0;
-            uint64_t capacity = 0;
-            for(auto &rdd : rdds){
-                size += rdd.size();
-                capacity += rdd.capacity();
-            }
-            std::cout << "size: " << double(size) / 1024 /1024 * sizeof(int*) << "MB" << "\t"
-            << "capacity: " << double(capacity) / 1024 /1024 *sizeof(int*)<< "MB" << std::endl;
-        }
-        tbb::parallel_for(0, num_partitions,
-                          [&rdds](uint32_t i){
-            std::sort(rdds[i].begin(), rdds[i].end(),
-                      // 因为目前 range partition 存储的是 pointer；---- 临时的
-                      [](DoublePair* a, DoublePair* b){
-                // record1.prime5_pos, record2.prime5_pos, pair.orientation
-                if(a->compare_pos_orientation(*b) != 0){
-                    return a->compare_pos_orientation(*b) == -1;
-                }
-                // pair score, bigger as first
-                if(a->compare_score(*b) != 0){
-                    return a->compare_score(*b) == 1;
+            sam_close(fp);
+            free(input_file);
+        }
+
+                                    
+        // the mates left in the matcher, the pairs of the spilled buckets are found here
+        if(mate_matcher){
+            std::atomic_uint32_t next_bucket(0);
+            tbb::parallel_for(0, num_thread_shuffle, [&](int i){
+                auto sbuffer = single_partitioner->initBuffer();
+                auto dbuffer = double_partitioner->initBuffer();
+                uint32_t bucket;
+                while((bucket = next_bucket++) < mate_matcher->num_buckets()){
+                    mate_matcher->drain(bucket,
+                        [&](const SinglePair &end1, const SinglePair &end2){
+                            add_double_pair(dbuffer, new (doublePairCache[i].getSpace()) DoublePair(end1, end2));
+                        },
+                        [&](const SinglePair &end){
+                            single_partitioner->addElem(sbuffer, new (singlePairCache[i].getSpace()) SinglePair(end));
+                        });
                 }
-                // compare tile, x, y
-                return a->compare_tile_X_Y(*b) != 1;
+                single_partitioner->destroyBuffer(sbuffer);
+                double_partitioner->destroyBuffer(dbuffer);
             });
-        });
-        time_stamp("double pair sort done");
-        // search duplicate index among double pair
-        {
-            tbb::parallel_for(0, num_partitions,
-                              [&rdds, &duplicate_index](uint32_t ii){
-                auto &rdd = rdds[ii];
-                for(uint64_t i = 0; i < rdd.size(); ){
-                    uint64_t j;
-                    for(j= i+1; j < rdd.size()
-                    && rdd[i]->compare_pos_orientation(*(rdd[j])) == 0; j++){
-                        duplicate_index.set(rdd[j]->get_pairID());
-                    }
-                    i = j;
-                }
+            std::cout << mate_matcher->num_spilled() << " records spilled waiting for the mate, "
+                << mate_matcher->aliases().size() << " pairs matched from the spill" << std::endl;
+        }
+                                
+        // flush all the data in the buffer to the file
+        if(bam_partitioner){
+            tbb::parallel_for(0, num_bam_partitions, [&bam_partitioner](int i){
+                BAMRecordBuffer * bam_buffer = bam_partitioner->getBAMRecordBuffer(i);
+                bam_buffer->flushData();
             });
         }
-        delete[] doublePairCache;
-        time_stamp("double pair search duplicate index done");
+    }
+        
+    time_stamp(checkpoint ? "resumed from the checkpoint" : "shuffle done");
+    if(page_pool){
+        std::cout << SpillCodec::summary() << std::endl;
+        std::cout << "page pool: " << page_pool->numFrames() << " frames, " << page_pool->numEvicted()
+            << " pages evicted" << std::endl;
+        // every page is flushed, the memory goes back before the partitions are reloaded for the output
+        page_pool.reset();
+        BAMRecordBuffer::page_pool = nullptr;
     }
 
-    // sort single pair
-    {
-        auto rdds = single_partitioner.getResult();
-        {
-            uint64_t size = 0;
-            uint64_t capacity = 0;
-            for(auto &rdd : rdds){
-                size += rdd.size();
-                capacity += rdd.capacity();
-            }
-            std::cout << "size: " << double(size) / 1024 /1024 * sizeof(int*) << "MB" << "\t"
-            << "capacity: " << double(capacity) / 1024 /1024 * sizeof(int*) << "MB" << std::endl;
-        }
-        tbb::parallel_for(0, num_partitions,
-                          [&rdds](uint32_t i){
-            std::sort(rdds[i].begin(), rdds[i].end(),
-                      // 因为目前 range partition 存储 pointer --- 临时性的
-                      [](SinglePair* a, SinglePair* b){
-                // record.prime5_pos, pair.orientation
-                if(a->compare_pos_orientation(*b) != 0){
-                    return a->compare_pos_orientation(*b) == -1;
-                }
-                // pair score, bigger as first
-                if(a->compare_score(*b) != 0){
-                    return a->compare_score(*b) == 1;
-                }
-                // compare tile, x, y
-                return a->compare_tile_X_Y(*b) != 1;
-            });
-        });
-        time_stamp("single pair sort done");
-        // search duplicate index among single pair
-        {
-            tbb::parallel_for(0, num_partitions,
-                              [&rdds, &duplicate_index, &double_pair_indicator, reference_length](uint32_t ii){
-                auto &rdd = rdds[ii];
-                for(uint64_t i = 0; i < rdd.size(); ){
-                    if(rdd[i]->ignorable()){
-                        i++;
-                        continue;
-                    }
-                    auto target = rdd[i]->get_prime5_pos();
-                    if(rdd[i]->get_orientation() == Orientation::RR){
-                        target += reference_length;
-                    }
-                    if(double_pair_indicator.get(target)){
-                        duplicate_index.set(rdd[i]->get_pairID());
-                    }
-                    uint64_t j;
-                    for(j = i+1; j < rdd.size() && rdd[i]->compare_pos_orientation(*(rdd[j])) == 0; j++){
-                        duplicate_index.set(rdd[j]->get_pairID());
-                    }
-                    i = j;
+    std::cout << "bam record count: " << Metrics::total(Counter::BamRecords)
+        << "\t" << "memory size: " << double(Metrics::total(Counter::BamRecords)) * sizeof(BAMRecord) * 2 / 1024 / 1024
+        << "MB" << std::endl;
+    if(regions){
+        std::cout << off_target_num << " off-target records " << (options.drop_off_target ? "dropped" : "not marked")
+            << std::endl;
+    }
+    
+    std::unique_ptr<bitmap> duplicate_index; // 存储找重的结果
+    if(options.need_markdup()){
+        // the pairIDs are spread over all the partitions, interleave the pages
+        duplicate_index.reset(new bitmap(pairIDSource, false));
+        numa.place(*duplicate_index, 1, true);
+    }
+    const int umi_edits = options.umi_edits_or_off();
+    std::vector<RangePartitioner<DoublePair>::tRDD> double_rdds;
+    std::vector<RangePartitioner<SinglePair>::tRDD> single_rdds;
+    if(options.need_markdup()){
+        if(checkpoint){
+            double_rdds = std::move(checkpoint->double_rdds);
+            single_rdds = std::move(checkpoint->single_rdds);
+            // the bitmap of the double pair ends is rebuilt rather than kept
+            tbb::parallel_for((size_t)0, double_rdds.size(), [&double_rdds, &mark_double_ends](size_t p){
+                for(auto pair : double_rdds[p]){
+                    mark_double_ends(pair);
                 }
             });
+        }else{
+            double_rdds = double_partitioner->getResult();
+            single_rdds = single_partitioner->getResult();
         }
-        delete[] singlePairCache;
-        time_stamp("single pair search duplicate done");
+        report_rdd_size("double_pair", double_rdds);
+        report_rdd_size("single_pair", single_rdds);
+    }
+    std::vector<BAMPartitioner::tRDD> rdds;
+    if(bam_partitioner){
+        rdds = checkpoint ? std::move(checkpoint->rdds) : bam_partitioner->getResult();
+        report_rdd_size("bam", rdds);
+    }
+    // the second end of a pair matched from the spill kept its own pairID
+    Checkpoint::tAliases aliases;
+    if(mate_matcher){
+        aliases = mate_matcher->aliases();
+        mate_matcher.reset();
+        // without sort partitions nothing else was spilled, the directory goes if it is empty
+        if(!bam_partitioner){
+            std::error_code error;
+            fs::remove(spill_dir, error);
+        }
+    }else if(checkpoint){
+        aliases = std::move(checkpoint->aliases);
     }
 
+    if(options.checkpoint_dir != nullptr && !checkpoint){
+        if(Checkpoint::save(options.checkpoint_dir, options, header, pairIDSource, *bam_partitioner,
+                            rdds, double_rdds, single_rdds, aliases)){
+            time_stamp("checkpoint written");
+        }else{
+            std::cerr << "can't write the checkpoint to " << options.checkpoint_dir << ", going on without it" << std::endl;
+        }
+    }
 
-    // mark duplicate and output
-    auto rdds = bam_partitioner.getResult();
-
-    tbb::parallel_for(0, num_partitions,
-                      [&rdds](uint32_t i){
-                        std::stable_sort(rdds[i].begin(), rdds[i].end(),
-                                  [](std::pair<uint64_t, size_t> a, std::pair<uint64_t, size_t> b){
-                                    return a.first < b.first;
-                                  });
-                      });
-    time_stamp("bam record sort done");
-
-    int num_thread = std::thread::hardware_concurrency();
-    int num_block = num_partitions * num_thread;
+    // the partitions written by the default output, the split and the ordered outputs run after the graph
+    const bool partition_output = options.need_sort() && !options.split_output;
+    int num_thread = options.num_threads;
+    int num_block = num_bam_partitions * num_thread;
+    const bool remove_duplicate = options.remove_duplicate();
 
     // allocate space to store compressed data and indexes
-    void * output_data[num_block];
-    hts_idx_t * hts_idxes[num_block];
-
-    for(int i=0; i<num_partitions; i++){
+    std::vector<void *> output_data(partition_output ? num_block : 0);
+    std::vector<hts_idx_t *> hts_idxes(partition_output ? num_block : 0);
 
+    // mark duplicate and compress the i-th bam partition
+    auto output_partition = [&](int i){
         // load the data from the file
-        BAMRecordBuffer * bam_buffer = bam_partitioner.getBAMRecordBuffer(i);
+        BAMRecordBuffer * bam_buffer = bam_partitioner->getBAMRecordBuffer(i);
         auto BAMRecordData = bam_buffer->readData();
         assert(BAMRecordData != nullptr);
 
         auto &rdd = rdds[i];
 
-        tbb::parallel_for(0, num_thread, [&rdd, &duplicate_index, &num_thread, 
-                &BAMRecordData, &output_data, &hts_idxes, &header, &output_file, &i, &total_num](uint32_t j){
+        tbb::parallel_for(0, num_thread, [&rdd, &duplicate_index, &num_thread, remove_duplicate,
+                &BAMRecordData, &output_data, &hts_idxes, &header, &output_file, &qc, &bqsr, i](uint32_t j){
         // for(int j=0; j<num_thread; j++){
 
             size_t read_num = 0;
-            BAMRecord * record;
+            size_t num_duplicate = 0;
+            bam1_t record;
             uint32_t size = rdd.size() / num_thread;
             uint32_t start = j * size;
             uint32_t end = (j == (num_thread - 1)) ? rdd.size() : (j + 1) * size ;
@@ -396,17 +1011,28 @@ int main(int argc, char* argv[]){
             for(uint32_t k = start ; k < end; k++)
             {
                 auto &pair = rdd[k];
-                record = (BAMRecord *)(BAMRecordData + pair.second);
-                if(duplicate_index.get(record->get_pairID())){
-                    record->mardup();
+                SpillRecord::load(BAMRecordData + pair.second, &record);
+                if(duplicate_index && duplicate_index->get(record.id)){
+                    num_duplicate++;
+                    if(remove_duplicate){
+                        continue;
+                    }
+                    record.core.flag |= BAM_FDUP;
                 }
 
-                bam1_t * b = record->get_record();
-                b->data = (uint8_t *)record + BAMPartitioner::RecordSize;
-                assert(bam_write_idx2(fp, header, b, &output_data[i * num_thread + j], i * num_thread + j) >= 0);
+                assert(bam_write_idx2(fp, header, &record, &output_data[i * num_thread + j], i * num_thread + j) >= 0);
+                if(qc){
+                    qc->add(&record);
+                }
+                if(bqsr){
+                    bqsr->add(&record);
+                }
                 read_num ++;
             }
 
+            Metrics::add(Counter::OutputRecords, read_num);
+            Metrics::add(Counter::DuplicateRecords, num_duplicate);
+
             // close the file pointer for each thread
             hts_idxes[i * num_thread + j] = fp->idx;
             fp->idx = nullptr;
@@ -421,8 +1047,157 @@ int main(int argc, char* argv[]){
         });
 
         // free the space
-        free(BAMRecordData);
-        //std::cout << i << "th rdd traversal completed, size of rdd: " << rdd.size() << std::endl;
+        HugePages::release(BAMRecordData);
+    };
+
+    // the stages after the shuffle run as a graph of per-partition tasks rather than as phases,
+    // a slow partition holds back only the tasks depending on it:
+    //   double/single pair search of every duplicate partition -> duplicates_done --+
+    //   key sort of bam partition i ---------------------------------------------+--> output of bam partition i
+    //   output of bam partition i-1 ---------------------------------------------+
+    // a pair may fall in any duplicate partition, so each output waits for all the searches.
+    // the outputs are chained to keep one partition loaded at a time
+    typedef tbb::flow::continue_node<tbb::flow::continue_msg> tStage;
+    tbb::flow::graph graph;
+    tbb::flow::broadcast_node<tbb::flow::continue_msg> shuffle_done(graph);
+    std::vector<std::unique_ptr<tStage>> stages;
+    auto add_stage = [&graph, &stages](std::function<void()> body){
+        stages.emplace_back(new tStage(graph, [body](const tbb::flow::continue_msg &){body();}));
+        return stages.back().get();
+    };
+
+    tStage * duplicates_done = add_stage([&](){
+        delete[] doublePairCache;
+        delete[] singlePairCache;
+        double_rdds.clear();
+        single_rdds.clear();
+        double_pair_indicator.reset();
+        checkpoint.reset();
+        if(shard && duplicate_index){
+            // the decisions the other shards need go out, theirs come in before any output
+            std::vector<uint64_t> duplicates;
+            for(auto pairID : shared_pairs){
+                if(duplicate_index->get(pairID)){
+                    duplicates.push_back(pairID);
+                }
+            }
+            if(!shard->write_duplicates(duplicates) || !shard->read_duplicates(*duplicate_index, options.shard_timeout)){
+                std::cerr << "can't exchange the duplicates with the other shards" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::cout << duplicates.size() << " duplicate pairs shared with the other shards" << std::endl;
+            shared_pairs.clear();
+        }
+        for(auto &alias : aliases){
+            if(duplicate_index->get(alias.second)){
+                duplicate_index->set(alias.first);
+            }
+        }
+        aliases.clear();
+        time_stamp("search duplicate done");
+    });
+    if(options.need_markdup()){
+        for(size_t p = 0; p < double_rdds.size(); p++){
+            tStage * search = add_stage([&numa, &double_rdds, &duplicate_index, umi_edits, p](){
+                auto &rdd = double_rdds[p];
+                numa.execute(numa.node_of(p, double_rdds.size()), rdd.size() * (sizeof(DoublePair *) + sizeof(DoublePair)),
+                    [&numa, &rdd, &duplicate_index, umi_edits](){
+                    numa.localize(rdd);
+                    search_double_duplicate(rdd, *duplicate_index, umi_edits);
+                });
+            });
+            tbb::flow::make_edge(shuffle_done, *search);
+            tbb::flow::make_edge(*search, *duplicates_done);
+        }
+        for(size_t p = 0; p < single_rdds.size(); p++){
+            tStage * search = add_stage([&numa, &single_rdds, &double_pair_indicator, &duplicate_index, reference_length,
+                                         umi_edits, p](){
+                auto &rdd = single_rdds[p];
+                numa.execute(numa.node_of(p, single_rdds.size()), rdd.size() * (sizeof(SinglePair *) + sizeof(SinglePair)),
+                    [&numa, &rdd, &double_pair_indicator, &duplicate_index, reference_length, umi_edits](){
+                    numa.localize(rdd);
+                    search_single_duplicate(rdd, *double_pair_indicator, *duplicate_index, reference_length, umi_edits);
+                });
+            });
+            tbb::flow::make_edge(shuffle_done, *search);
+            tbb::flow::make_edge(*search, *duplicates_done);
+        }
+    }else{
+        tbb::flow::make_edge(shuffle_done, *duplicates_done);
+    }
+
+    if(num_bam_partitions > 0){
+        tStage * sort_done = add_stage([](){
+            time_stamp("bam record sort done");
+        });
+        tStage * previous_output = nullptr;
+        for(int i = 0; i < num_bam_partitions; i++){
+            tStage * sort = add_stage([&numa, &rdds, num_bam_partitions, i](){
+                auto &rdd = rdds[i];
+                numa.execute(numa.node_of(i, num_bam_partitions), rdd.size() * sizeof(rdd[0]), [&numa, &rdd](){
+                    numa.localize(rdd);
+                    std::stable_sort(rdd.begin(), rdd.end(),
+                              [](std::pair<uint64_t, size_t> a, std::pair<uint64_t, size_t> b){
+                                return a.first < b.first;
+                              });
+                });
+            });
+            tbb::flow::make_edge(shuffle_done, *sort);
+            tbb::flow::make_edge(*sort, *sort_done);
+            if(!partition_output){
+                continue;
+            }
+            tStage * output = add_stage([&numa, &bam_partitioner, &output_partition, num_bam_partitions, i](){
+                // the records are loaded, marked and compressed on the node of the partition
+                numa.execute(numa.node_of(i, num_bam_partitions), bam_partitioner->getBAMRecordBuffer(i)->size(), [&output_partition, i](){
+                    output_partition(i);
+                });
+            });
+            tbb::flow::make_edge(*sort, *output);
+            tbb::flow::make_edge(*duplicates_done, *output);
+            if(previous_output){
+                tbb::flow::make_edge(*previous_output, *output);
+            }
+            previous_output = output;
+        }
+    }
+    shuffle_done.try_put(tbb::flow::continue_msg());
+    graph.wait_for_all();
+    std::cout << numa.summary() << std::endl;
+    std::cout << HugePages::summary() << std::endl;
+
+    if(!options.need_sort())
+    {
+        // records keep the input order, no partition and no index
+        output_alignment_ordered(options, header, *record_store, duplicate_index.get(), options.num_threads, qc.get(),
+            bqsr.get());
+        free(output_file);
+        if(qc && !qc->write(header)){
+            std::cerr << "can't write the QC files " << options.qc_prefix << ".*" << std::endl;
+        }
+        if(bqsr && !bqsr->write(options.bqsr_table)){
+            std::cerr << "can't write the recalibration table " << options.bqsr_table << std::endl;
+        }
+        time_stamp("output done");
+        return 0;
+    }
+
+    if(options.split_output)
+    {
+        output_alignment_split(options, header, rdds, *bam_partitioner, output_groups, duplicate_index.get(), num_thread,
+            qc.get(), bqsr.get());
+        free(output_file);
+        if(qc && !qc->write(header)){
+            std::cerr << "can't write the QC files " << options.qc_prefix << ".*" << std::endl;
+        }
+        if(bqsr && !bqsr->write(options.bqsr_table)){
+            std::cerr << "can't write the recalibration table " << options.bqsr_table << std::endl;
+        }
+        if(options.checkpoint_dir != nullptr){
+            Checkpoint::discard(options.checkpoint_dir);
+        }
+        time_stamp("output done");
+        return 0;
     }
     //std::cout << total_num << " reads written\n";
     time_stamp("mark duplicate and compress data done");
@@ -432,8 +1207,9 @@ int main(int argc, char* argv[]){
     char *fn_out_idx = auto_index(output_fp, output_file, header);
     // output the header
     assert(hflush(output_fp->fp.bgzf->fp) == 0);
+    const uint64_t data_offset = output_fp->fp.bgzf->block_address;
 
-    merge_index(hts_idxes, num_block, output_data, output_fp->fp.bgzf->block_address);
+    merge_index(hts_idxes.data(), num_block, output_data.data(), output_fp->fp.bgzf->block_address);
     hts_idx_finish3(hts_idxes[0]);
 
     // output the compressed data
@@ -461,11 +1237,506 @@ int main(int argc, char* argv[]){
         free(fn_out_idx);
     sam_close(output_fp);
     free(output_file);
+    if(qc && !qc->write(header)){
+        std::cerr << "can't write the QC files " << options.qc_prefix << ".*" << std::endl;
+    }
+    if(bqsr && !bqsr->write(options.bqsr_table)){
+        std::cerr << "can't write the recalibration table " << options.bqsr_table << std::endl;
+    }
+    if(shard && !shard->write_done(data_offset)){
+        std::cerr << "can't mark the shard done in " << options.shard_dir << std::endl;
+        return EXIT_FAILURE;
+    }
+    // the output is complete, the run can't be resumed any more
+    if(options.checkpoint_dir != nullptr){
+        Checkpoint::discard(options.checkpoint_dir);
+    }
 
     time_stamp("output done");
 
     return 0;
 }
+// split the positional duplicate set rdd[i, j) by UMI, all the pairs but the best one of each UMI cluster are duplicates
+template<typename Pair>
+void search_umi_duplicate(const std::vector<Pair*>& rdd, uint64_t i, uint64_t j, int umi_edits, bitmap& duplicate_index)
+{
+    thread_local std::vector<uint64_t> umis;
+    thread_local std::vector<bool> duplicate;
+    umis.clear();
+    for(uint64_t k = i; k < j; k++){
+        umis.push_back(rdd[k]->get_umi());
+    }
+    umi_duplicates(umis, umi_edits, duplicate);
+    for(uint64_t k = i + 1; k < j; k++){
+        if(duplicate[k - i]){
+            duplicate_index.set(rdd[k]->get_pairID());
+        }
+    }
+}
+
+// the memory held by the pointers of the partitions
+template<typename tRDD>
+void report_rdd_size(const std::string &name, const std::vector<tRDD>& rdds)
+{
+    uint64_t size = 0;
+    uint64_t capacity = 0;
+    std::vector<uint64_t> sizes;
+    for(auto &rdd : rdds){
+        size += rdd.size();
+        capacity += rdd.capacity();
+        sizes.push_back(rdd.size());
+    }
+    Metrics::distribution(name, sizes);
+    std::cout << "size: " << double(size) / 1024 /1024 * sizeof(int*) << "MB" << "\t"
+    << "capacity: " << double(capacity) / 1024 /1024 * sizeof(int*) << "MB" << std::endl;
+}
+
+// sort the double pairs of a partition and set the pairID of the duplicates in duplicate_index.
+// umi_edits is -1 if the UMI is not used
+void search_double_duplicate(RangePartitioner<DoublePair>::tRDD& rdd, bitmap& duplicate_index, int umi_edits)
+{
+    // sort double pair
+    std::sort(rdd.begin(), rdd.end(),
+              // 因为目前 range partition 存储的是 pointer；---- 临时的
+              [](DoublePair* a, DoublePair* b){
+        // record1.prime5_pos, record2.prime5_pos, pair.orientation
+        if(a->compare_pos_orientation(*b) != 0){
+            return a->compare_pos_orientation(*b) == -1;
+        }
+        // pair score, bigger as first
+        if(a->compare_score(*b) != 0){
+            return a->compare_score(*b) == 1;
+        }
+        // compare tile, x, y
+        return a->compare_tile_X_Y(*b) != 1;
+    });
+    // search duplicate index among double pair
+    for(uint64_t i = 0; i < rdd.size(); ){
+        uint64_t j;
+        for(j= i+1; j < rdd.size()
+        && rdd[i]->compare_pos_orientation(*(rdd[j])) == 0; j++){
+            if(umi_edits < 0){
+                duplicate_index.set(rdd[j]->get_pairID());
+            }
+        }
+        if(umi_edits >= 0){
+            search_umi_duplicate(rdd, i, j, umi_edits, duplicate_index);
+        }
+        i = j;
+    }
+}
+
+// sort the single pairs of a partition, a single pair is also a duplicate if a double pair shares its position.
+// the double pair indicator carries no UMI, so it is not used when the UMI is
+void search_single_duplicate(RangePartitioner<SinglePair>::tRDD& rdd, bitmap& double_pair_indicator,
+    bitmap& duplicate_index, uint64_t reference_length, int umi_edits)
+{
+    // sort single pair
+    std::sort(rdd.begin(), rdd.end(),
+              // 因为目前 range partition 存储 pointer --- 临时性的
+              [](SinglePair* a, SinglePair* b){
+        // record.prime5_pos, pair.orientation
+        if(a->compare_pos_orientation(*b) != 0){
+            return a->compare_pos_orientation(*b) == -1;
+        }
+        // pair score, bigger as first
+        if(a->compare_score(*b) != 0){
+            return a->compare_score(*b) == 1;
+        }
+        // compare tile, x, y
+        return a->compare_tile_X_Y(*b) != 1;
+    });
+    // search duplicate index among single pair
+    for(uint64_t i = 0; i < rdd.size(); ){
+        if(rdd[i]->ignorable()){
+            i++;
+            continue;
+        }
+        auto target = rdd[i]->get_prime5_pos();
+        if(rdd[i]->get_orientation() == Orientation::RR){
+            target += reference_length;
+        }
+        if(umi_edits < 0 && double_pair_indicator.get(target)){
+            duplicate_index.set(rdd[i]->get_pairID());
+        }
+        uint64_t j;
+        for(j = i+1; j < rdd.size() && rdd[i]->compare_pos_orientation(*(rdd[j])) == 0; j++){
+            if(umi_edits < 0){
+                duplicate_index.set(rdd[j]->get_pairID());
+            }
+        }
+        if(umi_edits >= 0){
+            search_umi_duplicate(rdd, i, j, umi_edits, duplicate_index);
+        }
+        i = j;
+    }
+}
+
+// the QC of the output if --qc is given, null otherwise or if its targets can't be loaded.
+// the depth is over --qc-targets, loaded into qc_targets, or over regions
+std::unique_ptr<QcStats> make_qc(const SormadupOptions &options, sam_hdr_t * header, const RegionIndex * regions,
+    std::unique_ptr<RegionIndex> &qc_targets)
+{
+    if(options.qc_prefix == nullptr){
+        return nullptr;
+    }
+    if(options.qc_targets_file != nullptr){
+        qc_targets.reset(new RegionIndex);
+        if(!qc_targets->load(options.qc_targets_file, header)){
+            std::cerr << "can't load the QC targets: " << options.qc_targets_file << std::endl;
+            return nullptr;
+        }
+        regions = qc_targets.get();
+    }
+    return std::unique_ptr<QcStats>(new QcStats(options.qc_prefix, regions));
+}
+
+// the recalibration tables of the output if --bqsr-table is given, null otherwise or if the reference
+// or the known sites can't be loaded
+std::unique_ptr<BaseRecalibrator> make_bqsr(const SormadupOptions &options, sam_hdr_t * header)
+{
+    if(options.bqsr_table == nullptr){
+        return nullptr;
+    }
+    std::unique_ptr<BaseRecalibrator> bqsr(new BaseRecalibrator);
+    if(!bqsr->load(options.reference_file, options.known_sites_file, header)){
+        return nullptr;
+    }
+    return bqsr;
+}
+
+// combine RNAME and POS to unified coordinate
+void construct_kTable(const sam_hdr_t * header)
+{
+    uint64_t accumulate = 0;
+    for(int i = 0; i < header->n_targets; i++){
+        BAMRecord::kTable.push_back(accumulate);
+        accumulate += header->target_len[i];
+    }
+    BAMRecord::kTable.push_back(accumulate);
+}
+
+// launch the workers of every shard on this host, each with its share of the threads, then merge their output
+int run_shards(const SormadupOptions &options, int argc, char * argv[])
+{
+    const int num_shards = options.num_shards;
+    const std::string threads = std::to_string(std::max(options.num_threads / num_shards, 1));
+    for(int i = 0; i < num_shards; i++){
+        Shard::clear(options.shard_dir, i);
+    }
+    std::vector<pid_t> workers;
+    for(int i = 0; i < num_shards; i++){
+        // the options of the run, the last -t wins
+        const std::string shard = std::to_string(i) + "/" + std::to_string(num_shards);
+        std::vector<char *> args(argv, argv + argc);
+        args.push_back((char *)"--shard");
+        args.push_back((char *)shard.c_str());
+        args.push_back((char *)"-t");
+        args.push_back((char *)threads.c_str());
+        args.push_back(nullptr);
+        pid_t pid = fork();
+        if(pid == 0){
+            execv("/proc/self/exe", args.data());
+            perror("can't start the shard worker");
+            _exit(EXIT_FAILURE);
+        }
+        if(pid < 0){
+            perror("can't start the shard worker");
+            break;
+        }
+        workers.push_back(pid);
+    }
+
+    // a worker failing leaves the others waiting for its duplicates, they are stopped
+    bool failed = workers.size() < (size_t)num_shards;
+    for(size_t left = workers.size(); left > 0; left--){
+        int status = 0;
+        pid_t pid = wait(&status);
+        if(pid < 0){
+            break;
+        }
+        if(!failed && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)){
+            std::cerr << "a shard worker failed, stopping the others" << std::endl;
+            failed = true;
+            for(auto worker : workers){
+                kill(worker, SIGTERM);
+            }
+        }
+    }
+    time_stamp("shards done");
+    if(failed || !Shard::merge(options.shard_dir, num_shards, options.output_file)){
+        return EXIT_FAILURE;
+    }
+    time_stamp("shards merged");
+    return 0;
+}
+
+// mark duplicates of coordinate-sorted SAM/BAM in one pass, no partition and no spill
+int stream_markdup(const SormadupOptions &options)
+{
+    htsFile * fp = sam_open(options.input_file ? options.input_file : "-", "r");
+    if(fp == nullptr){
+        std::cerr << "can't open " << (options.input_file ? options.input_file : "stdin") << std::endl;
+        return EXIT_FAILURE;
+    }
+    sam_hdr_t * header = sam_hdr_read(fp);
+    construct_kTable(header);
+    time_stamp("program start");
+
+    auto output_fp = sam_open(options.output_file, "wb");
+    // this thread reads, marks and writes, BGZF compression takes the rest of the budget
+    if(options.num_threads > 1){
+        hts_set_threads(output_fp, options.num_threads - 1);
+    }
+    assert(sam_hdr_write(output_fp, header) == 0);
+    char *fn_out_idx = auto_index(output_fp, options.output_file, header);
+
+    std::unique_ptr<RegionIndex> qc_targets;
+    std::unique_ptr<QcStats> qc = make_qc(options, header, nullptr, qc_targets);
+    if(options.qc_prefix != nullptr && !qc){
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<BaseRecalibrator> bqsr = make_bqsr(options, header);
+    if(options.bqsr_table != nullptr && !bqsr){
+        return EXIT_FAILURE;
+    }
+
+    StreamingMarkDup markdup(options.stream_window, options.stream_max_buffered, options.umi_edits_or_off());
+    auto write_ready = [&markdup, &output_fp, &header, &qc, &bqsr](){
+        BAMRecord * record;
+        while((record = markdup.pop_ready()) != nullptr){
+            assert(sam_write1(output_fp, header, record->get_record()) >= 0);
+            if(qc){
+                qc->add(record->get_record());
+            }
+            if(bqsr){
+                bqsr->add(record->get_record());
+            }
+            Metrics::add(Counter::OutputRecords);
+            if(record->flag() & BAM_FDUP){
+                Metrics::add(Counter::DuplicateRecords);
+            }
+            delete record;
+        }
+    };
+
+    while(true)
+    {
+        BAMRecord * record = new BAMRecord;
+        bam_set_mempolicy(record->get_record(), BAM_USER_OWNS_STRUCT);
+        if(sam_read1(fp, header, record->get_record()) < 0){
+            delete record;
+            break;
+        }
+        markdup.add(record);
+        write_ready();
+    }
+    markdup.finish();
+    write_ready();
+
+    std::cout << "duplicates: " << markdup.num_duplicate() << "\t"
+        << "mates given up: " << markdup.num_given_up() << std::endl;
+
+    if(fn_out_idx){
+        assert(sam_idx_save(output_fp) == 0);
+        free(fn_out_idx);
+    }
+    sam_close(output_fp);
+    if(qc && !qc->write(header)){
+        std::cerr << "can't write the QC files " << options.qc_prefix << ".*" << std::endl;
+    }
+    if(bqsr && !bqsr->write(options.bqsr_table)){
+        std::cerr << "can't write the recalibration table " << options.bqsr_table << std::endl;
+    }
+    sam_close(fp);
+    sam_hdr_destroy(header);
+    time_stamp("output done");
+    return 0;
+}
+
+// output the records in the input order, used when the sort is skipped
+void output_alignment_ordered(const SormadupOptions &options, const sam_hdr_t *header, OrderedRecordStore &record_store
+    , bitmap * duplicate_index, int num_thread, QcStats * qc, BaseRecalibrator * bqsr)
+{
+    auto fp = sam_open(options.output_file, "wb");
+    // the batches are decompressed by the feeder threads, BGZF compression has the others of the budget
+    const int num_feeders = ThreadBudget::feeder_threads(num_thread);
+    if(ThreadBudget::bgzf_threads(num_thread) > 0){
+        hts_set_threads(fp, ThreadBudget::bgzf_threads(num_thread));
+    }
+    tbb::task_arena feeders(num_feeders);
+    assert(sam_hdr_write(fp, header) == 0);
+
+    // decompress a window of batches in parallel, then write them sequentially
+    const int num_batches = record_store.num_batches();
+    const int window = num_feeders * 4;
+    std::vector<unsigned char *> data(window);
+    std::vector<size_t> lengths(window);
+    for(int base = 0; base < num_batches; base += window)
+    {
+        int n = std::min(window, num_batches - base);
+        feeders.execute([&](){
+            tbb::parallel_for(0, n, [&record_store, &data, &lengths, base](int k){
+                data[k] = record_store.load(base + k, lengths[k]);
+                record_store.release(base + k);
+            });
+        });
+        for(int k = 0; k < n; k++)
+        {
+            bam1_t record;
+            for(size_t offset = 0; offset < lengths[k];)
+            {
+                offset = OrderedRecordStore::next(data[k], offset, &record);
+                Metrics::add(Counter::OutputRecords);
+                if(duplicate_index && duplicate_index->get(record.id)){
+                    Metrics::add(Counter::DuplicateRecords);
+                    if(options.remove_duplicate()){
+                        continue;
+                    }
+                    record.core.flag |= BAM_FDUP;
+                }
+                assert(sam_write1(fp, header, &record) >= 0);
+                if(qc){
+                    qc->add(&record);
+                }
+                if(bqsr){
+                    bqsr->add(&record);
+                }
+            }
+            free(data[k]);
+        }
+    }
+
+    sam_close(fp);
+}
+
+// output one indexed BAM per group and a manifest. the partitions are loaded in parallel and written in order,
+// group after group, while BGZF compresses them. the partitions in flight are as many as the largest of them
+// fitting in --spill-memory, one at least
+void output_alignment_split(const SormadupOptions &options, sam_hdr_t *header, std::vector<BAMPartitioner::tRDD>& rdds,
+    BAMPartitioner& bam_partitioner, const std::vector<OutputGroup>& groups, bitmap * duplicate_index, int num_thread,
+    QcStats * qc, BaseRecalibrator * bqsr)
+{
+    const uint32_t num_partitions = bam_partitioner.getNumPartitions();
+    // the partitions are aligned to the group bounds, the first partition of group g starts at groups[g].start
+    std::vector<uint32_t> first_partition(groups.size() + 1, num_partitions);
+    for(uint32_t i = num_partitions; i-- > 0;){
+        if(rdds[i].empty())
+            continue;
+        uint64_t key = rdds[i].front().first;
+        size_t g = std::upper_bound(groups.begin(), groups.end(), key, [](uint64_t k, const OutputGroup &group){
+            return k < group.start;
+        }) - groups.begin() - 1;
+        first_partition[g] = i;
+    }
+    for(size_t g = groups.size(); g-- > 0;){
+        first_partition[g] = std::min(first_partition[g], first_partition[g + 1]);
+    }
+
+    // BGZF compression of all the files shares one pool, the partitions are loaded by the other threads of the budget
+    const int num_feeders = ThreadBudget::feeder_threads(num_thread);
+    const int num_bgzf = ThreadBudget::bgzf_threads(num_thread);
+    htsThreadPool pool = {num_bgzf > 0 ? hts_tpool_init(num_bgzf) : nullptr, 0};
+    tbb::task_arena feeders(num_feeders);
+    std::vector<uint64_t> num_records(groups.size(), 0);
+
+    const uint32_t first = first_partition[0], last = first_partition[groups.size()];
+    size_t largest = 1;
+    for(uint32_t i = first; i < last; i++){
+        largest = std::max(largest, bam_partitioner.getBAMRecordBuffer(i)->size());
+    }
+    const size_t num_tokens = std::min(std::max(options.spill_memory * 1024 * 1024 / largest, (size_t)1),
+                                       (size_t)num_feeders * 2);
+
+    // the file of the group being written, the groups are opened in order, empty ones included
+    size_t num_opened = 0;
+    htsFile * fp = nullptr;
+    char * fn_out_idx = nullptr;
+    auto close_group = [&](){
+        if(fn_out_idx){
+            assert(sam_idx_save(fp) == 0);
+            free(fn_out_idx);
+            fn_out_idx = nullptr;
+        }
+        sam_close(fp);
+        Metrics::add(Counter::OutputRecords, num_records[num_opened - 1]);
+    };
+    auto open_until = [&](size_t g){
+        for(; num_opened <= g; num_opened++){
+            if(num_opened > 0){
+                close_group();
+            }
+            std::string file = std::string(options.output_file) + "/" + groups[num_opened].name + ".bam";
+            fp = sam_open(file.c_str(), "wb");
+            if(pool.pool){
+                hts_set_thread_pool(fp, &pool);
+            }
+            assert(sam_hdr_write(fp, header) == 0);
+            fn_out_idx = auto_index(fp, file.c_str(), header);
+        }
+    };
+
+    struct tLoaded
+    {
+        uint32_t partition;
+        unsigned char * data;
+    };
+    uint32_t next = first;
+    feeders.execute([&](){
+        tbb::parallel_pipeline(num_tokens,
+            tbb::make_filter<void, uint32_t>(tbb::filter_mode::serial_in_order, [&](tbb::flow_control &control){
+                while(next < last && rdds[next].empty()){
+                    next++;
+                }
+                if(next >= last){
+                    control.stop();
+                    return last;
+                }
+                return next++;
+            }) &
+            tbb::make_filter<uint32_t, tLoaded>(tbb::filter_mode::parallel, [&bam_partitioner](uint32_t i){
+                return tLoaded{i, bam_partitioner.getBAMRecordBuffer(i)->readData()};
+            }) &
+            tbb::make_filter<tLoaded, void>(tbb::filter_mode::serial_in_order, [&](tLoaded loaded){
+                // the last group whose first partition is not after this one
+                size_t g = std::upper_bound(first_partition.begin(), first_partition.end() - 1, loaded.partition)
+                    - first_partition.begin() - 1;
+                open_until(g);
+                bam1_t record;
+                for(auto &pair : rdds[loaded.partition]){
+                    SpillRecord::load(loaded.data + pair.second, &record);
+                    if(duplicate_index && duplicate_index->get(record.id)){
+                        Metrics::add(Counter::DuplicateRecords);
+                        if(options.remove_duplicate()){
+                            continue;
+                        }
+                        record.core.flag |= BAM_FDUP;
+                    }
+                    assert(sam_write1(fp, header, &record) >= 0);
+                    if(qc){
+                        qc->add(&record);
+                    }
+                    if(bqsr){
+                        bqsr->add(&record);
+                    }
+                    num_records[g]++;
+                }
+                HugePages::release(loaded.data);
+            }));
+    });
+    if(!groups.empty()){
+        open_until(groups.size() - 1);
+        close_group();
+    }
+    if(pool.pool){
+        hts_tpool_destroy(pool.pool);
+    }
+
+    std::string manifest = std::string(options.output_file) + "/manifest.tsv";
+    if(!write_manifest(manifest, groups, num_records, header)){
+        std::cerr << "can't write " << manifest << std::endl;
+    }
+}
 
 // output the bam file sequentially
 void output_alignment(char* output_file, const sam_hdr_t *header, std::vector<BAMPartitioner::tRDD>& rdds, int num_partitions, BAMPartitioner& bam_partitioner
@@ -473,7 +1744,7 @@ void output_alignment(char* output_file, const sam_hdr_t *header, std::vector<BA
 {
     auto fp = sam_open(output_file, "wb");
     assert(sam_hdr_write(fp, header) == 0);
-    BAMRecord * record;
+    bam1_t record;
 
     for(int i=0; i<num_partitions; i++)
     {
@@ -485,13 +1756,11 @@ void output_alignment(char* output_file, const sam_hdr_t *header, std::vector<BA
 
         for(std::pair<uint64_t, size_t>& pair : rdd)
         {
-            record = (BAMRecord *)(BAMRecordData + pair.second);
-            if(duplicate_index.get(record->get_pairID())){
-                record->mardup();
+            SpillRecord::load(BAMRecordData + pair.second, &record);
+            if(duplicate_index.get(record.id)){
+                record.core.flag |= BAM_FDUP;
             }
-            bam1_t * b = record->get_record();
-            b->data = (uint8_t *)record + BAMPartitioner::RecordSize;
-            sam_write1(fp, header, b);
+            sam_write1(fp, header, &record);
 
         }
     }
@@ -510,7 +1779,9 @@ void read_alignment(htsFile *fp, sam_hdr_t * header)
     bam1_t *bam_last = bam_init1();
     bam1_t *bam_now = bam_init1();
 
-    // vector used to store the collected line
+    // vector used to store the collected line, batch_id keeps the input order of the batches
+    uint64_t batch_id = 0;
+    uint64_t num_lines = 0, first_line = 0;
     std::vector<kstring_t>* items = new std::vector<kstring_t>;
     items->reserve(BULK_SIZE);
     
@@ -531,7 +1802,9 @@ void read_alignment(htsFile *fp, sam_hdr_t * header)
 
             if(bam_get_qname(bam_last) != nullptr && strcmp(bam_get_qname(bam_now), bam_get_qname(bam_last)) != 0)
             {
-                LineQueue.enqueue(items);
+                LineQueue.enqueue(LineBatch{batch_id++, items, first_line, nullptr});
+                first_line = num_lines + 1;
+                Metrics::sample_queue("line_queue", LineQueue.size_approx());
 
                 items = new std::vector<kstring_t>;
                 items->reserve(BULK_SIZE);
@@ -546,9 +1819,10 @@ void read_alignment(htsFile *fp, sam_hdr_t * header)
         
         line = KS_INITIALIZE;
         read_num++;
+        num_lines++;
     }
     // enqueue the lines left
-    LineQueue.enqueue(items);
+    LineQueue.enqueue(LineBatch{batch_id++, items, first_line, nullptr});
     read_finished = true;
 
     //--- for debug mode
@@ -594,7 +1868,53 @@ char *auto_index(htsFile *fp, const char *fn, bam_hdr_t *header) {
 }
 
 
+void usage()
+{
+    std::cerr << "usage: ./sormadup [-I input.sam] [-t num] [-m mode] -O output.bam\n"
+              << "  -I, --input FILE    name-grouped SAM input (see --ungrouped), stdin if absent\n"
+              << "  -O, --output FILE   BAM output\n"
+              << "  -t, --threads NUM   threads of all the stages, one of them reads the input\n"
+              << "                      [the CPUs available: affinity mask and cgroup CPU quota]\n"
+              << "  -m, --mode MODE     sormadup: sort and mark duplicates (default)\n"
+              << "                      markdup:  mark duplicates, keep the input order\n"
+              << "                      sort:     sort only\n"
+              << "                      rmdup:    sort and remove duplicates\n"
+              << "                      stream:   mark duplicates of coordinate-sorted SAM/BAM in one pass\n"
+              << "      --window NUM        stream: max distance between a position and its unclipped 5' position [1000]\n"
+              << "      --max-buffered NUM  stream: max records buffered while waiting for a mate [4194304]\n"
+              << "      --umi               split the duplicate sets by the UMI in the RX tag\n"
+              << "      --umi-tag TAG       split the duplicate sets by the UMI in TAG\n"
+              << "      --umi-edits NUM     max mismatches between UMIs of the same molecule [1]\n"
+              << "      --regions FILE      BED of the target regions, the off-target pairs are not marked\n"
+              << "      --drop-off-target   with --regions, leave the off-target pairs out of the output\n"
+              << "      --split contig|NUM  -O is a directory, write one indexed BAM per contig (short contigs merged)\n"
+              << "                          or per interval of at most NUM bases, plus manifest.tsv\n"
+              << "      --spill-codec NAME  codec of the temporary pages: auto, lz4, none, zstd[:LEVEL] [auto]\n"
+              << "      --spill-memory MB   memory of the pages staging the temporary files, and of the ones reloaded by --split [4096]\n"
+              << "      --huge-pages POLICY back the bitmaps, pair slabs, pages and partitions with huge pages:\n"
+              << "                          off, thp (madvise) or hugetlb (reserved pages, else thp) [thp]\n"
+              << "      --ungrouped         the input is not grouped by QNAME (e.g. coordinate-sorted), match the mates by name\n"
+              << "      --mate-memory MB    --ungrouped: memory of the records waiting for the mate before they spill [2048]\n"
+              << "      --pin-threads       bind each worker thread to one CPU\n"
+              << "      --metrics FILE      write the per-stage metrics as JSON\n"
+              << "      --checkpoint DIR    spill into DIR/spill and keep the state after the shuffle in DIR until the output is written\n"
+              << "      --resume            restart a failed run from its --checkpoint, the input is not read again\n"
+              << "      --shards NUM        run NUM worker processes over shards of the genome, then merge their BAMs\n"
+              << "      --shard i/N         run only worker i of N, e.g. one per host, then --merge-shards N\n"
+              << "      --shard-dir DIR     the directory of the shard outputs, shared by the workers\n"
+              << "      --merge-shards NUM  concatenate the NUM shard BAMs of --shard-dir into -O and merge their indexes\n"
+              << "      --shard-timeout SEC seconds a worker waits for the duplicates of the others, 0 for no limit [3600]\n"
+              << "      --qc PREFIX         write flagstat, insert size and MAPQ histograms of the output to PREFIX.*\n"
+              << "      --qc-targets BED    with --qc, the depth over the targets of BED [the --regions]\n"
+              << "      --bqsr-table FILE   collect the base recalibration covariates of the output into FILE (GATK format)\n"
+              << "      --reference FASTA   with --bqsr-table, the reference of the alignments\n"
+              << "      --known-sites FILE  with --bqsr-table, the VCF or BED of the known variants, not counted as errors\n";
+}
+
 void time_stamp(std::string hint){
+    // called by the stages of the graph as they finish
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
     static auto now = std::chrono::steady_clock::now();
     static auto begin = now;
     static auto last = now;
@@ -604,4 +1924,5 @@ void time_stamp(std::string hint){
     last = now;
     std::cout << hint << "\t" << "module elapsed " << time2.count() << "s\t"
     << "total elapsed " << time1.count() << "s\n";
+    Metrics::stage(hint, time2.count(), time1.count());
 }
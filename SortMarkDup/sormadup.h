@@ -0,0 +1,28 @@
+/**
+ * tbb-sormadup linked into an aligner, the library built with -DSORMADUP_LIBRARY=ON.
+ *
+ * The aligner builds the bam1_t records itself and hands them over in batches, instead of writing SAM
+ * text to the pipe read by tbb-sormadup: nothing is formatted or parsed. The batches are taken by the
+ * parsing threads, which pair the records and add them to the BAMPartitioner and the RangePartitioners
+ * as the lines of a SAM input. Used by BWA-HUST mem --sort-markdup.
+ */
+
+#ifndef SORMADUP_H
+#define SORMADUP_H
+
+#include <cstddef>
+#include "sam.h"
+
+// parse the options of tbb-sormadup (argv[0] is the program name, -I, stream mode, the shards and
+// --resume are not available) and start the run on header, which it keeps. false if the options end
+// the run, the errors are printed
+bool sormadup_start(int argc, char * argv[], sam_hdr_t * header);
+
+// a batch of records grouped by QNAME, in the input order. the batches are pushed by one thread at a
+// time, the records are taken over, not the array
+void sormadup_push(bam1_t ** records, size_t n);
+
+// the end of the input: wait for the output, return the exit code of the run
+int sormadup_finish();
+
+#endif
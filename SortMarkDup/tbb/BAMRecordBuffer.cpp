@@ -5,22 +5,25 @@
 
 #include <iostream>
 #include <exception>
+#include <chrono>
 #include <cassert>
 #include <thread>
 #include <filesystem>
 #include <utility>
-#include "concurrentqueue.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <tbb/task_group.h>
 #include "BAMRecordBuffer.h"
+#include "Checkpoint.h"
+#include "HugePages.h"
 
 namespace fs = std::filesystem;
-moodycamel::ConcurrentQueue<struct CompressedBlock> CompressedBuffer;
-std::atomic_bool load_finished;
+SpillPagePool * BAMRecordBuffer::page_pool = nullptr;
 
 BAMRecordBuffer::BAMRecordBuffer(const std::string &db_file) : 
-                    buffer_offset(0), file_offset(0), file_name_(db_file)
+                    frame(-1), buffer_offset(0), file_offset(0), num_added(0), sync_fd(-1), file_name_(db_file)
 {
-    BAMBuffer = (char *)calloc(BAM_BUFFER_SIZE, sizeof(char));
-    compressed_buffer = (char *)malloc(LZ4_compressBound(BAM_BUFFER_SIZE) * sizeof(char));
+    assert(page_pool != nullptr);
     db_io_.open(db_file, std::ios::binary | std::ios::in | std::ios::out);
 
     // directory or file does not exist
@@ -43,92 +46,176 @@ BAMRecordBuffer::BAMRecordBuffer(const std::string &db_file) :
 
     }
 
+    // the temporary file starts with the layout version of the records in it
+    uint32_t file_header[2] = {Magic, SpillRecord::Version};
+    db_io_.write((const char *)file_header, sizeof(file_header));
+
+    if(SpillCodec::measures_writes())
+    {
+        sync_fd = open(db_file.c_str(), O_WRONLY);
+    }
+}
+
+BAMRecordBuffer::BAMRecordBuffer(const std::string &db_file, std::istream &tables) :
+                    frame(-1), buffer_offset(0), file_offset(0), num_added(0), sync_fd(-1), file_name_(db_file)
+{
+    read_value(tables, file_offset);
+    read_vector(tables, compressed_lengthes);
+    read_vector(tables, codecs);
+    read_vector(tables, offset);
+    db_io_.open(db_file, std::ios::binary | std::ios::in | std::ios::out);
+    if (!db_io_.is_open()) {
+        std::cerr << "can't open db file " << db_file << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void BAMRecordBuffer::save(std::ostream &tables) const
+{
+    assert(frame < 0);
+    write_value(tables, file_offset);
+    write_vector(tables, compressed_lengthes);
+    write_vector(tables, codecs);
+    write_vector(tables, offset);
 }
 
 BAMRecordBuffer::~BAMRecordBuffer()
 {
+    if(frame >= 0)
+    {
+        page_pool->release(frame);
+    }
+    if(sync_fd >= 0)
+    {
+        close(sync_fd);
+    }
     // remove the temporary files
     if(fs::exists(file_name_)){
         fs::remove(file_name_);
     }
 }
 
-size_t BAMRecordBuffer::addData(BAMRecord* elem)
+void BAMRecordBuffer::writePage()
 {
+    // the buffer used to store the compressed data, shared by the partitions written by a thread
+    thread_local std::vector<char> compressed_buffer;
+    compressed_buffer.resize(SpillCodec::bound(page_pool->frameSize()));
+
     size_t compressed_length;
-    bam1_t * b = elem->get_record();
-    // change page if necessary
-    if(buffer_offset + RecordSize + b->l_data > BAM_BUFFER_SIZE)
+    SpillCodecId codec;
+    const char * page = SpillCodec::encode(page_pool->frame(frame), buffer_offset, compressed_buffer.data(),
+        compressed_buffer.size(), compressed_length, codec);
+
+    if(sync_fd >= 0 && SpillCodec::sample_write())
     {
-        
-        compressed_length = LZ4_compress_default(BAMBuffer, compressed_buffer, buffer_offset, BAM_BUFFER_SIZE);
-        assert(compressed_length > 0);
-        db_io_.write((const char*)compressed_buffer, compressed_length);
-        
+        // a write only lands in the page cache, the speed of the device is seen once the page reaches it.
+        // the pages written before are synced first, so the timed sync carries this one alone
+        db_io_.flush();
+        fdatasync(sync_fd);
+        auto begin = std::chrono::steady_clock::now();
+        db_io_.write(page, compressed_length);
+        db_io_.flush();
+        fdatasync(sync_fd);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        SpillCodec::report_write(compressed_length, elapsed.count());
+    }
+    else
+    {
+        db_io_.write(page, compressed_length);
+    }
+    Metrics::add(Counter::SpillRawBytes, buffer_offset);
+    Metrics::add(Counter::SpillEncodedBytes, compressed_length);
 
-         // check for I/O error
-        if (db_io_.bad()) {
-            std::cerr << "I/O error while writing" << std::endl;
-            exit(EXIT_FAILURE);
-        }
+    // check for I/O error
+    if (db_io_.bad()) {
+        std::cerr << "I/O error while writing" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
-        // clear the buffer
-        memset(BAMBuffer, 0, BAM_BUFFER_SIZE);
+    compressed_lengthes.push_back(compressed_length);
+    codecs.push_back(codec);
+    offset.push_back((size_t)file_offset);
+    file_offset += buffer_offset;
+}
 
-        compressed_lengthes.push_back((size_t)compressed_length);
-        offset.push_back((size_t)file_offset);
-        
-        file_offset += buffer_offset;
+size_t BAMRecordBuffer::addData(BAMRecord* elem)
+{
+    std::lock_guard<std::mutex> lock(page_lock);
+    bam1_t * b = elem->get_record();
+    size_t size = SpillRecord::size(b);
+    assert(size <= page_pool->frameSize());
+    if(frame < 0)
+    {
+        // the last page was evicted or this is the first record
+        frame = page_pool->acquire(this);
+    }
+    // change page if necessary
+    else if(buffer_offset + size > page_pool->frameSize())
+    {
+        writePage();
         buffer_offset = 0;
     }
-    memcpy(BAMBuffer + buffer_offset, elem, RecordSize);
-    memcpy(BAMBuffer + buffer_offset + RecordSize, b->data, b->l_data);
-    uint32_t length = ((uint32_t)b->l_data + 7) & (~7U);
     size_t real_offset = file_offset + buffer_offset;
-    buffer_offset = buffer_offset + RecordSize + length;
+    buffer_offset += SpillRecord::store(page_pool->frame(frame) + buffer_offset, b);
     
+    if(++num_added % TouchPeriod == 0)
+    {
+        page_pool->touch(frame);
+    }
     return real_offset;
 }
 
-void BAMRecordBuffer::flushData()
+bool BAMRecordBuffer::evict(bustub::frame_id_t frame_id)
 {
-    size_t compressed_length;
-    compressed_length = LZ4_compress_default(BAMBuffer, compressed_buffer, buffer_offset, BAM_BUFFER_SIZE);
-    assert(compressed_length > 0);
-    db_io_.write((const char *)compressed_buffer, compressed_length);
-    
+    std::unique_lock<std::mutex> lock(page_lock, std::try_to_lock);
+    if(!lock.owns_lock() || frame != frame_id)
+    {
+        return false;
+    }
+    if(buffer_offset > 0)
+    {
+        writePage();
+        buffer_offset = 0;
+    }
+    frame = -1;
+    return true;
+}
 
-    // check for I/O error
-    if (db_io_.bad()) {
-        std::cerr << "I/O error while writing" << std::endl;
-        exit(EXIT_FAILURE);
+void BAMRecordBuffer::flushData()
+{
+    std::lock_guard<std::mutex> lock(page_lock);
+    if(frame >= 0)
+    {
+        if(buffer_offset > 0)
+        {
+            writePage();
+            buffer_offset = 0;
+        }
+        page_pool->release(frame);
+        frame = -1;
     }
     // needs to flush to keep disk file in sync
     db_io_.flush(); 
 
-    compressed_lengthes.push_back((size_t)compressed_length);
     offset.push_back((size_t)file_offset);
-    file_offset += buffer_offset;
-
-    offset.push_back((size_t)file_offset);
-    free(BAMBuffer);
-    free(compressed_buffer);
-
 }
 
 unsigned char * BAMRecordBuffer::readData()
 {
-    int num_consumer = 3;   // TODO: change this variable to a member variable
     // file_offset represents the length of the uncompressed file now
-    unsigned char * buffer = (unsigned char *)calloc(file_offset, 1);
+    Metrics::add(Counter::ReloadBytes, file_offset);
+    unsigned char * buffer = (unsigned char *)HugePages::allocate(file_offset);
 
     db_io_.seekp(0);
-    load_finished = false;
-    std::vector<std::thread> consumer;
-    for(int i=0; i<num_consumer; i++)
+    uint32_t file_header[2];
+    db_io_.read((char *)file_header, sizeof(file_header));
+    if(file_header[0] != Magic || file_header[1] != SpillRecord::Version)
     {
-        consumer.emplace_back(std::thread(&BAMRecordBuffer::decompress, this));
+        std::cerr << "unknown spill layout in " << file_name_ << std::endl;
+        exit(EXIT_FAILURE);
     }
+    // the pages are decompressed by the tasks of the calling arena while the next ones are read
+    tbb::task_group decompressors;
 
     for(int i=0; i<compressed_lengthes.size(); i++)
     {
@@ -139,21 +226,16 @@ unsigned char * BAMRecordBuffer::readData()
         block.src = compressed_buffer;
         block.dst = (char *)(buffer + offset[i]);
         block.compressedSize = compressed_lengthes[i];
-        block.dstCapacity = (int)(offset[i+1] - offset[i]);
+        block.dstCapacity = offset[i+1] - offset[i];
+        block.codec = codecs[i];
 
-        // enqueue the pointer
-        assert(CompressedBuffer.enqueue(block));
+        decompressors.run([this, block](){decompress(block);});
     }
-    load_finished = true;
     
     // for debugging
     // std::cout << "size of compressed_lengthes: " << compressed_lengthes.size() << "\n";
-    // std::cout << "size of blocking queue: " << CompressedBuffer.size_approx() << "\n";
 
-    for(int i=0; i<num_consumer; i++)
-    {
-        consumer[i].join();
-    }
+    decompressors.wait();
 
     if (!db_io_.good()) {
         std::cerr << "I/O error while writing" << std::endl;
@@ -173,29 +255,16 @@ unsigned char * BAMRecordBuffer::readData()
 }
 
 /**
- * @brief dequeue a block of compressed data and decompress it, until the concurrent queue is empty
+ * @brief decompress a block of compressed data into its place in the buffer
  * 
  */
 
-void BAMRecordBuffer::decompress()
+void BAMRecordBuffer::decompress(const CompressedBlock &block)
 {
-    int uncompressed_length;
-    struct CompressedBlock block;
-    while(true)
+    if(!SpillCodec::decode(block.codec, block.src, block.compressedSize, block.dst, block.dstCapacity))
     {
-        // if all the reads are processed, then break the loop
-        if(load_finished && CompressedBuffer.size_approx() == 0)
-        {
-            break;
-        }
-
-        if(CompressedBuffer.try_dequeue(block))
-        {
-            // pay attention! LZ4_decompress_safe() requires the data type to be int
-            uncompressed_length = LZ4_decompress_safe(block.src, block.dst, block.compressedSize, block.dstCapacity);
-            assert(uncompressed_length >= 0);
-            free(block.src);
-        }
-
+        std::cerr << "corrupted spill page in " << file_name_ << std::endl;
+        std::abort();
     }
+    free(block.src);
 }
@@ -9,54 +9,77 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <lz4.h>
 #include <mutex>
 #include "sam.h"
 #include "bam_record.h"
+#include "SpillRecord.h"
+#include "SpillCodec.h"
+#include "SpillPagePool.h"
 
-#define BAM_BUFFER_SIZE 0x8000000   // Maybe it can be a parameter
+#define BAM_BUFFER_SIZE 0x2000000   // the default size of a frame of the page pool
 
-// some variable passed to LZ4_decompress_safe()
+// some variable passed to SpillCodec::decode()
 struct CompressedBlock
 {
     char * src;
     char * dst;
-    int compressedSize;
-    int dstCapacity;
+    size_t compressedSize;
+    size_t dstCapacity;
+    SpillCodecId codec;
 };
 
 
 class BAMRecordBuffer
 {
 private:
-    const static int RecordSize = sizeof(BAMRecord);
-    char * BAMBuffer; // the buffer used to store the BAMRecord into the file
+    const static uint32_t Magic = 0x4c495053;  // "SPIL", followed by SpillRecord::Version
+    const static uint32_t TouchPeriod = 1024;  // records added between two updates of the LRU order
+    bustub::frame_id_t frame;   // the frame of page_pool holding the current page, -1 if none
     size_t buffer_offset;   // the offset in the buffer
     size_t file_offset;   // the offset of the total file
-    
-    char * compressed_buffer;   // the buffer used to store the compressed data
+    uint32_t num_added;
+    std::mutex page_lock;   // protects the current page, taken by addData and by the evictions
     
     std::vector<size_t> compressed_lengthes;    // the size of each compressed block
+    std::vector<SpillCodecId> codecs;           // the codec of each compressed block
     std::vector<size_t> offset;     // the accumulated size of uncompressed data
 
+    int sync_fd;    // another descriptor of the file, synced to time the pages SpillCodec samples
     std::fstream db_io_;
     std::string file_name_;
 
-    void decompress();
+    // decode a page read by readData and free its compressed copy
+    void decompress(const CompressedBlock &block);
+
+    // compress the buffer and append it to the file
+    void writePage();
 
 public:
-    
+    // the frames of every BAMRecordBuffer come from this pool
+    static SpillPagePool * page_pool;
 
     BAMRecordBuffer(const std::string &db_file);
+    // the pages spilled into db_file by a previous run, located by the tables written by save
+    BAMRecordBuffer(const std::string &db_file, std::istream &tables);
     ~BAMRecordBuffer();
 
-    // add a BAMRecord class object into the buffer
+    // write the tables locating the pages, after flushData
+    void save(std::ostream &tables) const;
+
+    // add a BAMRecord class object into the buffer in the SpillRecord layout, return its offset
     size_t addData(BAMRecord* elem);
 
     // flush all the data into the file
     void flushData();
 
-    // read the data from the file, remember to free it
+    // write out the page in frame_id and give up the frame, called by page_pool.
+    // return false if the page is busy or is not in frame_id any more
+    bool evict(bustub::frame_id_t frame_id);
+
+    // the length of the data returned by readData
+    size_t size() const {return file_offset;}
+
+    // read the data from the file, give it back with HugePages::release. the records are read back with SpillRecord::load
     unsigned char * readData();
 };
 
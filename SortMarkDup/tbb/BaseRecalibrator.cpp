@@ -0,0 +1,405 @@
+/**
+ * The implementation of BaseRecalibrator class
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include "BaseRecalibrator.h"
+#include "bam_record.h"
+
+static const hts_pos_t WindowSize = 1 << 20;   // the reference fetched at a time by a thread
+static const char Bases[] = "ACGT";
+
+// A C G T of the 4-bit encoding of the read bases as 0 1 2 3, -1 for the others
+static int read_base(uint8_t code)
+{
+    switch(code)
+    {
+        case 1: return 0;
+        case 2: return 1;
+        case 4: return 2;
+        case 8: return 3;
+        default: return -1;
+    }
+}
+
+static int reference_code(char base)
+{
+    const char * p = base ? strchr(Bases, base) : nullptr;
+    return p ? p - Bases : -1;
+}
+
+// the phred quality of errors among observations, with one error and one success added
+static double empirical_quality(uint64_t observations, uint64_t errors)
+{
+    double q = -10 * log10((errors + 1.0) / (observations + 2.0));
+    return std::min(q, (double)BaseRecalibrator::MaxQuality);
+}
+
+BaseRecalibrator::Tables::Tables(size_t num_groups):
+    observations(num_groups * (MaxQuality + 1), 0), errors(num_groups * (MaxQuality + 1), 0),
+    context_observations(num_groups * (MaxQuality + 1) * NumContexts, 0),
+    context_errors(num_groups * (MaxQuality + 1) * NumContexts, 0),
+    cycle_observations(num_groups * (MaxQuality + 1) * (2 * MaxCycle + 1), 0),
+    cycle_errors(num_groups * (MaxQuality + 1) * (2 * MaxCycle + 1), 0)
+{
+}
+
+BaseRecalibrator::Window::~Window()
+{
+    free(bases);
+    if(fai != nullptr)
+        fai_destroy(fai);
+}
+
+BaseRecalibrator::~BaseRecalibrator() = default;
+
+bool BaseRecalibrator::load(const char * reference, const char * known_sites_file, sam_hdr_t * h)
+{
+    header = h;
+    reference_file = reference;
+    // builds the .fai if missing, before the threads load it
+    faidx_t * fai = fai_load(reference);
+    if(fai == nullptr)
+    {
+        std::cerr << "can't load the reference " << reference << std::endl;
+        return false;
+    }
+    fai_destroy(fai);
+
+    // the read groups of the header
+    std::string text(sam_hdr_str(header), sam_hdr_length(header));
+    for(size_t line = 0; line < text.size(); line = text.find('\n', line) + 1)
+    {
+        size_t id = text.find("\tID:", line);
+        if(text.compare(line, 3, "@RG") == 0 && id != std::string::npos && id < text.find('\n', line))
+        {
+            size_t end = text.find_first_of("\t\n", id + 4);
+            read_groups.push_back(text.substr(id + 4, end - id - 4));
+        }
+        if(text.find('\n', line) == std::string::npos)
+            break;
+    }
+    read_groups.push_back("NA");
+    tables.reset(new tbb::enumerable_thread_specific<Tables>(Tables(read_groups.size())));
+
+    if(known_sites_file == nullptr)
+        return true;
+    known_sites.reset(new bitmap(BAMRecord::kTable.back() + 1));
+    return load_known_sites(known_sites_file);
+}
+
+bool BaseRecalibrator::load_known_sites(const char * file)
+{
+    htsFile * fp = hts_open(file, "r");
+    if(fp == nullptr)
+    {
+        std::cerr << "can't open the known sites " << file << std::endl;
+        return false;
+    }
+    const bool bed = strstr(file, ".bed") != nullptr;
+    kstring_t line = KS_INITIALIZE;
+    uint64_t num_sites = 0;
+    while(hts_getline(fp, KS_SEP_LINE, &line) >= 0)
+    {
+        if(line.l == 0 || line.s[0] == '#' || strncmp(line.s, "track", 5) == 0 || strncmp(line.s, "browser", 7) == 0)
+            continue;
+        // chrom start end of a BED, chrom pos id ref of a VCF
+        char * fields[4] = {line.s, nullptr, nullptr, nullptr};
+        for(int i = 1; i < 4; i++)
+        {
+            char * tab = fields[i - 1] ? strchr(fields[i - 1], '\t') : nullptr;
+            if(tab != nullptr)
+            {
+                *tab = 0;
+                fields[i] = tab + 1;
+            }
+        }
+        if(fields[1] == nullptr || fields[2] == nullptr || (!bed && fields[3] == nullptr))
+            continue;
+        int tid = sam_hdr_name2tid(header, fields[0]);
+        if(tid < 0)
+            continue;
+        int64_t start, end;
+        if(bed)
+        {
+            start = strtoll(fields[1], nullptr, 10);
+            end = strtoll(fields[2], nullptr, 10);
+        }else{
+            start = strtoll(fields[1], nullptr, 10) - 1;
+            end = start + strcspn(fields[3], "\t");
+        }
+        uint64_t length = BAMRecord::kTable[tid + 1] - BAMRecord::kTable[tid];
+        for(int64_t pos = std::max<int64_t>(start, 0); pos < end && (uint64_t)pos < length; pos++)
+        {
+            known_sites->set(BAMRecord::kTable[tid] + pos);
+        }
+        num_sites++;
+    }
+    free(line.s);
+    hts_close(fp);
+    std::cout << num_sites << " known sites masked from the recalibration" << std::endl;
+    return true;
+}
+
+int BaseRecalibrator::read_group(const bam1_t * record) const
+{
+    uint8_t * tag = bam_aux_get(record, "RG");
+    const char * name = tag ? bam_aux2Z(tag) : nullptr;
+    if(name != nullptr)
+    {
+        for(size_t i = 0; i + 1 < read_groups.size(); i++)
+        {
+            if(read_groups[i] == name)
+                return i;
+        }
+    }
+    return read_groups.size() - 1;
+}
+
+char BaseRecalibrator::reference_base(Window &window, int tid, hts_pos_t pos, hts_pos_t end)
+{
+    if(window.tid != tid || pos < window.begin || pos >= window.end)
+    {
+        if(window.fai == nullptr)
+            window.fai = fai_load(reference_file.c_str());
+        free(window.bases);
+        hts_pos_t length = 0;
+        window.tid = tid;
+        window.begin = pos;
+        window.bases = window.fai ? faidx_fetch_seq64(window.fai, sam_hdr_tid2name(header, tid), pos,
+                                                      std::max(pos + WindowSize, end) - 1, &length) : nullptr;
+        window.end = pos + (window.bases ? std::max<hts_pos_t>(length, 0) : 0);
+    }
+    if(pos >= window.end)
+        return 0;
+    return toupper(window.bases[pos - window.begin]);
+}
+
+void BaseRecalibrator::add(const bam1_t * record)
+{
+    const uint16_t flag = record->core.flag;
+    if((flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP)) != 0 || record->core.tid < 0
+       || record->core.qual == 0 || record->core.qual == 255)
+        return;
+    const int length = record->core.l_qseq;
+    const uint8_t * seq = bam_get_seq(record);
+    const uint8_t * qual = bam_get_qual(record);
+    if(length == 0 || qual[0] == 0xff)
+        return;
+
+    Tables &t = tables->local();
+    Window &window = windows.local();
+    const int tid = record->core.tid;
+    const int rg = read_group(record);
+    const bool reverse = bam_is_rev(record);
+    const int order = (flag & BAM_FPAIRED) && (flag & BAM_FREAD2) ? -1 : 1;
+    const hts_pos_t end = bam_endpos(record);
+    const uint64_t offset = BAMRecord::kTable[tid];
+
+    auto count = [&](int q, hts_pos_t r){
+        int quality = std::min<int>(qual[q], MaxQuality);
+        int base = read_base(bam_seqi(seq, q));
+        if(quality < MinQuality || base < 0)
+            return;
+        int reference = reference_code(reference_base(window, tid, r, end));
+        if(reference < 0 || (known_sites && known_sites->get(offset + r)))
+            return;
+        const bool error = base != reference;
+        const size_t key = rg * (MaxQuality + 1) + quality;
+        t.observations[key]++;
+        t.errors[key] += error;
+
+        // the previous base in the sequencing direction, complemented on the reverse strand
+        int previous = reverse ? q + 1 : q - 1;
+        int context_base = previous >= 0 && previous < length ? read_base(bam_seqi(seq, previous)) : -1;
+        if(context_base >= 0)
+        {
+            int context = reverse ? (3 - context_base) * 4 + (3 - base) : context_base * 4 + base;
+            t.context_observations[key * NumContexts + context]++;
+            t.context_errors[key * NumContexts + context] += error;
+        }
+        int cycle = order * (reverse ? length - q : q + 1);
+        if(std::abs(cycle) <= MaxCycle)
+        {
+            t.cycle_observations[key * (2 * MaxCycle + 1) + cycle + MaxCycle]++;
+            t.cycle_errors[key * (2 * MaxCycle + 1) + cycle + MaxCycle] += error;
+        }
+    };
+
+    const uint32_t * cigar = bam_get_cigar(record);
+    int q = 0;
+    hts_pos_t r = record->core.pos;
+    for(uint32_t i = 0; i < record->core.n_cigar; i++)
+    {
+        int op = bam_cigar_op(cigar[i]);
+        int len = bam_cigar_oplen(cigar[i]);
+        if(op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF)
+        {
+            for(int k = 0; k < len && q + k < length; k++)
+                count(q + k, r + k);
+        }
+        if(bam_cigar_type(op) & 1)
+            q += len;
+        if(bam_cigar_type(op) & 2)
+            r += len;
+    }
+}
+
+// one table of a GATKReport v1.1, the columns left aligned
+static void write_table(std::ostream &out, const std::string &name, const std::string &description,
+    const std::vector<std::string> &columns, const std::string &formats, const std::vector<std::vector<std::string>> &rows)
+{
+    out << "#:GATKTable:" << columns.size() << ":" << rows.size() << ":" << formats << ":;\n";
+    out << "#:GATKTable:" << name << ":" << description << "\n";
+    std::vector<size_t> widths(columns.size());
+    for(size_t c = 0; c < columns.size(); c++)
+    {
+        widths[c] = columns[c].size();
+        for(auto &row : rows)
+            widths[c] = std::max(widths[c], row[c].size());
+    }
+    auto line = [&out, &widths](const std::vector<std::string> &cells){
+        for(size_t c = 0; c < cells.size(); c++)
+        {
+            out << cells[c];
+            if(c + 1 < cells.size())
+                out << std::string(widths[c] - cells[c].size() + 2, ' ');
+        }
+        out << "\n";
+    };
+    line(columns);
+    for(auto &row : rows)
+        line(row);
+    out << "\n";
+}
+
+static std::string format(const char * fmt, double value)
+{
+    char text[64];
+    snprintf(text, sizeof(text), fmt, value);
+    return text;
+}
+
+bool BaseRecalibrator::write(const std::string &path)
+{
+    Tables total(read_groups.size());
+    auto add_to = [](std::vector<uint64_t> &to, const std::vector<uint64_t> &from){
+        for(size_t i = 0; i < to.size(); i++)
+            to[i] += from[i];
+    };
+    for(auto &t : *tables)
+    {
+        add_to(total.observations, t.observations);
+        add_to(total.errors, t.errors);
+        add_to(total.context_observations, t.context_observations);
+        add_to(total.context_errors, t.context_errors);
+        add_to(total.cycle_observations, t.cycle_observations);
+        add_to(total.cycle_errors, t.cycle_errors);
+    }
+
+    std::ofstream out(path);
+    out << "#:GATKReport.v1.1:5\n";
+    write_table(out, "Arguments", "Recalibration argument collection values used in this run", {"Argument", "Value"}, "%s:%s", {
+        {"binary_tag_name", "null"},
+        {"covariate", "ReadGroupCovariate,QualityScoreCovariate,ContextCovariate,CycleCovariate"},
+        {"default_platform", "null"},
+        {"deletions_default_quality", "45"},
+        {"force_platform", "null"},
+        {"indels_context_size", "3"},
+        {"insertions_default_quality", "45"},
+        {"low_quality_tail", "2"},
+        {"maximum_cycle_value", std::to_string(MaxCycle)},
+        {"mismatches_context_size", "2"},
+        {"mismatches_default_quality", "-1"},
+        {"no_standard_covs", "false"},
+        {"quantizing_levels", "16"},
+        {"recalibration_report", "null"},
+        {"run_without_dbsnp", "false"},
+        {"solid_nocall_strategy", "THROW_EXCEPTION"},
+        {"solid_recal_mode", "SET_Q_ZERO"}});
+
+    // no quantization, each quality maps to itself
+    std::vector<std::vector<std::string>> rows;
+    for(int q = 0; q <= MaxQuality; q++)
+    {
+        uint64_t n = 0;
+        for(size_t rg = 0; rg < read_groups.size(); rg++)
+            n += total.observations[rg * (MaxQuality + 1) + q];
+        rows.push_back({std::to_string(q), std::to_string(n), std::to_string(q)});
+    }
+    write_table(out, "Quantized", "Quality quantization map", {"QualityScore", "Count", "QuantizedScore"}, "%d:%d:%d", rows);
+
+    rows.clear();
+    for(size_t rg = 0; rg < read_groups.size(); rg++)
+    {
+        uint64_t observations = 0, errors = 0;
+        double expected_errors = 0;
+        for(int q = 0; q <= MaxQuality; q++)
+        {
+            observations += total.observations[rg * (MaxQuality + 1) + q];
+            errors += total.errors[rg * (MaxQuality + 1) + q];
+            expected_errors += total.observations[rg * (MaxQuality + 1) + q] * pow(10, -q / 10.0);
+        }
+        if(observations == 0)
+            continue;
+        rows.push_back({read_groups[rg], "M", format("%.4f", empirical_quality(observations, errors)),
+            format("%.4f", -10 * log10(expected_errors / observations)), std::to_string(observations),
+            format("%.2f", errors)});
+    }
+    write_table(out, "RecalTable0", "", {"ReadGroup", "EventType", "EmpiricalQuality", "EstimatedQReported",
+        "Observations", "Errors"}, "%s:%s:%.4f:%.4f:%d:%.2f", rows);
+
+    rows.clear();
+    for(size_t rg = 0; rg < read_groups.size(); rg++)
+    {
+        for(int q = 0; q <= MaxQuality; q++)
+        {
+            size_t key = rg * (MaxQuality + 1) + q;
+            if(total.observations[key] == 0)
+                continue;
+            rows.push_back({read_groups[rg], std::to_string(q), "M",
+                format("%.4f", empirical_quality(total.observations[key], total.errors[key])),
+                std::to_string(total.observations[key]), format("%.2f", total.errors[key])});
+        }
+    }
+    write_table(out, "RecalTable1", "", {"ReadGroup", "QualityScore", "EventType", "EmpiricalQuality",
+        "Observations", "Errors"}, "%s:%d:%s:%.4f:%d:%.2f", rows);
+
+    rows.clear();
+    for(size_t rg = 0; rg < read_groups.size(); rg++)
+    {
+        for(int q = 0; q <= MaxQuality; q++)
+        {
+            size_t key = rg * (MaxQuality + 1) + q;
+            for(int c = 0; c < NumContexts; c++)
+            {
+                uint64_t n = total.context_observations[key * NumContexts + c];
+                if(n == 0)
+                    continue;
+                uint64_t e = total.context_errors[key * NumContexts + c];
+                rows.push_back({read_groups[rg], std::to_string(q), std::string{Bases[c / 4], Bases[c % 4]}, "Context",
+                    "M", format("%.4f", empirical_quality(n, e)), std::to_string(n), format("%.2f", e)});
+            }
+            for(int c = 0; c <= 2 * MaxCycle; c++)
+            {
+                uint64_t n = total.cycle_observations[key * (2 * MaxCycle + 1) + c];
+                if(n == 0)
+                    continue;
+                uint64_t e = total.cycle_errors[key * (2 * MaxCycle + 1) + c];
+                rows.push_back({read_groups[rg], std::to_string(q), std::to_string(c - MaxCycle), "Cycle",
+                    "M", format("%.4f", empirical_quality(n, e)), std::to_string(n), format("%.2f", e)});
+            }
+        }
+    }
+    write_table(out, "RecalTable2", "", {"ReadGroup", "QualityScore", "CovariateValue", "CovariateName", "EventType",
+        "EmpiricalQuality", "Observations", "Errors"}, "%s:%d:%s:%s:%s:%.4f:%d:%.2f", rows);
+    out.close();
+    return !out.fail();
+}
@@ -0,0 +1,83 @@
+/**
+ * Base quality recalibration tables collected during the output, so the BQSR table needs no pass of
+ * its own over the BAM.
+ *
+ * The covariates are the ones of GATK BaseRecalibrator: read group, reported quality, the
+ * dinucleotide context ending at the base and the machine cycle (negative for the second of pair),
+ * both in the sequencing direction. The mapped non-duplicate, non-secondary, QC-passed records of
+ * MAPQ 1-254 are counted; a base is an observation if it is aligned (M/=/X), of quality >= 6, not an N
+ * in the read or the reference, and not on a known site. It is an error if it differs from the reference.
+ *
+ * The output threads count in their own tables and fetch the reference through their own faidx
+ * handle, a window around the position at a time. The table is written as a GATKReport v1.1,
+ * the input of ApplyBQSR, with the base substitutions (event M) only. The empirical quality is
+ * -10 log10((errors + 1) / (observations + 2)).
+ */
+
+#ifndef BASE_RECALIBRATOR_H
+#define BASE_RECALIBRATOR_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tbb/enumerable_thread_specific.h>
+#include "sam.h"
+#include "faidx.h"
+#include "bitmap.h"
+
+class BaseRecalibrator
+{
+public:
+    BaseRecalibrator() = default;
+    ~BaseRecalibrator();
+
+    // open the indexed (or indexable) reference FASTA and load the known sites from a VCF or BED file,
+    // plain or gzipped, its contigs looked up in header. return false with a message on error
+    bool load(const char * reference_file, const char * known_sites_file, sam_hdr_t * header);
+
+    // count the bases of a record written to the output, called by any thread
+    void add(const bam1_t * record);
+
+    // merge the tables of the threads and write the report, return false on I/O error
+    bool write(const std::string &path);
+
+    static const int MaxQuality = 93;
+    static const int MaxCycle = 500;        // the cycles past it are not counted, as GATK's maximum_cycle_value
+    static const int MinQuality = 6;
+    static const int NumContexts = 16;
+
+private:
+    // observations and errors by read group and reported quality, then by context and by cycle
+    struct Tables
+    {
+        std::vector<uint64_t> observations, errors;                 // [rg][quality]
+        std::vector<uint64_t> context_observations, context_errors; // [rg][quality][context]
+        std::vector<uint64_t> cycle_observations, cycle_errors;     // [rg][quality][cycle + MaxCycle]
+        Tables(size_t num_groups);
+    };
+
+    // the reference of [begin, end) of one contig, kept by each thread
+    struct Window
+    {
+        faidx_t * fai = nullptr;
+        int tid = -1;
+        hts_pos_t begin = 0, end = 0;
+        char * bases = nullptr;
+        ~Window();
+    };
+
+    std::string reference_file;
+    sam_hdr_t * header = nullptr;
+    std::vector<std::string> read_groups;   // the @RG of header, then NA for the records without a known RG
+    std::unique_ptr<bitmap> known_sites;    // on the unified coordinate, none without --known-sites
+    std::unique_ptr<tbb::enumerable_thread_specific<Tables>> tables;
+    tbb::enumerable_thread_specific<Window> windows;
+
+    int read_group(const bam1_t * record) const;
+    // the reference base at pos of tid, 0 if past the contig or unreadable
+    char reference_base(Window &window, int tid, hts_pos_t pos, hts_pos_t end);
+    bool load_known_sites(const char * file);
+};
+
+#endif
@@ -0,0 +1,208 @@
+/**
+ * The implementation of Checkpoint class
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "Checkpoint.h"
+
+namespace fs = std::filesystem;
+
+static const uint32_t Magic = 0x4b48434d;   // "MCHK"
+static const uint32_t Version = 3;  // 2: the score of the pairs is 32 bits, 3: the UMIs are kept beside the pairs
+
+std::string Checkpoint::shape(const SormadupOptions &options)
+{
+    std::string s = std::string("mode=") + run_mode_name(options.mode);
+    s += " split=" + (options.split_output ? std::to_string(options.split_size) : std::string("off"));
+    s += " umi=" + (options.umi ? options.umi_tag : std::string("off"));
+    s += " regions=" + std::string(options.regions_file ? options.regions_file : "off");
+    s += options.drop_off_target ? " drop-off-target" : "";
+    s += options.ungrouped_input ? " ungrouped" : "";
+    return s;
+}
+
+template<typename Pair>
+void Checkpoint::write_pairs(std::ostream &out, const std::vector<std::vector<Pair *>> &rdds)
+{
+    static_assert(is_raw_bytes<Pair>, "the pairs are written as raw bytes");
+    write_value(out, (uint64_t)rdds.size());
+    std::vector<char> buffer;
+    for(auto &rdd : rdds)
+    {
+        // gathered first, the pairs are scattered over the caches
+        buffer.resize(rdd.size() * sizeof(Pair));
+        for(size_t i = 0; i < rdd.size(); i++)
+        {
+            memcpy(buffer.data() + i * sizeof(Pair), rdd[i], sizeof(Pair));
+        }
+        write_value(out, (uint64_t)rdd.size());
+        out.write(buffer.data(), buffer.size());
+    }
+}
+
+template<typename Pair>
+void Checkpoint::read_pairs(std::istream &in, std::vector<std::vector<Pair *>> &rdds)
+{
+    uint64_t num_partitions = 0;
+    read_value(in, num_partitions);
+    rdds.resize(in ? num_partitions : 0);
+    for(auto &rdd : rdds)
+    {
+        uint64_t size = 0;
+        read_value(in, size);
+        if(!in)
+            return;
+        storage.emplace_back(new char[size * sizeof(Pair)]);
+        char * pairs = storage.back().get();
+        in.read(pairs, size * sizeof(Pair));
+        rdd.resize(size);
+        for(uint64_t i = 0; i < size; i++)
+        {
+            rdd[i] = (Pair *)(pairs + i * sizeof(Pair));
+        }
+    }
+}
+
+void Checkpoint::write_umis(std::ostream &out, uint64_t num_pairIDs)
+{
+    // in blocks, the UMIs are as many as the pairIDs
+    std::vector<uint64_t> block;
+    for(uint64_t begin = 0; begin <= num_pairIDs; begin += UmiBlock)
+    {
+        block.clear();
+        for(uint64_t pairID = begin; pairID <= num_pairIDs && pairID < begin + UmiBlock; pairID++)
+        {
+            block.push_back(PairUmis::get(pairID));
+        }
+        out.write((const char *)block.data(), block.size() * sizeof(uint64_t));
+    }
+}
+
+void Checkpoint::read_umis(std::istream &in, uint64_t num_pairIDs)
+{
+    std::vector<uint64_t> block;
+    for(uint64_t begin = 0; begin <= num_pairIDs && in; begin += UmiBlock)
+    {
+        block.resize(std::min(UmiBlock, num_pairIDs + 1 - begin));
+        in.read((char *)block.data(), block.size() * sizeof(uint64_t));
+        for(uint64_t i = 0; i < block.size() && in; i++)
+        {
+            PairUmis::set(begin + i, block[i]);
+        }
+    }
+}
+
+bool Checkpoint::save(const std::string &dir, const SormadupOptions &options, const sam_hdr_t * header,
+                      uint64_t num_pairIDs, const BAMPartitioner &bam_partitioner,
+                      const std::vector<BAMPartitioner::tRDD> &rdds,
+                      const std::vector<RangePartitioner<DoublePair>::tRDD> &double_rdds,
+                      const std::vector<RangePartitioner<SinglePair>::tRDD> &single_rdds,
+                      const tAliases &aliases)
+{
+    const std::string temp_name = file_name(dir) + ".part";
+    std::ofstream out(temp_name, std::ios::binary | std::ios::trunc);
+    write_value(out, Magic);
+    write_value(out, Version);
+    std::string s = shape(options);
+    write_vector(out, std::vector<char>(s.begin(), s.end()));
+    const char * text = sam_hdr_str((sam_hdr_t *)header);
+    write_vector(out, std::vector<char>(text, text + sam_hdr_length((sam_hdr_t *)header)));
+    write_value(out, num_pairIDs);
+
+    // the page tables are framed, the partitions are only opened once the whole file is read
+    std::ostringstream tables;
+    bam_partitioner.save(tables);
+    std::string blob = tables.str();
+    write_value(out, bam_partitioner.getNumPartitions());
+    write_vector(out, std::vector<char>(blob.begin(), blob.end()));
+    write_value(out, (uint64_t)rdds.size());
+    for(auto &rdd : rdds)
+    {
+        write_vector(out, rdd);
+    }
+    write_pairs(out, double_rdds);
+    write_pairs(out, single_rdds);
+    write_vector(out, aliases);
+    if(options.umi)
+    {
+        write_umis(out, num_pairIDs);
+    }
+
+    out.close();
+    if(out.fail())
+    {
+        fs::remove(temp_name);
+        return false;
+    }
+    std::error_code error;
+    fs::rename(temp_name, file_name(dir), error);
+    return !error;
+}
+
+bool Checkpoint::load(const std::string &dir, const SormadupOptions &options)
+{
+    std::ifstream in(file_name(dir), std::ios::binary);
+    if(!in.is_open())
+    {
+        std::cerr << "no checkpoint in " << dir << std::endl;
+        return false;
+    }
+    uint32_t magic = 0, version = 0;
+    read_value(in, magic);
+    read_value(in, version);
+    if(magic != Magic || version != Version)
+    {
+        std::cerr << "unknown checkpoint format in " << dir << std::endl;
+        return false;
+    }
+    std::vector<char> saved_shape;
+    read_vector(in, saved_shape);
+    if(std::string(saved_shape.begin(), saved_shape.end()) != shape(options))
+    {
+        std::cerr << "the checkpoint was written with " << std::string(saved_shape.begin(), saved_shape.end())
+                  << ", not " << shape(options) << std::endl;
+        return false;
+    }
+    std::vector<char> text;
+    read_vector(in, text);
+    read_value(in, num_pairIDs);
+
+    uint32_t num_partitions = 0;
+    std::vector<char> tables;
+    read_value(in, num_partitions);
+    read_vector(in, tables);
+    uint64_t num_rdds = 0;
+    read_value(in, num_rdds);
+    rdds.resize(in ? num_rdds : 0);
+    for(auto &rdd : rdds)
+    {
+        read_vector(in, rdd);
+    }
+    read_pairs(in, double_rdds);
+    read_pairs(in, single_rdds);
+    read_vector(in, aliases);
+    if(options.umi)
+    {
+        PairUmis::enable();
+        read_umis(in, num_pairIDs);
+    }
+    if(!in || (header = sam_hdr_parse(text.size(), text.data())) == nullptr)
+    {
+        std::cerr << "truncated checkpoint in " << dir << std::endl;
+        return false;
+    }
+    std::istringstream tables_in(std::string(tables.begin(), tables.end()));
+    bam_partitioner.reset(new BAMPartitioner(spill_dir(dir), num_partitions, tables_in));
+    return true;
+}
+
+void Checkpoint::discard(const std::string &dir)
+{
+    std::error_code error;
+    fs::remove(file_name(dir), error);
+}
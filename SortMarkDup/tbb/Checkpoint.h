@@ -0,0 +1,122 @@
+/**
+ * The state of sort_markdup after the shuffle, kept so that a run failing later can be resumed.
+ *
+ * With --checkpoint DIR the sort partitions are spilled into DIR/spill instead of temp, and once the
+ * shuffle is done DIR/checkpoint is written (to a temporary name, then renamed): the header, the
+ * number of pairIDs handed out, the page tables of the spill files, the sort keys of every partition,
+ * the double and single pairs by value, the aliases of the mates matched from the spill and, with the
+ * UMI, the UMIs of the pairs by pairID.
+ * The bitmap of the double pair ends is rebuilt from the pairs rather than stored.
+ * --resume loads it and goes straight to the duplicate search; once the output is written the checkpoint
+ * and the spill files are removed, DIR itself and anything else in it are left alone.
+ *
+ * The file is raw host-endian binary, for the same build on the same machine, and is refused if the
+ * options shaping the partitions (mode, split, UMI, regions) differ from the ones it was written with.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "sam.h"
+#include "bam_partitioner.h"
+#include "range_partitioner.h"
+#include "options.h"
+
+// raw binary (de)serialization of values and vectors of values made of plain bytes. std::pair of scalars
+// is one of them although not trivially copyable, because of its operator=
+template<typename T>
+constexpr bool is_raw_bytes = std::is_trivially_copy_constructible<T>::value && std::is_trivially_destructible<T>::value;
+
+template<typename T>
+void write_value(std::ostream &out, const T &value)
+{
+    static_assert(is_raw_bytes<T>, "written as raw bytes");
+    out.write((const char *)&value, sizeof(T));
+}
+
+template<typename T>
+void read_value(std::istream &in, T &value)
+{
+    static_assert(is_raw_bytes<T>, "read as raw bytes");
+    in.read((char *)&value, sizeof(T));
+}
+
+template<typename T>
+void write_vector(std::ostream &out, const std::vector<T> &values)
+{
+    static_assert(is_raw_bytes<T>, "written as raw bytes");
+    write_value(out, (uint64_t)values.size());
+    out.write((const char *)values.data(), values.size() * sizeof(T));
+}
+
+template<typename T>
+void read_vector(std::istream &in, std::vector<T> &values)
+{
+    static_assert(is_raw_bytes<T>, "read as raw bytes");
+    uint64_t size = 0;
+    read_value(in, size);
+    values.resize(in ? size : 0);
+    in.read((char *)values.data(), values.size() * sizeof(T));
+}
+
+class Checkpoint
+{
+public:
+    typedef std::vector<std::pair<uint64_t, uint64_t>> tAliases;
+
+    // the state loaded by load, the rdds point into the storage of the checkpoint
+    sam_hdr_t * header = nullptr;
+    uint64_t num_pairIDs = 0;
+    std::unique_ptr<BAMPartitioner> bam_partitioner;
+    std::vector<BAMPartitioner::tRDD> rdds;
+    std::vector<RangePartitioner<DoublePair>::tRDD> double_rdds;
+    std::vector<RangePartitioner<SinglePair>::tRDD> single_rdds;
+    tAliases aliases;
+
+    // write dir/checkpoint, the spill files of bam_partitioner are flushed into dir already.
+    // return false on I/O error, the run goes on without checkpoint
+    static bool save(const std::string &dir, const SormadupOptions &options, const sam_hdr_t * header,
+                     uint64_t num_pairIDs, const BAMPartitioner &bam_partitioner,
+                     const std::vector<BAMPartitioner::tRDD> &rdds,
+                     const std::vector<RangePartitioner<DoublePair>::tRDD> &double_rdds,
+                     const std::vector<RangePartitioner<SinglePair>::tRDD> &single_rdds,
+                     const tAliases &aliases);
+
+    // load dir/checkpoint, return false with a message if it is missing, broken or written with other options
+    bool load(const std::string &dir, const SormadupOptions &options);
+
+    // remove a checkpoint left in dir by an earlier run, so a new run is never resumed from it
+    static void discard(const std::string &dir);
+
+    // the options the partitions depend on
+    static std::string shape(const SormadupOptions &options);
+
+    // the subdirectory of dir the sort partitions are spilled into, the run never removes anything else in dir
+    static std::string spill_dir(const std::string &dir) {return dir + "/spill";}
+
+private:
+    std::vector<std::unique_ptr<char[]>> storage;   // the pairs of double_rdds and single_rdds
+
+    static std::string file_name(const std::string &dir) {return dir + "/checkpoint";}
+
+    static const uint64_t UmiBlock = 1 << 20;   // the UMIs written or read at once
+
+    // the UMIs of the pairIDs up to num_pairIDs, kept beside the pairs
+    static void write_umis(std::ostream &out, uint64_t num_pairIDs);
+    static void read_umis(std::istream &in, uint64_t num_pairIDs);
+
+    template<typename Pair>
+    static void write_pairs(std::ostream &out, const std::vector<std::vector<Pair *>> &rdds);
+    template<typename Pair>
+    void read_pairs(std::istream &in, std::vector<std::vector<Pair *>> &rdds);
+};
+
+#endif
@@ -4,25 +4,26 @@
  */
 #include <iostream>
 #include "DoublePairCache.h"
+#include "HugePages.h"
 
-DoublePairCache::DoublePairCache() : offset(0)
+DoublePairCache::DoublePairCache() : offset(0), length(HugePages::slab_length(sizeof(DoublePair), INITIAL_LENGTH))
 {
-    cache.emplace_back(malloc(sizeof(DoublePair) * INITIAL_LENGTH));
+    cache.emplace_back(HugePages::allocate(HugePages::slab_size(sizeof(DoublePair), length)));
 }
 
 DoublePairCache::~DoublePairCache()
 {
     for(auto & DoublePairArray : cache)
     {
-        free(DoublePairArray);
+        HugePages::release(DoublePairArray);
     }
 }
 
 DoublePair * DoublePairCache::getSpace()
 {
-    if(offset >= INITIAL_LENGTH)
+    if(offset >= length)
     {
-        cache.emplace_back(malloc(sizeof(DoublePair) * INITIAL_LENGTH));
+        cache.emplace_back(HugePages::allocate(HugePages::slab_size(sizeof(DoublePair), length)));
         offset = 0;
     }
     DoublePair * result = (DoublePair*)cache.back() + offset;
@@ -0,0 +1,143 @@
+/**
+ * The implementation of HugePages class
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+#include "HugePages.h"
+
+HugePages::Policy HugePages::policy = HugePages::Policy::Thp;
+std::mutex HugePages::lock;
+std::unordered_map<void *, size_t> HugePages::mappings;
+std::atomic_uint64_t HugePages::thp_bytes(0);
+std::atomic_uint64_t HugePages::hugetlb_bytes(0);
+std::atomic_uint64_t HugePages::num_fallbacks(0);
+
+bool HugePages::set_policy(const std::string &name)
+{
+    if(name == "off")
+        policy = Policy::Off;
+    else if(name == "thp")
+        policy = Policy::Thp;
+    else if(name == "hugetlb")
+        policy = Policy::Hugetlb;
+    else
+        return false;
+    return true;
+}
+
+void * HugePages::map_thp(size_t length)
+{
+    // map one more page and trim both ends, so the region starts on a huge page boundary
+    char * p = (char *)mmap(nullptr, length + PageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        return nullptr;
+    char * aligned = (char *)(((uintptr_t)p + PageSize - 1) & ~(uintptr_t)(PageSize - 1));
+    if(aligned > p)
+        munmap(p, aligned - p);
+    if(aligned + length < p + length + PageSize)
+        munmap(aligned + length, p + length + PageSize - (aligned + length));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+    thp_bytes += length;
+    return aligned;
+}
+
+void * HugePages::allocate(size_t size)
+{
+    if(!maps(size))
+        return calloc(size, 1);
+
+    const size_t length = (size + PageSize - 1) & ~(PageSize - 1);
+    void * p = nullptr;
+#ifdef MAP_HUGETLB
+    if(policy == Policy::Hugetlb)
+    {
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p == MAP_FAILED)
+        {
+            p = nullptr;
+            num_fallbacks++;
+        }
+        else
+        {
+            hugetlb_bytes += length;
+        }
+    }
+#endif
+    if(p == nullptr)
+        p = map_thp(length);
+    if(p == nullptr)
+        return calloc(size, 1);
+
+    std::lock_guard<std::mutex> guard(lock);
+    mappings[p] = length;
+    return p;
+}
+
+void HugePages::release(void * p)
+{
+    if(p == nullptr)
+        return;
+    size_t length = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = mappings.find(p);
+        if(iter != mappings.end())
+        {
+            length = iter->second;
+            mappings.erase(iter);
+        }
+    }
+    if(length == 0)
+        free(p);
+    else
+        munmap(p, length);
+}
+
+size_t HugePages::slab_length(size_t element_size, size_t min_length)
+{
+    if(policy == Policy::Off)
+        return min_length;
+    // a slab rounded down to whole elements would fall short of its last page, or of the one page it needs
+    // to be mapped at all, so the pages are counted first and filled with the elements fitting in them
+    const size_t num_pages = std::max<size_t>(1, (min_length * element_size + PageSize - 1) / PageSize);
+    const size_t length = num_pages * PageSize / element_size;
+    assert(maps(slab_size(element_size, length)));
+    return length;
+}
+
+size_t HugePages::slab_size(size_t element_size, size_t length)
+{
+    const size_t size = element_size * length;
+    if(policy == Policy::Off)
+        return size;
+    return (size + PageSize - 1) & ~(PageSize - 1);
+}
+
+std::string HugePages::summary()
+{
+    static const char * policy_name[] = {"off", "thp", "hugetlb"};
+    std::ostringstream out;
+    out << "huge pages: " << policy_name[(int)policy] << ", " << thp_bytes / 1048576 << " MB madvised, "
+        << hugetlb_bytes / 1048576 << " MB hugetlb";
+    if(num_fallbacks > 0)
+        out << " (" << num_fallbacks << " fell back to thp)";
+    // what the kernel really backed with transparent huge pages, at this point
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    std::string line;
+    while(std::getline(smaps, line))
+    {
+        if(line.compare(0, 14, "AnonHugePages:") == 0)
+        {
+            out << ", AnonHugePages " << strtoull(line.c_str() + 14, nullptr, 10) / 1024 << " MB";
+            break;
+        }
+    }
+    return out.str();
+}
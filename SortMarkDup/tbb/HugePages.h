@@ -0,0 +1,58 @@
+/**
+ * Huge page backing of the large allocations walked at random or streamed at high rate: the bitmaps,
+ * the slabs of the pair caches, the frames of the spill page pool and the partitions reloaded by
+ * BAMRecordBuffer::readData. With 4 KB pages every one of them misses the TLB nearly on each access.
+ *
+ * The policy "thp" maps them anonymously, aligned to a huge page, and asks for transparent huge pages
+ * with madvise(MADV_HUGEPAGE), which works with THP set to "madvise" as well as "always". "hugetlb"
+ * takes them from the reserved huge pages (MAP_HUGETLB, see vm.nr_hugepages) and falls back to thp
+ * when the reservation runs out. "off" keeps malloc. The allocations smaller than a huge page always
+ * come from malloc. The memory is zeroed, as by calloc, and its pages are first touched by the user.
+ */
+
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class HugePages
+{
+public:
+    // "off", "thp" or "hugetlb". return false if the name is unknown
+    static bool set_policy(const std::string &name);
+
+    // size bytes of zeroed memory, give it back with release
+    static void * allocate(size_t size);
+    static void release(void * p);
+
+    // whether allocate maps size bytes, the smaller allocations and all of them with "off" come from calloc
+    static bool maps(size_t size) {return policy != Policy::Off && size >= PageSize;}
+
+    // the elements of element_size bytes in a slab: min_length, or as many as fit in the whole huge pages
+    // holding at least min_length when they are used
+    static size_t slab_length(size_t element_size, size_t min_length);
+    // the bytes to allocate for a slab of length elements, rounded up to the whole huge pages it sits in
+    static size_t slab_size(size_t element_size, size_t length);
+
+    // one line summary of the bytes mapped by every policy and of the huge pages the kernel gave
+    static std::string summary();
+
+    static const size_t PageSize = 2 << 20;
+
+private:
+    enum class Policy {Off, Thp, Hugetlb};
+
+    static Policy policy;
+    static std::mutex lock;
+    static std::unordered_map<void *, size_t> mappings;   // the mapped allocations and their lengths
+    static std::atomic_uint64_t thp_bytes, hugetlb_bytes, num_fallbacks;
+
+    static void * map_thp(size_t length);
+};
+
+#endif
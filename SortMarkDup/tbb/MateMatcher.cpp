@@ -0,0 +1,158 @@
+/**
+ * The implementation of MateMatcher class
+ */
+
+#include <cassert>
+#include <filesystem>
+#include <iostream>
+#include <string_view>
+#include "MateMatcher.h"
+
+MateMatcher::MateMatcher(size_t max_memory, const std::string &directory, uint32_t num_buckets) :
+    max_memory(max_memory), directory(directory), buckets(num_buckets), memory(0), spilled_records(0)
+{
+}
+
+MateMatcher::~MateMatcher()
+{
+    for(uint32_t i = 0; i < buckets.size(); i++)
+    {
+        if(buckets[i].spilled)
+        {
+            buckets[i].file.close();
+            std::filesystem::remove(file_name(i));
+        }
+    }
+    std::error_code ec;
+    std::filesystem::remove(directory, ec);   // the directory is left alone if it is not empty
+}
+
+bool MateMatcher::need_mate(const BAMRecord * record)
+{
+    return !record->ignorable() && (record->flag() & BAM_FPAIRED) && !(record->flag() & BAM_FMUNMAP);
+}
+
+std::string MateMatcher::file_name(uint32_t bucket) const
+{
+    return directory + "/mate" + std::to_string(bucket) + ".db";
+}
+
+void MateMatcher::write_entry(std::fstream &file, const std::string &qname, const SinglePair &pair)
+{
+    uint16_t length = qname.size();
+    file.write((const char *)&length, sizeof(length));
+    file.write(qname.data(), length);
+    file.write((const char *)&pair, sizeof(SinglePair));
+}
+
+std::optional<SinglePair> MateMatcher::match(BAMRecord * record)
+{
+    std::string qname(record->qname());
+    uint32_t b = std::hash<std::string_view>()(qname) % buckets.size();
+    Bucket &bucket = buckets[b];
+    std::lock_guard<std::mutex> guard(bucket.lock);
+
+    if(bucket.spilled)
+    {
+        write_entry(bucket.file, qname, SinglePair(record));
+        spilled_records++;
+        return std::nullopt;
+    }
+
+    auto iter = bucket.waiting.find(qname);
+    if(iter != bucket.waiting.end())
+    {
+        SinglePair mate = iter->second;
+        bucket.waiting.erase(iter);
+        bucket.memory -= entry_size(qname);
+        memory -= entry_size(qname);
+        record->set_pairID(mate.get_pairID());
+        return mate;
+    }
+
+    size_t size = entry_size(qname);
+    bucket.waiting.emplace(std::move(qname), SinglePair(record));
+    bucket.memory += size;
+    // over the cap, spill the bucket being filled if it holds at least its share of the table
+    if((memory += size) > max_memory && bucket.memory * buckets.size() >= memory)
+    {
+        spill(b);
+    }
+    return std::nullopt;
+}
+
+// called with the lock of the bucket held
+void MateMatcher::spill(uint32_t b)
+{
+    Bucket &bucket = buckets[b];
+    if(!std::filesystem::is_directory(directory))
+    {
+        std::filesystem::create_directories(directory);
+    }
+    bucket.file.open(file_name(b), std::ios::binary | std::ios::trunc | std::ios::in | std::ios::out);
+    if(!bucket.file.is_open())
+    {
+        std::cerr << "can't open " << file_name(b) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    for(auto &entry : bucket.waiting)
+    {
+        write_entry(bucket.file, entry.first, entry.second);
+    }
+    spilled_records += bucket.waiting.size();
+    memory -= bucket.memory;
+    bucket.memory = 0;
+    bucket.spilled = true;
+    std::unordered_map<std::string, SinglePair>().swap(bucket.waiting);
+}
+
+void MateMatcher::drain(uint32_t b, const std::function<void(const SinglePair&, const SinglePair&)> &on_pair,
+    const std::function<void(const SinglePair&)> &on_single)
+{
+    Bucket &bucket = buckets[b];
+    std::lock_guard<std::mutex> guard(bucket.lock);
+
+    if(bucket.spilled)
+    {
+        // only one spilled bucket is loaded by a thread at a time
+        std::vector<std::pair<uint64_t, uint64_t>> matched;
+        bucket.file.flush();
+        bucket.file.seekg(0);
+        std::string qname;
+        alignas(SinglePair) char pair[sizeof(SinglePair)];
+        uint16_t length;
+        while(bucket.file.read((char *)&length, sizeof(length)))
+        {
+            qname.resize(length);
+            bucket.file.read(&qname[0], length);
+            bucket.file.read(pair, sizeof(SinglePair));
+            assert(bucket.file);
+            const SinglePair &end = *reinterpret_cast<SinglePair *>(pair);
+
+            auto iter = bucket.waiting.find(qname);
+            if(iter == bucket.waiting.end())
+            {
+                bucket.waiting.emplace(qname, end);
+                continue;
+            }
+            on_pair(iter->second, end);
+            matched.emplace_back(end.get_pairID(), iter->second.get_pairID());
+            bucket.waiting.erase(iter);
+        }
+        bucket.file.close();
+        std::filesystem::remove(file_name(b));
+        bucket.spilled = false;
+
+        std::lock_guard<std::mutex> alias_guard(alias_lock);
+        alias_list.insert(alias_list.end(), matched.begin(), matched.end());
+    }
+
+    // the mates never came
+    for(auto &entry : bucket.waiting)
+    {
+        on_single(entry.second);
+    }
+    memory -= bucket.memory;
+    bucket.memory = 0;
+    std::unordered_map<std::string, SinglePair>().swap(bucket.waiting);
+}
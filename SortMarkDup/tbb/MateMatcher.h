@@ -0,0 +1,79 @@
+/**
+ * Match the mates of inputs which are not grouped by QNAME, e.g. coordinate-sorted SAM.
+ *
+ * A record waiting for its mate is kept as a SinglePair summary in a hash table split into buckets
+ * by the QNAME hash. When the table grows over its memory cap, the bucket being filled is spilled
+ * to a file and the later records hashed to it are appended there (Grace hash join), the spilled
+ * buckets are matched one at a time by drain() once the input is exhausted.
+ *
+ * Every record is emitted as soon as it is parsed, so the matching never holds a BAMRecord:
+ *   - matched in memory, the record takes the pairID of its mate
+ *   - matched in drain, the pair keeps the pairID of the first end and the second one is an alias of it,
+ *     resolve the aliases after the duplicate search
+ */
+
+#ifndef MATE_MATCHER_H
+#define MATE_MATCHER_H
+
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "bam_record.h"
+#include "pair.h"
+
+class MateMatcher
+{
+public:
+    // max_memory in bytes, the files of the spilled buckets are created in directory
+    MateMatcher(size_t max_memory, const std::string &directory, uint32_t num_buckets = 256);
+    ~MateMatcher();
+
+    // whether a record has a mate to wait for: a primary alignment of a pair whose mate is mapped
+    static bool need_mate(const BAMRecord * record);
+
+    // return the summary of the mate if it is waiting in memory, the record takes its pairID.
+    // otherwise the record is kept until its mate comes or drain() is called
+    std::optional<SinglePair> match(BAMRecord * record);
+
+    // match what is left in a bucket, called once per bucket after the last match().
+    // the buckets may be drained in parallel
+    void drain(uint32_t bucket, const std::function<void(const SinglePair&, const SinglePair&)> &on_pair,
+        const std::function<void(const SinglePair&)> &on_single);
+
+    uint32_t num_buckets() const {return buckets.size();}
+    uint64_t num_spilled() const {return spilled_records;}
+
+    // (alias, pairID) of the pairs matched by drain(), the alias is a duplicate if the pairID is
+    const std::vector<std::pair<uint64_t, uint64_t>>& aliases() const {return alias_list;}
+
+private:
+    struct Bucket
+    {
+        std::mutex lock;
+        std::unordered_map<std::string, SinglePair> waiting;
+        size_t memory = 0;
+        bool spilled = false;
+        std::fstream file;
+    };
+
+    const size_t max_memory;
+    const std::string directory;
+    std::vector<Bucket> buckets;
+    std::atomic_size_t memory;
+    std::atomic_uint64_t spilled_records;
+    std::mutex alias_lock;
+    std::vector<std::pair<uint64_t, uint64_t>> alias_list;
+
+    static size_t entry_size(const std::string &qname) {return qname.size() + sizeof(SinglePair) + 64;}
+    std::string file_name(uint32_t bucket) const;
+    void spill(uint32_t bucket);
+    static void write_entry(std::fstream &file, const std::string &qname, const SinglePair &pair);
+};
+
+#endif
@@ -0,0 +1,191 @@
+/**
+ * The implementation of Metrics class
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "Metrics.h"
+
+std::mutex Metrics::registry_lock;
+std::vector<std::unique_ptr<Metrics::Counters>> Metrics::registry;
+std::mutex Metrics::lock;
+std::vector<Metrics::Stage> Metrics::stages;
+uint64_t Metrics::last_totals[(int)Counter::NumCounter] = {0};
+std::vector<Metrics::Queue> Metrics::queues;
+std::vector<Metrics::Distribution> Metrics::distributions;
+std::vector<std::pair<std::string, std::string>> Metrics::values;
+
+static const char * counter_name[] = {
+    "bam_records", "parsed_records", "parsed_bytes", "single_pairs", "double_pairs",
+    "spill_raw_bytes", "spill_encoded_bytes", "store_raw_bytes", "store_encoded_bytes",
+    "reload_bytes", "output_records", "duplicate_records"
+};
+static_assert(sizeof(counter_name) / sizeof(counter_name[0]) == (size_t)Counter::NumCounter, "a name per counter");
+
+// the resident set size now, in KB
+static uint64_t current_rss_kb()
+{
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size, resident;
+    if(statm >> size >> resident)
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+    return 0;
+}
+
+static uint64_t peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static std::string quote(const std::string &s)
+{
+    std::string out = "\"";
+    for(char c : s)
+    {
+        if(c == '"' || c == '\\')
+            out += '\\';
+        if((unsigned char)c >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+Metrics::Counters * Metrics::enroll()
+{
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry.emplace_back(new Counters);
+    return registry.back().get();
+}
+
+uint64_t Metrics::total(Counter counter)
+{
+    std::lock_guard<std::mutex> guard(registry_lock);
+    uint64_t sum = 0;
+    for(auto &c : registry)
+    {
+        sum += c->values[(int)counter].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+void Metrics::stage(const std::string &name, double seconds, double total_seconds)
+{
+    Stage s;
+    s.name = name;
+    s.seconds = seconds;
+    s.total_seconds = total_seconds;
+    s.rss_kb = current_rss_kb();
+    std::lock_guard<std::mutex> guard(lock);
+    for(int i = 0; i < (int)Counter::NumCounter; i++)
+    {
+        uint64_t now = total((Counter)i);
+        s.counters[i] = now - last_totals[i];
+        last_totals[i] = now;
+    }
+    stages.push_back(s);
+}
+
+void Metrics::sample_queue(const std::string &name, uint64_t depth)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = std::find_if(queues.begin(), queues.end(), [&name](const Queue &q){return q.name == name;});
+    if(iter == queues.end())
+    {
+        queues.push_back(Queue());
+        iter = queues.end() - 1;
+        iter->name = name;
+    }
+    iter->samples++;
+    iter->sum += depth;
+    iter->max = std::max(iter->max, depth);
+}
+
+void Metrics::distribution(const std::string &name, std::vector<uint64_t> sizes)
+{
+    Distribution d = {name, sizes.size(), 0, 0, 0, 0, 0, 0};
+    if(!sizes.empty())
+    {
+        std::sort(sizes.begin(), sizes.end());
+        for(auto size : sizes)
+            d.total += size;
+        d.min = sizes.front();
+        d.p50 = sizes[sizes.size() / 2];
+        d.p90 = sizes[sizes.size() * 9 / 10];
+        d.p99 = sizes[sizes.size() * 99 / 100];
+        d.max = sizes.back();
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    distributions.push_back(d);
+}
+
+void Metrics::set(const std::string &name, const std::string &value)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    values.emplace_back(name, quote(value));
+}
+
+void Metrics::set(const std::string &name, uint64_t value)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    values.emplace_back(name, std::to_string(value));
+}
+
+bool Metrics::write_json(const std::string &path)
+{
+    std::ofstream out(path);
+    std::lock_guard<std::mutex> guard(lock);
+    out << "{\n  \"version\": 1";
+    for(auto &value : values)
+    {
+        out << ",\n  " << quote(value.first) << ": " << value.second;
+    }
+
+    out << ",\n  \"stages\": [";
+    for(size_t i = 0; i < stages.size(); i++)
+    {
+        const Stage &s = stages[i];
+        out << (i ? "," : "") << "\n    {\"name\": " << quote(s.name) << ", \"seconds\": " << s.seconds
+            << ", \"total_seconds\": " << s.total_seconds << ", \"rss_kb\": " << s.rss_kb;
+        for(int c = 0; c < (int)Counter::NumCounter; c++)
+        {
+            if(s.counters[c] > 0)
+                out << ", \"" << counter_name[c] << "\": " << s.counters[c];
+        }
+        out << "}";
+    }
+    out << "\n  ]";
+
+    out << ",\n  \"totals\": {";
+    for(int c = 0; c < (int)Counter::NumCounter; c++)
+    {
+        out << (c ? ", " : "") << "\"" << counter_name[c] << "\": " << total((Counter)c);
+    }
+    out << "}";
+
+    out << ",\n  \"queues\": {";
+    for(size_t i = 0; i < queues.size(); i++)
+    {
+        const Queue &q = queues[i];
+        out << (i ? ", " : "") << quote(q.name) << ": {\"samples\": " << q.samples << ", \"mean\": "
+            << (q.samples ? (double)q.sum / q.samples : 0) << ", \"max\": " << q.max << "}";
+    }
+    out << "}";
+
+    out << ",\n  \"partitions\": {";
+    for(size_t i = 0; i < distributions.size(); i++)
+    {
+        const Distribution &d = distributions[i];
+        out << (i ? "," : "") << "\n    " << quote(d.name) << ": {\"count\": " << d.count << ", \"total\": " << d.total
+            << ", \"min\": " << d.min << ", \"p50\": " << d.p50 << ", \"p90\": " << d.p90 << ", \"p99\": " << d.p99
+            << ", \"max\": " << d.max << "}";
+    }
+    out << "\n  }";
+
+    out << ",\n  \"peak_rss_kb\": " << peak_rss_kb() << "\n}\n";
+    out.close();
+    return !out.fail();
+}
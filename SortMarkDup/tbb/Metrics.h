@@ -0,0 +1,106 @@
+/**
+ * Per-stage metrics of tbb-sormadup, written as a JSON file with --metrics.
+ *
+ * The counters are kept per thread and only summed at the stage boundaries, the ones marked by
+ * time_stamp(), so counting a record costs an uncontended add. The counters of a thread are
+ * enrolled in a registry on its first add and outlive it.
+ * A stage reports the counters added since the previous boundary, its duration and the RSS at its end.
+ * The gauges (LineQueue depth) and the partition size distributions are recorded as they come.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class Counter
+{
+    BamRecords = 0,     // BAMRecords constructed
+    ParsedRecords,      // SAM lines parsed
+    ParsedBytes,
+    SinglePairs,
+    DoublePairs,
+    SpillRawBytes,      // pages spilled by the sort partitions, before and after compression
+    SpillEncodedBytes,
+    StoreRawBytes,      // batches kept by the ordered record store, before and after compression
+    StoreEncodedBytes,
+    ReloadBytes,        // spilled data read back
+    OutputRecords,
+    DuplicateRecords,   // records marked or removed as duplicates
+    NumCounter
+};
+
+class Metrics
+{
+public:
+    static void add(Counter counter, uint64_t n = 1)
+    {
+        local().values[(int)counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // the sum over all the threads
+    static uint64_t total(Counter counter);
+
+    // close the current stage, called by time_stamp
+    static void stage(const std::string &name, double seconds, double total_seconds);
+
+    // one sample of the depth of a queue
+    static void sample_queue(const std::string &name, uint64_t depth);
+
+    // the sizes of the partitions of a partitioner
+    static void distribution(const std::string &name, std::vector<uint64_t> sizes);
+
+    // free form values of the run, e.g. the thread budget
+    static void set(const std::string &name, const std::string &value);
+    static void set(const std::string &name, uint64_t value);
+
+    // write every metric to path, return false on I/O error
+    static bool write_json(const std::string &path);
+
+private:
+    struct Counters
+    {
+        std::atomic_uint64_t values[(int)Counter::NumCounter];
+        Counters() {for(auto &v : values) v = 0;}
+    };
+    struct Stage
+    {
+        std::string name;
+        double seconds, total_seconds;
+        uint64_t rss_kb;
+        uint64_t counters[(int)Counter::NumCounter];
+    };
+    struct Queue
+    {
+        std::string name;
+        uint64_t samples = 0, sum = 0, max = 0;
+    };
+    struct Distribution
+    {
+        std::string name;
+        uint64_t count, total, min, p50, p90, p99, max;
+    };
+
+    static std::mutex registry_lock;
+    static std::vector<std::unique_ptr<Counters>> registry;     // the counters of every thread
+    static std::mutex lock;     // protects everything but the counters
+    static std::vector<Stage> stages;
+    static uint64_t last_totals[(int)Counter::NumCounter];
+    static std::vector<Queue> queues;
+    static std::vector<Distribution> distributions;
+    static std::vector<std::pair<std::string, std::string>> values;
+
+    static Counters * enroll();
+    static Counters & local()
+    {
+        thread_local Counters * mine = enroll();
+        return *mine;
+    }
+};
+
+#endif
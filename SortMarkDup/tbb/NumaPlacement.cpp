@@ -0,0 +1,115 @@
+/**
+ * The implementation of NumaPlacement class
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <sched.h>
+#include <tbb/info.h>
+#include <tbb/parallel_for.h>
+#include "NumaPlacement.h"
+
+// parse a sysfs cpu list such as "0-3,8-11"
+static std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while(std::getline(ss, range, ','))
+    {
+        if(range.empty())
+            continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for(int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+NumaPlacement::NumaPlacement(int num_threads)
+{
+    for(auto id : tbb::info::numa_nodes())
+    {
+        nodes.push_back(id);
+    }
+    if(nodes.size() > 1)
+    {
+        int per_node = std::max(num_threads / (int)nodes.size(), 1);
+        for(int id : nodes)
+        {
+            arenas.emplace_back(new tbb::task_arena(tbb::task_arena::constraints(id, per_node)));
+        }
+    }
+    for(size_t n = 0; n < nodes.size(); n++)
+    {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(nodes[n]) + "/cpulist");
+        std::string list;
+        if(!std::getline(file, list))
+            continue;
+        for(int cpu : parse_cpu_list(list))
+        {
+            if(cpu >= (int)cpu_node.size())
+                cpu_node.resize(cpu + 1, -1);
+            cpu_node[cpu] = n;
+        }
+    }
+    stats.reset(new Stat[nodes.size()]);
+}
+
+void NumaPlacement::account(int node, uint64_t bytes)
+{
+    Stat &s = stats[node];
+    s.tasks++;
+    s.bytes += bytes;
+    int cpu = sched_getcpu();
+    if(nodes.size() > 1 && cpu >= 0 && cpu < (int)cpu_node.size() && cpu_node[cpu] != node)
+    {
+        s.remote_bytes += bytes;
+    }
+}
+
+void NumaPlacement::place(bitmap &bits, int copies, bool interleave)
+{
+    const uint64_t length = bits.length();
+    const int num = nodes.size();
+    if(num == 1)
+    {
+        bits.clear(0, length);
+        return;
+    }
+    tbb::parallel_for(0, num, [&](int n){
+        execute(n, length / 8 / num, [&](){
+            if(interleave)
+            {
+                // 2 MB blocks, the pages of a block stay on one node
+                const uint64_t block = 1ULL << 24;
+                for(uint64_t begin = n * block; begin < length; begin += num * block)
+                    bits.clear(begin, std::min(begin + block, length));
+                return;
+            }
+            uint64_t slice = length / copies;
+            for(int c = 0; c < copies; c++)
+            {
+                uint64_t begin = c * slice + slice * n / num;
+                uint64_t end = (c == copies - 1 && n == num - 1) ? length : c * slice + slice * (n + 1) / num;
+                bits.clear(begin, end);
+            }
+        });
+    });
+}
+
+std::string NumaPlacement::summary() const
+{
+    std::ostringstream out;
+    out << "numa:";
+    for(size_t n = 0; n < nodes.size(); n++)
+    {
+        const Stat &s = stats[n];
+        out << " node" << nodes[n] << " " << s.tasks << " tasks " << s.bytes / 1048576.0 << "MB"
+            << " (" << s.remote_bytes / 1048576.0 << "MB remote)";
+    }
+    return out.str();
+}
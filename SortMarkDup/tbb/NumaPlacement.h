@@ -0,0 +1,86 @@
+/**
+ * NUMA placement of the partitions after the shuffle.
+ *
+ * The partitions are given to the NUMA nodes seen by TBB in contiguous blocks, so the neighbouring
+ * ranges of the reference, and of the position-indexed bitmap, share a node. The tasks of a partition
+ * run in a task_arena constrained to its node, and the memory they allocate is first touched there.
+ * Every task also records whether the thread running it really sat on the owning node, the bytes of
+ * the tasks that did not are reported as remote.
+ *
+ * Without tbbbind (hwloc) TBB sees one node, the tasks then run in the calling arena as before.
+ */
+
+#ifndef NUMA_PLACEMENT_H
+#define NUMA_PLACEMENT_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tbb/task_arena.h>
+#include "bitmap.h"
+
+class NumaPlacement
+{
+public:
+    // num_threads are shared among the nodes
+    NumaPlacement(int num_threads);
+
+    int num_nodes() const {return nodes.size();}
+
+    // the node owning partition p of num_partitions
+    int node_of(uint32_t p, uint32_t num_partitions) const
+    {
+        return (uint64_t)p * nodes.size() / num_partitions;
+    }
+
+    // run f on node, bytes is the memory f mostly walks through
+    template<typename F>
+    void execute(int node, uint64_t bytes, F &&f)
+    {
+        if(arenas.empty())
+        {
+            account(node, bytes);
+            f();
+            return;
+        }
+        arenas[node]->execute([this, node, bytes, &f](){
+            account(node, bytes);
+            f();
+        });
+    }
+
+    // move the storage of v to the calling node, call it in the task owning v
+    template<typename V>
+    void localize(V &v) const
+    {
+        if(nodes.size() > 1)
+            V(v).swap(v);
+    }
+
+    // clear a bitmap created without zeroing, node n first touches the n-th block of every one
+    // of the copies equal slices of it (a position-indexed bitmap holds a slice per strand),
+    // or the lines round robin if interleave
+    void place(bitmap &bits, int copies, bool interleave);
+
+    // tasks, MB and remote MB per node
+    std::string summary() const;
+
+private:
+    struct Stat
+    {
+        std::atomic_uint64_t tasks{0};
+        std::atomic_uint64_t bytes{0};
+        std::atomic_uint64_t remote_bytes{0};
+    };
+
+    std::vector<int> nodes;                             // the NUMA node ids
+    std::vector<std::unique_ptr<tbb::task_arena>> arenas;   // empty with one node
+    std::vector<int> cpu_node;                          // the node of every cpu, from sysfs
+    std::unique_ptr<Stat[]> stats;
+
+    // called by the thread running the task
+    void account(int node, uint64_t bytes);
+};
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * The implementation of OrderedRecordStore class
+ */
+
+#include <cassert>
+#include <cstring>
+#include <lz4.h>
+#include "OrderedRecordStore.h"
+
+OrderedRecordStore::~OrderedRecordStore()
+{
+    for(auto &block : blocks)
+    {
+        free(block.data);
+    }
+}
+
+void OrderedRecordStore::put(uint64_t batch_id, std::vector<BAMRecord *> &records)
+{
+    // the same layout as BAMRecordBuffer
+    size_t length = 0;
+    for(auto record : records)
+    {
+        length += SpillRecord::size(record->get_record());
+    }
+
+    char * buffer = (char *)calloc(length, 1);
+    size_t offset = 0;
+    for(auto record : records)
+    {
+        offset += SpillRecord::store(buffer + offset, record->get_record());
+        delete record;
+    }
+    records.clear();
+
+    Block block;
+    block.length = (int)length;
+    block.data = (char *)malloc(LZ4_compressBound(block.length));
+    block.compressed_length = LZ4_compress_default(buffer, block.data, block.length, LZ4_compressBound(block.length));
+    assert(block.length == 0 || block.compressed_length > 0);
+    block.data = (char *)realloc(block.data, block.compressed_length > 0 ? block.compressed_length : 1);
+    Metrics::add(Counter::StoreRawBytes, block.length);
+    Metrics::add(Counter::StoreEncodedBytes, block.compressed_length);
+    free(buffer);
+
+    blocks.grow_to_at_least(batch_id + 1);
+    blocks[batch_id] = block;
+}
+
+unsigned char * OrderedRecordStore::load(uint64_t batch_id, size_t &length) const
+{
+    const Block &block = blocks[batch_id];
+    length = block.length;
+    unsigned char * buffer = (unsigned char *)malloc(length > 0 ? length : 1);
+    if(block.length > 0)
+    {
+        int uncompressed_length = LZ4_decompress_safe(block.data, (char *)buffer, block.compressed_length, block.length);
+        assert(uncompressed_length == block.length);
+    }
+    return buffer;
+}
+
+void OrderedRecordStore::release(uint64_t batch_id)
+{
+    Block &block = blocks[batch_id];
+    free(block.data);
+    block.data = nullptr;
+}
+
+size_t OrderedRecordStore::next(const unsigned char * data, size_t offset, bam1_t * b)
+{
+    return offset + SpillRecord::load(data + offset, b);
+}
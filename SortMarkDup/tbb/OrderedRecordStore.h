@@ -0,0 +1,45 @@
+/**
+ * A class used to keep the parsed BAMRecords of every input batch in memory, LZ4 compressed,
+ * so that they can be written back in the original input order once the duplicates are known
+ */
+
+#ifndef ORDERED_RECORD_STORE_H
+#define ORDERED_RECORD_STORE_H
+
+#include <vector>
+#include <tbb/concurrent_vector.h>
+#include "bam_record.h"
+#include "SpillRecord.h"
+
+class OrderedRecordStore
+{
+private:
+    struct Block
+    {
+        char * data = nullptr;      // compressed records of one batch
+        int compressed_length = 0;
+        int length = 0;             // length after decompression
+    };
+
+    tbb::concurrent_vector<Block> blocks;   // indexed by the batch id
+
+public:
+    OrderedRecordStore() = default;
+    ~OrderedRecordStore();
+
+    // serialize and compress the records of batch `batch_id`, the records are deleted afterwards
+    void put(uint64_t batch_id, std::vector<BAMRecord *> &records);
+
+    size_t num_batches() const {return blocks.size();}
+
+    // decompress the records of a batch, remember to free it. length is set to the decompressed size
+    unsigned char * load(uint64_t batch_id, size_t &length) const;
+
+    // release the compressed data of a batch once it has been written
+    void release(uint64_t batch_id);
+
+    // point b to the record at `offset` and return the offset of the following one
+    static size_t next(const unsigned char * data, size_t offset, bam1_t * b);
+};
+
+#endif
@@ -0,0 +1,237 @@
+/**
+ * The implementation of QcStats class
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include "QcStats.h"
+#include "bam_record.h"
+
+QcStats::QcStats(const std::string &p, const RegionIndex * t): prefix(p), targets(t)
+{
+    if(targets != nullptr)
+    {
+        uint64_t accumulate = 0;
+        for(size_t i = 0; i < targets->size(); i++)
+        {
+            target_starts.push_back(targets->start(i));
+            target_offsets.push_back(accumulate);
+            accumulate += targets->end(i) - targets->start(i);
+        }
+        target_offsets.push_back(accumulate);
+        depth_steps.reset(new std::atomic<int32_t>[accumulate + 1]());
+    }
+}
+
+void QcStats::Counts::merge(const Counts &other)
+{
+    for(int w = 0; w < 2; w++)
+    {
+        total[w] += other.total[w];
+        primary[w] += other.primary[w];
+        secondary[w] += other.secondary[w];
+        supplementary[w] += other.supplementary[w];
+        duplicates[w] += other.duplicates[w];
+        primary_duplicates[w] += other.primary_duplicates[w];
+        mapped[w] += other.mapped[w];
+        primary_mapped[w] += other.primary_mapped[w];
+        paired[w] += other.paired[w];
+        read1[w] += other.read1[w];
+        read2[w] += other.read2[w];
+        proper_pair[w] += other.proper_pair[w];
+        both_mapped[w] += other.both_mapped[w];
+        singletons[w] += other.singletons[w];
+        mate_other_chr[w] += other.mate_other_chr[w];
+        mate_other_chr_q5[w] += other.mate_other_chr_q5[w];
+    }
+    for(size_t i = 0; i < insert_sizes.size(); i++)
+        insert_sizes[i] += other.insert_sizes[i];
+    for(size_t i = 0; i < mapq.size(); i++)
+        mapq[i] += other.mapq[i];
+}
+
+void QcStats::add(const bam1_t * record)
+{
+    Counts &c = counts.local();
+    const uint16_t flag = record->core.flag;
+    const int w = (flag & BAM_FQCFAIL) ? 1 : 0;
+    const bool mapped = (flag & BAM_FUNMAP) == 0;
+
+    // the rules of samtools flagstat
+    c.total[w]++;
+    if(flag & BAM_FSECONDARY)
+    {
+        c.secondary[w]++;
+    }
+    else if(flag & BAM_FSUPPLEMENTARY)
+    {
+        c.supplementary[w]++;
+    }
+    else
+    {
+        c.primary[w]++;
+        if(flag & BAM_FPAIRED)
+        {
+            c.paired[w]++;
+            if((flag & BAM_FPROPER_PAIR) && mapped)
+                c.proper_pair[w]++;
+            if(flag & BAM_FREAD1)
+                c.read1[w]++;
+            if(flag & BAM_FREAD2)
+                c.read2[w]++;
+            if((flag & BAM_FMUNMAP) && mapped)
+                c.singletons[w]++;
+            if(mapped && !(flag & BAM_FMUNMAP))
+            {
+                c.both_mapped[w]++;
+                if(record->core.mtid != record->core.tid)
+                {
+                    c.mate_other_chr[w]++;
+                    if(record->core.qual >= 5)
+                        c.mate_other_chr_q5[w]++;
+                }
+                // the leftmost end counts the pair
+                else if(w == 0 && !(flag & BAM_FDUP) && record->core.isize > 0)
+                {
+                    c.insert_sizes[std::min<int64_t>(record->core.isize, MaxInsertSize)]++;
+                }
+            }
+        }
+        if(mapped)
+        {
+            c.primary_mapped[w]++;
+            c.mapq[record->core.qual]++;
+        }
+        if(flag & BAM_FDUP)
+            c.primary_duplicates[w]++;
+    }
+    if(mapped)
+        c.mapped[w]++;
+    if(flag & BAM_FDUP)
+        c.duplicates[w]++;
+
+    if(targets != nullptr && mapped && record->core.tid >= 0
+       && (flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP)) == 0)
+    {
+        cover(record);
+    }
+}
+
+uint64_t QcStats::targeted_offset(uint64_t pos) const
+{
+    // the last target starting at or before pos
+    size_t i = std::upper_bound(target_starts.begin(), target_starts.end(), pos) - target_starts.begin();
+    if(i == 0)
+        return 0;
+    i--;
+    return target_offsets[i] + std::min(pos - targets->start(i), targets->end(i) - targets->start(i));
+}
+
+void QcStats::cover(const bam1_t * record)
+{
+    uint64_t start = BAMRecord::kTable[record->core.tid] + record->core.pos;
+    uint64_t end = BAMRecord::kTable[record->core.tid] + bam_endpos(record);
+    uint64_t first = targeted_offset(start), last = targeted_offset(end);
+    if(first < last)
+    {
+        depth_steps[first].fetch_add(1, std::memory_order_relaxed);
+        depth_steps[last].fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+static std::string percent(uint64_t n, uint64_t total)
+{
+    if(total == 0)
+        return "N/A";
+    char text[32];
+    snprintf(text, sizeof(text), "%.2f%%", 100.0 * n / total);
+    return text;
+}
+
+bool QcStats::write_flagstat(const Counts &c) const
+{
+    FILE * out = fopen((prefix + ".flagstat").c_str(), "w");
+    if(out == nullptr)
+        return false;
+    auto line = [out](const uint64_t n[2], const char * name){
+        fprintf(out, "%" PRIu64 " + %" PRIu64 " %s", n[0], n[1], name);
+    };
+    auto ratio = [out](const uint64_t n[2], const uint64_t total[2]){
+        fprintf(out, " (%s : %s)\n", percent(n[0], total[0]).c_str(), percent(n[1], total[1]).c_str());
+    };
+    line(c.total, "in total (QC-passed reads + QC-failed reads)\n");
+    line(c.primary, "primary\n");
+    line(c.secondary, "secondary\n");
+    line(c.supplementary, "supplementary\n");
+    line(c.duplicates, "duplicates\n");
+    line(c.primary_duplicates, "primary duplicates\n");
+    line(c.mapped, "mapped");
+    ratio(c.mapped, c.total);
+    line(c.primary_mapped, "primary mapped");
+    ratio(c.primary_mapped, c.primary);
+    line(c.paired, "paired in sequencing\n");
+    line(c.read1, "read1\n");
+    line(c.read2, "read2\n");
+    line(c.proper_pair, "properly paired");
+    ratio(c.proper_pair, c.paired);
+    line(c.both_mapped, "with itself and mate mapped\n");
+    line(c.singletons, "singletons");
+    ratio(c.singletons, c.paired);
+    line(c.mate_other_chr, "with mate mapped to a different chr\n");
+    line(c.mate_other_chr_q5, "with mate mapped to a different chr (mapQ>=5)\n");
+    return fclose(out) == 0;
+}
+
+bool QcStats::write_histogram(const std::string &name, const char * column, const std::vector<uint64_t> &histogram) const
+{
+    std::ofstream out(prefix + name);
+    out << column << "\tcount\n";
+    for(size_t i = 0; i < histogram.size(); i++)
+    {
+        if(histogram[i] != 0)
+            out << i << "\t" << histogram[i] << "\n";
+    }
+    out.close();
+    return !out.fail();
+}
+
+bool QcStats::write_coverage(const sam_hdr_t * header) const
+{
+    std::ofstream out(prefix + ".coverage.tsv");
+    out << "contig\tstart\tend\tmean_depth\n";
+    std::vector<uint64_t> histogram(MaxDepth + 1, 0);
+    int64_t depth = 0;
+    for(size_t i = 0; i < targets->size(); i++)
+    {
+        uint64_t sum = 0;
+        for(uint64_t k = target_offsets[i]; k < target_offsets[i + 1]; k++)
+        {
+            depth += depth_steps[k].load(std::memory_order_relaxed);
+            sum += depth;
+            histogram[std::min<int64_t>(depth, MaxDepth)]++;
+        }
+        // the targets are on the unified coordinate, printed as BED on their contig
+        uint64_t start = targets->start(i);
+        int tid = std::upper_bound(BAMRecord::kTable.begin(), BAMRecord::kTable.end(), start) - BAMRecord::kTable.begin() - 1;
+        uint64_t length = target_offsets[i + 1] - target_offsets[i];
+        out << sam_hdr_tid2name((sam_hdr_t *)header, tid) << "\t" << start - BAMRecord::kTable[tid] << "\t"
+            << start - BAMRecord::kTable[tid] + length << "\t" << (double)sum / length << "\n";
+    }
+    out.close();
+    return !out.fail() && write_histogram(".depth.tsv", "depth", histogram);
+}
+
+bool QcStats::write(const sam_hdr_t * header)
+{
+    Counts total;
+    for(auto &c : counts)
+        total.merge(c);
+    bool written = write_flagstat(total)
+        && write_histogram(".insert_size.tsv", "insert_size", total.insert_sizes)
+        && write_histogram(".mapq.tsv", "mapq", total.mapq);
+    if(written && targets != nullptr)
+        written = write_coverage(header);
+    return written;
+}
@@ -0,0 +1,76 @@
+/**
+ * QC of the output computed while it is written, so samtools flagstat/stats and a coverage tool need
+ * not read the BAM again.
+ *
+ * Every output thread adds the records it writes (after the duplicate flag, without the removed
+ * duplicates) to its own counters, merged when the output is done:
+ *   PREFIX.flagstat            the counts of samtools flagstat, in its format
+ *   PREFIX.insert_size.tsv     the insert sizes of the mapped pairs on one contig, once per pair
+ *   PREFIX.mapq.tsv            the MAPQ of the mapped primary records
+ * and with target regions:
+ *   PREFIX.coverage.tsv        the mean depth of each target
+ *   PREFIX.depth.tsv           the number of targeted bases at each depth
+ * The depth counts the aligned span of the mapped records which are neither secondary, QC failed
+ * nor duplicates (as mosdepth does by default); it is kept as +1/-1 steps per targeted base.
+ */
+
+#ifndef QC_STATS_H
+#define QC_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tbb/enumerable_thread_specific.h>
+#include "sam.h"
+#include "RegionIndex.h"
+
+class QcStats
+{
+public:
+    // targets may be null, then no coverage is computed
+    QcStats(const std::string &prefix, const RegionIndex * targets);
+
+    // count a record written to the output, called by any thread
+    void add(const bam1_t * record);
+
+    // merge the counters of the threads and write the files, return false on I/O error
+    bool write(const sam_hdr_t * header);
+
+    static const int MaxInsertSize = 10000;     // the larger ones are counted at MaxInsertSize
+    static const int MaxDepth = 10000;
+
+private:
+    // the counters of flagstat, [0] for the QC-passed records, [1] for the QC-failed ones
+    struct Counts
+    {
+        uint64_t total[2] = {0}, primary[2] = {0}, secondary[2] = {0}, supplementary[2] = {0};
+        uint64_t duplicates[2] = {0}, primary_duplicates[2] = {0}, mapped[2] = {0}, primary_mapped[2] = {0};
+        uint64_t paired[2] = {0}, read1[2] = {0}, read2[2] = {0}, proper_pair[2] = {0};
+        uint64_t both_mapped[2] = {0}, singletons[2] = {0}, mate_other_chr[2] = {0}, mate_other_chr_q5[2] = {0};
+        std::vector<uint64_t> insert_sizes = std::vector<uint64_t>(MaxInsertSize + 1, 0);
+        std::vector<uint64_t> mapq = std::vector<uint64_t>(256, 0);
+
+        void merge(const Counts &other);
+    };
+
+    const std::string prefix;
+    const RegionIndex * targets;
+    tbb::enumerable_thread_specific<Counts> counts;
+
+    // the depth steps on the targeted bases, see targeted_offset
+    std::vector<uint64_t> target_starts;
+    std::vector<uint64_t> target_offsets;   // targeted bases before target i, one more for the total
+    std::unique_ptr<std::atomic<int32_t>[]> depth_steps;
+
+    // the number of targeted bases before the unified coordinate pos
+    uint64_t targeted_offset(uint64_t pos) const;
+    void cover(const bam1_t * record);
+
+    bool write_flagstat(const Counts &total) const;
+    bool write_histogram(const std::string &name, const char * column, const std::vector<uint64_t> &histogram) const;
+    bool write_coverage(const sam_hdr_t * header) const;
+};
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * The implementation of RegionIndex class
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "RegionIndex.h"
+
+bool RegionIndex::load(const char * bed_file, sam_hdr_t * header)
+{
+    std::ifstream in(bed_file);
+    if(!in.is_open())
+    {
+        return false;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> intervals;
+    std::string line;
+    size_t skipped = 0;
+    while(std::getline(in, line))
+    {
+        if(line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0 || line.compare(0, 7, "browser") == 0)
+            continue;
+        std::istringstream fields(line);
+        std::string contig;
+        uint64_t start, end;
+        if(!(fields >> contig >> start >> end))
+        {
+            std::cerr << "malformed BED line: " << line << std::endl;
+            return false;
+        }
+        int tid = sam_hdr_name2tid(header, contig.c_str());
+        if(tid < 0 || start >= end)
+        {
+            skipped++;
+            continue;
+        }
+        uint64_t length = BAMRecord::kTable[tid + 1] - BAMRecord::kTable[tid];
+        intervals.emplace_back(BAMRecord::kTable[tid] + std::min(start, length),
+                               BAMRecord::kTable[tid] + std::min(end, length));
+    }
+    if(skipped > 0)
+    {
+        std::cerr << skipped << " BED lines on unknown contigs or empty are skipped" << std::endl;
+    }
+
+    // merge the overlapping intervals
+    std::sort(intervals.begin(), intervals.end());
+    for(auto &interval : intervals)
+    {
+        if(!ends.empty() && interval.first <= ends.back())
+        {
+            ends.back() = std::max(ends.back(), interval.second);
+        }
+        else
+        {
+            starts.push_back(interval.first);
+            ends.push_back(interval.second);
+        }
+    }
+    total_length = 0;
+    for(size_t i = 0; i < starts.size(); i++)
+    {
+        total_length += ends[i] - starts[i];
+    }
+    return true;
+}
+
+bool RegionIndex::overlap(uint64_t start, uint64_t end) const
+{
+    // the first interval ending after start
+    auto iter = std::upper_bound(ends.begin(), ends.end(), start);
+    if(iter == ends.end())
+    {
+        return false;
+    }
+    return starts[iter - ends.begin()] < end;
+}
+
+bool RegionIndex::overlap(BAMRecord * record) const
+{
+    bam1_t * b = record->get_record();
+    if(b->core.tid < 0)
+    {
+        return false;
+    }
+    uint64_t start = record->sort_key();
+    // an unmapped read placed next to its mate covers one base
+    uint64_t end = (b->core.flag & BAM_FUNMAP) ? start + 1 : record->reference_end();
+    return overlap(start, std::max(end, start + 1));
+}
+
+std::vector<uint64_t> RegionIndex::partition_bounds(uint32_t num_partitions) const
+{
+    std::vector<uint64_t> bounds(num_partitions + 1, 0);
+    bounds[num_partitions] = BAMRecord::kTable.back() + 1;
+    size_t i = 0;
+    uint64_t accumulate = 0;    // targeted length before starts[i]
+    for(uint32_t k = 1; k < num_partitions; k++)
+    {
+        uint64_t target = total_length * k / num_partitions;
+        while(i < starts.size() && accumulate + (ends[i] - starts[i]) <= target)
+        {
+            accumulate += ends[i] - starts[i];
+            i++;
+        }
+        bounds[k] = i < starts.size() ? starts[i] + (target - accumulate) : bounds[num_partitions];
+        bounds[k] = std::max(bounds[k], bounds[k - 1]);
+    }
+    return bounds;
+}
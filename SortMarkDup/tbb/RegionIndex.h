@@ -0,0 +1,44 @@
+/**
+ * A class used to index the target regions of a BED file on the unified coordinate (BAMRecord::kTable)
+ */
+
+#ifndef REGION_INDEX_H
+#define REGION_INDEX_H
+
+#include <vector>
+#include "sam.h"
+#include "bam_record.h"
+
+class RegionIndex
+{
+public:
+    RegionIndex() = default;
+
+    // load a BED file, the contigs are looked up in header. return false if the file can't be read
+    bool load(const char * bed_file, sam_hdr_t * header);
+
+    // whether the unified range [start, end) overlaps a target
+    bool overlap(uint64_t start, uint64_t end) const;
+
+    // whether the alignment of a record overlaps a target, unplaced records never do
+    bool overlap(BAMRecord * record) const;
+
+    // the total length of the targets
+    uint64_t targeted_length() const {return total_length;}
+
+    // split the targeted space into num_partitions ranges of the same targeted length.
+    // return num_partitions + 1 bounds on the unified coordinate, the last one is past all the records
+    std::vector<uint64_t> partition_bounds(uint32_t num_partitions) const;
+
+    size_t size() const {return starts.size();}
+    uint64_t start(size_t i) const {return starts[i];}
+    uint64_t end(size_t i) const {return ends[i];}
+
+private:
+    // sorted and merged intervals [starts[i], ends[i])
+    std::vector<uint64_t> starts;
+    std::vector<uint64_t> ends;
+    uint64_t total_length = 0;
+};
+
+#endif
@@ -0,0 +1,359 @@
+/**
+ * The implementation of Shard class
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <thread>
+#include "Shard.h"
+#include "Checkpoint.h"
+
+namespace fs = std::filesystem;
+
+// the empty block closing every BGZF file
+static const char BgzfEof[28] = {
+    '\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', '\x06', 0, '\x42', '\x43',
+    '\x02', 0, '\x1b', 0, '\x03', 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint32_t BaiMetaBin = 37450;   // the pseudo-bin holding the offsets and counts of a reference
+
+Shard::Shard(const std::string &d, int index, int count, uint64_t reference_length, uint64_t r):
+    dir(d), me(index), num_shards(count), run(r)
+{
+    end_key = reference_length + 1;
+    span = (end_key + num_shards - 1) / num_shards;
+}
+
+int Shard::owner(uint64_t key) const
+{
+    return std::min<uint64_t>(key / span, num_shards - 1);
+}
+
+std::vector<uint64_t> Shard::partition_bounds(int num_partitions) const
+{
+    uint64_t begin = me * span;
+    uint64_t end = me == num_shards - 1 ? end_key : begin + span;
+    std::vector<uint64_t> bounds;
+    for(int i = 0; i <= num_partitions; i++)
+    {
+        bounds.push_back(begin + (end - begin) * i / num_partitions);
+    }
+    return bounds;
+}
+
+uint64_t Shard::fingerprint(const std::string &input_file, const std::string &header_text, const std::string &shape,
+                            int count)
+{
+    // FNV-1a, the same on every host whatever the standard library
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto add = [&hash](const void * data, size_t size){
+        for(size_t i = 0; i < size; i++)
+        {
+            hash = (hash ^ ((const unsigned char *)data)[i]) * 0x100000001b3ULL;
+        }
+    };
+    std::error_code error;
+    uint64_t size = fs::file_size(input_file, error);
+    int64_t modified = fs::last_write_time(input_file, error).time_since_epoch().count();
+    add(&size, sizeof(size));
+    add(&modified, sizeof(modified));
+    add(header_text.data(), header_text.size());
+    add(shape.data(), shape.size());
+    add(&count, sizeof(count));
+    return hash == 0 ? 1 : hash;
+}
+
+void Shard::clear(const std::string &dir, int i)
+{
+    std::error_code error;
+    fs::remove(done_file(dir, i), error);
+    fs::remove(dups_file(dir, i), error);
+    fs::remove(bam_file(dir, i), error);
+    fs::remove(bam_file(dir, i) + ".bai", error);
+}
+
+bool Shard::write_duplicates(const std::vector<uint64_t> &pairIDs) const
+{
+    // renamed once complete, the other shards poll for the name
+    const std::string temp_name = dups_file(dir, me) + ".part";
+    std::ofstream out(temp_name, std::ios::binary | std::ios::trunc);
+    write_value(out, run);
+    write_vector(out, pairIDs);
+    out.close();
+    std::error_code error;
+    if(!out.fail())
+    {
+        fs::rename(temp_name, dups_file(dir, me), error);
+    }
+    return !out.fail() && !error;
+}
+
+uint64_t Shard::run_of(const std::string &name)
+{
+    std::ifstream in(name, std::ios::binary);
+    uint64_t run = 0;
+    read_value(in, run);
+    return in ? run : 0;
+}
+
+bool Shard::read_duplicates(bitmap &duplicate_index, int timeout) const
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    for(int i = 0; i < num_shards; i++)
+    {
+        if(i == me)
+            continue;
+        // a file of another run is left by a worker not started yet, it will be replaced
+        const std::string name = dups_file(dir, i);
+        bool waited = false;
+        while(run_of(name) != run)
+        {
+            if(timeout > 0 && std::chrono::steady_clock::now() >= deadline)
+            {
+                std::cerr << "no duplicates from shard " << i << " after " << timeout << " seconds"
+                          << (fs::exists(name) ? ", " + name + " is of another run" : "") << std::endl;
+                return false;
+            }
+            if(!waited)
+            {
+                std::cout << "waiting for the duplicates of shard " << i << std::endl;
+                waited = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+        std::ifstream in(name, std::ios::binary);
+        uint64_t written_run = 0;
+        std::vector<uint64_t> pairIDs;
+        read_value(in, written_run);
+        read_vector(in, pairIDs);
+        if(!in || written_run != run)
+        {
+            std::cerr << "broken duplicates of shard " << i << ": " << name << std::endl;
+            return false;
+        }
+        for(auto pairID : pairIDs)
+        {
+            if(pairID >= duplicate_index.length())
+            {
+                std::cerr << "shard " << i << " was run on another input" << std::endl;
+                return false;
+            }
+            duplicate_index.set(pairID);
+        }
+    }
+    return true;
+}
+
+bool Shard::write_done(uint64_t data_offset) const
+{
+    std::ofstream out(done_file(dir, me), std::ios::trunc);
+    out << data_offset << " " << run << std::endl;
+    out.close();
+    return !out.fail();
+}
+
+bool Shard::parse(const char * text, int &index, int &count)
+{
+    char * end = nullptr;
+    index = strtol(text, &end, 10);
+    if(end == text || *end != '/')
+        return false;
+    const char * second = end + 1;
+    count = strtol(second, &end, 10);
+    return end != second && *end == 0 && count > 0 && index >= 0 && index < count;
+}
+
+// the bins, meta data and linear index of one reference of a BAI
+struct BaiReference
+{
+    std::map<uint32_t, std::vector<std::pair<uint64_t, uint64_t>>> bins;
+    bool has_meta = false;
+    uint64_t begin = 0, end = 0;    // virtual offsets of the first and past the last record
+    uint64_t mapped = 0, unmapped = 0;
+    std::vector<uint64_t> intervals;
+};
+
+// read path into references, the virtual offsets shifted by shift bytes of the compressed file
+static bool read_bai(const std::string &path, int64_t shift, std::vector<BaiReference> &references, uint64_t &no_coordinate)
+{
+    std::ifstream in(path, std::ios::binary);
+    char magic[4] = {0};
+    in.read(magic, 4);
+    int32_t num_references = 0;
+    read_value(in, num_references);
+    if(!in || memcmp(magic, "BAI\1", 4) != 0 || (!references.empty() && (size_t)num_references != references.size()))
+        return false;
+    references.resize(num_references);
+    const uint64_t delta = (uint64_t)shift << 16;
+    for(auto &reference : references)
+    {
+        int32_t num_bins = 0;
+        read_value(in, num_bins);
+        for(int32_t b = 0; b < num_bins && in; b++)
+        {
+            uint32_t bin = 0;
+            int32_t num_chunks = 0;
+            read_value(in, bin);
+            read_value(in, num_chunks);
+            std::vector<std::pair<uint64_t, uint64_t>> chunks(std::max(num_chunks, 0));
+            for(auto &chunk : chunks)
+            {
+                read_value(in, chunk.first);
+                read_value(in, chunk.second);
+            }
+            if(bin == BaiMetaBin && chunks.size() == 2)
+            {
+                // the first shard holding the reference gives the begin, the last one the end
+                if(!reference.has_meta)
+                    reference.begin = chunks[0].first + delta;
+                reference.end = chunks[0].second + delta;
+                reference.mapped += chunks[1].first;
+                reference.unmapped += chunks[1].second;
+                reference.has_meta = true;
+                continue;
+            }
+            auto &merged = reference.bins[bin];
+            for(auto &chunk : chunks)
+            {
+                merged.emplace_back(chunk.first + delta, chunk.second + delta);
+            }
+        }
+        int32_t num_intervals = 0;
+        read_value(in, num_intervals);
+        if(reference.intervals.size() < (size_t)std::max(num_intervals, 0))
+            reference.intervals.resize(num_intervals, 0);
+        for(int32_t w = 0; w < num_intervals && in; w++)
+        {
+            // the smallest offset of the shards is the one to seek to
+            uint64_t offset = 0;
+            read_value(in, offset);
+            if(offset != 0 && (reference.intervals[w] == 0 || offset + delta < reference.intervals[w]))
+                reference.intervals[w] = offset + delta;
+        }
+    }
+    if(!in)
+        return false;
+    uint64_t count = 0;
+    read_value(in, count);
+    if(in)
+        no_coordinate += count;
+    return true;
+}
+
+static bool write_bai(const std::string &path, const std::vector<BaiReference> &references, uint64_t no_coordinate)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write("BAI\1", 4);
+    write_value(out, (int32_t)references.size());
+    for(auto &reference : references)
+    {
+        write_value(out, (int32_t)(reference.bins.size() + reference.has_meta));
+        for(auto &bin : reference.bins)
+        {
+            write_value(out, bin.first);
+            write_value(out, (int32_t)bin.second.size());
+            for(auto &chunk : bin.second)
+            {
+                write_value(out, chunk.first);
+                write_value(out, chunk.second);
+            }
+        }
+        if(reference.has_meta)
+        {
+            write_value(out, BaiMetaBin);
+            write_value(out, (int32_t)2);
+            write_value(out, reference.begin);
+            write_value(out, reference.end);
+            write_value(out, reference.mapped);
+            write_value(out, reference.unmapped);
+        }
+        write_value(out, (int32_t)reference.intervals.size());
+        for(auto offset : reference.intervals)
+        {
+            write_value(out, offset);
+        }
+    }
+    write_value(out, no_coordinate);
+    out.close();
+    return !out.fail();
+}
+
+// append the bytes [begin, end) of in to out
+static bool copy_range(std::ifstream &in, uint64_t begin, uint64_t end, std::ofstream &out)
+{
+    std::vector<char> buffer(4 * 1024 * 1024);
+    in.seekg(begin);
+    while(begin < end && in)
+    {
+        uint64_t size = std::min<uint64_t>(buffer.size(), end - begin);
+        in.read(buffer.data(), size);
+        out.write(buffer.data(), in.gcount());
+        begin += in.gcount();
+    }
+    return begin == end && !out.fail();
+}
+
+bool Shard::merge(const std::string &dir, int count, const std::string &output_file)
+{
+    std::ofstream out(output_file, std::ios::binary | std::ios::trunc);
+    std::vector<BaiReference> references;
+    uint64_t no_coordinate = 0;
+    uint64_t first_run = 0;
+    for(int i = 0; i < count; i++)
+    {
+        std::ifstream done(done_file(dir, i));
+        uint64_t data_offset = 0, run = 0;
+        if(!(done >> data_offset >> run))
+        {
+            std::cerr << "shard " << i << " is not done: " << done_file(dir, i) << std::endl;
+            return false;
+        }
+        // every shard must come from the same run
+        if(i == 0)
+            first_run = run;
+        else if(run != first_run)
+        {
+            std::cerr << "shard " << i << " was run on another input or with other options than shard 0" << std::endl;
+            return false;
+        }
+        // the records of the shard lie between its header and its EOF block
+        const std::string name = bam_file(dir, i);
+        std::ifstream in(name, std::ios::binary);
+        std::error_code error;
+        uint64_t size = fs::file_size(name, error);
+        char eof[sizeof(BgzfEof)];
+        in.seekg(size - sizeof(BgzfEof));
+        in.read(eof, sizeof(eof));
+        if(error || size < data_offset + sizeof(BgzfEof) || !in || memcmp(eof, BgzfEof, sizeof(eof)) != 0)
+        {
+            std::cerr << "truncated shard " << name << std::endl;
+            return false;
+        }
+        // every shard has the header of the input, the first one is kept
+        bool copied = i > 0 || copy_range(in, 0, data_offset, out);
+        int64_t shift = (int64_t)out.tellp() - (int64_t)data_offset;
+        if(!copied || !copy_range(in, data_offset, size - sizeof(BgzfEof), out))
+        {
+            std::cerr << "can't copy " << name << " to " << output_file << std::endl;
+            return false;
+        }
+        if(!read_bai(name + ".bai", shift, references, no_coordinate))
+        {
+            std::cerr << "can't merge the index " << name << ".bai" << std::endl;
+            return false;
+        }
+    }
+    out.write(BgzfEof, sizeof(BgzfEof));
+    out.close();
+    if(out.fail())
+    {
+        std::cerr << "can't write " << output_file << std::endl;
+        return false;
+    }
+    return write_bai(output_file + ".bai", references, no_coordinate);
+}
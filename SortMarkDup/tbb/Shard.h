@@ -0,0 +1,86 @@
+/**
+ * Multi-process sharding of sort_markdup.
+ *
+ * The unified coordinate space (BAMRecord::kTable) is split into N equal shard ranges, the last
+ * one also holding the unplaced reads. Worker i of N parses the whole input, but keeps only the
+ * records and the duplicate partitions (by the pair key) falling in its range, and writes them to
+ * DIR/shard.i.bam with its index. DIR is on a filesystem shared by the workers, which may run on
+ * several hosts.
+ *
+ * A pair is decided by the shard of its key, while its records, supplementary ones included, may
+ * fall in other shards. The pairIDs are made the same in every worker (the input line of the pair),
+ * and after the duplicate search each worker writes DIR/dups.i: the duplicate pairs it decided that
+ * have records in other shards. Before its output, a worker waits for the dups files of all the
+ * others, at most --shard-timeout seconds, and marks their pairs. DIR/shard.i.done is written last,
+ * with the offset where the records start after the header.
+ *
+ * The dups and done files carry the fingerprint of the run: the input (size, modification time and
+ * header), the options shaping the partitions and the number of shards. The workers of other hosts
+ * only clear their own files, so a file left by an earlier run on another input is told apart and
+ * waited past; one of an identical run holds the same duplicates.
+ *
+ * The final step concatenates the bodies of the shard BAMs behind one header and merges their BAI
+ * indexes, shifting the virtual offsets; nothing is decompressed.
+ */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "bitmap.h"
+
+class Shard
+{
+public:
+    // run is the fingerprint shared by the workers of the run
+    Shard(const std::string &dir, int index, int count, uint64_t reference_length, uint64_t run);
+
+    int index() const {return me;}
+    int count() const {return num_shards;}
+
+    // the shard owning a unified coordinate or pair key, the keys past the end belong to the last one
+    int owner(uint64_t key) const;
+    bool owns(uint64_t key) const {return owner(key) == me;}
+
+    // num_partitions even bounds over the range of this shard, for the partitioners
+    std::vector<uint64_t> partition_bounds(int num_partitions) const;
+
+    std::string spill_dir() const {return dir + "/temp." + std::to_string(me);}
+
+    // write the duplicate pairIDs exchanged with the other shards, return false on I/O error
+    bool write_duplicates(const std::vector<uint64_t> &pairIDs) const;
+    // wait for the duplicates of every other shard and set them in duplicate_index. return false if
+    // one of them is broken or isn't written by this run within timeout seconds (0 for no limit)
+    bool read_duplicates(bitmap &duplicate_index, int timeout) const;
+    // mark the shard BAM complete, data_offset is where its records start
+    bool write_done(uint64_t data_offset) const;
+
+    // the fingerprint of a run on input_file with header_text, shape being the options the partitions depend on
+    static uint64_t fingerprint(const std::string &input_file, const std::string &header_text, const std::string &shape,
+                                int count);
+    // the output of worker i in dir
+    static std::string bam_file(const std::string &dir, int i) {return dir + "/shard." + std::to_string(i) + ".bam";}
+    // remove the files left in dir by an earlier run of worker i
+    static void clear(const std::string &dir, int i);
+    // parse the "i/N" of --shard
+    static bool parse(const char * text, int &index, int &count);
+    // concatenate the shard BAMs of dir into output_file and merge their indexes
+    static bool merge(const std::string &dir, int count, const std::string &output_file);
+
+private:
+    const std::string dir;
+    const int me;
+    const int num_shards;
+    const uint64_t run;
+    uint64_t span;          // the unified coordinates per shard
+    uint64_t end_key;       // the end of the last shard, past the unplaced reads
+
+    static std::string dups_file(const std::string &dir, int i) {return dir + "/dups." + std::to_string(i);}
+    // the fingerprint of the run which wrote the dups file name, 0 if it is missing or broken
+    static uint64_t run_of(const std::string &name);
+    static std::string done_file(const std::string &dir, int i) {return dir + "/shard." + std::to_string(i) + ".done";}
+};
+
+#endif
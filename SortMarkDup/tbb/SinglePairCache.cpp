@@ -4,25 +4,26 @@
  */
 #include <iostream>
 #include "SinglePairCache.h"
+#include "HugePages.h"
 
-SinglePairCache::SinglePairCache() : offset(0)
+SinglePairCache::SinglePairCache() : offset(0), length(HugePages::slab_length(sizeof(SinglePair), INITIAL_LENGTH))
 {
-    cache.emplace_back(malloc(sizeof(SinglePair) * INITIAL_LENGTH));
+    cache.emplace_back(HugePages::allocate(HugePages::slab_size(sizeof(SinglePair), length)));
 }
 
 SinglePairCache::~SinglePairCache()
 {
     for(auto & singlePairArray : cache)
     {
-        free(singlePairArray);
+        HugePages::release(singlePairArray);
     }
 }
 
 SinglePair * SinglePairCache::getSpace()
 {
-    if(offset >= INITIAL_LENGTH)
+    if(offset >= length)
     {
-        cache.emplace_back(malloc(sizeof(SinglePair) * INITIAL_LENGTH));
+        cache.emplace_back(HugePages::allocate(HugePages::slab_size(sizeof(SinglePair), length)));
         offset = 0;
     }
     SinglePair * result = (SinglePair*)cache.back() + offset;
@@ -15,6 +15,7 @@ class SinglePairCache{
 private:
     std::vector<void *> cache;
     uint32_t offset;
+    const uint32_t length;      // the pairs of a slab, whole huge pages of them when HugePages are used
 
 public:
     SinglePairCache();
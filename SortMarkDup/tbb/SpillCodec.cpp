@@ -0,0 +1,219 @@
+/**
+ * The implementation of SpillCodec class
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <lz4.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "SpillCodec.h"
+
+bool SpillCodec::adaptive = false;
+SpillCodecId SpillCodec::fixed = SpillCodecId::LZ4;
+int SpillCodec::zstd_level = 1;
+
+std::mutex SpillCodec::lock;
+SpillCodec::Stat SpillCodec::stats[SpillCodec::NumCodec];
+uint64_t SpillCodec::written_bytes = 0;
+double SpillCodec::write_seconds = 0;
+uint64_t SpillCodec::num_pages = 0;
+uint64_t SpillCodec::num_writes = 0;
+
+static const char * codec_name[] = {"none", "lz4", "zstd"};
+
+bool SpillCodec::set_policy(const std::string &name)
+{
+    adaptive = false;
+    if(name == "auto")
+        adaptive = true;
+    else if(name == "none")
+        fixed = SpillCodecId::None;
+    else if(name == "lz4")
+        fixed = SpillCodecId::LZ4;
+    else if(name.compare(0, 4, "zstd") == 0 && (name.size() == 4 || name[4] == ':'))
+    {
+        fixed = SpillCodecId::Zstd;
+        if(name.size() > 5)
+            zstd_level = atoi(name.c_str() + 5);
+    }
+    else
+        return false;
+    return adaptive || available(fixed);
+}
+
+bool SpillCodec::available(SpillCodecId codec)
+{
+#ifdef HAVE_ZSTD
+    (void)codec;
+    return true;
+#else
+    return codec != SpillCodecId::Zstd;
+#endif
+}
+
+size_t SpillCodec::bound(size_t length)
+{
+    size_t capacity = std::max(length, (size_t)LZ4_compressBound(length));
+#ifdef HAVE_ZSTD
+    capacity = std::max(capacity, ZSTD_compressBound(length));
+#endif
+    return capacity;
+}
+
+SpillCodecId SpillCodec::choose()
+{
+    if(!adaptive)
+    {
+        return fixed;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    num_pages++;
+    // try every codec once before trusting the measures
+    for(auto codec : {SpillCodecId::LZ4, SpillCodecId::None, SpillCodecId::Zstd})
+    {
+        if(available(codec) && stats[(int)codec].pages == 0)
+            return codec;
+    }
+    // retry another codec from time to time, the data and the device load may change
+    if(num_pages % ExplorePeriod == 0)
+    {
+        auto codec = (SpillCodecId)((num_pages / ExplorePeriod) % NumCodec);
+        if(available(codec))
+            return codec;
+    }
+
+    double disk_speed = write_seconds > 0 ? written_bytes / write_seconds : 0;
+    SpillCodecId best = SpillCodecId::LZ4;
+    double best_bandwidth = 0;
+    for(int i = 0; i < NumCodec; i++)
+    {
+        const Stat &s = stats[i];
+        if(!available((SpillCodecId)i) || s.pages == 0)
+            continue;
+        // without a timed write the cost of the bytes written is unknown, and storing as is would look free
+        if((SpillCodecId)i == SpillCodecId::None && disk_speed == 0)
+            continue;
+        double seconds = s.seconds + (disk_speed > 0 ? s.encoded_bytes / disk_speed : 0);
+        double bandwidth = seconds > 0 ? s.raw_bytes / seconds : 1e30;
+        if(bandwidth > best_bandwidth)
+        {
+            best = (SpillCodecId)i;
+            best_bandwidth = bandwidth;
+        }
+    }
+    return best;
+}
+
+size_t SpillCodec::compress(SpillCodecId codec, const char * src, size_t length, char * dst, size_t capacity)
+{
+    switch(codec)
+    {
+        case SpillCodecId::LZ4:
+        {
+            int n = LZ4_compress_default(src, dst, (int)length, (int)std::min(capacity, (size_t)LZ4_compressBound(length)));
+            return n > 0 ? n : 0;
+        }
+#ifdef HAVE_ZSTD
+        case SpillCodecId::Zstd:
+        {
+            size_t n = ZSTD_compress(dst, capacity, src, length, zstd_level);
+            return ZSTD_isError(n) ? 0 : n;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+const char * SpillCodec::encode(const char * src, size_t length, char * scratch, size_t capacity,
+    size_t &encoded_length, SpillCodecId &codec)
+{
+    auto begin = std::chrono::steady_clock::now();
+    SpillCodecId chosen = choose();
+    const char * out = src;
+    encoded_length = length;
+    codec = SpillCodecId::None;
+    if(chosen != SpillCodecId::None)
+    {
+        size_t n = compress(chosen, src, length, scratch, capacity);
+        // keep the page as it is if it doesn't shrink
+        if(n > 0 && n < length)
+        {
+            out = scratch;
+            encoded_length = n;
+            codec = chosen;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+    std::lock_guard<std::mutex> guard(lock);
+    Stat &s = stats[(int)chosen];
+    s.pages++;
+    s.raw_bytes += length;
+    s.encoded_bytes += encoded_length;
+    s.seconds += elapsed.count();
+    return out;
+}
+
+bool SpillCodec::decode(SpillCodecId codec, const char * src, size_t encoded_length, char * dst, size_t length)
+{
+    switch(codec)
+    {
+        case SpillCodecId::None:
+            if(encoded_length != length)
+                return false;
+            memcpy(dst, src, length);
+            return true;
+        case SpillCodecId::LZ4:
+            // pay attention! LZ4_decompress_safe() requires the data type to be int
+            return LZ4_decompress_safe(src, dst, (int)encoded_length, (int)length) == (int)length;
+#ifdef HAVE_ZSTD
+        case SpillCodecId::Zstd:
+        {
+            size_t n = ZSTD_decompress(dst, length, src, encoded_length);
+            return !ZSTD_isError(n) && n == length;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+bool SpillCodec::sample_write()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return num_writes++ % SyncPeriod == 0;
+}
+
+void SpillCodec::report_write(size_t bytes, double seconds)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    written_bytes += bytes;
+    write_seconds += seconds;
+}
+
+std::string SpillCodec::summary()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::ostringstream out;
+    out << "spill pages:";
+    for(int i = 0; i < NumCodec; i++)
+    {
+        const Stat &s = stats[i];
+        if(s.pages == 0)
+            continue;
+        out << " " << codec_name[i] << " " << s.pages << " (" << (double)s.raw_bytes / std::max(s.encoded_bytes, (uint64_t)1) << "x, "
+            << s.raw_bytes / 1048576.0 / std::max(s.seconds, 1e-9) << " MB/s)";
+    }
+    if(write_seconds > 0)
+    {
+        out << ", disk " << written_bytes / 1048576.0 / write_seconds << " MB/s";
+    }
+    return out.str();
+}
@@ -0,0 +1,85 @@
+/**
+ * The codecs of the spilled pages: LZ4, zstd (built with HAVE_ZSTD) or no compression.
+ * The codec is recorded per page, so a partition can be reloaded whatever mix it was written with.
+ *
+ * With the auto policy a feedback loop picks the codec of every page: each codec is scored by
+ * the bandwidth it would give on its own, raw bytes / (compress time + compressed bytes / disk speed),
+ * using the compress times and write speed measured on the pages spilled so far. The write speed is
+ * timed up to fdatasync on one page out of SyncPeriod, a write returning from the page cache would show
+ * the speed of memcpy; the other pages stay buffered. No page is stored uncompressed on the strength of
+ * its score before a write has been timed.
+ */
+
+#ifndef SPILL_CODEC_H
+#define SPILL_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+enum class SpillCodecId : uint8_t
+{
+    None = 0,
+    LZ4 = 1,
+    Zstd = 2
+};
+
+class SpillCodec
+{
+public:
+    // "auto", "none", "lz4", "zstd" or "zstd:LEVEL". return false if the name is unknown or zstd is not built in
+    static bool set_policy(const std::string &name);
+
+    // the capacity of the scratch buffer needed by encode for a page of length bytes
+    static size_t bound(size_t length);
+
+    // compress a page with the codec chosen by the policy. return the data to write, which is
+    // either scratch or src itself when the page is stored as it is
+    static const char * encode(const char * src, size_t length, char * scratch, size_t capacity,
+        size_t &encoded_length, SpillCodecId &codec);
+
+    // decode a page written by encode, return false if the data is corrupted
+    static bool decode(SpillCodecId codec, const char * src, size_t encoded_length, char * dst, size_t length);
+
+    // whether the policy needs the write speed of the temporary device, some writes are synced to measure it
+    static bool measures_writes() {return adaptive;}
+    // whether the page about to be written is one of the sampled ones, to be synced and reported
+    static bool sample_write();
+
+    // feed the bytes of a sampled page written and synced to the temporary device in seconds back to the policy
+    static void report_write(size_t bytes, double seconds);
+
+    // one line summary of the pages spilled by every codec
+    static std::string summary();
+
+private:
+    const static int NumCodec = 3;
+    const static int ExplorePeriod = 32;    // every ExplorePeriod pages, the auto policy retries another codec
+    const static int SyncPeriod = 16;       // every SyncPeriod pages written, one is synced to time the device
+
+    struct Stat
+    {
+        uint64_t pages = 0;
+        uint64_t raw_bytes = 0;
+        uint64_t encoded_bytes = 0;
+        double seconds = 0;
+    };
+
+    static bool adaptive;
+    static SpillCodecId fixed;
+    static int zstd_level;
+
+    static std::mutex lock;
+    static Stat stats[NumCodec];
+    static uint64_t written_bytes;
+    static double write_seconds;
+    static uint64_t num_pages;
+    static uint64_t num_writes;
+
+    static SpillCodecId choose();
+    static bool available(SpillCodecId codec);
+    static size_t compress(SpillCodecId codec, const char * src, size_t length, char * dst, size_t capacity);
+};
+
+#endif
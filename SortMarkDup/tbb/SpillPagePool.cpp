@@ -0,0 +1,96 @@
+/**
+ * The implementation of SpillPagePool class
+ */
+
+#include <cstdlib>
+#include <thread>
+#include "SpillPagePool.h"
+#include "BAMRecordBuffer.h"
+#include "HugePages.h"
+
+SpillPagePool::SpillPagePool(size_t num_frames, size_t frame_size) :
+    frame_size(frame_size), frames(num_frames, nullptr), owners(num_frames, nullptr),
+    replacer(num_frames), num_evicted(0)
+{
+    for(size_t i = num_frames; i-- > 0;)
+    {
+        free_list.push_back((bustub::frame_id_t)i);
+    }
+}
+
+SpillPagePool::~SpillPagePool()
+{
+    for(auto frame : frames)
+    {
+        HugePages::release(frame);
+    }
+}
+
+bustub::frame_id_t SpillPagePool::acquire(BAMRecordBuffer * owner)
+{
+    while(true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(latch);
+            if(!free_list.empty())
+            {
+                bustub::frame_id_t frame_id = free_list.back();
+                free_list.pop_back();
+                if(frames[frame_id] == nullptr)
+                {
+                    frames[frame_id] = (char *)HugePages::allocate(frame_size);
+                }
+                owners[frame_id] = owner;
+                replacer.Unpin(frame_id);
+                return frame_id;
+            }
+        }
+
+        bustub::frame_id_t victim;
+        if(!replacer.Victim(&victim))
+        {
+            // every frame is being handed over, wait for one of them
+            std::this_thread::yield();
+            continue;
+        }
+        BAMRecordBuffer * victim_owner;
+        {
+            std::lock_guard<std::mutex> lock(latch);
+            victim_owner = owners[victim];
+        }
+        // released in the meantime, it is in the free list now
+        if(victim_owner == nullptr)
+            continue;
+
+        // the victim may be adding a record right now, never wait for it while holding our own page lock
+        if(victim_owner->evict(victim))
+        {
+            num_evicted++;
+            std::lock_guard<std::mutex> lock(latch);
+            owners[victim] = owner;
+            replacer.Unpin(victim);
+            return victim;
+        }
+
+        std::lock_guard<std::mutex> lock(latch);
+        if(owners[victim] == victim_owner)
+        {
+            replacer.Unpin(victim);
+        }
+        std::this_thread::yield();
+    }
+}
+
+void SpillPagePool::release(bustub::frame_id_t frame_id)
+{
+    std::lock_guard<std::mutex> lock(latch);
+    owners[frame_id] = nullptr;
+    replacer.Pin(frame_id);
+    free_list.push_back(frame_id);
+}
+
+void SpillPagePool::touch(bustub::frame_id_t frame_id)
+{
+    replacer.Pin(frame_id);
+    replacer.Unpin(frame_id);
+}
@@ -0,0 +1,49 @@
+/**
+ * A pool of page frames shared by the BAMRecordBuffers of all the partitions, so the staging memory
+ * of the spill is capped by the pool size rather than growing with the number of partitions.
+ * A partition holds at most one frame. When the pool is exhausted the frame of the least recently
+ * used partition (bustub's LRUReplacer) is written out and handed over, hot partitions keep their pages.
+ */
+
+#ifndef SPILL_PAGE_POOL_H
+#define SPILL_PAGE_POOL_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "buffer/lru_replacer.h"
+
+class BAMRecordBuffer;
+
+class SpillPagePool
+{
+public:
+    // num_frames must be larger than the number of threads adding records, so an eviction always finds a victim
+    SpillPagePool(size_t num_frames, size_t frame_size);
+    ~SpillPagePool();
+
+    // get a frame for owner, evicting the page of another partition if no frame is free
+    bustub::frame_id_t acquire(BAMRecordBuffer * owner);
+
+    // give a frame back, its page has been written out
+    void release(bustub::frame_id_t frame_id);
+
+    // move a frame to the most recently used end
+    void touch(bustub::frame_id_t frame_id);
+
+    char * frame(bustub::frame_id_t frame_id) {return frames[frame_id];}
+    size_t frameSize() const {return frame_size;}
+    size_t numFrames() const {return frames.size();}
+    uint64_t numEvicted() const {return num_evicted;}
+
+private:
+    const size_t frame_size;
+    std::vector<char *> frames;                 // allocated on first use
+    std::vector<BAMRecordBuffer *> owners;      // nullptr for a free frame
+    std::vector<bustub::frame_id_t> free_list;
+    bustub::LRUReplacer replacer;               // the owned frames which may be evicted
+    std::mutex latch;                           // protects frames, owners and free_list
+    std::atomic_uint64_t num_evicted;
+};
+
+#endif
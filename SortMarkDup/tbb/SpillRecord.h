@@ -0,0 +1,62 @@
+/**
+ * The compact layout of a BAM record spilled to the temporary files and the ordered record store.
+ * Only the fields needed to write the record back are kept, the pointers and allocation fields of
+ * bam1_t are left out.
+ *
+ * layout of version 1, every record starts 4 bytes aligned so the CIGAR can be read in place:
+ *   bam1_core_t core
+ *   uint64_t    pairID
+ *   uint32_t    l_data
+ *   uint8_t     data[l_data], padded to 4 bytes
+ */
+
+#ifndef SPILL_RECORD_H
+#define SPILL_RECORD_H
+
+#include <cstdint>
+#include <cstring>
+#include "sam.h"
+
+class SpillRecord
+{
+public:
+    const static uint32_t Version = 1;
+    const static size_t HeaderSize = sizeof(bam1_core_t) + sizeof(uint64_t) + sizeof(uint32_t);
+
+    // the spilled size of a record
+    static size_t size(const bam1_t * b)
+    {
+        return HeaderSize + (((uint32_t)b->l_data + 3) & (~3U));
+    }
+
+    // serialize a record to dst, return the spilled size
+    static size_t store(char * dst, const bam1_t * b)
+    {
+        uint32_t l_data = b->l_data;
+        memcpy(dst, &b->core, sizeof(bam1_core_t));
+        memcpy(dst + sizeof(bam1_core_t), &b->id, sizeof(uint64_t));
+        memcpy(dst + sizeof(bam1_core_t) + sizeof(uint64_t), &l_data, sizeof(uint32_t));
+        memcpy(dst + HeaderSize, b->data, l_data);
+        // zero the padding, the pages are compressed
+        memset(dst + HeaderSize + l_data, 0, ((l_data + 3) & (~3U)) - l_data);
+        return HeaderSize + ((l_data + 3) & (~3U));
+    }
+
+    // point b to a spilled record, the data is not copied and must outlive b. return the spilled size
+    static size_t load(const unsigned char * src, bam1_t * b)
+    {
+        uint32_t l_data;
+        memcpy(&b->core, src, sizeof(bam1_core_t));
+        memcpy(&b->id, src + sizeof(bam1_core_t), sizeof(uint64_t));
+        memcpy(&l_data, src + sizeof(bam1_core_t) + sizeof(uint64_t), sizeof(uint32_t));
+        b->data = (uint8_t *)(src + HeaderSize);
+        b->l_data = l_data;
+        b->m_data = l_data;
+        b->mempolicy = BAM_USER_OWNS_STRUCT | BAM_USER_OWNS_DATA;
+        return HeaderSize + ((l_data + 3) & (~3U));
+    }
+};
+
+static_assert(SpillRecord::HeaderSize % 4 == 0, "spilled records must stay 4 bytes aligned");
+
+#endif
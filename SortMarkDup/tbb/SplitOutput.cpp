@@ -0,0 +1,119 @@
+/**
+ * The implementation of the split output helpers
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include "SplitOutput.h"
+#include "bam_record.h"
+
+// contig names may hold characters like '*' and ':' (HLA-A*01:01), keep the file names portable
+static std::string sanitize(const char * name)
+{
+    std::string s(name);
+    for(auto &c : s)
+    {
+        if(!isalnum((unsigned char)c) && c != '.' && c != '-' && c != '_')
+            c = '_';
+    }
+    return s;
+}
+
+static std::string group_name(size_t index, const std::string &suffix)
+{
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "%04zu_", index);
+    return prefix + suffix;
+}
+
+std::vector<OutputGroup> make_output_groups(const sam_hdr_t * header, uint64_t cut_size, uint64_t merge_size)
+{
+    std::vector<OutputGroup> groups;
+    bool merging = false;   // the last group is open for more short contigs
+    for(int tid = 0; tid < sam_hdr_nref(header); tid++)
+    {
+        uint64_t start = BAMRecord::kTable[tid];
+        uint64_t length = BAMRecord::kTable[tid + 1] - start;
+        if(length == 0)
+            continue;
+        std::string name = sanitize(sam_hdr_tid2name(header, tid));
+        if(cut_size > 0 && length > cut_size)
+        {
+            uint64_t pieces = (length + cut_size - 1) / cut_size;
+            for(uint64_t p = 0; p < pieces; p++)
+            {
+                groups.push_back(OutputGroup{start + length * p / pieces, start + length * (p + 1) / pieces,
+                    group_name(groups.size(), name + "_" + std::to_string(p + 1))});
+            }
+            merging = false;
+        }
+        else if(merging && groups.back().end - groups.back().start + length <= merge_size)
+        {
+            groups.back().end = start + length;
+        }
+        else
+        {
+            groups.push_back(OutputGroup{start, start + length, group_name(groups.size(), name)});
+            merging = length < merge_size;
+        }
+    }
+    // the unplaced reads have the partition key kTable.back()
+    groups.push_back(OutputGroup{BAMRecord::kTable.back(), BAMRecord::kTable.back() + 1,
+        group_name(groups.size(), "unmapped")});
+    return groups;
+}
+
+std::vector<uint64_t> merge_bounds(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b)
+{
+    std::vector<uint64_t> bounds;
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(bounds));
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    return bounds;
+}
+
+std::string group_regions(const OutputGroup &group, const sam_hdr_t * header)
+{
+    if(group.start >= BAMRecord::kTable.back())
+    {
+        return "*";
+    }
+    std::string regions;
+    int tid = std::upper_bound(BAMRecord::kTable.begin(), BAMRecord::kTable.end(), group.start)
+        - BAMRecord::kTable.begin() - 1;
+    for(; tid < sam_hdr_nref(header) && BAMRecord::kTable[tid] < group.end; tid++)
+    {
+        uint64_t contig_start = BAMRecord::kTable[tid];
+        uint64_t contig_end = BAMRecord::kTable[tid + 1];
+        if(contig_end == contig_start)
+            continue;
+        if(!regions.empty())
+            regions += ",";
+        regions += sam_hdr_tid2name(header, tid);
+        if(group.start > contig_start || group.end < contig_end)
+        {
+            // 1-based, inclusive
+            regions += ":" + std::to_string(std::max(group.start, contig_start) - contig_start + 1)
+                + "-" + std::to_string(std::min(group.end, contig_end) - contig_start);
+        }
+    }
+    return regions;
+}
+
+bool write_manifest(const std::string &path, const std::vector<OutputGroup> &groups,
+    const std::vector<uint64_t> &num_records, const sam_hdr_t * header)
+{
+    std::ofstream out(path);
+    if(!out.is_open())
+    {
+        return false;
+    }
+    out << "#file\trecords\tregions\n";
+    for(size_t i = 0; i < groups.size(); i++)
+    {
+        out << groups[i].name << ".bam\t" << num_records[i] << "\t" << group_regions(groups[i], header) << "\n";
+    }
+    return out.good();
+}
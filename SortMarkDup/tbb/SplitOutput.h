@@ -0,0 +1,36 @@
+/**
+ * Helpers used to split the sorted output into one BAM per group of partitions.
+ * A group is a contiguous range of the unified coordinate (BAMRecord::kTable) aligned to contig
+ * or interval boundaries, so every group file can be handed to a scatter job as it is.
+ */
+
+#ifndef SPLIT_OUTPUT_H
+#define SPLIT_OUTPUT_H
+
+#include <string>
+#include <vector>
+#include "sam.h"
+
+struct OutputGroup
+{
+    uint64_t start;     // unified coordinate [start, end)
+    uint64_t end;
+    std::string name;   // file name without the extension
+};
+
+// group the contigs of header in order. a contig longer than cut_size is cut into intervals of
+// at most cut_size bases (cut_size = 0: never cut), the consecutive contigs shorter than merge_size
+// are merged up to merge_size bases. the last group holds the unplaced reads
+std::vector<OutputGroup> make_output_groups(const sam_hdr_t * header, uint64_t cut_size, uint64_t merge_size);
+
+// the sorted union of two lists of partition bounds
+std::vector<uint64_t> merge_bounds(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b);
+
+// the regions of a group in samtools style (chr1:1-1000,chr2), "*" for the unplaced reads
+std::string group_regions(const OutputGroup &group, const sam_hdr_t * header);
+
+// write the manifest listing file, record count and regions of each group. return false on I/O error
+bool write_manifest(const std::string &path, const std::vector<OutputGroup> &groups,
+    const std::vector<uint64_t> &num_records, const sam_hdr_t * header);
+
+#endif
@@ -0,0 +1,240 @@
+/**
+ * The implementation of StreamingMarkDup class
+ */
+
+#include <algorithm>
+#include <cassert>
+#include "StreamingMarkDup.h"
+#include "umi.h"
+
+StreamingMarkDup::StreamingMarkDup(uint64_t window, size_t max_buffered, int umi_edits) :
+    window(window), max_buffered(max_buffered), umi_edits(umi_edits), head_seq(1), frontier(0),
+    count_duplicate(0), count_given_up(0)
+{
+
+}
+
+StreamingMarkDup::~StreamingMarkDup()
+{
+    for(auto &s : slots)
+    {
+        delete s.record;
+    }
+    for(auto &set : double_sets)
+    {
+        for(auto pair : set.second)
+            delete pair;
+    }
+    for(auto &set : single_sets)
+    {
+        for(auto pair : set.second)
+            delete pair;
+    }
+}
+
+void StreamingMarkDup::add(BAMRecord * record)
+{
+    // the sequence number is used as pairID, it never equals to 0
+    uint64_t seq = head_seq + slots.size();
+    bam1_t * b = record->get_record();
+    b->core.flag &= ~BAM_FDUP;  // the input may have been marked before
+    record->set_pairID(seq);
+
+    uint64_t pos = record->sort_key();
+    assert(pos >= frontier);    // the input must be sorted by coordinate
+    frontier = pos;
+    slots.push_back(Slot{record, false});
+
+    uint16_t flag = b->core.flag;
+    if((flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) != 0)
+    {
+        record->set_pairID(0);
+        slots.back().resolved = true;
+    }
+    else if((flag & BAM_FPAIRED) == 0 || (flag & BAM_FMUNMAP) != 0)
+    {
+        auto pair = new SinglePair(record);
+        single_sets[tSingleKey(pair->get_prime5_pos(), pair->get_orientation())].push_back(pair);
+    }
+    else
+    {
+        std::string qname(record->qname());
+        auto iter = pending.find(qname);
+        if(iter != pending.end())
+        {
+            uint64_t seq1 = iter->second;
+            pending.erase(iter);
+            auto pair = new StreamPair(slot(seq1).record, record, seq);
+            double_sets[tDoubleKey(pair->pair.get_record2_prime5_pos(), pair->pair.get_record1_prime5_pos(),
+                pair->pair.get_orientation())].push_back(pair);
+        }
+        else
+        {
+            uint64_t mate_pos = b->core.mtid < 0 ? BAMRecord::kTable.back()
+                : BAMRecord::kTable[b->core.mtid] + b->core.mpos;
+            if(mate_pos < pos)
+            {
+                // the mate has been given up before, this record can't form a pair any more
+                slots.back().resolved = true;
+                count_given_up++;
+            }
+            else
+            {
+                pending.emplace(std::move(qname), seq);
+            }
+        }
+        if(!slots.back().resolved)
+        {
+            double_pair_indicator.insert((record->prime5_pos() << 1) | (record->is_forward() ? 0 : 1));
+        }
+    }
+
+    close_sets(false);
+    give_up_pending();
+}
+
+void StreamingMarkDup::finish()
+{
+    close_sets(true);
+    for(auto &item : pending)
+    {
+        // the mate is absent from the input
+        mark(item.second, false);
+        count_given_up++;
+    }
+    pending.clear();
+}
+
+BAMRecord * StreamingMarkDup::pop_ready()
+{
+    if(slots.empty() || !slots.front().resolved)
+    {
+        return nullptr;
+    }
+    BAMRecord * record = slots.front().record;
+    slots.pop_front();
+    head_seq++;
+    return record;
+}
+
+void StreamingMarkDup::mark(uint64_t seq, bool duplicate)
+{
+    Slot &s = slot(seq);
+    if(duplicate)
+    {
+        s.record->mardup();
+        count_duplicate++;
+    }
+    s.resolved = true;
+}
+
+// a record whose unclipped 5' position is p is added before the position p + window,
+// so a set can be closed once the frontier has passed the largest 5' position in its key by window
+void StreamingMarkDup::close_sets(bool all)
+{
+    while(!double_sets.empty())
+    {
+        auto iter = double_sets.begin();
+        if(!all && std::get<0>(iter->first) + window >= frontier)
+            break;
+        close_double_set(iter->second);
+        double_sets.erase(iter);
+    }
+    while(!single_sets.empty())
+    {
+        auto iter = single_sets.begin();
+        if(!all && std::get<0>(iter->first) + window >= frontier)
+            break;
+        close_single_set(iter->first, iter->second);
+        single_sets.erase(iter);
+    }
+
+    // the indicator is only looked up by the single sets still open
+    if(frontier > window)
+    {
+        double_pair_indicator.erase(double_pair_indicator.begin(),
+            double_pair_indicator.lower_bound((frontier - window) << 1));
+    }
+}
+
+void StreamingMarkDup::decide(const std::vector<uint64_t> &umis, bool covered, std::vector<bool> &duplicate) const
+{
+    if(umi_edits >= 0)
+    {
+        // the double pair indicator carries no UMI, covered is ignored
+        umi_duplicates(umis, umi_edits, duplicate);
+        return;
+    }
+    duplicate.assign(umis.size(), true);
+    duplicate[0] = covered;
+}
+
+void StreamingMarkDup::close_double_set(std::vector<StreamPair *> &pairs)
+{
+    // the same order as the double pair sort of the partitioned mode
+    std::sort(pairs.begin(), pairs.end(), [](StreamPair * a, StreamPair * b){
+        // pair score, bigger as first
+        if(a->pair.compare_score(b->pair) != 0){
+            return a->pair.compare_score(b->pair) == 1;
+        }
+        // compare tile, x, y
+        return a->pair.compare_tile_X_Y(b->pair) == -1;
+    });
+    std::vector<uint64_t> umis;
+    std::vector<bool> duplicate;
+    for(auto pair : pairs)
+    {
+        // the records of an open set are still buffered, the stream keeps no side table of the UMIs
+        umis.push_back(slot(pair->pair.get_pairID()).record->umi());
+    }
+    decide(umis, false, duplicate);
+    for(size_t i = 0; i < pairs.size(); i++)
+    {
+        mark(pairs[i]->pair.get_pairID(), duplicate[i]);
+        mark(pairs[i]->seq2, duplicate[i]);
+        delete pairs[i];
+    }
+    pairs.clear();
+}
+
+void StreamingMarkDup::close_single_set(const tSingleKey &key, std::vector<SinglePair *> &pairs)
+{
+    std::sort(pairs.begin(), pairs.end(), [](SinglePair * a, SinglePair * b){
+        // pair score, bigger as first
+        if(a->compare_score(*b) != 0){
+            return a->compare_score(*b) == 1;
+        }
+        // compare tile, x, y
+        return a->compare_tile_X_Y(*b) == -1;
+    });
+    uint64_t target = (std::get<0>(key) << 1) | (std::get<1>(key) == Orientation::RR ? 1 : 0);
+    std::vector<uint64_t> umis;
+    std::vector<bool> duplicate;
+    for(auto pair : pairs)
+    {
+        umis.push_back(slot(pair->get_pairID()).record->umi());
+    }
+    decide(umis, double_pair_indicator.count(target) > 0, duplicate);
+    for(size_t i = 0; i < pairs.size(); i++)
+    {
+        mark(pairs[i]->get_pairID(), duplicate[i]);
+        delete pairs[i];
+    }
+    pairs.clear();
+}
+
+void StreamingMarkDup::give_up_pending()
+{
+    if(slots.size() <= max_buffered || slots.front().resolved)
+    {
+        return;
+    }
+    // only a record waiting for its mate can block the head for long, the sets close within the window
+    auto iter = pending.find(slots.front().record->qname());
+    if(iter != pending.end() && iter->second == head_seq)
+    {
+        pending.erase(iter);
+        mark(head_seq, false);
+        count_given_up++;
+    }
+}
@@ -0,0 +1,93 @@
+/**
+ * A class used to mark duplicates on coordinate-sorted input in one streaming pass.
+ * The records are buffered in input order until the duplicate sets they belong to are closed,
+ * so the memory is bounded by the window of unclipped 5' positions rather than the whole input.
+ */
+
+#ifndef STREAMING_MARKDUP_H
+#define STREAMING_MARKDUP_H
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "bam_record.h"
+#include "pair.h"
+
+class StreamingMarkDup
+{
+public:
+    // @ window         the max distance between the position of a record and its unclipped 5' position
+    // @ max_buffered   the max number of records waiting for their mate before the oldest one is given up
+    // @ umi_edits      max mismatches between the UMIs of one molecule, -1 if the UMI is not used
+    StreamingMarkDup(uint64_t window, size_t max_buffered, int umi_edits = -1);
+    ~StreamingMarkDup();
+
+    // take over a record, the records must be added in coordinate order
+    void add(BAMRecord * record);
+
+    // close all the duplicate sets, called at the end of the input
+    void finish();
+
+    // return the next record whose duplicate flag is decided, in input order, or nullptr
+    BAMRecord * pop_ready();
+
+    uint64_t num_duplicate() const {return count_duplicate;}
+    uint64_t num_given_up() const {return count_given_up;}
+
+private:
+    struct Slot
+    {
+        BAMRecord * record;
+        bool resolved;
+    };
+
+    // a DoublePair with the sequence number of its second record
+    struct StreamPair
+    {
+        DoublePair pair;
+        uint64_t seq2;
+        StreamPair(BAMRecord * record1, BAMRecord * record2, uint64_t s2) : pair(record1, record2), seq2(s2){}
+    };
+
+    // record2 5' position, record1 5' position, orientation. ordered by record2 so the sets close in order
+    typedef std::tuple<uint64_t, uint64_t, int> tDoubleKey;
+    // 5' position, orientation
+    typedef std::tuple<uint64_t, int> tSingleKey;
+
+    const uint64_t window;
+    const size_t max_buffered;
+    const int umi_edits;
+
+    std::deque<Slot> slots;     // the records not yet emitted, slots[0] has sequence number head_seq
+    uint64_t head_seq;
+    uint64_t frontier;          // unified coordinate of the last added record
+
+    std::unordered_map<std::string, uint64_t> pending;  // qname -> sequence number of the first mate
+    std::map<tDoubleKey, std::vector<StreamPair *>> double_sets;
+    std::map<tSingleKey, std::vector<SinglePair *>> single_sets;
+    std::set<uint64_t> double_pair_indicator;   // (5' position << 1 | reverse) of the records in double pairs
+
+    uint64_t count_duplicate;
+    uint64_t count_given_up;
+
+    Slot & slot(uint64_t seq) {return slots[seq - head_seq];}
+    void mark(uint64_t seq, bool duplicate);
+
+    // the duplicate flag of each member of a set sorted best first, given their UMIs.
+    // covered is true if a double pair shares the position of a single set
+    void decide(const std::vector<uint64_t> &umis, bool covered, std::vector<bool> &duplicate) const;
+
+    // decide the duplicate sets that no record added later can join
+    void close_sets(bool all);
+    void close_double_set(std::vector<StreamPair *> &pairs);
+    void close_single_set(const tSingleKey &key, std::vector<SinglePair *> &pairs);
+
+    // give up waiting for the mate of the oldest record if too many records are buffered
+    void give_up_pending();
+};
+
+#endif
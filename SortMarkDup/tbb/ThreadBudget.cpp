@@ -0,0 +1,124 @@
+/**
+ * The implementation of ThreadBudget class
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include "ThreadBudget.h"
+
+ThreadBudget::ThreadBudget(int num_threads, bool pin) :
+    num_threads(num_threads > 0 ? num_threads : available_cpus()),
+    control(tbb::global_control::max_allowed_parallelism, this->num_threads),
+    arena(this->num_threads)
+{
+    if(pin)
+    {
+        arena.initialize();
+        pinner.reset(new Pinner(arena, affinity_cpus()));
+    }
+}
+
+ThreadBudget::~ThreadBudget()
+{
+    if(pinner)
+    {
+        pinner->observe(false);
+    }
+}
+
+std::vector<int> ThreadBudget::affinity_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for(int i = 0; i < CPU_SETSIZE; i++)
+        {
+            if(CPU_ISSET(i, &set))
+                cpus.push_back(i);
+        }
+    }
+    if(cpus.empty())
+    {
+        for(int i = 0; i < (int)std::thread::hardware_concurrency(); i++)
+            cpus.push_back(i);
+    }
+    return cpus;
+}
+
+// the quota of the cgroup of the process, in CPUs
+double ThreadBudget::cgroup_cpu_limit()
+{
+    // cgroup v2: "0::/path" in /proc/self/cgroup, "quota period" or "max period" in cpu.max
+    std::string path;
+    {
+        std::ifstream cgroup("/proc/self/cgroup");
+        std::string line;
+        while(std::getline(cgroup, line))
+        {
+            if(line.compare(0, 3, "0::") == 0)
+                path = line.substr(3);
+        }
+    }
+    for(const std::string &dir : {"/sys/fs/cgroup" + path, std::string("/sys/fs/cgroup")})
+    {
+        std::ifstream cpu_max(dir + "/cpu.max");
+        std::string quota;
+        double period;
+        if(cpu_max >> quota >> period)
+        {
+            if(quota == "max" || period <= 0)
+                return 0;
+            return std::stod(quota) / period;
+        }
+    }
+
+    // cgroup v1: cpu.cfs_quota_us is -1 without quota
+    for(const char * dir : {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"})
+    {
+        std::ifstream quota_file(std::string(dir) + "/cpu.cfs_quota_us");
+        std::ifstream period_file(std::string(dir) + "/cpu.cfs_period_us");
+        double quota, period;
+        if((quota_file >> quota) && (period_file >> period))
+        {
+            return quota > 0 && period > 0 ? quota / period : 0;
+        }
+    }
+    return 0;
+}
+
+int ThreadBudget::available_cpus()
+{
+    int cpus = affinity_cpus().size();
+    double limit = cgroup_cpu_limit();
+    if(limit > 0)
+    {
+        cpus = std::min(cpus, (int)std::ceil(limit));
+    }
+    return std::max(cpus, 1);
+}
+
+ThreadBudget::Pinner::Pinner(tbb::task_arena &arena, std::vector<int> cpus) :
+    tbb::task_scheduler_observer(arena), cpus(std::move(cpus))
+{
+    observe(true);
+}
+
+void ThreadBudget::Pinner::on_scheduler_entry(bool is_worker)
+{
+    // the main thread is left free, the threads it starts (the reader) inherit its mask
+    if(!is_worker || cpus.empty())
+        return;
+    int slot = tbb::this_task_arena::current_thread_index();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[slot % cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
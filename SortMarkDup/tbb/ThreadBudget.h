@@ -0,0 +1,66 @@
+/**
+ * One thread budget shared by all the stages of tbb-sormadup.
+ *
+ * The budget defaults to the CPUs the process may really use: the affinity mask and the CPU quota
+ * of its cgroup (v1 or v2), not the cores of the host. TBB is capped to the budget by a global_control,
+ * and the stages run in one task_arena of that size, so parse, search, decompression and compression
+ * tasks all share the same threads. The htslib BGZF pools are threads of their own: they take a share of
+ * the budget and the TBB tasks feeding them run in an arena narrowed to the rest. With pinning, the worker threads of the arena are bound one per CPU
+ * of the affinity mask.
+ */
+
+#ifndef THREAD_BUDGET_H
+#define THREAD_BUDGET_H
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+
+class ThreadBudget
+{
+public:
+    // num_threads 0 for available_cpus()
+    ThreadBudget(int num_threads, bool pin);
+    ~ThreadBudget();
+
+    int size() const {return num_threads;}
+
+    // run f in the arena of the budget
+    template<typename F>
+    auto execute(F &&f) -> decltype(f())
+    {
+        return arena.execute(std::forward<F>(f));
+    }
+
+    // the threads of num_threads given to the TBB tasks feeding an htslib BGZF pool, the pool gets the
+    // others, none with a single thread. compression is the heavier part, the feeders get a quarter
+    static int feeder_threads(int num_threads) {return std::max(num_threads / 4, 1);}
+    static int bgzf_threads(int num_threads) {return num_threads - feeder_threads(num_threads);}
+
+    // the CPUs of the affinity mask, reduced to the cgroup CPU quota if there is one
+    static int available_cpus();
+
+private:
+    // bind every worker thread entering the arena to one CPU
+    class Pinner : public tbb::task_scheduler_observer
+    {
+    public:
+        Pinner(tbb::task_arena &arena, std::vector<int> cpus);
+        void on_scheduler_entry(bool is_worker) override;
+    private:
+        std::vector<int> cpus;
+    };
+
+    const int num_threads;
+    tbb::global_control control;
+    tbb::task_arena arena;
+    std::unique_ptr<Pinner> pinner;
+
+    static std::vector<int> affinity_cpus();
+    static double cgroup_cpu_limit();   // 0 if the cgroup has no quota
+};
+
+#endif
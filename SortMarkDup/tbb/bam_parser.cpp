@@ -4,13 +4,13 @@
 
 sam_hdr_t * BamParser::header;
 
-BamParser::BamParser(): index(0), line(nullptr){
+BamParser::BamParser(): index(0), line(nullptr), built(nullptr), last_pairID(0){
 
 };
 
 BamParser::~BamParser()
 {
-    if(line)
+    if(line || built)
     {
         clear();
     }
@@ -31,23 +31,34 @@ bool BamParser::has_record(){
 
 BAMRecord* BamParser::construct_BAMRecord(){
   // run out of read
-  if(!line)
+  if(!line && !built)
   {
       return nullptr;
   }
 
-  if(index >= line->size())
+  if(index >= (line ? line->size() : built->size()))
   {
         clear();
         return nullptr;
   }
 
   auto p = new BAMRecord; //---this memory block needs to be moved to the buffer pool later
-  int ret = sam_parse1(&(*line)[index], header, &p->record);
-  
-  if(ret < 0)
-    std::cout << index << "\t" << (*line)[index].s << std::endl;
-  assert(ret >= 0);
+  if(built)
+  {
+    // take the data of the built record over, only its struct is freed
+    bam1_t * b = (*built)[index];
+    p->record = *b;
+    free(b);
+    (*built)[index] = nullptr;
+  }
+  else
+  {
+    int ret = sam_parse1(&(*line)[index], header, &p->record);
+
+    if(ret < 0)
+      std::cout << index << "\t" << (*line)[index].s << std::endl;
+    assert(ret >= 0);
+  }
   index++;
   
   bam_set_mempolicy(&(p->record), BAM_USER_OWNS_STRUCT);
@@ -70,6 +81,17 @@ void BamParser::clear()
         delete line;
         line = nullptr;
     } 
+    if(built)
+    {
+        // the records not taken over yet
+        for(auto b : *built)
+        {
+            if(b)
+                bam_destroy1(b);
+        }
+        delete built;
+        built = nullptr;
+    }
     index = 0;
 }
 
@@ -78,6 +100,10 @@ std::unique_ptr<BAMRecord> BamParser::pop_record(const uint64_t pairID){
   records.pop_front();
   if(!ret->ignorable()){
     ret->set_pairID(pairID);
+    last_qname = ret->qname();
+    last_pairID = pairID;
+  }else if((ret->flag() & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) != 0 && last_qname == ret->qname()){
+    ret->set_pairID(last_pairID);
   }
   return std::unique_ptr<BAMRecord>(ret);
 }
@@ -114,9 +140,18 @@ std::unique_ptr<BAMRecord> BamParser::pop_record(const uint64_t pairID, const BA
 
 void BamParser::add_line(std::vector<kstring_t> * line)
 {
-    if(this->line)
+    if(this->line || built)
     {
         clear();
     }
     this->line = line;
+}
+
+void BamParser::add_records(std::vector<bam1_t *> * built)
+{
+    if(line || this->built)
+    {
+        clear();
+    }
+    this->built = built;
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <vector>
 #include <list>
 #include <memory>
+#include <string>
 #include "bam_record.h"
 
 class BamParser{
@@ -17,12 +18,16 @@ public:
     ~BamParser();
 
     bool has_record();
-    std::unique_ptr<BAMRecord> pop_record(const uint64_t pairID); // 需要小心的初始化 BAMRecord 中的各项
+    // 需要小心的初始化 BAMRecord 中的各项. a secondary/supplementary record following a primary of the same
+    // qname takes the pairID of that primary, so the duplicate flag is copied to it in the output
+    std::unique_ptr<BAMRecord> pop_record(const uint64_t pairID);
     std::unique_ptr<BAMRecord> pop_record(const uint64_t pairID, const BAMRecord* hint);
 
     void add_line(std::vector<kstring_t> * line);
+    // records built by an aligner linked in (see sormadup.h), taken over instead of parsing lines
+    void add_records(std::vector<bam1_t *> * built);
 
-    // remove everything in the vector<kstring_t> line
+    // remove everything in the vector<kstring_t> line or the built records
     void clear();
 
     static sam_hdr_t *header;
@@ -30,7 +35,10 @@ public:
 private:
     std::list<BAMRecord*> records;
     std::vector<kstring_t> * line;
+    std::vector<bam1_t *> * built;
     int index;
+    std::string last_qname;     // the qname and pairID of the last primary record popped
+    uint64_t last_pairID;
 
     // return nullptr if record file end. set pairID = 1 for !ignorale or pairID = 0 for ignorable
     BAMRecord* construct_BAMRecord();
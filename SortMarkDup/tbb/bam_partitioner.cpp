@@ -3,24 +3,46 @@
  */
 
 #include <cassert>
+#include <algorithm>
 #include <filesystem>
 #include "bam_partitioner.h"
 
- BAMPartitioner::BAMPartitioner(uint64_t max_ky, uint32_t np, uint64_t perp):
+ BAMPartitioner::BAMPartitioner(uint64_t max_ky, uint32_t np, uint64_t perp, const std::string &d):
   num_partitions(np),
   range_size((max_ky + num_partitions - 1) / num_partitions),
-  max_RDD_size_per_partition(perp){
+  max_RDD_size_per_partition(perp),
+  dir(d){
+  init(nullptr);
+}
   
-  // set the buffer for the partitioned reads
-  partitioned_Page_lock = new std::mutex[num_partitions];
+BAMPartitioner::BAMPartitioner(const std::vector<uint64_t> &bs, uint64_t perp, const std::string &d):
+  num_partitions(bs.size() - 1),
+  range_size(0),
+  max_RDD_size_per_partition(perp),
+  bounds(bs),
+  dir(d){
+  init(nullptr);
+}
+
+// selectPartition is never called on the partitions of a previous run, range_size and bounds are left empty
+BAMPartitioner::BAMPartitioner(const std::string &d, uint32_t np, std::istream &tables):
+  num_partitions(np),
+  range_size(0),
+  max_RDD_size_per_partition(0),
+  dir(d){
+  init(&tables);
+}
 
+void BAMPartitioner::init(std::istream * tables){
+  // set the buffer for the partitioned reads, they lock their own pages
   bam_buffer = new BAMRecordBuffer* [num_partitions];
-  if (!std::filesystem::is_directory("temp") || !std::filesystem::exists("temp")) { // Check if temp folder exists
-    std::filesystem::create_directory("temp"); // create temp folder
+  if (!std::filesystem::is_directory(dir) || !std::filesystem::exists(dir)) { // Check if temp folder exists
+    std::filesystem::create_directories(dir); // create temp folder
   }
   for(int i=0; i<num_partitions; i++)
   {
-    bam_buffer[i] = new BAMRecordBuffer("./temp/tmp" + std::to_string(i) + ".db");
+    std::string file_name = dir + "/tmp" + std::to_string(i) + ".db";
+    bam_buffer[i] = tables ? new BAMRecordBuffer(file_name, *tables) : new BAMRecordBuffer(file_name);
   }
 
   result = new tRDD[num_partitions];
@@ -29,12 +51,14 @@
 
 
 uint32_t BAMPartitioner::selectPartition(BAMRecord* elem){
-  return elem->partition_key() / range_size;
+  if(bounds.empty()){
+    return elem->partition_key() / range_size;
+  }
+  return std::upper_bound(bounds.begin() + 1, bounds.end() - 1, elem->partition_key()) - (bounds.begin() + 1);
 }
 
 BAMPartitioner::~BAMPartitioner(){
 
-  delete[] partitioned_Page_lock;
   for(int i=0; i<num_partitions; i++)
   {
     delete bam_buffer[i];
@@ -43,19 +67,22 @@ BAMPartitioner::~BAMPartitioner(){
 
   delete[] lk_result;
   delete[] result;
-  std::filesystem::remove_all("temp"); // remove temp folder
+  // the buffers removed their own files, the folder goes only if nothing else was put in it
+  std::error_code error;
+  std::filesystem::remove(dir, error);
+}
+
+void BAMPartitioner::save(std::ostream &tables) const{
+  for(uint32_t i = 0; i < num_partitions; i++){
+    bam_buffer[i]->save(tables);
+  }
 }
 
 void BAMPartitioner::addElem(BAMRecord * elem, std::vector<tBuffer>* buffer){
   auto index = selectPartition(elem);
 
-  partitioned_Page_lock[index].lock();
- 
   size_t offset = bam_buffer[index]->addData(elem);
 
-
-  partitioned_Page_lock[index].unlock();
-
   // add the offset in the file to the buffer
   (*buffer)[index].emplace_back(std::pair<uint64_t, size_t>(elem->sort_key(), offset));
   if((*buffer)[index].size() == buffer_size){
@@ -11,15 +11,22 @@
 #include <iostream>
 #include <cstdio>
 #include <cstring>
+#include <string>
 #include "bam_record.h"
 #include "BAMRecordBuffer.h"
 
 class BAMPartitioner{
 public:
-    const static int RecordSize = sizeof(BAMRecord);
-
-    BAMPartitioner(uint64_t max_ky, uint32_t np, uint64_t perp);
+    // the partitions are spilled into dir, their files are removed with the partitioner and dir too if left empty
+    BAMPartitioner(uint64_t max_ky, uint32_t np, uint64_t perp, const std::string &dir = "temp");
+    // 分区 i 覆盖 [bounds[i], bounds[i+1]) 的 partition key
+    BAMPartitioner(const std::vector<uint64_t> &bounds, uint64_t perp, const std::string &dir = "temp");
+    // the np partitions spilled into dir by a previous run, see save. no element can be added to them
+    BAMPartitioner(const std::string &dir, uint32_t np, std::istream &tables);
     ~BAMPartitioner();
+
+    // write the tables of the spilled partitions, after their flushData
+    void save(std::ostream &tables) const;
     
 
     // 供每个线程添加元素的暂存缓冲, 要支持 size, capacity, push_back 方法
@@ -44,15 +51,17 @@ public:
     // get the data bufffer
     BAMRecordBuffer * getBAMRecordBuffer(int i);
 
+    uint32_t getNumPartitions() const {return num_partitions;}
+
 private:
     const uint32_t num_partitions; // partition 的个数
     const uint64_t range_size; // 每个partition 覆盖 partition key 的个数
     const uint64_t max_RDD_size_per_partition;
+    const std::vector<uint64_t> bounds; // 为空时按 range_size 均匀分区
+    const std::string dir;  // the spill files
 
     BAMRecordBuffer ** bam_buffer;
 
-    std::mutex * partitioned_Page_lock;
-
     std::mutex* lk_result; // 保证对result 的某个 RDD 的互斥访问
     const uint32_t buffer_size = 500; // 暂存 buffer 的 capacity
 
@@ -66,6 +75,9 @@ private:
     // 确定一个 elem 属于哪个分区
     uint32_t selectPartition(BAMRecord* elem);
 
+    // tables is null for new partitions
+    void init(std::istream * tables);
+
 };
 
 
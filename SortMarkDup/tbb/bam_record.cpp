@@ -1,20 +1,49 @@
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "bam_record.h"
+#include "umi.h"
 std::vector<uint64_t> BAMRecord::kTable;
+std::string BAMRecord::umi_tag;
 
-uint64_t BAMRecord::count_bam_record = 0;
-
-uint16_t BAMRecord::score() const{
-  uint8_t* p = bam_get_qual(&record);
-  uint16_t result = 0;
+uint32_t BAMRecord::score() const{
+  const uint8_t* p = bam_get_qual(&record);
+  const int n = record.core.l_qseq;
+  uint64_t result = 0;
+  int i = 0;
   // calculate a score for the  read which is the sum of scores over Q15
-  for(int i = 0; i < record.core.l_qseq; i++){
+#ifdef __SSE2__
+  // 16 qualities at a time: zero the ones under Q15 (unsigned compare through max), then sum them into
+  // the two 64-bit lanes with psadbw
+  const __m128i min_quality = _mm_set1_epi8(15);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums = zero;
+  for(; i + 16 <= n; i += 16){
+    __m128i q = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i keep = _mm_cmpeq_epi8(_mm_max_epu8(q, min_quality), q);
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_and_si128(q, keep), zero));
+  }
+  result = _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+#endif
+  for(; i < n; i++){
     if(p[i] >= 15)
       result += p[i];
   }
   return result;
 }
 
+uint64_t BAMRecord::umi() const{
+  if(umi_tag.empty()){
+    return 0;
+  }
+  uint8_t* p = bam_aux_get(&record, umi_tag.c_str());
+  if(p == nullptr || *p != 'Z'){
+    return 0;
+  }
+  return umi_encode(bam_aux2Z(p));
+}
+
 uint64_t BAMRecord::get_unify_coordinate() const{
   if(record.core.tid < 0){
     return kTable.back();
@@ -23,40 +52,48 @@ uint64_t BAMRecord::get_unify_coordinate() const{
   }
 }
 
+void BAMRecord::scan_cigar() const{
+  const uint32_t *cigar_array = bam_get_cigar(&record);
+  bool leading = true;
+  leading_clip = 0;
+  trailing_clip = 0;
+  reference_length = 0;
+  for(uint32_t i = 0; i < record.core.n_cigar; i++){
+    int op = bam_cigar_op(cigar_array[i]);
+    if(op == BAM_CSOFT_CLIP || op == BAM_CHARD_CLIP){
+      if(leading)
+        leading_clip += bam_cigar_oplen(cigar_array[i]);
+      trailing_clip += bam_cigar_oplen(cigar_array[i]);
+    }else{
+      leading = false;
+      trailing_clip = 0;
+      if((bam_cigar_type(op) & 2) != 0)
+        reference_length += bam_cigar_oplen(cigar_array[i]);
+    }
+  }
+  cigar_scanned = true;
+}
+
 uint64_t BAMRecord::prime5_pos() const{
-  uint32_t *cigar_array = bam_get_cigar(&(record));
-  uint32_t n_cigar = record.core.n_cigar;
   auto tmp = get_unify_coordinate();
-  if(n_cigar == 0){
+  if(record.core.n_cigar == 0){
     return tmp;
   }
+  if(!cigar_scanned){
+    scan_cigar();
+  }
   if(is_forward()){
     // tmp -= clipped_length
-    for(uint32_t i = 0; i < n_cigar; i++){
-      if((bam_cigar_op(cigar_array[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(cigar_array[i]) == BAM_CHARD_CLIP)){
-        tmp -= bam_cigar_oplen(cigar_array[i]);
-      }else{
-        return tmp;
-      }
-    }
-    return tmp;
+    return tmp - leading_clip;
   }else{
     // tmp += getCigar().getReferenceLength - 1 + clipped_length;
-    int i = n_cigar - 1;
-    // clipped_length
-    while((bam_cigar_op(cigar_array[i]) == BAM_CSOFT_CLIP)
-          || (bam_cigar_op(cigar_array[i]) == BAM_CHARD_CLIP)){
-      tmp += bam_cigar_oplen(cigar_array[i]);
-      i--;
-      if(i < 0) break;
-    }
-    // referenceLength
-    for(; i >= 0; i--){
-      if((bam_cigar_type(bam_cigar_op(cigar_array[i])) & 2) != 0)
-        tmp += bam_cigar_oplen(cigar_array[i]);
-    }
-    // -1
-    tmp--;
-    return tmp;
+    return tmp + reference_length + trailing_clip - 1;
+  }
+}
+
+uint64_t BAMRecord::reference_end() const{
+  if(!cigar_scanned){
+    scan_cigar();
   }
+  return get_unify_coordinate() + reference_length;
 }
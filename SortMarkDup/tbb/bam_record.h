@@ -2,14 +2,16 @@
 #define BAM_RECORD_HH
 
 #include <vector>
+#include <string>
 #include "sam.h"
+#include "Metrics.h"
 
 // 复用 bam1_t 的 id 作为 pairID
 // 不存储 unify_coordinate, 采用实时转化的策略
-// ignorable 的BAMrecord 的唯一特征是 pairID = 0
+// unmapped/secondary/supplementary 的 BAMRecord 是 ignorable 的，不参与找重。
+// 它们的 pairID 为 0，或者是同一 template 的 primary pair 的 pairID，只用于在输出时传递 duplicate 标记
 class BAMRecord{
 public:
-  static uint64_t count_bam_record;
   uint64_t get_pairID()const {return record.id;}
   void set_pairID(uint64_t id){record.id = id;}
   // uint64_t get_pairID() const{return pairID;}
@@ -17,20 +19,32 @@ public:
   uint64_t partition_key()const {return get_unify_coordinate();}
   uint64_t sort_key() const {return get_unify_coordinate();}
   void mardup(){record.core.flag |= BAM_FDUP;}
-  bool ignorable()const{return get_pairID() == 0;} // unmapped/secondary/supplementary
+  bool ignorable()const{return (record.core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) != 0 || get_pairID() == 0;}
   bool is_forward() const{return (record.core.flag & BAM_FREVERSE) == 0;}
   const char* qname() const{return bam_get_qname(&record);}
-  BAMRecord(){memset(&record, 0, sizeof(bam1_t)); count_bam_record++;}
+  uint16_t flag() const{return record.core.flag;}
+  BAMRecord(){memset(&record, 0, sizeof(bam1_t)); Metrics::add(Counter::BamRecords);}
   ~BAMRecord(){bam_destroy1(&record);}
   static std::vector<uint64_t> kTable; // combine RNAME and POS to unified coordinate
-  uint16_t score() const;
+  static std::string umi_tag; // the tag holding the UMI, empty if the UMI is not used
+  // the sum of the base qualities over Q15
+  uint32_t score() const;
+  uint64_t umi() const; // the encoded UMI, 0 if absent
+  // the unclipped 5' position and the end of the aligned span on the unified coordinate,
+  // computed by one walk of the CIGAR at the first call of either
   uint64_t prime5_pos() const;
+  uint64_t reference_end() const;
   bam1_t* get_record() {return &record;}
   friend class BamParser;
 private:
   bam1_t record;
   //uint64_t pairID;
+  // the clips before the first and after the last aligned op, and the bases the CIGAR spans on the reference
+  mutable bool cigar_scanned = false;
+  mutable uint32_t leading_clip, trailing_clip;
+  mutable uint64_t reference_length;
   uint64_t get_unify_coordinate() const;
+  void scan_cigar() const;
 };
 
 #endif
@@ -1,18 +1,20 @@
 #include "bitmap.h"
+#include "HugePages.h"
 #include <cassert>
 #include <iostream>
 
-bitmap::bitmap(uint64_t _size): size(_size){
+bitmap::bitmap(uint64_t _size, bool zero): size(_size){
   uint64_t lines = (size + 63) / 64;
-  array = new std::atomic_uint64_t[lines];
-  for(uint64_t i=0; i < lines; i++){
-    array[i] = 0;
+  // zeroed or not, the pages are first touched by clear
+  array = (std::atomic_uint64_t *)HugePages::allocate(lines * sizeof(uint64_t));
+  if(zero){
+    clear(0, size);
   }
   std::cout << "bitmap size: " << double(lines) * sizeof(uint64_t) / 1024 / 1024 / 1024 <<"GB" <<std::endl;
 }
 
 bitmap::~bitmap(){
-  delete[] array;
+  HugePages::release(array);
 }
 
 void bitmap::set(uint64_t pos){
@@ -31,3 +33,11 @@ bool bitmap::get(uint64_t pos){
   uint64_t value_or = 1ll << offset;
   return (value_or & line_value) != 0;
 }
+
+void bitmap::clear(uint64_t begin, uint64_t end){
+  assert(begin <= end && end <= size);
+  uint64_t line_end = end == size ? (size + 63) / 64 : end >> 6;
+  for(uint64_t i = begin >> 6; i < line_end; i++){
+    array[i].store(0, std::memory_order_relaxed);
+  }
+}
@@ -7,12 +7,16 @@
 // bitmap 是线程安全的，但要求所有 set 都调用完成后方可调用 get 方法
 class bitmap{
 public:
-  bitmap(uint64_t size);
+  // zero = false 时不清零，由调用者通过 clear 分段清零（分段的首次写入决定内存所在的 NUMA 节点）
+  bitmap(uint64_t size, bool zero = true);
   ~bitmap();
   // set bitmap[pos] = 1
   void set(uint64_t pos);
   // get bitmap[pos]
   bool get(uint64_t pos);
+  // clear bitmap[begin, end), begin and end are rounded down to multiples of 64 unless end == size
+  void clear(uint64_t begin, uint64_t end);
+  uint64_t length() const {return size;}
 private:
   std::atomic_uint64_t *array;
   uint64_t size;
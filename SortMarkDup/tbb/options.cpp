@@ -0,0 +1,35 @@
+/**
+ * The implementation of the helpers in options.h
+ */
+
+#include "options.h"
+
+bool parse_run_mode(const std::string &name, RunMode &mode)
+{
+    if(name == "sormadup")
+        mode = RunMode::SortMarkDup;
+    else if(name == "markdup")
+        mode = RunMode::MarkDup;
+    else if(name == "sort")
+        mode = RunMode::Sort;
+    else if(name == "rmdup")
+        mode = RunMode::RemoveDup;
+    else if(name == "stream")
+        mode = RunMode::Stream;
+    else
+        return false;
+    return true;
+}
+
+const char * run_mode_name(RunMode mode)
+{
+    switch(mode)
+    {
+        case RunMode::SortMarkDup: return "sormadup";
+        case RunMode::MarkDup: return "markdup";
+        case RunMode::Sort: return "sort";
+        case RunMode::RemoveDup: return "rmdup";
+        case RunMode::Stream: return "stream";
+    }
+    return "";
+}
@@ -0,0 +1,94 @@
+/**
+ * Command line options of tbb-sormadup, shared by the stages in main.cpp
+ */
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// which stages of the pipeline are paid for
+enum class RunMode
+{
+    SortMarkDup,    // coordinate sort + mark duplicates (default)
+    MarkDup,        // mark duplicates only, records keep the input order
+    Sort,           // coordinate sort only, no duplicate detection
+    RemoveDup,      // coordinate sort + drop the duplicates
+    Stream          // mark duplicates of coordinate-sorted input in one streaming pass
+};
+
+struct SormadupOptions
+{
+    RunMode mode = RunMode::SortMarkDup;
+    char * input_file = nullptr;
+    char * output_file = nullptr;
+    int num_threads = 0;            // the thread budget of all the stages, 0 for the CPUs available
+    bool pin_threads = false;
+    int num_thread_shuffle = 0;     // the parsing threads, derived from the budget
+
+    // streaming mode
+    uint64_t stream_window = 1000;          // max distance between a position and its unclipped 5' position
+    size_t stream_max_buffered = 1 << 22;   // max records buffered while waiting for a mate
+
+    // UMI-aware duplicate sets
+    bool umi = false;
+    std::string umi_tag = "RX";
+    int umi_edits = 1;      // max mismatches between the UMIs of one molecule
+
+    // target regions, the off-target records skip the duplicate detection
+    char * regions_file = nullptr;
+    bool drop_off_target = false;
+
+    // split output, -O names a directory holding one indexed BAM per group and a manifest
+    bool split_output = false;
+    uint64_t split_size = 0;    // max bases per group, 0 for one group per contig
+
+    std::string spill_codec = "auto";   // see SpillCodec::set_policy
+    size_t spill_memory = 4096;         // MB of the pages staging the spilled records
+    std::string huge_pages = "thp";     // see HugePages::set_policy
+
+    // input not grouped by QNAME, the mates are matched through a hash table spilled past mate_memory MB
+    bool ungrouped_input = false;
+    size_t mate_memory = 2048;
+
+    char * metrics_file = nullptr;  // the per-stage metrics are written there as JSON
+
+    // QC side files of the output written as qc_prefix.*, see QcStats. the depth is over qc_targets_file,
+    // or the --regions if absent
+    char * qc_prefix = nullptr;
+    char * qc_targets_file = nullptr;
+
+    // the base recalibration table written to bqsr_table while the output is written, see BaseRecalibrator
+    char * bqsr_table = nullptr;
+    char * reference_file = nullptr;
+    char * known_sites_file = nullptr;
+
+    // the sort partitions are spilled into checkpoint_dir and the state after the shuffle is kept there,
+    // resume restarts from it. see Checkpoint
+    char * checkpoint_dir = nullptr;
+    bool resume = false;
+
+    // multi-process run over shards of the coordinate space sharing shard_dir, see Shard.
+    // shard_index >= 0 for a worker, -1 for the run launching the num_shards workers or merge_shards
+    int num_shards = 0;
+    int shard_index = -1;
+    bool merge_shards = false;  // only concatenate the shard BAMs of shard_dir into the output
+    char * shard_dir = nullptr;
+    int shard_timeout = 3600;   // seconds a worker waits for the duplicates of the others, 0 for no limit
+
+    bool need_sort() const {return mode != RunMode::MarkDup && mode != RunMode::Stream;}
+    bool need_markdup() const {return mode != RunMode::Sort;}
+    bool remove_duplicate() const {return mode == RunMode::RemoveDup;}
+    int umi_edits_or_off() const {return umi ? umi_edits : -1;}
+    bool shard_worker() const {return shard_index >= 0;}
+};
+
+// parse the value of -m, return false if the name is unknown
+bool parse_run_mode(const std::string &name, RunMode &mode);
+
+// the name of mode taken by -m
+const char * run_mode_name(RunMode mode);
+
+#endif
@@ -5,8 +5,41 @@
 #include <vector>
 #include <array>
 
-uint64_t SinglePair::count_single_pair = 0;
-uint64_t DoublePair::count_double_pair = 0;
+
+std::atomic<uint64_t *> * PairUmis::chunks = nullptr;
+
+void PairUmis::enable(){
+  if(chunks == nullptr){
+    chunks = new std::atomic<uint64_t *>[NumChunks]();
+  }
+}
+
+void PairUmis::set(uint64_t pairID, uint64_t umi){
+  if(chunks == nullptr || umi == 0){
+    return;
+  }
+  assert((pairID >> ChunkBits) < NumChunks);
+  std::atomic<uint64_t *> &chunk = chunks[pairID >> ChunkBits];
+  uint64_t * umis = chunk.load(std::memory_order_acquire);
+  if(umis == nullptr){
+    // the first thread reaching the chunk allocates it, the others take its chunk
+    uint64_t * fresh = (uint64_t *)calloc(1ULL << ChunkBits, sizeof(uint64_t));
+    if(chunk.compare_exchange_strong(umis, fresh, std::memory_order_acq_rel)){
+      umis = fresh;
+    }else{
+      free(fresh);
+    }
+  }
+  umis[pairID & ((1ULL << ChunkBits) - 1)] = umi;
+}
+
+uint64_t PairUmis::get(uint64_t pairID){
+  if(chunks == nullptr){
+    return 0;
+  }
+  uint64_t * umis = chunks[pairID >> ChunkBits].load(std::memory_order_acquire);
+  return umis == nullptr ? 0 : umis[pairID & ((1ULL << ChunkBits) - 1)];
+}
 
 uint16_t str_to_uint16(const char *str) {
   char *end;
@@ -58,6 +91,9 @@ SinglePair::SinglePair(BAMRecord* b){
   X = result[1];
   Y = result[2];
   score = b->score();
+  if(PairUmis::enabled()){
+    PairUmis::set(pairID, b->umi());
+  }
   // sort_key
   sort_key = (b->prime5_pos() << 2);
   if(b->is_forward()){
@@ -65,7 +101,7 @@ SinglePair::SinglePair(BAMRecord* b){
   }else{
     sort_key += Orientation::RR;
   }
-  count_single_pair++;
+  Metrics::add(Counter::SinglePairs);
 }
 
 DoublePair::DoublePair(BAMRecord* b1, BAMRecord* b2){
@@ -79,21 +115,45 @@ DoublePair::DoublePair(BAMRecord* b1, BAMRecord* b2){
   X = result[1];
   Y = result[2];
   score = b1->score() + b2->score();
-  // sort_key, record2_prime5_pos
-  if(b1->prime5_pos() > b2->prime5_pos()){
-    std::swap(b1, b2);
+  if(PairUmis::enabled()){
+    PairUmis::set(pairID, b1->umi()); // both ends carry the UMI of the molecule
+  }
+  set_ends(b1->prime5_pos(), b1->is_forward(), b2->prime5_pos(), b2->is_forward());
+  Metrics::add(Counter::DoublePairs);
+}
+
+DoublePair::DoublePair(const SinglePair& end1, const SinglePair& end2){
+  // pairID
+  pairID = end1.pairID;
+  assert(pairID != 0);
+  // both ends share the qname
+  tile = end1.tile;
+  X = end1.X;
+  Y = end1.Y;
+  score = end1.score + end2.score;
+  // the UMI was kept under the pairID of end1 when it was summarized
+  set_ends(end1.get_prime5_pos(), end1.get_orientation() == Orientation::FF,
+           end2.get_prime5_pos(), end2.get_orientation() == Orientation::FF);
+  Metrics::add(Counter::DoublePairs);
+}
+
+// sort_key, record2_prime5_pos
+void DoublePair::set_ends(uint64_t pos1, bool forward1, uint64_t pos2, bool forward2){
+  if(pos1 > pos2){
+    std::swap(pos1, pos2);
+    std::swap(forward1, forward2);
   }
-  sort_key = b1->prime5_pos();
-  record2_prime5_pos = b2->prime5_pos();
+  sort_key = pos1;
+  record2_prime5_pos = pos2;
   Orientation orientation;
-  if(b1->is_forward()){
-    if(b2->is_forward()){
+  if(forward1){
+    if(forward2){
       orientation = Orientation::FF;
     }else{
       orientation = Orientation::FR;
     }
   }else{
-    if(b2->is_forward()){
+    if(forward2){
       orientation = Orientation::RF;
     }else{
       orientation = Orientation::RR;
@@ -104,7 +164,6 @@ DoublePair::DoublePair(BAMRecord* b1, BAMRecord* b2){
   }
   sort_key <<= 2;
   sort_key += orientation;
-  count_double_pair++;
 }
 
 int SinglePair::compare_pos_orientation(const SinglePair& other) const{
@@ -1,6 +1,7 @@
 #ifndef PAIR_HH
 #define PAIR_HH
 
+#include <atomic>
 #include "bam_record.h"
 
 enum Orientation
@@ -19,15 +20,30 @@ enum Orientation
 // };
 
 // 假设 tile, x, y 可以用 uint16_t 表示
-// 假设 score 值可以用 uint16_t 表示
+// score 用 uint32_t, 长读长和 DoublePair 两端之和会超出 uint16_t
 
 
+// the UMIs of the pairs by pairID, kept beside the pairs so that they don't grow without the UMI.
+// filled by the constructors of the pairs once enabled, the chunks are allocated as the pairIDs reach them
+class PairUmis{
+public:
+  static void enable();
+  static bool enabled() {return chunks != nullptr;}
+  // concurrent calls are safe, for different pairIDs
+  static void set(uint64_t pairID, uint64_t umi);
+  // 0 if the UMI is not used
+  static uint64_t get(uint64_t pairID);
+private:
+  static const int ChunkBits = 20;
+  static const uint64_t NumChunks = 1ULL << 22;
+  static std::atomic<uint64_t *> * chunks;
+};
+
 // combine prime5_pos and orientation as sort_key, orientation 占低两位
 // for single pair, Orientation::FF for forward, Orientation::RR for reverse
 // consistence with BAMRecord, pairID = 0 indicate a ignorable BAMRecord
 class SinglePair{
 public:
-  static uint64_t count_single_pair;
   SinglePair(BAMRecord*);
   uint64_t get_prime5_pos() const {return sort_key>>2;}
   // if forward, return FF, if reverse, return RR
@@ -35,6 +51,7 @@ public:
   bool ignorable() const {return pairID == 0;}
   uint64_t get_pairID() const {return pairID;}
   uint64_t partition_key()const{return get_prime5_pos();}
+  uint64_t get_umi() const {return PairUmis::get(pairID);}
   // return 0 if equal, 1 this > other, -1, this < other
   int compare_pos_orientation(const SinglePair& other)const;
   // return 0 if equal, 1 this > other, -1, this < other
@@ -42,20 +59,24 @@ public:
   // return 0 if equal, 1 this > other, -1, this < other
   int compare_tile_X_Y(const SinglePair& other)const;
 private:
+  friend class DoublePair;
   uint64_t pairID;
   uint64_t sort_key;
-  uint16_t score, tile, X, Y;
+  uint32_t score;
+  uint16_t tile, X, Y;
 };
 
 class DoublePair{
 public:
-  static uint64_t count_double_pair;
   DoublePair(BAMRecord* record1, BAMRecord* record2);
+  // the same pair built from the summaries of its ends, used when the mates are matched out of order
+  DoublePair(const SinglePair& end1, const SinglePair& end2);
   uint64_t get_pairID() const{return pairID;}
   uint64_t get_record1_prime5_pos()const{return sort_key >> 2;}
   uint64_t get_record2_prime5_pos()const{return record2_prime5_pos;}
   uint64_t partition_key()const{return get_record1_prime5_pos();}
   Orientation get_orientation()const{return Orientation(sort_key & 3);}
+  uint64_t get_umi() const {return PairUmis::get(pairID);}
   // return 0 if equal, 1 this > other, -1, this < other
   int compare_pos_orientation(const DoublePair& other)const;
   // return 0 if equal, 1 this > other, -1, this < other
@@ -63,9 +84,11 @@ public:
   // return 0 if equal, 1 this > other, -1, this < other
   int compare_tile_X_Y(const DoublePair& other)const;
 private:
+  void set_ends(uint64_t pos1, bool forward1, uint64_t pos2, bool forward2);
   uint64_t pairID;
   uint64_t sort_key;
-  uint16_t score, tile, X, Y;
+  uint32_t score;
+  uint16_t tile, X, Y;
   uint64_t record2_prime5_pos;
 };
 
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <mutex>
+#include <algorithm>
 #include <iostream>
 #include <cstdio>
 #include <cstring>
@@ -54,6 +55,8 @@ private:
 public:
   // @ max_key   IPartitionElem 的 partition_key() 的上限
   RangePartitioner(uint64_t max_key, uint32_t num_partitions, uint64_t max_RDD_size_per_partition);
+  // @ bounds   分区 i 覆盖 [bounds[i], bounds[i+1]) 的 partition key, 用于不均匀的分区 (例如只覆盖 target region)
+  RangePartitioner(const std::vector<uint64_t> &bounds, uint64_t max_RDD_size_per_partition);
   ~RangePartitioner();
   // 为一个线程分配一个 buffer
   std::vector<RangePartitioner<IPartitionElem>::tBuffer>* initBuffer();
@@ -72,6 +75,7 @@ private:
   const uint32_t num_partitions; // partition 的个数
   const uint64_t range_size; // 每个partition 覆盖 partition key 的个数
   const uint64_t max_RDD_size_per_partition;
+  const std::vector<uint64_t> bounds; // 为空时按 range_size 均匀分区
   tRDD *result; // 存取分区的结果
 
   std::vector<std::vector<RangePartitioner<IPartitionElem>::tBuffer>*> bufBuffer; // 用于避免频繁的 initBuffer, destroyBuffer 造成的内存的 allocate 和 deallocate
@@ -88,6 +92,16 @@ RangePartitioner<IPartitionElem>::RangePartitioner(uint64_t max_ky, uint32_t np,
   lk_result = new std::mutex[num_partitions];
 }
 
+template<typename IPartitionElem>
+RangePartitioner<IPartitionElem>::RangePartitioner(const std::vector<uint64_t> &bs, uint64_t perp):
+  num_partitions(bs.size() - 1),
+  range_size(0),
+  max_RDD_size_per_partition(perp),
+  bounds(bs){
+  result = new tRDD[num_partitions];
+  lk_result = new std::mutex[num_partitions];
+}
+
 template<typename IPartitionElem>
 RangePartitioner<IPartitionElem>::~RangePartitioner(){
   delete[] lk_result;
@@ -96,7 +110,11 @@ RangePartitioner<IPartitionElem>::~RangePartitioner(){
 
 template<typename IPartitionElem>
 uint32_t RangePartitioner<IPartitionElem>::selectPartition(IPartitionElem* elem){
-  return elem->partition_key() / range_size;
+  if(bounds.empty()){
+    return elem->partition_key() / range_size;
+  }
+  // the keys out of range fall into the first or the last partition
+  return std::upper_bound(bounds.begin() + 1, bounds.end() - 1, elem->partition_key()) - (bounds.begin() + 1);
 }
 
 template<typename IPartitionElem>
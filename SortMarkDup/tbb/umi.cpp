@@ -0,0 +1,75 @@
+/**
+ * The implementation of the UMI helpers
+ */
+
+#include <cstring>
+#include "umi.h"
+
+static const uint64_t UMI_HASHED = 1ULL << 63;
+static const uint64_t UMI_BASES = (1ULL << 56) - 1;
+static const int UMI_MAX_LENGTH = 28;
+
+uint64_t umi_encode(const char * umi)
+{
+    uint64_t code = 0;
+    int length = 0;
+    for(const char * p = umi; *p; p++)
+    {
+        uint64_t base;
+        switch(*p)
+        {
+            case 'A': case 'a': base = 0; break;
+            case 'C': case 'c': base = 1; break;
+            case 'G': case 'g': base = 2; break;
+            case 'T': case 't': base = 3; break;
+            case '-': case '+': continue;
+            default: base = 4; break;
+        }
+        if(base > 3 || length == UMI_MAX_LENGTH)
+        {
+            // FNV-1a of the whole string
+            uint64_t hash = 0xcbf29ce484222325ULL;
+            for(const char * q = umi; *q; q++)
+            {
+                hash = (hash ^ (uint8_t)*q) * 0x100000001b3ULL;
+            }
+            return hash | UMI_HASHED;
+        }
+        code |= base << (2 * length);
+        length++;
+    }
+    return code | ((uint64_t)length << 56);
+}
+
+int umi_distance(uint64_t a, uint64_t b)
+{
+    if(a == b)
+        return 0;
+    if(((a | b) & UMI_HASHED) != 0 || (a >> 56) != (b >> 56))
+        return UMI_FAR;
+    uint64_t x = (a ^ b) & UMI_BASES;
+    // one bit per mismatched base
+    x = (x | (x >> 1)) & 0x5555555555555555ULL;
+    return __builtin_popcountll(x);
+}
+
+void umi_duplicates(const std::vector<uint64_t> &umis, int max_edits, std::vector<bool> &duplicate)
+{
+    duplicate.assign(umis.size(), false);
+    std::vector<uint64_t> representatives;
+    for(size_t i = 0; i < umis.size(); i++)
+    {
+        for(auto representative : representatives)
+        {
+            if(umi_distance(umis[i], representative) <= max_edits)
+            {
+                duplicate[i] = true;
+                break;
+            }
+        }
+        if(!duplicate[i])
+        {
+            representatives.push_back(umis[i]);
+        }
+    }
+}
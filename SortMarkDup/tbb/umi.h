@@ -0,0 +1,24 @@
+/**
+ * Helpers to compare the UMIs (RX tag) of the reads inside a positional duplicate set
+ */
+
+#ifndef UMI_H
+#define UMI_H
+
+#include <cstdint>
+#include <vector>
+
+// pack a UMI into 64 bits: 2 bits per base, the length in bits 56-61.
+// UMIs longer than 28 bases or with other bases than ACGT are hashed and flagged by bit 63,
+// they only match an identical UMI. separators between the UMIs of the two ends are skipped
+uint64_t umi_encode(const char * umi);
+
+// the number of mismatched bases between two encoded UMIs, UMI_FAR if they can't be compared
+int umi_distance(uint64_t a, uint64_t b);
+const int UMI_FAR = 0x7fffffff;
+
+// cluster the UMIs of a duplicate set which is sorted best first. a read is a duplicate if its UMI
+// is within max_edits of the first read of an earlier cluster, otherwise it starts a new cluster
+void umi_duplicates(const std::vector<uint64_t> &umis, int max_edits, std::vector<bool> &duplicate);
+
+#endif